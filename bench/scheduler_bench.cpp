@@ -0,0 +1,172 @@
+// Compares the workers' WorkScheduler with the single shared queue it replaced.
+//
+// Each workload pushes jobs that spin for a set time, the way handlers keep a
+// core busy, and measures how long jobs waited in the queue:
+//   uniform  - tiny jobs spread evenly over the workers: the cost of queueing itself
+//   skewed   - every job lands on worker 0, like requests of one busy connection,
+//              and 2% are slow uploads: the cost of load imbalance
+//   chains   - every job queues a follow-up for the worker it runs on, like a
+//              coroutine resuming after I/O: the cost of moving work between cores
+//
+// Build and run with `make bench`.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../include/work_scheduler.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct Job {
+    Clock::time_point enqueued;
+    uint32_t work_ns;
+    uint32_t follow_ups;    // Jobs still to queue after this one, for the same worker
+};
+
+// The old design: one deque, one lock, one condition variable for every worker
+template <typename T>
+class SharedQueue {
+public:
+    explicit SharedQueue(size_t) : stopped(false) {}
+
+    void push(size_t, T item) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back(std::move(item));
+        }
+        ready.notify_one();
+    }
+
+    bool pop(size_t, T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this]() { return stopped || !items.empty(); });
+        if (stopped) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        return true;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        ready.notify_all();
+    }
+
+    uint64_t stolen() const { return 0; }
+
+private:
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool stopped;
+};
+
+struct Workload {
+    const char* name;
+    size_t jobs;
+    uint32_t fast_ns;
+    uint32_t slow_ns;
+    unsigned slow_percent;
+    bool skewed;            // All jobs go to worker 0 instead of round robin
+    uint32_t follow_ups;
+};
+
+struct Result {
+    double seconds;
+    double p50_us;
+    double p99_us;
+    uint64_t stolen;
+};
+
+static void spin(uint32_t ns) {
+    auto until = Clock::now() + std::chrono::nanoseconds(ns);
+    while (Clock::now() < until) {
+    }
+}
+
+template <typename Queue>
+static Result run(const Workload& workload, size_t workers) {
+    Queue queue(workers);
+    size_t total = workload.jobs * (workload.follow_ups + 1);
+    std::atomic<size_t> done(0);
+    std::vector<std::vector<double>> delays(workers);
+
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers; ++w) {
+        threads.emplace_back([&, w]() {
+            Job job;
+            while (queue.pop(w, job)) {
+                delays[w].push_back(std::chrono::duration<double, std::micro>(Clock::now() - job.enqueued).count());
+                spin(job.work_ns);
+                if (job.follow_ups > 0) {
+                    queue.push(w, Job{Clock::now(), workload.fast_ns, job.follow_ups - 1});
+                }
+                if (done.fetch_add(1) + 1 == total) {
+                    queue.stop();
+                }
+            }
+        });
+    }
+
+    // One producer, as the event loop is
+    auto start = Clock::now();
+    unsigned seed = 1;
+    for (size_t i = 0; i < workload.jobs; ++i) {
+        seed = seed * 1103515245 + 12345;
+        bool slow = (seed >> 16) % 100 < workload.slow_percent;
+        size_t worker = workload.skewed ? 0 : i % workers;
+        queue.push(worker, Job{Clock::now(), slow ? workload.slow_ns : workload.fast_ns, workload.follow_ups});
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    Result result;
+    result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::vector<double> all;
+    for (auto& worker_delays : delays) {
+        all.insert(all.end(), worker_delays.begin(), worker_delays.end());
+    }
+    std::sort(all.begin(), all.end());
+    result.p50_us = all[all.size() / 2];
+    result.p99_us = all[all.size() * 99 / 100];
+    result.stolen = queue.stolen();
+    return result;
+}
+
+static void report(const char* workload, const char* queue, size_t jobs, const Result& result) {
+    std::printf("%-8s %-10s %9.3f %12.0f %10.1f %10.1f %10llu\n", workload, queue, result.seconds,
+                jobs / result.seconds, result.p50_us, result.p99_us,
+                static_cast<unsigned long long>(result.stolen));
+}
+
+int main(int argc, char* argv[]) {
+    size_t workers = argc > 1 ? std::strtoul(argv[1], nullptr, 10)
+                              : std::max(1u, std::thread::hardware_concurrency());
+    const Workload workloads[] = {
+        {"uniform", 500000, 500, 0, 0, false, 0},
+        {"skewed", 50000, 5000, 1000000, 2, true, 0},
+        {"chains", 20000, 2000, 0, 0, false, 9},
+    };
+
+    std::printf("%zu workers, %u cores\n\n", workers, std::thread::hardware_concurrency());
+    std::printf("%-8s %-10s %9s %12s %10s %10s %10s\n", "workload", "queue", "seconds", "jobs/s", "p50 us",
+                "p99 us", "stolen");
+    for (const Workload& workload : workloads) {
+        size_t jobs = workload.jobs * (workload.follow_ups + 1);
+        report(workload.name, "shared", jobs, run<SharedQueue<Job>>(workload, workers));
+        report(workload.name, "stealing", jobs, run<WorkScheduler<Job>>(workload, workers));
+    }
+    return 0;
+}
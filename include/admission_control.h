@@ -0,0 +1,50 @@
+#ifndef ADMISSION_CONTROL_H
+#define ADMISSION_CONTROL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Settings for the worker pool and its admission control
+struct AdmissionConfig {
+    int target_delay_ms;        // Acceptable standing queue delay
+    int interval_ms;            // How long the delay must persist before shedding starts
+    size_t max_queue_length;    // Accepting pauses while more connections than this wait
+    size_t worker_count;        // Worker threads; 0 runs one per core
+    size_t blocking_count;      // Threads for blocking routes and the blocking calls of coroutine handlers
+
+    AdmissionConfig()
+        : target_delay_ms(5), interval_ms(100), max_queue_length(1024), worker_count(0), blocking_count(16) {}
+};
+
+// CoDel (controlled delay) drop decision, applied to requests as they leave
+// the ready queue. Short bursts pass untouched; once the queue delay stays
+// above the target for a whole interval, requests are shed at an increasing
+// rate (interval / sqrt(count)) until the delay falls back under the target.
+//
+// Not thread-safe: callers serialise access with a lock of their own.
+class CoDelController {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    CoDelController(std::chrono::milliseconds target, std::chrono::milliseconds interval);
+
+    // Returns true if the request that waited for `sojourn` should be shed
+    bool should_drop(Clock::duration sojourn, Clock::time_point now);
+
+    bool dropping() const { return dropping_state; }
+    uint64_t total_dropped() const { return dropped; }
+
+private:
+    Clock::duration target;
+    Clock::duration interval;
+    Clock::time_point first_above_time;   // When the delay may first be acted on; epoch if below target
+    Clock::time_point drop_next;
+    uint32_t count;
+    bool dropping_state;
+    uint64_t dropped;
+
+    Clock::time_point control_law(Clock::time_point from) const;
+};
+
+#endif // ADMISSION_CONTROL_H
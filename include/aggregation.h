@@ -0,0 +1,82 @@
+#ifndef AGGREGATION_H
+#define AGGREGATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Count, sum, min and max of numeric fields over a collection, optionally
+// per value of a group-by field.
+//
+// Records are fed in batches and processed a column at a time: the group of
+// every record is resolved to a small integer code first, then each field is
+// gathered into a contiguous array of doubles and reduced in one tight loop.
+// Without grouping, the reduction runs over the array with several
+// independent accumulators, which the compiler turns into SIMD code.
+class Aggregator {
+public:
+    using Item = std::map<std::string, std::string>;
+
+    // Keeps records whose field equals the value; two numbers compare by value
+    struct Filter {
+        std::string field;
+        std::string value;
+    };
+
+    struct FieldSummary {
+        size_t count;       // Records where the field holds a number
+        double sum;
+        double min;
+        double max;
+
+        FieldSummary();
+        void merge(const FieldSummary& other);
+    };
+
+    struct Group {
+        std::string key;
+        bool has_key;       // False for records without the group-by field
+        size_t count;
+        std::vector<FieldSummary> fields;   // In the order the fields were given
+    };
+
+    // An empty `group_by` puts every record into a single group
+    Aggregator(const std::vector<std::string>& fields, const std::string& group_by,
+               const std::vector<Filter>& filters = std::vector<Filter>());
+
+    // Records not matching every filter are skipped
+    void add(const std::vector<std::shared_ptr<const Item>>& records);
+
+    // Groups ordered by key, the one without a key first
+    std::vector<Group> result() const;
+
+    // Reduces an array of values, unrolled over independent accumulators. NaN marks a
+    // missing value and is skipped.
+    static FieldSummary summarize(const double* values, size_t count);
+
+    // Parses a field value as a finite JSON number
+    static bool parse_number(const std::string& text, double& value);
+    static bool values_equal(const std::string& a, const std::string& b);
+
+private:
+    std::vector<std::string> fields;
+    std::string group_by;
+    std::vector<Filter> filters;
+    std::vector<Group> groups;
+    std::unordered_map<std::string, uint32_t> group_codes;
+    uint32_t missing_code;              // Group of records without the field, once seen
+
+    // Scratch columns reused between batches
+    std::vector<const Item*> selected;
+    std::vector<uint32_t> record_codes;
+    std::vector<double> values;
+    std::vector<uint32_t> value_codes;
+
+    uint32_t code_for(const Item& item);
+};
+
+#endif // AGGREGATION_H
@@ -0,0 +1,93 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <coroutine>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <type_traits>
+#include "task.h"
+
+// Where coroutine handlers send work that would block a thread.
+//
+// Regular files are always "ready" as far as epoll is concerned, so their
+// reads and writes cannot wait in the event loop the way sockets do. They run
+// on a few threads kept for blocking calls instead, and the coroutine that
+// asked is resumed on a worker once the call returns. HttpServer is the
+// runtime of its own handlers.
+class AsyncRuntime {
+public:
+    virtual ~AsyncRuntime() {}
+
+    // Runs `work` off the worker pool, then resumes `waiting` on a worker
+    virtual void run_blocking(std::function<void()> work, std::coroutine_handle<> waiting) = 0;
+};
+
+// co_await offload(runtime, call) runs a blocking call on the runtime's threads and
+// gives back its result, suspending the caller meanwhile
+template <typename Call>
+class Offload {
+public:
+    using Result = std::invoke_result_t<Call&>;
+
+    Offload(AsyncRuntime& runtime, Call call) : runtime(runtime), call(std::move(call)) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> waiting) {
+        runtime.run_blocking([this]() {
+            if constexpr (std::is_void_v<Result>) {
+                call();
+            } else {
+                result.emplace(call());
+            }
+        }, waiting);
+    }
+    Result await_resume() {
+        if constexpr (!std::is_void_v<Result>) {
+            return std::move(*result);
+        }
+    }
+
+private:
+    struct Empty {};
+    AsyncRuntime& runtime;
+    Call call;
+    std::optional<std::conditional_t<std::is_void_v<Result>, Empty, Result>> result;
+};
+
+template <typename Call>
+Offload<Call> offload(AsyncRuntime& runtime, Call call) {
+    return Offload<Call>(runtime, std::move(call));
+}
+
+// A file whose calls run on the runtime's blocking threads while the coroutine using
+// it is suspended. Each call is a single system call, or a loop of them for write(),
+// so one handler's large write does not hold the threads from others for long.
+class AsyncFile {
+public:
+    explicit AsyncFile(AsyncRuntime& runtime) : runtime(runtime), fd(-1), last_error(0) {}
+    ~AsyncFile();
+    AsyncFile(const AsyncFile&) = delete;
+    AsyncFile& operator=(const AsyncFile&) = delete;
+
+    // Flags as for open(2); false when the file cannot be opened
+    Task<bool> open(std::string path, int flags, mode_t mode = 0644);
+    // Bytes read at `offset`, 0 at the end of the file, -1 on failure
+    Task<ssize_t> read(char* buffer, size_t length, off_t offset);
+    // Writes all of `data` at `offset`; false on failure
+    Task<bool> write(std::string_view data, off_t offset);
+    Task<bool> close();
+
+    bool is_open() const { return fd != -1; }
+    // errno of the last call that failed, such as ENOSPC from a write
+    int error() const { return last_error; }
+
+private:
+    AsyncRuntime& runtime;
+    int fd;
+    int last_error;
+};
+
+#endif // ASYNC_IO_H
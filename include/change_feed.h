@@ -0,0 +1,62 @@
+#ifndef CHANGE_FEED_H
+#define CHANGE_FEED_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Recent mutations of one collection, for watchers that follow it instead of
+// polling.
+//
+// Events are numbered by the commit sequence of the write that produced them,
+// so they order the same way as record versions, and a watcher resumes by
+// asking for everything after the last sequence it saw. The feed is a fixed
+// ring: once full, every new event overwrites the oldest one, and a reader
+// that fell further behind than the ring reaches is told it missed events.
+//
+// Events hold their own copy of the record, so the feed never keeps the
+// store's versions alive. Each event is published with the memory it costs,
+// and publish() returns what the event it overwrote cost, so the owner can
+// charge the ring to its budget.
+class ChangeFeed {
+public:
+    using Item = std::map<std::string, std::string>;
+
+    enum class Type { Create, Update, Delete };
+
+    struct Event {
+        uint64_t sequence;
+        Type type;
+        std::string id;
+        std::shared_ptr<const Item> item;   // The record after the change; null for deletes
+    };
+
+    explicit ChangeFeed(size_t capacity);
+
+    // Sequences must increase from one event to the next. Returns the bytes of the
+    // event overwritten to make room, 0 while the ring is filling.
+    size_t publish(Event event, size_t bytes);
+
+    // Appends up to `limit` events committed after `after_sequence`, oldest first.
+    // False when events after it were already overwritten; what is still retained
+    // is appended anyway.
+    bool read(uint64_t after_sequence, size_t limit, std::vector<Event>& events);
+
+    // Sequence of the newest event, 0 before the first one
+    uint64_t last_sequence();
+
+    static const char* type_name(Type type);
+
+private:
+    std::mutex feed_mutex;
+    std::vector<Event> ring;
+    std::vector<size_t> ring_bytes;     // Memory of each event, by slot
+    size_t capacity;
+    size_t oldest;                  // Slot of the oldest retained event
+    uint64_t overwritten_sequence;  // Newest event no longer retained; 0 when none was lost
+};
+
+#endif // CHANGE_FEED_H
@@ -0,0 +1,97 @@
+#ifndef COLUMN_STORE_H
+#define COLUMN_STORE_H
+
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "aggregation.h"
+
+// Columnar copy of selected fields of one collection, for scans that touch a
+// few fields of many records.
+//
+// Every record owns a row, and every column keeps one array entry per row, so
+// reading a field across the collection walks contiguous memory instead of a
+// map per record. Rows of deleted records are reused. A column starts out
+// numeric, holding doubles with NaN for missing values, and stays numeric as
+// long as every value is a number written the way it prints back. The first
+// other value turns it into a dictionary column: distinct strings are stored
+// once and rows hold 32-bit codes, with the numeric value of each dictionary
+// entry cached for reductions. Entries count the rows holding them and are
+// dropped, their codes reused, once none does.
+//
+// Columns follow the latest committed write; they do not see snapshots. Rows
+// carry the record's expiry deadline so aggregates skip records that expired
+// before the store swept them. Aggregates read the rows a slice at a time, so
+// a writer waits for at most one slice; a write made during the scan is
+// counted as if it happened before or after it, depending on the slice.
+class ColumnStore {
+public:
+    using Item = std::map<std::string, std::string>;
+
+    struct Stats {
+        size_t rows;
+        size_t bytes;
+        size_t dictionary_columns;
+    };
+
+    explicit ColumnStore(const std::vector<std::string>& fields);
+
+    bool has_field(const std::string& field) const;
+
+    // Replaces the record's row, keeping its deadline, or adds one. Both return the
+    // memory the columns take afterwards.
+    size_t put(const std::string& id, const Item& item);
+    size_t remove(const std::string& id);
+    // The epoch clears the deadline
+    void set_deadline(const std::string& id, std::chrono::steady_clock::time_point deadline);
+
+    // Same result as Aggregator over the live rows. False, without touching `groups`,
+    // when a field, the group-by field or a filter field has no column.
+    bool aggregate(const std::vector<std::string>& fields, const std::string& group_by,
+                   const std::vector<Aggregator::Filter>& filters, std::vector<Aggregator::Group>& groups);
+
+    Stats stats();
+
+private:
+    struct Column {
+        bool numeric;
+        std::vector<double> numbers;                // Numeric columns: value per row, NaN when missing
+        std::vector<uint32_t> codes;                // Dictionary columns: code per row, 0 when missing
+        std::vector<std::string> dictionary;        // Value of code c at c - 1
+        std::vector<double> dictionary_numbers;     // Numeric value of code c at c, NaN if none
+        std::vector<uint32_t> references;           // Rows holding code c at c
+        std::vector<uint32_t> free_codes;           // Codes no row holds, for reuse
+        std::unordered_map<std::string, uint32_t> lookup;
+        size_t dictionary_bytes;                    // Held by the entries in use
+
+        Column()
+            : numeric(true), dictionary_numbers(1, std::numeric_limits<double>::quiet_NaN()), references(1, 0),
+              dictionary_bytes(0) {}
+    };
+
+    std::shared_mutex column_mutex;
+    std::vector<std::string> field_names;
+    std::unordered_map<std::string, size_t> field_positions;
+    std::vector<Column> columns;
+
+    std::unordered_map<std::string, uint32_t> rows;     // Record id to row
+    std::vector<uint8_t> live;                          // Per row
+    std::vector<std::chrono::steady_clock::time_point> deadlines;   // Per row; the epoch for none
+    std::vector<uint32_t> free_rows;
+    size_t live_rows;
+
+    static void set_value(Column& column, uint32_t row, const std::string* text);
+    static uint32_t acquire_code(Column& column, const std::string& text);
+    static void release_code(Column& column, uint32_t code);
+    static void convert_to_dictionary(Column& column);
+    static double value_at(const Column& column, uint32_t row);
+    const Column* find_column(const std::string& field) const;
+    size_t memory() const;
+};
+
+#endif // COLUMN_STORE_H
@@ -0,0 +1,399 @@
+#ifndef DATA_STORE_H
+#define DATA_STORE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "aggregation.h"
+#include "change_feed.h"
+#include "column_store.h"
+#include "frequency_sketch.h"
+#include "lsm_store.h"
+#include "search_index.h"
+
+// In-memory data store for CRUD operations.
+//
+// Records are multi-versioned: every write appends an immutable version tagged
+// with a commit sequence number, and a reader holding a Snapshot sees each
+// collection exactly as it was when the snapshot was taken. Scans copy one page
+// of version pointers at a time under the lock and deep-copy records outside
+// it, so long reads hold up writers for at most a page. Versions that no open
+// snapshot can see are reclaimed on write and when the oldest snapshot closes.
+//
+// The commit sequence of a record's current version doubles as its version
+// number, so conditional writes can be checked against it atomically.
+//
+// Records may carry a time-to-live. Deadlines are filed in coarse time
+// buckets which expire_due() drains a bounded amount at a time; until then,
+// reads already treat expired records as gone.
+//
+// Memory use is charged per record, including every retained version. With a
+// budget set, writes that push the total over it evict cold records, chosen
+// by sampling a few at random and comparing them under the configured policy.
+//
+// With a spill directory, evicted records are written to an LsmStore instead
+// of being dropped, and their in-memory version is replaced by a marker that
+// carries no data. A record that only exists on disk keeps no memory at all.
+// Reads fetch spilled records back transparently and keep them in memory
+// again, and scans merge the disk tier in id order. Memory stays
+// authoritative for every record it holds.
+//
+// The disk is never touched under data_mutex. Reads go to it before taking the
+// lock, and spills and deletions are queued and written once the lock is
+// released; a record keeps its data in memory until then. disk_mutex is held
+// shared across a disk read and exclusively while the queue is written, so
+// what a reader found on disk still holds when it takes data_mutex.
+//
+// Collections with search enabled keep a SearchIndex, and collections with
+// columnar fields a ColumnStore; every write updates both along with the record.
+// The columns count against the memory budget like the records. Index updates
+// are queued and applied in order once data_mutex is released, before the write
+// returns, so writers never wait on a search.
+//
+// Once change feeds are turned on, every write is also published to the
+// ChangeFeed of its collection, as a copy charged to the collection's memory.
+// Expiry and eviction publish deletions like any other write; spilling a record
+// to disk changes nothing readers see and publishes nothing.
+class DataStore {
+public:
+    using Item = std::map<std::string, std::string>;
+
+    // Called after every successful mutation with the affected collection
+    using MutationListener = std::function<void(const std::string& collection)>;
+
+    // A consistent read view of the whole store, released when destroyed
+    class Snapshot {
+    public:
+        ~Snapshot();
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+
+        uint64_t sequence() const { return snapshot_sequence; }
+
+    private:
+        friend class DataStore;
+        Snapshot(DataStore& store, uint64_t sequence) : store(store), snapshot_sequence(sequence) {}
+
+        DataStore& store;
+        uint64_t snapshot_sequence;
+    };
+
+    // Outcome of an update or remove
+    enum class WriteStatus { Ok, NotFound, VersionMismatch };
+
+    // Conditions and settings for a single write
+    struct WriteOptions {
+        std::vector<uint64_t> expected_versions;    // Write only if the record is at one of these; empty always writes
+        std::chrono::milliseconds ttl;              // Expire this long after the write; 0 never expires
+
+        WriteOptions() : ttl(0) {}
+
+        bool accepts(uint64_t version) const {
+            return expected_versions.empty() ||
+                   std::find(expected_versions.begin(), expected_versions.end(), version) != expected_versions.end();
+        }
+    };
+
+    // One operation of a bulk request
+    struct BatchOperation {
+        enum class Type { Create, Update, Delete };
+        Type type;
+        std::string id;
+        Item item;
+        WriteOptions options;
+
+        BatchOperation() : type(Type::Create) {}
+    };
+
+    struct BatchResult {
+        int status;         // HTTP status of this operation on its own
+        std::string id;
+    };
+
+    // How eviction ranks the sampled records
+    enum class EvictionPolicy {
+        Lru,        // Least recently accessed
+        Lfu,        // Lowest logarithmic access counter, decayed over time
+        TinyLfu     // Lowest access count in a shared frequency sketch
+    };
+
+    struct MemoryBudget {
+        size_t max_bytes;           // 0 leaves the store unbounded
+        EvictionPolicy policy;
+        size_t sample_size;         // Records compared to pick each victim
+        std::string spill_directory;    // Where evicted records go; empty deletes them instead
+
+        MemoryBudget() : max_bytes(0), policy(EvictionPolicy::Lru), sample_size(5) {}
+    };
+
+    struct CollectionUsage {
+        size_t bytes;
+        size_t records;             // Including deleted records kept for snapshots
+        uint64_t evictions;
+        uint64_t expirations;
+
+        CollectionUsage() : bytes(0), records(0), evictions(0), expirations(0) {}
+    };
+
+    struct MemoryStats {
+        MemoryBudget budget;
+        size_t used_bytes;
+        uint64_t evictions;
+        uint64_t expirations;
+        bool spilling;
+        uint64_t spills;            // Evictions written to disk rather than deleted
+        uint64_t promotions;        // Spilled records read back into memory
+        LsmStore::Stats disk;       // Only filled in when spilling
+        std::map<std::string, CollectionUsage> collections;
+        std::map<std::string, SearchIndex::Stats> search;     // Collections with an index
+        std::map<std::string, ColumnStore::Stats> columns;    // Collections with columns
+    };
+
+    DataStore();
+
+    void set_mutation_listener(MutationListener listener);
+
+    // `version`, when given, receives the record's version after the call
+    std::string create(const std::string& collection, const Item& item, const WriteOptions& options = WriteOptions(),
+                       uint64_t* version = nullptr);
+
+    // Reads copy only the listed `fields`, plus `id`, or every field when the list is empty
+    Item read(const std::string& collection, const std::string& id, uint64_t* version = nullptr,
+              const std::vector<std::string>& fields = std::vector<std::string>());
+    // The same without waiting, for callers that must not block: false, and nothing read, when
+    // the lock is taken or the record would have to come from disk
+    bool try_read(const std::string& collection, const std::string& id, Item& item, uint64_t* version = nullptr,
+                  const std::vector<std::string>& fields = std::vector<std::string>());
+    std::vector<Item> read_all(const std::string& collection,
+                               const std::vector<std::string>& fields = std::vector<std::string>());
+    // Copies up to `limit` items whose id sorts after `after_id` (from the start when empty),
+    // as seen by `snapshot`, or by the latest commit when no snapshot is given
+    std::vector<Item> scan(const std::string& collection, const std::string& after_id, size_t limit,
+                           const Snapshot* snapshot = nullptr,
+                           const std::vector<std::string>& fields = std::vector<std::string>());
+    // Replaces the record, including its time-to-live
+    WriteStatus update(const std::string& collection, const std::string& id, const Item& item,
+                       const WriteOptions& options = WriteOptions(), uint64_t* version = nullptr);
+    WriteStatus remove(const std::string& collection, const std::string& id,
+                       const WriteOptions& options = WriteOptions());
+    // JSON merge patch of the top-level fields: `changes` are set and `removed` are deleted.
+    // Keeps the record's time-to-live unless the options give a new one. Edits the current
+    // version in place when no reader can see it, otherwise copies it.
+    WriteStatus patch(const std::string& collection, const std::string& id, const Item& changes,
+                      const std::vector<std::string>& removed, const WriteOptions& options = WriteOptions(),
+                      uint64_t* version = nullptr);
+
+    // Applies all operations under a single lock acquisition
+    std::vector<BatchResult> apply_batch(const std::string& collection, const std::vector<BatchOperation>& operations);
+
+    std::shared_ptr<Snapshot> snapshot();
+
+    // Deletes up to `budget` records whose time-to-live ran out; returns how many it deleted
+    size_t expire_due(std::chrono::steady_clock::time_point now, size_t budget);
+    // Whether expire_due() would find anything; takes no lock, so it can be asked every tick
+    bool expiry_due(std::chrono::steady_clock::time_point now) const;
+
+    // Applies the budget at once, evicting records if the store is already over it. The
+    // spill directory is only opened the first time one is given.
+    void set_memory_budget(const MemoryBudget& budget);
+    MemoryStats memory_stats();
+
+    // Indexes a collection for full-text search from now on, or every collection for "*".
+    // Records already spilled to disk when the index is built are left out of it.
+    void enable_search(const std::string& collection);
+    // Keeps `fields` of a collection in columns from now on. Only the first call for a
+    // collection takes effect, and records already spilled to disk are left out.
+    void enable_columns(const std::string& collection, const std::vector<std::string>& fields);
+
+    // Summarises numeric `fields` over the records matching `filters`, per value of
+    // `group_by` when given. Answered from columns when they cover every field involved,
+    // otherwise from records read through one snapshot.
+    std::vector<Aggregator::Group> aggregate(const std::string& collection, const std::vector<std::string>& fields,
+                                             const std::string& group_by,
+                                             const std::vector<Aggregator::Filter>& filters =
+                                                 std::vector<Aggregator::Filter>());
+
+    // Keeps the last `capacity` changes of each collection created from now on; 0, the
+    // default, keeps none. Meant to be set before the first write.
+    void set_change_feed_capacity(size_t capacity);
+    bool change_feed_enabled();
+
+    // Sequence of the latest commit, for watchers that only want changes from now on
+    uint64_t last_commit();
+
+    // Appends up to `limit` changes to a collection committed after `after_sequence`,
+    // oldest first. False when some of them are no longer retained.
+    bool read_changes(const std::string& collection, uint64_t after_sequence, size_t limit,
+                      std::vector<ChangeFeed::Event>& events);
+
+    // False when the collection has no index
+    bool search(const std::string& collection, const std::string& query, size_t limit,
+                std::vector<SearchIndex::Hit>& hits, size_t* total = nullptr);
+
+private:
+    struct Version {
+        uint64_t sequence;                  // Commit that wrote this version
+        std::shared_ptr<Item> item;         // Null when the commit deleted the record or the
+                                            // data was spilled; only modified while no snapshot
+                                            // or reader holds it
+    };
+
+    // Retained versions of one record, oldest first; the last one is current
+    struct Record {
+        std::vector<Version> versions;
+        std::chrono::steady_clock::time_point expires_at;   // Epoch when the record never expires
+        bool gc_queued;
+        size_t bytes;               // Memory charged for the record and all its versions
+        size_t resident_slot;       // Position in `residents`
+        uint64_t last_access;       // Access clock at the last read or write
+        uint8_t frequency;          // Logarithmic access counter for LFU
+        uint16_t frequency_minute;  // Minute the counter was last decayed
+        uint64_t spilled_sequence;  // Version held by the disk tier, or queued for it; 0 when none
+        uint32_t disk_writes;       // Queued disk writes; the record stays in memory until they are done
+
+        Record()
+            : gc_queued(false), bytes(0), resident_slot(0), last_access(0), frequency(0), frequency_minute(0),
+              spilled_sequence(0), disk_writes(0) {}
+    };
+
+    using RecordKey = std::pair<std::string, std::string>;   // Collection and id
+    using RecordMap = std::map<std::string, Record>;
+
+    struct Collection {
+        RecordMap records;
+        CollectionUsage usage;
+        std::unique_ptr<SearchIndex> search;    // Only for collections with search enabled
+        std::unique_ptr<ColumnStore> columns;   // Only for collections with columnar fields
+        std::unique_ptr<ChangeFeed> changes;    // Only while change feeds are on
+        size_t column_bytes;                    // Charged to `usage` for the columns
+
+        Collection() : column_bytes(0) {}
+    };
+    using CollectionMap = std::map<std::string, Collection>;
+
+    // Every record in the store, for picking eviction samples in constant time
+    struct ResidentRef {
+        CollectionMap::iterator collection;
+        RecordMap::iterator record;
+    };
+
+    // A change to a search index, queued under data_mutex and applied once it is released
+    struct SearchUpdate {
+        enum class Type { Add, Remove, Deadline };
+        SearchIndex* index;
+        Type type;
+        std::string id;
+        std::shared_ptr<const Item> item;                   // For Add
+        std::chrono::steady_clock::time_point deadline;     // For Deadline
+    };
+
+    // A spill or deletion waiting to be written to the disk tier
+    struct DiskWrite {
+        RecordKey key;
+        uint64_t sequence;              // Version being spilled
+        std::shared_ptr<Item> item;     // Null for a deletion
+        size_t bytes;                   // Memory the spill frees once written
+    };
+
+    CollectionMap data;
+    std::mutex data_mutex;
+    int next_id;
+    uint64_t commit_sequence;
+    std::multiset<uint64_t> open_snapshots;
+    // Records keeping old versions alive for open snapshots
+    std::vector<RecordKey> gc_queue;
+    // Records with a deadline, by expiry bucket; entries go stale when a deadline moves
+    std::map<int64_t, std::vector<RecordKey>> expiry_buckets;
+    std::atomic<int64_t> first_expiry_bucket;   // Earliest key of expiry_buckets, or INT64_MAX
+
+    MemoryBudget memory_budget;
+    size_t used_bytes;
+    uint64_t total_evictions;
+    uint64_t total_expirations;
+    std::vector<ResidentRef> residents;
+    uint64_t access_clock;
+    uint64_t random_state;
+    std::unique_ptr<FrequencySketch> sketch;     // Only kept for TinyLfu
+    std::set<std::string> evicted_collections;  // Awaiting notification
+
+    std::unique_ptr<LsmStore> disk;             // Set once, when spilling is first enabled
+    std::shared_mutex disk_mutex;               // Taken before data_mutex, never while holding it
+    std::vector<DiskWrite> disk_writes;         // In commit order
+    size_t spilling_bytes;                      // Still charged for spills not yet written
+    uint64_t total_spills;
+    uint64_t total_promotions;
+
+    std::set<std::string> search_collections;
+    bool search_everything;
+    std::vector<SearchUpdate> search_updates;   // In commit order
+    bool indexing;                              // Updates taken off the queue are being applied
+    std::mutex indexing_mutex;                  // Keeps appliers in order; taken before data_mutex
+    std::map<std::string, std::vector<std::string>> column_fields;
+    size_t change_feed_capacity;
+
+    MutationListener mutation_listener;
+    void notify_mutation(const std::string& collection);
+    void notify_evictions();
+    void write_disk();
+    void write_index();
+
+    // Mutations shared by the single and batch paths; data_mutex must be held
+    std::string create_locked(const std::string& collection, const Item& item, const WriteOptions& options);
+    WriteStatus update_locked(const std::string& collection, const std::string& id, const Item& item,
+                              const WriteOptions& options);
+    WriteStatus remove_locked(const std::string& collection, const std::string& id, const WriteOptions& options);
+    WriteStatus patch_locked(const std::string& collection, const std::string& id, const Item& changes,
+                             const std::vector<std::string>& removed, const WriteOptions& options);
+
+    static const Version* visible_version(const Record& record, uint64_t sequence);
+    Record* find_current(const std::string& collection, const std::string& id);
+    RecordMap::iterator find_record(const std::string& collection, const std::string& id,
+                                    CollectionMap::iterator& collection_it);
+    std::pair<CollectionMap::iterator, RecordMap::iterator> emplace_record(const std::string& collection,
+                                                                           const std::string& id);
+    void erase_record(CollectionMap::iterator collection_it, RecordMap::iterator record_it);
+    void recharge(CollectionMap::iterator collection_it, RecordMap::iterator record_it);
+    static bool is_expired(const Record& record, std::chrono::steady_clock::time_point now);
+    void set_expiry(const std::string& collection, const std::string& id, std::chrono::milliseconds ttl);
+    bool is_private(const Record& record) const;
+    void write_version(const std::string& collection, const std::string& id, std::shared_ptr<Item> item);
+    bool prune(Record& record);
+    void release_snapshot(uint64_t sequence);
+
+    uint64_t next_random();
+    void touch(const std::string& collection, const std::string& id, Record& record);
+    uint64_t eviction_rank(const ResidentRef& resident);
+    void enforce_budget(const Record* keep);
+
+    static bool is_spilled(const Record& record, const Version& version);
+    bool needs_disk(const std::string& collection, const std::string& id);
+    bool promote(const std::string& collection, const std::string& id);
+    std::unique_lock<std::mutex> lock_records(const std::string& collection, const std::vector<std::string>& ids,
+                                              std::shared_lock<std::shared_mutex>& disk_lock, bool& promoted);
+    Record* install(const std::string& collection, const std::string& id, const LsmStore::Entry& entry);
+    void spill(const ResidentRef& victim);
+    void release_spilled(CollectionMap::iterator collection_it, RecordMap::iterator record_it);
+
+    void build_search_index(Collection& collection);
+    void build_columns(Collection& collection, const std::vector<std::string>& fields);
+    void index_record(Collection& collection, const std::string& id, const std::shared_ptr<Item>& item);
+    void charge_columns(Collection& collection, size_t bytes);
+    void publish_change(Collection& collection, ChangeFeed::Type type, const std::string& id,
+                        const Version& version);
+
+    // Like scan, but hands out the shared immutable items rather than copies
+    std::vector<std::shared_ptr<const Item>> scan_shared(const std::string& collection, const std::string& after_id,
+                                                         size_t limit, const Snapshot* snapshot);
+};
+
+#endif // DATA_STORE_H
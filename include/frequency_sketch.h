@@ -0,0 +1,35 @@
+#ifndef FREQUENCY_SKETCH_H
+#define FREQUENCY_SKETCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Count-min sketch of recent access frequencies, as used by TinyLFU.
+//
+// Each key hash bumps one small saturating counter in each of four rows and
+// the estimate is the smallest of them. After a sample period of ten
+// increments per counter column every counter is halved, so old popularity
+// fades and the sketch follows the current workload.
+class FrequencySketch {
+public:
+    // `width` counters per row, rounded up to a power of two
+    explicit FrequencySketch(size_t width);
+
+    void increment(uint64_t hash);
+    unsigned estimate(uint64_t hash) const;
+
+private:
+    static const int DEPTH = 4;
+    static const uint8_t MAX_COUNT = 15;
+
+    std::vector<uint8_t> counters;  // DEPTH rows of `width` counters
+    size_t width;
+    size_t additions;
+    size_t sample_period;
+
+    size_t index(uint64_t hash, int row) const;
+    void age();
+};
+
+#endif // FREQUENCY_SKETCH_H
@@ -0,0 +1,77 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+// HPACK header compression for HTTP/2 (RFC 7541).
+//
+// Each direction of a connection has its own dynamic table, so a connection
+// decodes what it receives with one HpackDecoder and encodes what it sends
+// with one HpackEncoder. Both keep state across header blocks and must see
+// the blocks in the order they cross the wire; neither is thread-safe.
+using HeaderList = std::vector<std::pair<std::string, std::string>>;
+
+// Entries added by previous header blocks, newest first
+class HpackTable {
+public:
+    explicit HpackTable(size_t max_size);
+
+    void add(std::string name, std::string value);
+    void set_max_size(size_t size);
+    size_t max_size() const { return limit; }
+    size_t count() const { return entries.size(); }
+    // Index 0 is the newest entry
+    const std::pair<std::string, std::string>& at(size_t index) const { return entries[index]; }
+
+    // Size of an entry as the protocol counts it
+    static size_t entry_size(const std::string& name, const std::string& value) {
+        return name.size() + value.size() + 32;
+    }
+
+private:
+    std::deque<std::pair<std::string, std::string>> entries;
+    size_t size;
+    size_t limit;
+
+    void evict(size_t target);
+};
+
+class HpackDecoder {
+public:
+    enum class Status { Ok, TooLarge, Invalid };
+
+    HpackDecoder();
+
+    // Decodes one complete header block, appending the fields to `headers`.
+    // Invalid is a compression error, after which the connection cannot go on.
+    // TooLarge means the fields add up to more than `max_list_size`; the block
+    // is still decoded to the end so the table stays in step with the peer.
+    Status decode(const uint8_t* data, size_t length, HeaderList& headers, size_t max_list_size);
+
+private:
+    HpackTable table;
+    size_t protocol_max_size;   // SETTINGS_HEADER_TABLE_SIZE this side advertised
+};
+
+class HpackEncoder {
+public:
+    HpackEncoder();
+
+    // Applies the peer's SETTINGS_HEADER_TABLE_SIZE; the next block announces the change
+    void set_max_table_size(size_t size);
+
+    // Appends the block for `headers`, whose names must be lowercase
+    void encode(const HeaderList& headers, std::string& out);
+
+private:
+    HpackTable table;
+    size_t smallest_pending;    // Smallest size set since the last block
+    bool size_changed;
+};
+
+#endif // HPACK_H
@@ -0,0 +1,280 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+#include "hpack.h"
+
+// Body of an HTTP/2 response, written by the thread that runs the handler and
+// read by the connection as flow control allows. A complete body can be
+// handed over at once; a streamed one fills a bounded buffer, and the writer
+// waits while the client is not taking it.
+class Http2Body {
+public:
+    enum class WriteStatus { Written, Full, Cancelled };
+
+    explicit Http2Body(std::string data);
+    // `wake` runs when data arrives after the connection found the buffer empty
+    Http2Body(std::function<void()> wake, size_t max_buffered);
+
+    // Waits up to `timeout` for room. Cancelled once the stream is gone.
+    WriteStatus write(std::string_view chunk, std::chrono::milliseconds timeout);
+    void finish();
+    void cancel();
+
+    // Moves up to `max_length` bytes to `out`; `finished` is set once everything was taken
+    size_t read(std::string& out, size_t max_length, bool& finished);
+    // Bytes ready to read, with `finished` telling whether more may come
+    size_t available(bool& finished);
+    // The writer gave up, or the stream went away
+    bool was_cancelled();
+
+private:
+    std::mutex body_mutex;
+    std::condition_variable drained;
+    std::string buffer;
+    size_t read_offset;
+    size_t max_buffered;
+    bool complete;
+    bool cancelled;
+    bool reader_waiting;        // The connection found nothing to read
+    std::function<void()> wake;
+};
+
+// Body of an HTTP/2 request whose handler reads it as it arrives. The connection
+// appends what DATA frames carry and the handler takes it, waiting while nothing
+// is there. The client's window only grows back as the handler reads, so the
+// buffer never holds more than one window.
+class Http2RequestBody {
+public:
+    // `wake` runs when the handler reads after the connection took the count of what was read
+    explicit Http2RequestBody(std::function<void()> wake);
+
+    // Waits up to `timeout` for data. Returns the bytes read, 0 at the end of the body,
+    // or -1 once the stream was reset or nothing came in time.
+    ssize_t read(char* out, size_t length, std::chrono::milliseconds timeout);
+
+    void append(const char* data, size_t length);
+    void finish();
+    void cancel();
+    // Bytes the handler read since the last call
+    size_t take_consumed();
+
+private:
+    std::mutex body_mutex;
+    std::condition_variable arrived;
+    std::string buffer;
+    size_t read_offset;
+    size_t consumed;
+    bool complete;
+    bool cancelled;
+    std::function<void()> wake;
+};
+
+// One HTTP/2 connection (RFC 9113), server side, over cleartext TCP.
+//
+// This is the protocol state machine only: it parses the frames received,
+// tracks streams, enforces flow control in both directions and produces the
+// frames to send, but does no I/O and is not thread-safe. Requests come out
+// whole, body included, except those `Settings::stream_body` picks, which come
+// out at their HEADERS with the body following through an Http2RequestBody.
+// Responses go back in through respond() and are sent as the peer's windows
+// allow.
+//
+// Window is given back to the client as request bytes leave the connection,
+// so a connection never holds more than `Settings::max_buffered` of them.
+//
+// DATA frames are scheduled by priority. Streams form the dependency tree the
+// client declares with HEADERS and PRIORITY frames; a stream only sends while
+// none of its ancestors has data ready, and ready streams share the
+// connection in proportion to their weights (stride scheduling over the bytes
+// each one sent).
+class Http2Connection {
+public:
+    struct Settings {
+        uint32_t max_concurrent_streams;
+        uint32_t initial_window_size;       // Per stream, for request bodies
+        uint32_t connection_window_size;
+        uint32_t max_header_list_size;
+        size_t max_body_size;
+        size_t max_buffered;                        // Request body bytes held at once, for all streams
+        std::chrono::milliseconds header_timeout;  // For a header block split over CONTINUATION frames
+        std::chrono::milliseconds body_timeout;    // Longest wait for the next frame of a request body
+        std::chrono::milliseconds send_timeout;    // Longest a response may wait for the peer's window
+        // Whether a request with this method and path has its body streamed to the handler
+        std::function<bool(const std::string& method, const std::string& path)> stream_body;
+        // Runs, on the handler's thread, when a streamed body was read and window can be given back
+        std::function<void()> wake;
+
+        Settings()
+            : max_concurrent_streams(256), initial_window_size(1 << 20), connection_window_size(16 << 20),
+              max_header_list_size(16 * 1024), max_body_size(256 * 1024 * 1024), max_buffered(256 * 1024 * 1024),
+              header_timeout(10000), body_timeout(15000), send_timeout(30000) {}
+    };
+
+    struct Request {
+        uint32_t stream_id;
+        std::string method;
+        std::string path;           // With the query string
+        std::string authority;
+        HeaderList headers;         // Regular fields, in arrival order
+        std::string body;
+        std::shared_ptr<Http2RequestBody> body_stream;  // Set instead of `body` when the body is streamed
+    };
+
+    enum ErrorCode : uint32_t {
+        NoError = 0x0, ProtocolError = 0x1, InternalError = 0x2, FlowControlError = 0x3,
+        StreamClosed = 0x5, FrameSizeError = 0x6, RefusedStream = 0x7, Cancel = 0x8,
+        CompressionError = 0x9, EnhanceYourCalm = 0xb
+    };
+
+    // Sent by a client before anything else
+    static const std::string PREFACE;
+
+    explicit Http2Connection(const Settings& settings);
+    ~Http2Connection();
+
+    // For a connection upgraded from HTTP/1.1: applies the client's HTTP2-Settings header
+    // and opens stream 1 for the request that carried it, awaiting its response.
+    // False when the header is not valid.
+    bool upgrade(const std::string& http2_settings);
+
+    // Consumes the complete frames at the front of `input`, received at `now`, appending
+    // finished requests to `requests`. False once the connection has failed; a GOAWAY is
+    // queued to say why.
+    bool receive(std::string& input, std::vector<Request>& requests, std::chrono::steady_clock::time_point now);
+
+    // Answers a stream with fields that start with ":status". Ignored, and the body
+    // cancelled, when the stream was reset meanwhile.
+    void respond(uint32_t stream_id, HeaderList headers, std::shared_ptr<Http2Body> body);
+
+    // Appends the frames ready to go, with DATA up to about `budget` bytes.
+    // True when anything was appended.
+    bool write(std::string& out, size_t budget);
+
+    // Ends what waited past its deadline: a request whose frames stopped coming is answered
+    // 408, a response the peer gives no window to is reset, and a header block left
+    // unfinished fails the connection. Meant to run about once a second.
+    void expire(std::chrono::steady_clock::time_point now);
+
+    // Stops taking new streams; the ones already open still finish
+    void go_away();
+    // Cancels every response body, for a connection that is closing
+    void abandon();
+
+    // GOAWAY was exchanged, or the connection failed, and nothing is left to do
+    bool finished() const;
+    size_t open_streams() const { return streams.size(); }
+
+private:
+    enum FrameType : uint8_t {
+        Data = 0x0, Headers = 0x1, Priority = 0x2, RstStream = 0x3, SettingsFrame = 0x4,
+        PushPromise = 0x5, Ping = 0x6, GoAway = 0x7, WindowUpdate = 0x8, Continuation = 0x9
+    };
+
+    struct Stream {
+        bool request_done;          // END_STREAM received
+        HeaderList request_headers;
+        std::string request_body;
+        int64_t expected_length;    // Content-Length of the request, -1 when absent
+        int64_t receive_window;
+        uint32_t unacknowledged;    // Body bytes taken since the last WINDOW_UPDATE
+        size_t body_length;         // Body bytes received
+        size_t held;                // Of them, still in request_body or request_stream
+        std::shared_ptr<Http2RequestBody> request_stream;
+        std::chrono::steady_clock::time_point deadline;         // For the next frame, until END_STREAM
+
+        int64_t send_window;
+        bool responded;
+        bool headers_sent;
+        HeaderList response_headers;
+        std::shared_ptr<Http2Body> response_body;
+        std::chrono::steady_clock::time_point stalled_since;    // Response blocked by flow control; epoch when not
+    };
+
+    // Priority tree node; kept for a while after its stream closes so dependants keep their place
+    struct PriorityNode {
+        uint32_t parent;
+        uint16_t weight;            // 1 to 256
+        std::set<uint32_t> children;
+        uint64_t pass;              // Virtual time of the stream's next DATA frame
+    };
+
+    struct PrioritySpec {
+        bool present;
+        uint32_t parent;
+        uint16_t weight;
+        bool exclusive;
+    };
+
+    Settings settings;
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    std::map<uint32_t, Stream> streams;
+    std::map<uint32_t, PriorityNode> priorities;
+    std::vector<uint32_t> retired_nodes;    // Nodes of closed streams, oldest first
+    std::vector<uint32_t> reset_streams;    // Streams this side reset or ignored lately, oldest first
+    std::string control;                    // Frames that go out ahead of DATA
+
+    bool preface_received;
+    bool settings_received;
+    uint32_t last_stream_id;
+    uint32_t continuation_stream;           // Stream whose header block is incomplete; 0 for none
+    uint8_t continuation_flags;             // Flags of the HEADERS frame that opened it
+    std::chrono::steady_clock::time_point continuation_deadline;
+    PrioritySpec block_priority;
+    std::string header_block;
+    bool goaway_sent;
+    bool goaway_received;
+    bool failed;
+
+    int64_t connection_send_window;
+    int64_t connection_receive_window;
+    uint32_t connection_unacknowledged;     // Received, and not given back as window yet
+    size_t buffered;                        // Request body bytes held for all streams
+    uint32_t peer_initial_window;
+    uint32_t peer_max_frame_size;
+    uint64_t virtual_time;
+    std::chrono::steady_clock::time_point received_at;     // Of the frames being handled
+
+    void append_frame(std::string& out, uint8_t type, uint8_t flags, uint32_t stream_id, std::string_view payload);
+    bool connection_error(ErrorCode code);
+    void reset_stream(uint32_t stream_id, ErrorCode code);
+    void forget_stream(uint32_t stream_id);
+    void close_stream(std::map<uint32_t, Stream>::iterator it);
+    void end_stream_sent(std::map<uint32_t, Stream>::iterator it);
+    bool apply_settings(const uint8_t* payload, size_t length);
+
+    bool handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t length,
+                      std::vector<Request>& requests);
+    bool handle_data(uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t length,
+                     std::vector<Request>& requests);
+    bool handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t length,
+                        std::vector<Request>& requests);
+    bool finish_header_block(uint32_t stream_id, uint8_t flags, std::vector<Request>& requests);
+    bool handle_window_update(uint32_t stream_id, const uint8_t* payload, size_t length);
+    void acknowledge_data(Stream& stream, uint32_t stream_id, size_t length);
+    void acknowledge_connection();
+    void release_body(Stream& stream);
+    bool complete_request(uint32_t stream_id, Stream& stream, std::vector<Request>& requests);
+    void hand_out(uint32_t stream_id, Stream& stream, std::vector<Request>& requests);
+
+    void set_priority(uint32_t stream_id, uint32_t parent, uint16_t weight, bool exclusive);
+    PriorityNode& priority_node(uint32_t stream_id);
+    void retire_node(uint32_t stream_id);
+    void remove_node(uint32_t stream_id);
+    bool write_headers(std::string& out, uint32_t stream_id, Stream& stream);
+    uint32_t next_data_stream(const std::set<uint32_t>& ready);
+};
+
+#endif // HTTP2_H
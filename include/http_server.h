@@ -9,13 +9,36 @@
 #include <thread>
 #include <mutex>
 #include <sstream>
+#include <sys/types.h>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <coroutine>
+#include <array>
+#include "timer_wheel.h"
+#include "admission_control.h"
+#include "response_cache.h"
+#include "data_store.h"
+#include "websocket.h"
+#include "http2.h"
+#include "tls.h"
+#include "task.h"
+#include "async_io.h"
+#include "work_scheduler.h"
+#include "http_tokens.h"
+#include "route_table.h"
 
 // HTTP Request structure
 struct HttpRequest {
     std::string method;
+    HttpMethod method_id = HttpMethod::Unknown;     // Unknown for any method not in HttpMethod
     std::string path;
     std::string version;
     std::map<std::string, std::string> headers;
+    // Values of the headers HttpHeader knows, filled in with `headers` when the request is parsed
+    std::array<std::string, HTTP_HEADER_COUNT> known_headers;
     std::string body;
     std::map<std::string, std::string> query_params;
     std::map<std::string, std::string> form_data;
@@ -27,6 +50,25 @@ struct HttpRequest {
         std::vector<char> data;
     };
     std::map<std::string, FileData> files;
+    
+    // Set instead of `body` for routes registered with RouteOptions::stream_body.
+    // Reads the next piece of the body into buffer, returning the number of bytes
+    // read, 0 at the end of the body, or -1 if the client failed to send it.
+    std::function<ssize_t(char* buffer, size_t length)> read_body;
+    // The same for async routes, which suspend instead of blocking while the client is slow
+    std::function<Task<ssize_t>(char* buffer, size_t length)> read_body_async;
+};
+
+// An open file sent as a response body. It is not read into memory: plain and
+// kernel TLS connections send it with sendfile(), others in small pieces.
+struct ResponseFile {
+    int fd;                     // Closed with the ResponseFile
+    size_t size;
+    
+    ResponseFile(int fd, size_t size) : fd(fd), size(size) {}
+    ~ResponseFile();
+    ResponseFile(const ResponseFile&) = delete;
+    ResponseFile& operator=(const ResponseFile&) = delete;
 };
 
 // HTTP Response structure
@@ -37,44 +79,375 @@ struct HttpResponse {
     std::string body;
     std::vector<char> binary_data;
     bool is_binary;
+    std::shared_ptr<ResponseFile> file;     // When set, the body instead of `binary_data`
+    
+    // When set, the body is produced incrementally and sent with chunked transfer
+    // encoding. The writer sends one chunk and returns false once the client is gone.
+    using ChunkWriter = std::function<bool(const std::string& chunk)>;
+    std::function<void(const ChunkWriter& write)> stream_body;
+    // Set by the server for HTTP/1.0 clients, which do not know chunked encoding: the
+    // streamed body is sent as it is and ends when the connection closes
+    bool close_delimited = false;
+    
+    // When set, the connection becomes a server-sent event stream once the head is
+    // sent, and the event loop serves it from then on. The source runs on the blocking
+    // pool, one call at a time, right away and again whenever `event_channel` is
+    // signalled or the socket takes everything produced so far; it appends events to
+    // `out` and returns false to end the stream.
+    std::function<bool(std::string& out)> event_source;
+    std::string event_channel;
+    
+    // Set by HttpServer::accept_websocket(). Once the 101 head is sent the connection
+    // speaks WebSocket, served by the event loop with these handlers.
+    std::shared_ptr<WebSocketHandlers> websocket;
     
     HttpResponse() : status_code(200), status_text("OK"), is_binary(false) {}
 };
 
+// Per-connection read limits used to defend against slow clients (slowloris)
+struct ConnectionLimits {
+    int header_timeout_ms;      // Time allowed to receive the request line and headers
+    int body_idle_timeout_ms;   // Max time the body may go without any progress
+    int body_rate_grace_ms;     // Time before the minimum body rate is enforced
+    size_t min_body_rate;       // Minimum body bytes per second after the grace period
+    size_t max_header_size;     // Max size of the request line plus headers
+    size_t max_body_size;       // Max accepted Content-Length
+    int idle_timeout_ms;        // Time a keep-alive connection may sit idle between requests
+    int write_timeout_ms;       // Time allowed to send a complete response
+    
+    ConnectionLimits()
+        : header_timeout_ms(10000), body_idle_timeout_ms(15000), body_rate_grace_ms(5000),
+          min_body_rate(1024), max_header_size(16 * 1024), max_body_size(256 * 1024 * 1024),
+          idle_timeout_ms(30000), write_timeout_ms(30000) {}
+};
+
 // Route handler function type
 using RouteHandler = std::function<void(const HttpRequest&, HttpResponse&)>;
 
-// Simple data store for CRUD operations
-class DataStore {
-private:
-    std::map<std::string, std::map<std::string, std::map<std::string, std::string>>> data;
-    std::mutex data_mutex;
-    int next_id;
+// Coroutine route handler. The request and response stay valid until the task finishes,
+// and the task may suspend on the request body, files or other AsyncRuntime work without
+// holding a worker thread. It resumes on any worker, not necessarily the one it started on.
+using AsyncRouteHandler = std::function<Task<void>(const HttpRequest&, HttpResponse&)>;
 
-public:
-    DataStore() : next_id(1) {}
+// Per-route behaviour beyond the handler itself
+struct RouteOptions {
+    // Where the handler runs. Coroutine handlers always start on a worker, as they do not hold it.
+    enum class Execution {
+        Worker,     // The worker pool, sized to the cores
+        Inline,     // The event loop itself, for HTTP/1.1 requests without a body that arrived whole;
+                    // the handler must never block and should finish in microseconds
+        Blocking    // The blocking pool, for handlers that wait on clients or disks, such as
+                    // uploads and downloads, so they cannot take the workers from cheap requests
+    };
+    
+    bool cacheable;                 // GET responses may be served from the response cache
+    std::vector<std::string> vary;  // Request headers that select between cached variants
+    bool stream_body;               // The handler reads the body itself through HttpRequest::read_body
+    Execution execution;
     
-    std::string create(const std::string& collection, const std::map<std::string, std::string>& item);
-    std::map<std::string, std::string> read(const std::string& collection, const std::string& id);
-    std::vector<std::map<std::string, std::string>> read_all(const std::string& collection);
-    bool update(const std::string& collection, const std::string& id, const std::map<std::string, std::string>& item);
-    bool remove(const std::string& collection, const std::string& id);
+    RouteOptions() : cacheable(false), stream_body(false), execution(Execution::Worker) {}
 };
 
 // HTTP Server class
-class HttpServer {
+class HttpServer : public AsyncRuntime {
 private:
+    // State kept for each accepted client connection
+    struct Connection : std::enable_shared_from_this<Connection> {
+        enum class Phase { Header, Body, Write, Idle, Stream };
+        
+        int socket;
+        std::string buffer;             // Bytes received but not yet consumed
+        TimerWheel::Timer timer;        // Deadline of the current phase
+        std::atomic<Phase> phase;       // Read by the timer callback on the event loop
+        std::atomic<bool> timed_out;
+        size_t requests_served;
+        std::unique_ptr<TlsSession> tls;    // Set when the server terminates TLS
+        std::coroutine_handle<> awaiting;   // Resumed once the socket is ready; guarded by connections_mutex
+        std::atomic<size_t> home_worker;    // Worker whose deque its requests and continuations go to
+        
+        explicit Connection(int socket)
+            : socket(socket), phase(Phase::Header), timed_out(false), requests_served(0), home_worker(0) {}
+        
+        // recv() and send() through TLS when the connection has it. Without `wait`
+        // they fail with EAGAIN instead of blocking.
+        ssize_t receive(char* data, size_t length, bool wait);
+        ssize_t transmit(const char* data, size_t length, bool wait);
+        // Decrypted input is waiting that epoll cannot report
+        bool has_buffered_input() const { return tls && tls->has_buffered_input(); }
+        // What to wait for after receive() or transmit() failed with EAGAIN. TLS can need
+        // the other direction, to finish a handshake or answer a key update.
+        uint32_t retry_events(bool transmitting) const;
+    };
+    
     int port;
     int server_socket;
-    bool running;
-    std::vector<std::thread> worker_threads;
-    std::map<std::string, std::map<std::string, RouteHandler>> routes;
+    std::atomic<bool> running;
+    std::atomic<bool> stop_requested;   // Set by request_stop(); the event loop returns from start()
+    struct RouteEntry {
+        HandlerRef<const HttpRequest&, HttpResponse&> handler;
+        AsyncRouteHandler async_handler;    // Set instead of `handler` for coroutine routes
+        RouteOptions options;
+    };
+    // Built-in routes are matched through a table generated at compile time, and take
+    // precedence; routes added at run time are tried after them, except that one added
+    // for exactly the method and pattern of a built-in route replaces it
+    struct BuiltinRoutes;
+    std::vector<RouteEntry> builtin_routes;             // In the order of BuiltinRoutes::Table
+    std::vector<const RouteEntry*> builtin_overrides;   // The same, set where a route in `routes` replaces one
+    std::map<std::string, std::map<std::string, RouteEntry>> routes;
+    struct DynamicRoute {
+        std::string_view method;            // Views of the keys in `routes`
+        HttpMethod method_id;
+        RoutePattern pattern;
+        const RouteEntry* entry;
+    };
+    std::vector<DynamicRoute> dynamic_routes;
+    size_t inline_routes;                   // Without any, the event loop never reads requests itself
+    std::atomic<uint64_t> inline_served;
+    std::unique_ptr<ResponseCache> response_cache;
     DataStore data_store;
+    std::atomic<bool> expiring;         // A sweep of expired records is queued or running
+    ConnectionLimits limits;
+    std::shared_ptr<TlsContext> tls;    // Every connection speaks TLS when set
+    
+    // Event loop state: ready connections are handed to worker threads,
+    // idle keep-alive connections stay parked in epoll
+    int epoll_fd;
+    int wake_fd;
+    TimerWheel timers;
+    std::map<int, std::shared_ptr<Connection>> connections;
+    std::mutex connections_mutex;
+    bool accept_paused;
+    size_t next_home_worker;            // New connections are spread over the workers in turn
+    
+    // Worker pool fed by the event loop; CoDel sheds requests that queued too long
+    struct QueuedConnection {
+        std::shared_ptr<Connection> conn;
+        std::chrono::steady_clock::time_point enqueued;
+        std::function<void(bool shed)> task;    // Runs instead of handle_client, as for an HTTP/2 stream
+        std::coroutine_handle<> resumed = nullptr;  // A suspended handler going on instead
+        bool admitted = false;                  // Continues a request already admitted; not timed by CoDel
+    };
+    AdmissionConfig admission;
+    std::unique_ptr<CoDelController> codel;
+    std::vector<std::thread> worker_threads;
+    std::unique_ptr<WorkScheduler<QueuedConnection>> scheduler;
+    std::mutex codel_mutex;
+    
+    // Threads for blocking routes, and for blocking calls coroutine handlers wait on, such as file I/O
+    std::vector<std::thread> blocking_threads;
+    std::deque<std::function<void()>> blocking_jobs;
+    std::mutex blocking_mutex;
+    std::condition_variable blocking_ready;
+    TaskGroup handlers;                 // Coroutine handlers, destroyed at shutdown if still suspended
+    
+    // Output the event loop writes to a socket without blocking
+    struct Outbound {
+        std::string pending;            // Not yet taken by the socket
+        bool waiting_writable;          // EPOLLOUT is armed
+        std::chrono::steady_clock::time_point last_write;
+    };
+    
+    // Connections the event loop serves as server-sent event streams. The source runs on
+    // the blocking pool, one call at a time, and its output comes back as an EventOutput.
+    struct EventStream {
+        std::shared_ptr<Connection> conn;
+        std::shared_ptr<std::function<bool(std::string& out)>> source;
+        std::string channel;
+        Outbound out;
+        bool finished;                  // The source ended the stream
+        bool polling;                   // A call to the source is running
+        bool repoll;                    // Signalled meanwhile; call it again once it returns
+    };
+    
+    struct EventOutput {
+        std::shared_ptr<Connection> conn;
+        std::string events;
+        bool finished;
+    };
+    
+    // Upgraded connections; received bytes not yet parsed stay in conn->buffer
+    struct WebSocketSession {
+        std::shared_ptr<Connection> conn;
+        std::shared_ptr<WebSocket> socket;
+        std::shared_ptr<WebSocketHandlers> handlers;
+        Outbound out;
+        std::string message;            // Fragments of a message still arriving
+        uint8_t message_opcode;         // Opcode of that message; 0 between messages
+        bool close_sent;
+        bool finishing;                 // Close the socket once `out` is sent
+        uint16_t close_code;            // Reported to on_close
+        std::chrono::steady_clock::time_point last_received;
+        std::chrono::steady_clock::time_point ping_sent;       // Epoch when no ping is outstanding
+        std::chrono::steady_clock::time_point close_started;
+    };
+    
+    // Connections speaking HTTP/2; received bytes not yet parsed stay in conn->buffer
+    struct Http2Session {
+        std::shared_ptr<Connection> conn;
+        std::unique_ptr<Http2Connection> protocol;
+        Outbound out;
+        std::chrono::steady_clock::time_point last_received;
+    };
+    
+    // A stream's response, finished by a worker for the event loop to send
+    struct Http2Response {
+        std::shared_ptr<Connection> conn;
+        uint32_t stream_id;
+        HeaderList fields;
+        std::shared_ptr<Http2Body> body;
+    };
+    
+    // Only the event loop touches the maps keyed by socket; the rest is guarded by streams_mutex
+    std::map<int, EventStream> event_streams;
+    std::map<int, WebSocketSession> websockets;
+    std::map<int, Http2Session> http2_sessions;
+    std::vector<EventStream> new_event_streams;         // Handed over by workers
+    std::vector<EventOutput> event_output;              // Produced by sources on the blocking pool
+    std::vector<WebSocketSession> new_websockets;
+    std::vector<Http2Session> new_http2_sessions;
+    std::vector<Http2Response> http2_responses;
+    std::set<int> websocket_output;                     // Sockets with frames queued by handlers
+    std::set<int> http2_output;                         // Sockets with streamed response data ready
+    std::set<std::string> signalled_channels;
+    std::map<std::string, size_t> watched_channels;     // Open streams and sockets per channel
+    std::mutex streams_mutex;
+    std::chrono::steady_clock::time_point next_stream_check;
+    uint32_t http2_max_streams;                         // 0 turns HTTP/2 off
+    
+    // Outcome of reading part of a request from a client socket
+    enum class ReadStatus { Ok, Closed, Timeout, TooLarge, Invalid };
+    
+    // Progress through a request body sent with Content-Length or chunked encoding
+    struct BodyState {
+        bool chunked;
+        bool finished;
+        bool chunk_crlf_pending;    // The CRLF closing the previous chunk is still unread
+        bool trailers;              // The last chunk was read; trailer fields follow
+        size_t remaining;           // Bytes left in the body, or in the current chunk
+        size_t total;               // Body bytes delivered so far
+        size_t received;            // Body bytes taken off the socket, for the rate check
+        ReadStatus error;           // Why reading stopped early; Ok while it has not
+        std::chrono::steady_clock::time_point started;
+    };
+    
+    // Where a cacheable GET response is looked up and stored
+    struct CacheLookup {
+        bool use;
+        std::string key;
+        uint64_t generation;
+    };
+    
+    // Waits for a connection's socket inside a coroutine; the event loop resumes it on a worker
+    struct SocketWait {
+        HttpServer& server;
+        Connection& conn;
+        uint32_t events;
+        
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> waiting) { server.await_socket(conn, events, waiting); }
+        void await_resume() const noexcept {}
+    };
     
     // Helper methods
     void start_listening();
-    void handle_client(int client_socket);
+    void accept_connections();
+    void dispatch_connection(const std::shared_ptr<Connection>& conn);
+    void update_accept_state();
+    void worker_loop(size_t worker);
+    void blocking_loop();
+    void queue_blocking(std::function<void()> job);
+    bool serve_inline(const std::shared_ptr<Connection>& conn);
+    void finish_inline(const std::shared_ptr<Connection>& conn, std::string response_str, bool keep_alive);
+    void resume_on_worker(std::coroutine_handle<> waiting, size_t worker);
+    void finish_coroutines();
+    void await_socket(Connection& conn, uint32_t events, std::coroutine_handle<> waiting);
+    void shed_connection(const std::shared_ptr<Connection>& conn);
+    void handle_client(std::shared_ptr<Connection> conn);
+    void arm_timer(Connection& conn, Connection::Phase phase, int timeout_ms);
+    void park_connection(const std::shared_ptr<Connection>& conn);
+    void close_connection(const std::shared_ptr<Connection>& conn);
+    ReadStatus read_request_head(Connection& conn, size_t& header_end);
+    ReadStatus begin_body(const HttpRequest& request, BodyState& body);
+    bool body_too_slow(const BodyState& body);
+    ReadStatus fill_body_buffer(Connection& conn, BodyState& body);
+    Task<ReadStatus> fill_body_buffer_async(Connection& conn, BodyState& body);
+    static ssize_t copy_buffered_body(const HttpRequest& request, size_t& offset, char* buffer, size_t length);
+    Task<ssize_t> read_streamed_body_async(Http2RequestBody& body_stream, char* buffer, size_t length);
+    static Task<ssize_t> read_buffered_body_async(const HttpRequest& request, size_t& offset, char* buffer,
+                                                  size_t length);
+    ssize_t take_body_some(Connection& conn, BodyState& body, char* buffer, size_t length, bool& need_input);
+    ssize_t read_body_some(Connection& conn, BodyState& body, char* buffer, size_t length);
+    Task<ssize_t> read_body_async(Connection& conn, BodyState& body, char* buffer, size_t length);
+    ReadStatus read_full_body(Connection& conn, BodyState& body, std::string& out);
+    Task<ReadStatus> read_full_body_async(Connection& conn, BodyState& body, std::string& out);
+    void send_read_error(const std::shared_ptr<Connection>& conn, ReadStatus status, bool in_head);
+    bool wants_keep_alive(const HttpRequest& request);
+    const RouteEntry* find_route(const HttpRequest& request);
+    void index_dynamic_routes();
+    bool serve_request(Connection& conn, const HttpRequest& request, const RouteEntry* route,
+                       const BodyState& body, bool keep_alive);
+    Task<void> serve_async_request(std::shared_ptr<Connection> conn, HttpRequest request, const RouteEntry* route,
+                                   BodyState body, bool keep_alive);
+    bool serve_routed_request(const std::shared_ptr<Connection>& conn, HttpRequest& request, const RouteEntry* route,
+                              BodyState& body);
+    bool finish_request(const std::shared_ptr<Connection>& conn, bool served, bool keep_alive, bool body_finished);
+    bool lookup_cached_response(const HttpRequest& request, const RouteEntry* route, CacheLookup& lookup,
+                                ResponseCache::CachedResponse& cached);
+    bool send_handler_response(Connection& conn, HttpResponse& response, const CacheLookup& lookup, bool keep_alive);
+    Task<bool> send_handler_response_async(Connection& conn, HttpResponse& response, const CacheLookup& lookup,
+                                           bool keep_alive);
+    std::string cache_key(const HttpRequest& request, const RouteOptions& options);
+    ResponseCache::CachedResponse split_response(const std::string& response_str);
+    std::string build_cached_response(const ResponseCache::CachedResponse& cached, bool keep_alive);
+    std::string build_handler_response(HttpResponse& response, const CacheLookup& lookup, bool keep_alive);
+    bool send_cached_response(Connection& conn, const ResponseCache::CachedResponse& cached, bool keep_alive);
+    bool send_all(Connection& conn, const char* data, size_t length);
+    Task<bool> send_all_async(Connection& conn, std::string data);
+    bool send_file_body(Connection& conn, const ResponseFile& file);
+    bool send_response(Connection& conn, HttpResponse& response);
+    bool send_chunked_body(Connection& conn, HttpResponse& response);
+    void wake_event_loop();
+    void run_streams(std::chrono::steady_clock::time_point now);
+    bool flush_outbound(Connection& conn, Outbound& out);
+    bool wait_writable(int socket, Outbound& out, bool wait);
+    void unwatch_channel(const std::string& channel);
+    bool open_event_stream(Connection& conn, HttpResponse& response);
+    void handle_event_stream_io(int fd, uint32_t events);
+    bool pump_event_stream(EventStream& stream);
+    void poll_event_source(EventStream& stream);
+    std::map<int, EventStream>::iterator close_event_stream(std::map<int, EventStream>::iterator it);
+    bool open_websocket(Connection& conn, HttpResponse& response);
+    void run_websockets(std::chrono::steady_clock::time_point now, const std::set<std::string>& channels,
+                        bool check_idle);
+    void handle_websocket_io(int fd, uint32_t events);
+    bool read_websocket(WebSocketSession& session);
+    void process_websocket_frames(WebSocketSession& session);
+    void fail_websocket(WebSocketSession& session, uint16_t code);
+    bool flush_websocket(WebSocketSession& session);
+    std::map<int, WebSocketSession>::iterator close_websocket(std::map<int, WebSocketSession>::iterator it);
+    bool is_http2_upgrade(const HttpRequest& request);
+    std::unique_ptr<Http2Connection> new_http2_connection(int fd);
+    bool open_http2(Connection& conn, std::unique_ptr<Http2Connection> protocol);
+    void run_http2(std::chrono::steady_clock::time_point now, bool check_idle);
+    void handle_http2_io(int fd, uint32_t events);
+    bool read_http2(Http2Session& session);
+    void dispatch_http2_requests(Http2Session& session, std::vector<Http2Connection::Request>& requests);
+    void serve_http2_stream(const std::shared_ptr<Connection>& conn, uint32_t stream_id, HttpRequest& request,
+                            std::shared_ptr<Http2RequestBody> body_stream, bool shed);
+    Task<void> serve_async_http2_stream(std::shared_ptr<Connection> conn, uint32_t stream_id, HttpRequest request,
+                                        std::shared_ptr<Http2RequestBody> body_stream, const RouteEntry* route,
+                                        CacheLookup lookup);
+    void respond_http2_stream(const std::shared_ptr<Connection>& conn, uint32_t stream_id, HttpResponse& response,
+                              const CacheLookup& lookup, const ResponseCache::CachedResponse* cached);
+    void post_http2_response(const std::shared_ptr<Connection>& conn, uint32_t stream_id, HeaderList fields,
+                             std::shared_ptr<Http2Body> body);
+    void wake_http2_output(int fd);
+    bool flush_http2(Http2Session& session);
+    std::map<int, Http2Session>::iterator close_http2(std::map<int, Http2Session>::iterator it);
+    void send_and_close(const std::shared_ptr<Connection>& conn, HttpResponse& response);
     HttpRequest parse_request(const std::string& request_str);
+    void parse_request_body(HttpRequest& request);
     std::string build_response(const HttpResponse& response);
     void parse_multipart_form_data(HttpRequest& request, const std::string& boundary);
     void parse_url_encoded_form_data(HttpRequest& request);
@@ -83,14 +456,23 @@ private:
     std::string extract_filename_from_path(const std::string& path);
     
     // Built-in route handlers
+    bool parse_item_body(const HttpRequest& request, std::map<std::string, std::string>& item);
+    void send_write_error(HttpResponse& response, DataStore::WriteStatus status, bool conditional);
     void handle_crud_create(const HttpRequest& request, HttpResponse& response);
+    void handle_crud_batch(const HttpRequest& request, HttpResponse& response);
+    void handle_crud_import(const HttpRequest& request, HttpResponse& response);
     void handle_crud_read(const HttpRequest& request, HttpResponse& response);
+    void handle_crud_search(const HttpRequest& request, HttpResponse& response);
+    void handle_crud_aggregate(const HttpRequest& request, HttpResponse& response);
+    void handle_crud_changes(const HttpRequest& request, HttpResponse& response);
     void handle_crud_read_all(const HttpRequest& request, HttpResponse& response);
     void handle_crud_update(const HttpRequest& request, HttpResponse& response);
+    void handle_crud_patch(const HttpRequest& request, HttpResponse& response);
     void handle_crud_delete(const HttpRequest& request, HttpResponse& response);
-    void handle_file_upload(const HttpRequest& request, HttpResponse& response);
+    Task<void> handle_file_upload(const HttpRequest& request, HttpResponse& response);
     void handle_file_download(const HttpRequest& request, HttpResponse& response);
     void handle_file_list(const HttpRequest& request, HttpResponse& response);
+    void handle_stats(const HttpRequest& request, HttpResponse& response);
     void handle_client_page(const HttpRequest& request, HttpResponse& response);
 
 public:
@@ -98,12 +480,42 @@ public:
     ~HttpServer();
     
     // Route registration
-    void add_route(const std::string& method, const std::string& path, RouteHandler handler);
+    void add_route(const std::string& method, const std::string& path, RouteHandler handler,
+                   const RouteOptions& options = RouteOptions());
+    void add_async_route(const std::string& method, const std::string& path, AsyncRouteHandler handler,
+                         const RouteOptions& options = RouteOptions());
     void setup_default_routes();
+    void set_connection_limits(const ConnectionLimits& new_limits);
+    void set_admission_config(const AdmissionConfig& config);
+    void enable_response_cache(size_t max_bytes);
+    void set_memory_budget(const DataStore::MemoryBudget& budget);
+    void enable_search(const std::string& collection);
+    void enable_columns(const std::string& collection, const std::vector<std::string>& fields);
+    void set_change_feed_capacity(size_t capacity);
+    // Concurrent streams per HTTP/2 connection; 0 serves HTTP/1.x only
+    void set_http2_max_streams(uint32_t streams);
+    // Terminates TLS on every connection. HTTP/2 is offered through ALPN as set at the
+    // time of the call. False, with the reason in `error`, when the certificate or key
+    // cannot be used or the server was built without TLS.
+    bool enable_tls(const TlsConfig& config, std::string& error);
+    
+    // AsyncRuntime: runs blocking calls of coroutine handlers on a few threads of their own
+    void run_blocking(std::function<void()> work, std::coroutine_handle<> waiting) override;
+    
+    // Wakes the event streams and WebSockets watching `channel`; safe to call from any thread
+    void signal_event_channel(const std::string& channel);
+    
+    // For GET handlers: switches the response to the WebSocket protocol, served with
+    // `handlers` from then on. Sets an error response and returns false when the
+    // request is not a valid upgrade.
+    bool accept_websocket(const HttpRequest& request, HttpResponse& response, const WebSocketHandlers& handlers);
+    static bool is_websocket_upgrade(const HttpRequest& request);
     
-    // Server control
+    // Server control. start() runs the event loop until request_stop() or stop() is called.
     void start();
     void stop();
+    // Makes start() return, leaving stop() to the caller; async-signal-safe, unlike stop()
+    void request_stop();
     
     // Utility methods
     void send_json_response(HttpResponse& response, const std::string& json, int status = 200);
@@ -0,0 +1,167 @@
+#ifndef HTTP_TOKENS_H
+#define HTTP_TOKENS_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Request methods and header names the server knows, turned into small integers
+// once when a request is parsed, so routing and header lookups compare integers
+// instead of strings. Anything else maps to Unknown and is still handled through
+// its text.
+
+enum class HttpMethod : uint8_t {
+    Unknown,
+    Get,
+    Head,
+    Post,
+    Put,
+    Patch,
+    Delete,
+    Options,
+    Connect,
+    Trace,
+};
+
+// Methods are case-sensitive, so "get" is Unknown
+constexpr HttpMethod parse_method(std::string_view text) {
+    switch (text.size()) {
+        case 3:
+            if (text == "GET") return HttpMethod::Get;
+            if (text == "PUT") return HttpMethod::Put;
+            break;
+        case 4:
+            if (text == "POST") return HttpMethod::Post;
+            if (text == "HEAD") return HttpMethod::Head;
+            break;
+        case 5:
+            if (text == "PATCH") return HttpMethod::Patch;
+            if (text == "TRACE") return HttpMethod::Trace;
+            break;
+        case 6:
+            if (text == "DELETE") return HttpMethod::Delete;
+            break;
+        case 7:
+            if (text == "OPTIONS") return HttpMethod::Options;
+            if (text == "CONNECT") return HttpMethod::Connect;
+            break;
+    }
+    return HttpMethod::Unknown;
+}
+
+enum class HttpHeader : uint8_t {
+    Unknown,
+    Accept,
+    AcceptEncoding,
+    AcceptLanguage,
+    Authorization,
+    CacheControl,
+    Connection,
+    ContentEncoding,
+    ContentLength,
+    ContentType,
+    Cookie,
+    Expect,
+    Host,
+    Http2Settings,
+    IfMatch,
+    IfModifiedSince,
+    IfNoneMatch,
+    KeepAlive,
+    LastEventId,
+    Origin,
+    Pragma,
+    Range,
+    Referer,
+    SecWebSocketExtensions,
+    SecWebSocketKey,
+    SecWebSocketProtocol,
+    SecWebSocketVersion,
+    Te,
+    Trailer,
+    TransferEncoding,
+    Upgrade,
+    UserAgent,
+    XForwardedFor,
+    Count
+};
+
+static constexpr size_t HTTP_HEADER_COUNT = static_cast<size_t>(HttpHeader::Count);
+
+// Names in the order of HttpHeader
+static constexpr std::array<std::string_view, HTTP_HEADER_COUNT> HTTP_HEADER_NAMES = {
+    "", "Accept", "Accept-Encoding", "Accept-Language", "Authorization", "Cache-Control", "Connection",
+    "Content-Encoding", "Content-Length", "Content-Type", "Cookie", "Expect", "Host", "HTTP2-Settings",
+    "If-Match", "If-Modified-Since", "If-None-Match", "Keep-Alive", "Last-Event-ID", "Origin", "Pragma",
+    "Range", "Referer", "Sec-WebSocket-Extensions", "Sec-WebSocket-Key", "Sec-WebSocket-Protocol",
+    "Sec-WebSocket-Version", "TE", "Trailer", "Transfer-Encoding", "Upgrade", "User-Agent", "X-Forwarded-For",
+};
+
+// Header names are found through a perfect hash: a seed the compiler searches for
+// gives every known name a slot of its own, so a lookup hashes the name once and
+// compares it with the one name in its slot. Names are case-insensitive, so the
+// hash folds case and so does the comparison.
+namespace http_header_hash {
+
+static constexpr size_t SLOTS = 128;
+
+constexpr char fold(char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+constexpr uint32_t hash(std::string_view name, uint32_t seed) {
+    uint32_t h = seed ^ static_cast<uint32_t>(name.size());
+    for (char c : name) {
+        h = (h ^ static_cast<unsigned char>(fold(c))) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+constexpr bool equal(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (fold(a[i]) != fold(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct Table {
+    uint32_t seed = 0;
+    std::array<HttpHeader, SLOTS> slots{};
+};
+
+constexpr Table build() {
+    for (uint32_t seed = 2166136261u;; seed += 0x9e3779b9u) {
+        Table table;
+        table.seed = seed;
+        bool collision = false;
+        for (size_t id = 1; id < HTTP_HEADER_COUNT && !collision; ++id) {
+            HttpHeader& slot = table.slots[hash(HTTP_HEADER_NAMES[id], seed) % SLOTS];
+            collision = slot != HttpHeader::Unknown;
+            slot = static_cast<HttpHeader>(id);
+        }
+        if (!collision) {
+            return table;
+        }
+    }
+}
+
+static constexpr Table TABLE = build();
+
+} // namespace http_header_hash
+
+constexpr HttpHeader parse_header_name(std::string_view name) {
+    using namespace http_header_hash;
+    HttpHeader candidate = TABLE.slots[hash(name, TABLE.seed) % SLOTS];
+    return equal(HTTP_HEADER_NAMES[static_cast<size_t>(candidate)], name) ? candidate : HttpHeader::Unknown;
+}
+
+static_assert(parse_header_name("content-length") == HttpHeader::ContentLength);
+static_assert(parse_header_name("X-Custom") == HttpHeader::Unknown);
+
+#endif // HTTP_TOKENS_H
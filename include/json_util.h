@@ -0,0 +1,29 @@
+#ifndef JSON_UTIL_H
+#define JSON_UTIL_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Minimal JSON support for the flat string records kept in DataStore.
+//
+// Objects parse into string maps: strings are unescaped, numbers and
+// booleans keep their literal text, and nested objects or arrays are kept
+// as raw JSON text so callers can parse them again if they need to.
+
+std::string json_escape(const std::string& value);
+
+// Serialises a record with every value written as a JSON string
+std::string json_serialize_object(const std::map<std::string, std::string>& item);
+
+void json_skip_whitespace(const std::string& text, size_t& pos);
+
+// Parses one object starting at pos and leaves pos just past it. Keys whose
+// value is null are left out of `item` and reported in `null_keys` if given.
+bool json_parse_object(const std::string& text, size_t& pos, std::map<std::string, std::string>& item,
+                       std::vector<std::string>* null_keys = nullptr);
+
+// Parses either a JSON array of objects or newline-delimited objects (NDJSON)
+bool json_parse_object_list(const std::string& text, std::vector<std::map<std::string, std::string>>& items);
+
+#endif // JSON_UTIL_H
@@ -0,0 +1,123 @@
+#ifndef LSM_STORE_H
+#define LSM_STORE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// On-disk tier for records evicted from DataStore, organised as a small
+// log-structured merge tree.
+//
+// Writes land in a memtable. Once it is full, a background thread writes it
+// out as an immutable run: a file of entries sorted by key, with a sparse
+// index and a bloom filter kept in memory. Lookups go from the newest data to
+// the oldest and skip runs whose bloom filter rules the key out. Runs have
+// levels: a flush makes a level 0 run, and once a level holds four runs a
+// second thread merges them into one run of the next level, dropping
+// overwritten entries (and deletions, when nothing older is left). A read
+// checks at most three runs per level, and levels grow by four times each.
+//
+// The files are scratch space. The directory is emptied when the store opens.
+class LsmStore {
+public:
+    using Item = std::map<std::string, std::string>;
+
+    struct Entry {
+        uint64_t sequence;      // Version of the record when it was written out
+        bool deleted;
+        Item item;
+
+        Entry() : sequence(0), deleted(false) {}
+    };
+
+    struct Stats {
+        size_t runs;
+        uint64_t disk_bytes;
+        size_t memtable_bytes;
+        uint64_t flushes;
+        uint64_t compactions;
+        uint64_t bloom_skips;   // Run lookups avoided by a bloom filter
+    };
+
+    // Flushes the memtable once it holds about `memtable_bytes`
+    LsmStore(const std::string& directory, size_t memtable_bytes);
+    ~LsmStore();
+
+    // False when the directory cannot be created or cleared
+    bool open();
+
+    void put(const std::string& key, uint64_t sequence, const Item& item);
+    void remove(const std::string& key);
+
+    // Finds the live entry for a key; false when absent or deleted
+    bool get(const std::string& key, Entry& entry);
+
+    // Up to `limit` live entries whose keys start with `prefix` and sort after `after`
+    std::vector<std::pair<std::string, Entry>> scan(const std::string& prefix, const std::string& after, size_t limit);
+
+    Stats stats();
+
+private:
+    struct BloomFilter {
+        std::vector<uint64_t> bits;
+        size_t bit_count;
+
+        void reset(size_t keys);
+        void add(const std::string& key);
+        bool might_contain(const std::string& key) const;
+    };
+
+    // One immutable sorted file; the index maps every INDEX_INTERVAL-th key to its offset
+    struct Run {
+        uint64_t number;
+        int level;
+        std::string path;
+        int fd;
+        uint64_t data_bytes;
+        size_t entries;
+        std::vector<std::pair<std::string, uint64_t>> index;
+        BloomFilter bloom;
+
+        Run() : number(0), level(0), fd(-1), data_bytes(0), entries(0) {}
+        ~Run();
+    };
+
+    using Memtable = std::map<std::string, Entry>;
+    class RunCursor;
+    class RunWriter;
+
+    std::string directory;
+    size_t memtable_limit;
+
+    std::mutex store_mutex;
+    std::condition_variable flush_needed;
+    std::condition_variable flush_done;
+    std::condition_variable compaction_needed;
+    Memtable memtable;
+    size_t memtable_bytes;
+    std::shared_ptr<const Memtable> flushing;           // Being written out; still searched
+    std::vector<std::shared_ptr<Run>> runs;             // Newest first
+    uint64_t next_run_number;
+    bool stopping;
+    std::thread flush_thread;
+    std::thread compaction_thread;
+
+    uint64_t flush_count;
+    uint64_t compaction_count;
+    uint64_t bloom_skip_count;
+
+    void insert(const std::string& key, Entry entry);
+    void flush_loop();
+    void compaction_loop();
+    bool find_compaction(size_t& first, size_t& count);
+    std::shared_ptr<Run> merge_runs(const std::vector<std::shared_ptr<Run>>& inputs, bool drop_deleted);
+    bool search_run(const Run& run, const std::string& key, Entry& entry);
+};
+
+#endif // LSM_STORE_H
@@ -0,0 +1,55 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Size-bounded LRU cache of fully built responses.
+//
+// Keys begin with the request path followed by '?', so every entry for a
+// path, and for the paths below it, can be dropped with one ordered range
+// scan. Responses are stored as two pre-built halves so the per-connection
+// "Connection" header can be inserted between them on a hit.
+class ResponseCache {
+public:
+    struct CachedResponse {
+        std::string head;   // Status line and headers up to Content-Length
+        std::string tail;   // Content-Length line, blank line and body
+    };
+
+    explicit ResponseCache(size_t max_bytes);
+
+    bool lookup(const std::string& key, CachedResponse& response);
+
+    // Stores a response unless an invalidation happened after `generation` was read
+    void store(const std::string& key, CachedResponse response, uint64_t generation);
+
+    // Read before running a handler; guards against caching data that changed meanwhile
+    uint64_t generation();
+
+    // Drops all entries for path and for any path below it
+    void invalidate(const std::string& path);
+
+private:
+    struct Entry {
+        CachedResponse response;
+        std::list<std::string>::iterator lru_position;
+    };
+    using EntryMap = std::map<std::string, Entry>;
+
+    EntryMap entries;
+    std::list<std::string> lru;   // Keys, most recently used first
+    size_t max_bytes;
+    size_t current_bytes;
+    uint64_t current_generation;
+    std::mutex cache_mutex;
+
+    static size_t entry_size(const std::string& key, const CachedResponse& response);
+    void erase(EntryMap::iterator it);
+    void invalidate_prefix(const std::string& prefix);
+};
+
+#endif // RESPONSE_CACHE_H
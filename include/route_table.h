@@ -0,0 +1,183 @@
+#ifndef ROUTE_TABLE_H
+#define ROUTE_TABLE_H
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include "http_tokens.h"
+
+// Route patterns such as "/api/data/{collection}/{id}", split once into literal
+// text and parameters and then matched against paths without allocating.
+//
+// A parameter matches one or more characters up to the next '/', so it must be
+// followed by the end of the pattern or by text starting with '/'; "{name}.txt"
+// is rejected, as finding where the name ends would take backtracking.
+//
+// Parsing and matching are constexpr: the patterns of built-in routes are parsed
+// by the compiler through RouteTable, and routes added at run time go through
+// the same code.
+
+static constexpr size_t MAX_ROUTE_TOKENS = 16;
+
+struct RoutePattern {
+    struct Token {
+        std::string_view literal;   // Text to match exactly; empty for a parameter
+        bool parameter = false;
+    };
+
+    std::array<Token, MAX_ROUTE_TOKENS> tokens{};
+    size_t count = 0;
+    bool valid = false;
+
+    constexpr bool matches(std::string_view path) const {
+        if (!valid) {
+            return false;
+        }
+        size_t position = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (tokens[i].parameter) {
+                size_t end = path.find('/', position);
+                if (end == std::string_view::npos) {
+                    end = path.size();
+                }
+                if (end == position) {
+                    return false;
+                }
+                position = end;
+            } else {
+                if (path.substr(position, tokens[i].literal.size()) != tokens[i].literal) {
+                    return false;
+                }
+                position += tokens[i].literal.size();
+            }
+        }
+        return position == path.size();
+    }
+};
+
+// The tokens of `pattern`, which must outlive the result; `valid` is false when it is malformed
+constexpr RoutePattern parse_route_pattern(std::string_view pattern) {
+    RoutePattern result;
+    size_t position = 0;
+    while (position < pattern.size()) {
+        if (result.count == MAX_ROUTE_TOKENS) {
+            return RoutePattern();
+        }
+        if (pattern[position] == '{') {
+            size_t close = pattern.find('}', position);
+            if (close == std::string_view::npos || close == position + 1) {
+                return RoutePattern();
+            }
+            std::string_view name = pattern.substr(position + 1, close - position - 1);
+            if (name.find('/') != std::string_view::npos || name.find('{') != std::string_view::npos) {
+                return RoutePattern();
+            }
+            position = close + 1;
+            if (position < pattern.size() && pattern[position] != '/') {
+                return RoutePattern();
+            }
+            result.tokens[result.count++] = RoutePattern::Token{std::string_view(), true};
+        } else {
+            size_t next = pattern.find('{', position);
+            if (next == std::string_view::npos) {
+                next = pattern.size();
+            }
+            std::string_view literal = pattern.substr(position, next - position);
+            if (literal.find('}') != std::string_view::npos) {
+                return RoutePattern();
+            }
+            result.tokens[result.count++] = RoutePattern::Token{literal, false};
+            position = next;
+        }
+    }
+    result.valid = true;
+    return result;
+}
+
+// Known methods compare by HttpMethod, others by their text
+constexpr bool method_matches(HttpMethod route_id, std::string_view route_method, HttpMethod id,
+                              std::string_view method) {
+    return route_id != HttpMethod::Unknown ? route_id == id : route_method == method;
+}
+
+// A string literal usable as a template argument
+template <size_t N>
+struct FixedString {
+    char text[N];
+
+    constexpr FixedString(const char (&literal)[N]) {
+        for (size_t i = 0; i < N; ++i) {
+            text[i] = literal[i];
+        }
+    }
+    constexpr std::string_view view() const { return std::string_view(text, N - 1); }
+};
+
+// Method and pattern of a route known at compile time, parsed by the compiler
+template <FixedString Method, FixedString Pattern>
+struct StaticRoutePattern {
+    static constexpr std::string_view method = Method.view();
+    static constexpr HttpMethod method_id = parse_method(Method.view());
+    static constexpr std::string_view text = Pattern.view();
+    static constexpr RoutePattern pattern = parse_route_pattern(Pattern.view());
+    static_assert(pattern.valid, "malformed route pattern");
+};
+
+// Routes known at compile time, each a type derived from StaticRoutePattern, tried
+// in order. The method and pattern of every route are constants in find(), so the
+// compiler unrolls all the comparisons into one function, and a route with a known
+// method costs one integer comparison when the request's method differs.
+template <typename... Routes>
+struct RouteTable {
+    static constexpr size_t size = sizeof...(Routes);
+
+    // Index of the first route matching, or -1; `method_id` is parse_method(method)
+    static int find(HttpMethod method_id, std::string_view method, std::string_view path) {
+        int index = 0;
+        bool found = ((method_matches(Routes::method_id, Routes::method, method_id, method) &&
+                       Routes::pattern.matches(path) ? true : (++index, false)) || ...);
+        return found ? index : -1;
+    }
+
+    // Index of the route declared with exactly this method and pattern, or -1
+    static int find_declared(std::string_view method, std::string_view pattern) {
+        int index = 0;
+        bool found = ((Routes::method == method && Routes::text == pattern ? true : (++index, false)) || ...);
+        return found ? index : -1;
+    }
+};
+
+// A handler called through one function pointer and one object pointer. Bound to a
+// member function chosen at compile time, the call lands straight in that function,
+// which the compiler may inline into the thunk; a handler only known at run time is
+// kept alive here and called through.
+template <typename... Args>
+class HandlerRef {
+public:
+    using Invoke = void (*)(void* target, Args... args);
+
+    HandlerRef() : invoke(nullptr), target(nullptr) {}
+    HandlerRef(Invoke invoke, void* target) : invoke(invoke), target(target) {}
+
+    template <typename Function>
+    static HandlerRef owning(Function function) {
+        auto held = std::make_shared<Function>(std::move(function));
+        HandlerRef ref([](void* target, Args... args) {
+            (*static_cast<Function*>(target))(std::forward<Args>(args)...);
+        }, held.get());
+        ref.owned = std::move(held);
+        return ref;
+    }
+
+    void operator()(Args... args) const { invoke(target, std::forward<Args>(args)...); }
+    explicit operator bool() const { return invoke != nullptr; }
+
+private:
+    Invoke invoke;
+    void* target;
+    std::shared_ptr<void> owned;
+};
+
+#endif // ROUTE_TABLE_H
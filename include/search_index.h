@@ -0,0 +1,83 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Full-text inverted index over the field values of one collection.
+//
+// Values are split into lowercase alphanumeric tokens (bytes above ASCII
+// count as letters, so UTF-8 words stay whole). Every indexed record gets a
+// document number, and each token keeps a posting list of the documents that
+// contain it, stored as varint-encoded gaps between document numbers followed
+// by the term frequency. Re-indexing a record gives it a new, higher number,
+// so postings are only ever appended; the old number is marked dead and
+// skipped until enough dead documents pile up to rewrite the lists.
+//
+// Queries match every term (a trailing `*` matches a prefix) and rank the
+// matching records by BM25. Documents can carry the record's expiry deadline,
+// and searches leave them out once it passes.
+class SearchIndex {
+public:
+    using Item = std::map<std::string, std::string>;
+
+    struct Hit {
+        std::string id;
+        double score;
+    };
+
+    struct Stats {
+        size_t documents;
+        size_t terms;
+        size_t posting_bytes;
+    };
+
+    SearchIndex();
+
+    // Indexes every field except `id`, replacing what was indexed for the record before
+    // and keeping its deadline
+    void add(const std::string& id, const Item& item);
+    void remove(const std::string& id);
+    // The epoch clears the deadline
+    void set_deadline(const std::string& id, std::chrono::steady_clock::time_point deadline);
+
+    // The best `limit` matches, highest score first; `total` receives the number of matches
+    std::vector<Hit> search(const std::string& query, size_t limit, size_t* total = nullptr);
+
+    Stats stats();
+
+    static std::vector<std::string> tokenize(const std::string& text);
+
+private:
+    struct Postings {
+        std::string data;       // (document gap, term frequency) varint pairs
+        uint32_t last_document;
+        uint32_t entries;       // Including dead documents
+
+        Postings() : last_document(0), entries(0) {}
+    };
+
+    struct Document {
+        std::string id;
+        uint32_t length;        // Tokens in the record
+        bool live;
+        std::chrono::steady_clock::time_point deadline;     // The epoch when the record never expires
+    };
+
+    std::shared_mutex index_mutex;
+    std::map<std::string, Postings> terms;
+    std::vector<Document> documents;     // By document number - 1
+    std::unordered_map<std::string, uint32_t> document_numbers;
+    size_t live_documents;
+    uint64_t total_length;              // Tokens over all live documents
+
+    void remove_locked(const std::string& id);
+    void compact();
+};
+
+#endif // SEARCH_INDEX_H
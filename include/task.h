@@ -0,0 +1,206 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// C++20 coroutine returning a T, started when first awaited.
+//
+// A Task is awaited by another coroutine, which resumes as soon as the task
+// finishes, on whatever thread finished it; an exception the task ended with
+// is rethrown there. The outermost task is started with spawn(). Awaiting
+// costs no thread: a task that waits on a socket or a file suspends, and is
+// resumed later by whoever completes the wait.
+template <typename T = void>
+class Task;
+
+namespace task_detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    // Hands control straight to the awaiting coroutine, so long chains of tasks
+    // finishing one after another do not grow the stack
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept {
+            std::coroutine_handle<> next = finished.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+}  // namespace task_detail
+
+template <typename T>
+class Task {
+public:
+    struct promise_type : task_detail::PromiseBase {
+        std::optional<T> value;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_value(T result) { value = std::move(result); }
+    };
+
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() {
+        if (handle.promise().error) {
+            std::rethrow_exception(handle.promise().error);
+        }
+        return std::move(*handle.promise().value);
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+};
+
+template <>
+class Task<void> {
+public:
+    struct promise_type : task_detail::PromiseBase {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_void() {}
+    };
+
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    void await_resume() {
+        if (handle.promise().error) {
+            std::rethrow_exception(handle.promise().error);
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+};
+
+// Tasks spawned on behalf of one owner, so that whatever is still suspended when the
+// owner goes away can be destroyed rather than leaked
+class TaskGroup {
+public:
+    // Destroys every task of the group that has not finished, together with the tasks
+    // it awaits. Nothing may resume them afterwards.
+    void destroy_suspended() {
+        std::vector<void*> frames;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            frames.assign(running.begin(), running.end());
+        }
+        for (void* frame : frames) {
+            std::coroutine_handle<>::from_address(frame).destroy();
+        }
+    }
+
+    // Called by the spawned tasks themselves
+    void add(void* frame) {
+        std::lock_guard<std::mutex> lock(mutex);
+        running.insert(frame);
+    }
+    void remove(void* frame) {
+        std::lock_guard<std::mutex> lock(mutex);
+        running.erase(frame);
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_set<void*> running;
+};
+
+namespace task_detail {
+
+// Runs eagerly and frees itself at the end; nothing can await it
+struct Detached {
+    struct promise_type {
+        TaskGroup* group = nullptr;
+
+        promise_type() = default;
+        promise_type(Task<void>&, TaskGroup& owner) : group(&owner) {
+            group->add(std::coroutine_handle<promise_type>::from_promise(*this).address());
+        }
+        ~promise_type() {
+            if (group) {
+                group->remove(std::coroutine_handle<promise_type>::from_promise(*this).address());
+            }
+        }
+
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+inline Detached run_detached(Task<void> task) {
+    co_await task;
+}
+
+inline Detached run_detached(Task<void> task, TaskGroup&) {
+    co_await task;
+}
+
+}  // namespace task_detail
+
+// Starts `task` on the calling thread, which gets control back when the task first
+// suspends or finishes. Nothing waits for the result: an exception the task ends
+// with terminates the process, as one escaping a thread would.
+inline void spawn(Task<void> task) {
+    task_detail::run_detached(std::move(task));
+}
+
+// As above, with the task counted in `group` until it finishes
+inline void spawn(Task<void> task, TaskGroup& group) {
+    task_detail::run_detached(std::move(task), group);
+}
+
+#endif // TASK_H
@@ -0,0 +1,67 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+// Hashed hierarchical timing wheel.
+//
+// Timers are intrusive list nodes owned by the caller, so arming, re-arming
+// and cancelling are O(1) and never allocate. Four levels of 64 slots cover
+// 64^4 ticks; timers further out are clamped to the last slot.
+//
+// Callbacks run on the thread calling advance() while the wheel lock is held:
+// they must be short and must not arm or cancel timers themselves. In exchange,
+// once cancel() returns the callback is guaranteed not to be running.
+class TimerWheel {
+public:
+    struct Timer {
+        std::function<void()> callback;
+
+        Timer() : prev(nullptr), next(nullptr), expires(0) {}
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        bool armed() const { return next != nullptr; }
+
+    private:
+        friend class TimerWheel;
+        Timer* prev;
+        Timer* next;
+        uint64_t expires;   // Absolute tick at which the timer fires
+    };
+
+    explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(50));
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Arms (or re-arms) the timer to fire after the given delay
+    void arm(Timer& timer, std::chrono::milliseconds delay);
+    void cancel(Timer& timer);
+
+    // Fires every timer whose deadline is at or before now
+    void advance(std::chrono::steady_clock::time_point now);
+
+    std::chrono::milliseconds tick_duration() const { return tick; }
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const uint64_t SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+
+    std::chrono::milliseconds tick;
+    std::chrono::steady_clock::time_point origin;
+    uint64_t current_tick;    // Next tick to be processed
+    Timer slots[LEVELS][SLOTS];  // Sentinel heads of circular lists
+    std::mutex wheel_mutex;
+
+    uint64_t tick_at(std::chrono::steady_clock::time_point time) const;
+    void link(Timer& timer);
+    void unlink(Timer& timer);
+    uint64_t cascade(int level);
+};
+
+#endif // TIMER_WHEEL_H
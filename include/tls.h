@@ -0,0 +1,123 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+// TLS termination with OpenSSL, compiled in with `make TLS=1`. In a build
+// without it TlsContext::create() fails, so the server can only speak
+// plaintext.
+//
+// When the kernel supports it (kTLS, the `tls` module on Linux), records are
+// encrypted by the kernel once the handshake is done. Files can then be sent
+// with sendfile() straight from the page cache, as on a plain socket; other
+// writes still go through OpenSSL but skip its copy into a record buffer.
+struct TlsConfig {
+    std::string certificate_file;   // PEM, leaf certificate first, then any intermediates
+    std::string key_file;           // PEM private key
+    bool kernel_tls;                // Hand record encryption to the kernel when possible
+    bool http2;                     // Offer h2 through ALPN
+    int ticket_key_rotation_s;      // How often session ticket keys are replaced
+    size_t session_cache_size;      // Sessions kept for clients resuming by session ID
+
+    TlsConfig() : kernel_tls(true), http2(true), ticket_key_rotation_s(12 * 3600), session_cache_size(20480) {}
+};
+
+struct TlsStats {
+    uint64_t handshakes;        // Completed, resumed ones included
+    uint64_t resumed;
+    uint64_t failed;
+    uint64_t kernel_send;       // Handshakes after which the kernel encrypts what is sent
+    uint64_t kernel_receive;    // ... and decrypts what is received
+};
+
+class TlsSession;
+
+// Certificate, settings and session ticket keys shared by every connection.
+//
+// Sessions resume with tickets, which the client keeps so the server stores
+// nothing, or by session ID from a bounded cache for clients without ticket
+// support. Ticket keys live in memory only: a new key is made every
+// `ticket_key_rotation_s` and the previous one is still accepted, so a ticket
+// stays valid for one to two periods and restarting the server invalidates
+// them all.
+class TlsContext : public std::enable_shared_from_this<TlsContext> {
+public:
+    // Null, with the reason in `error`, when the certificate or key cannot be loaded
+    static std::shared_ptr<TlsContext> create(const TlsConfig& config, std::string& error);
+    ~TlsContext();
+
+    // Server side of a new connection. The socket must be non-blocking; the handshake
+    // runs as part of the first read.
+    std::unique_ptr<TlsSession> accept(int socket);
+
+    TlsStats stats() const;
+
+private:
+    friend class TlsSession;
+    struct TicketKeys;
+
+    TlsConfig config;
+    struct ssl_ctx_st* context;
+    std::unique_ptr<TicketKeys> ticket_keys;
+    std::atomic<uint64_t> handshakes;
+    std::atomic<uint64_t> resumed;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> kernel_send;
+    std::atomic<uint64_t> kernel_receive;
+
+    TlsContext();
+    static int ticket_key_callback(struct ssl_st* ssl, unsigned char* name, unsigned char* iv,
+                                   struct evp_cipher_ctx_st* cipher, struct evp_mac_ctx_st* mac, int encrypt);
+};
+
+// One connection's TLS state, used by whichever thread owns the connection.
+//
+// read() and write() behave like recv() and send() on the socket: they return
+// the bytes moved, 0 once the peer closed (reads only), or -1 with errno set,
+// EAGAIN when `wait` is false and the socket is not ready. With `wait` they
+// poll the socket until it is, so a deadline that shuts the socket down still
+// interrupts them.
+class TlsSession {
+public:
+    ~TlsSession();
+
+    ssize_t read(char* buffer, size_t length, bool wait);
+    ssize_t write(const char* data, size_t length, bool wait);
+    // Sends up to `length` bytes of the file from `offset`: with sendfile() when the
+    // kernel encrypts, else through a buffer. Waits like write().
+    ssize_t send_file(int fd, off_t offset, size_t length);
+
+    // Decrypted bytes OpenSSL holds but the socket no longer shows as readable
+    bool has_buffered_input() const;
+    // After a read or write failed with EAGAIN: whether OpenSSL waits for the socket to
+    // take output rather than to deliver input, which need not match the call that failed
+    bool wants_write() const;
+    bool established() const;
+    bool kernel_send() const;
+    // The protocol agreed through ALPN, such as "h2"; empty when none was
+    std::string protocol() const;
+
+    // Sends close_notify if the socket takes it right away
+    void close();
+
+private:
+    friend class TlsContext;
+
+    std::shared_ptr<TlsContext> owner;
+    struct ssl_st* ssl;
+    int socket;
+    bool handshake_done;
+    bool want_write;
+
+    TlsSession(std::shared_ptr<TlsContext> owner, struct ssl_st* ssl, int socket);
+    // Maps an OpenSSL result to errno, waiting for the socket when asked to. True to retry.
+    bool should_retry(int result, bool wait);
+    void finish_handshake();
+};
+
+#endif // TLS_H
@@ -0,0 +1,91 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// RFC 6455 frame codec.
+//
+// Frames are parsed where they were received: the header is decoded from the
+// front of the read buffer and the payload is unmasked in place, so a message
+// that arrives in a single frame reaches its handler without being copied.
+// Unmasking XORs 16 bytes at a time with SSE2, or 8 at a time elsewhere.
+struct WebSocketFrame {
+    enum Opcode : uint8_t { Continuation = 0x0, Text = 0x1, Binary = 0x2, Close = 0x8, Ping = 0x9, Pong = 0xA };
+    enum class ParseStatus { Ok, Incomplete, Invalid };
+
+    bool fin;
+    uint8_t opcode;
+    bool masked;
+    uint8_t mask[4];
+    size_t header_length;       // The payload starts this far into the frame
+    uint64_t payload_length;
+
+    // Decodes the header at the start of `data`. Invalid covers reserved bits,
+    // unknown opcodes, fragmented or oversized control frames and non-minimal lengths.
+    static ParseStatus parse_header(const char* data, size_t size, WebSocketFrame& frame);
+
+    // XORs `data` with the repeating 4-byte mask, which both masks and unmasks
+    static void apply_mask(char* data, size_t length, const uint8_t mask[4]);
+
+    // Appends a complete unmasked frame, as servers send them
+    static void append(std::string& out, uint8_t opcode, std::string_view payload);
+
+    // Sec-WebSocket-Accept for a client's Sec-WebSocket-Key
+    static std::string accept_key(const std::string& client_key);
+
+    static bool valid_utf8(const char* data, size_t length);
+};
+
+// Server side of one WebSocket connection, handed to route handlers. Sending
+// only queues frames for the event loop, so it never blocks and may be called
+// from any thread, including after the connection closed, when it does nothing.
+// The server owns it through a shared_ptr, so work handed to another thread can
+// keep it with shared_from_this().
+class WebSocket : public std::enable_shared_from_this<WebSocket> {
+public:
+    explicit WebSocket(std::function<void()> wake);
+
+    void send_text(std::string_view message);
+    void send_binary(std::string_view message);
+    // Starts the closing handshake; messages queued afterwards are dropped
+    void close(uint16_t code = 1000, std::string_view reason = "");
+    bool is_open();
+
+    // Used by the server: take_output moves the queued frames to `out` and returns true
+    // once close() was called; mark_closed stops further sends when the connection ends
+    bool take_output(std::string& out);
+    void mark_closed();
+
+private:
+    std::mutex socket_mutex;
+    std::string outbox;
+    bool open;
+    bool closing;
+    bool wake_pending;
+    std::function<void()> wake;
+
+    void queue(uint8_t opcode, std::string_view payload);
+};
+
+// Callbacks of a WebSocket route. They run on the event loop, one at a time per
+// server, so they must return quickly; slow work belongs on another thread,
+// which can reply through the WebSocket later.
+struct WebSocketHandlers {
+    std::function<void(WebSocket& socket)> on_open;
+    // The message is only valid during the call
+    std::function<void(WebSocket& socket, std::string_view message, bool binary)> on_message;
+    // Runs once when the connection ends, with the close code (1006 when it dropped)
+    std::function<void(WebSocket& socket, uint16_t code)> on_close;
+
+    // When both are set, on_signal runs whenever the server is signalled on the channel
+    std::string channel;
+    std::function<void(WebSocket& socket)> on_signal;
+};
+
+#endif // WEBSOCKET_H
@@ -0,0 +1,157 @@
+#ifndef WORK_SCHEDULER_H
+#define WORK_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Work for a pool of worker threads, kept in one deque per worker.
+//
+// Work is pushed to the deque of the worker it has affinity with, such as
+// the one that last served a connection or the one a coroutine suspended on,
+// so a request and its continuations tend to run on the same thread while
+// their data is still in that core's cache. A worker takes the oldest item of
+// its own deque first. When that is empty it steals the oldest item of
+// another worker's, so a burst landing on one worker, a run of slow uploads
+// for instance, spreads over the idle ones instead of queueing behind it.
+//
+// Every deque has its own lock, held only to push or take one item; workers
+// contend only when they push to or steal from the same deque. Workers with
+// nothing to run or steal sleep until new work is pushed.
+template <typename T>
+class WorkScheduler {
+public:
+    explicit WorkScheduler(size_t workers);
+
+    size_t worker_count() const { return lanes.size(); }
+
+    // Queues `item` for `worker`, waking a sleeping worker if there is one; any thread may call it
+    void push(size_t worker, T item);
+
+    // Next item for `worker`, stolen when its own deque is empty. Blocks until there is
+    // one; false once stop() was called.
+    bool pop(size_t worker, T& item);
+
+    // Items waiting in all deques together
+    size_t size() const { return pending.load(); }
+    uint64_t stolen() const { return steals.load(); }
+
+    // Wakes every worker and makes pop() return false from then on
+    void stop();
+    // Takes out whatever is still queued; only once the workers are gone
+    std::vector<T> drain();
+
+private:
+    // Own cache line each, so workers taking from neighbouring deques do not slow each other down
+    struct alignas(64) Lane {
+        std::mutex mutex;
+        std::deque<T> items;
+    };
+
+    std::vector<std::unique_ptr<Lane>> lanes;
+    std::atomic<size_t> pending;
+    std::atomic<uint64_t> steals;
+    std::atomic<size_t> sleeping;
+    std::atomic<bool> stopped;
+    std::mutex sleep_mutex;
+    std::condition_variable work_ready;
+
+    bool take(size_t lane, T& item);
+};
+
+template <typename T>
+WorkScheduler<T>::WorkScheduler(size_t workers) : pending(0), steals(0), sleeping(0), stopped(false) {
+    for (size_t i = 0; i < workers; ++i) {
+        lanes.emplace_back(new Lane());
+    }
+}
+
+template <typename T>
+void WorkScheduler<T>::push(size_t worker, T item) {
+    Lane& lane = *lanes[worker % lanes.size()];
+    {
+        // Counted under the lane lock, before take() can see the item, so a thief's
+        // decrement never comes first and `pending` never wraps below zero
+        std::lock_guard<std::mutex> lock(lane.mutex);
+        lane.items.push_back(std::move(item));
+        pending.fetch_add(1);
+    }
+
+    // A worker about to sleep counts itself before checking `pending`, so one of the two
+    // sees the other's update and the item is never left behind
+    if (sleeping.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        work_ready.notify_one();
+    }
+}
+
+template <typename T>
+bool WorkScheduler<T>::take(size_t lane_index, T& item) {
+    Lane& lane = *lanes[lane_index];
+    std::lock_guard<std::mutex> lock(lane.mutex);
+    if (lane.items.empty()) {
+        return false;
+    }
+    item = std::move(lane.items.front());
+    lane.items.pop_front();
+    pending.fetch_sub(1);
+    return true;
+}
+
+template <typename T>
+bool WorkScheduler<T>::pop(size_t worker, T& item) {
+    size_t count = lanes.size();
+    while (true) {
+        if (stopped.load()) {
+            return false;
+        }
+
+        if (pending.load() > 0) {
+            if (take(worker, item)) {
+                return true;
+            }
+            // Victims are tried from the next worker on, so thieves do not all pile onto the first
+            for (size_t i = 1; i < count; ++i) {
+                if (take((worker + i) % count, item)) {
+                    steals.fetch_add(1);
+                    return true;
+                }
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleeping.fetch_add(1);
+        work_ready.wait(lock, [this]() { return stopped || pending.load() > 0; });
+        sleeping.fetch_sub(1);
+    }
+}
+
+template <typename T>
+void WorkScheduler<T>::stop() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopped.store(true);
+    }
+    work_ready.notify_all();
+}
+
+template <typename T>
+std::vector<T> WorkScheduler<T>::drain() {
+    std::vector<T> items;
+    for (auto& lane : lanes) {
+        std::lock_guard<std::mutex> lock(lane->mutex);
+        pending.fetch_sub(lane->items.size());
+        for (auto& item : lane->items) {
+            items.push_back(std::move(item));
+        }
+        lane->items.clear();
+    }
+    return items;
+}
+
+#endif // WORK_SCHEDULER_H
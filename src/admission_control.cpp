@@ -0,0 +1,46 @@
+#include "../include/admission_control.h"
+#include <cmath>
+
+CoDelController::CoDelController(std::chrono::milliseconds target, std::chrono::milliseconds interval)
+    : target(target), interval(interval), count(0), dropping_state(false), dropped(0) {}
+
+CoDelController::Clock::time_point CoDelController::control_law(Clock::time_point from) const {
+    return from + std::chrono::duration_cast<Clock::duration>(interval / std::sqrt(static_cast<double>(count)));
+}
+
+bool CoDelController::should_drop(Clock::duration sojourn, Clock::time_point now) {
+    bool ok_to_drop = false;
+
+    if (sojourn < target) {
+        first_above_time = Clock::time_point();
+    } else if (first_above_time == Clock::time_point()) {
+        first_above_time = now + interval;
+    } else if (now >= first_above_time) {
+        ok_to_drop = true;
+    }
+
+    if (dropping_state) {
+        if (!ok_to_drop) {
+            dropping_state = false;
+            return false;
+        }
+        if (now >= drop_next) {
+            ++count;
+            drop_next = control_law(drop_next);
+            ++dropped;
+            return true;
+        }
+        return false;
+    }
+
+    if (ok_to_drop) {
+        dropping_state = true;
+        // Resume near the previous drop rate if we only just left the dropping state
+        count = (count > 2 && now - drop_next < 16 * interval) ? count - 2 : 1;
+        drop_next = control_law(now);
+        ++dropped;
+        return true;
+    }
+
+    return false;
+}
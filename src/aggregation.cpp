@@ -0,0 +1,193 @@
+#include "../include/aggregation.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <limits>
+
+static const uint32_t NO_CODE = std::numeric_limits<uint32_t>::max();
+
+Aggregator::FieldSummary::FieldSummary()
+    : count(0), sum(0), min(std::numeric_limits<double>::infinity()),
+      max(-std::numeric_limits<double>::infinity()) {}
+
+void Aggregator::FieldSummary::merge(const FieldSummary& other) {
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+}
+
+Aggregator::Aggregator(const std::vector<std::string>& fields, const std::string& group_by,
+                       const std::vector<Filter>& filters)
+    : fields(fields), group_by(group_by), filters(filters), missing_code(NO_CODE) {
+    if (group_by.empty()) {
+        groups.push_back(Group{"", false, 0, std::vector<FieldSummary>(fields.size())});
+    }
+}
+
+// Only the JSON number grammar is accepted: no whitespace, '+', hex, "inf" or "nan",
+// so a string field such as " 0x10" is not mistaken for a number
+bool Aggregator::parse_number(const std::string& text, double& value) {
+    const char* begin = text.data();
+    const char* end = begin + text.size();
+    const char* p = begin;
+    auto digits = [&p, end]() {
+        const char* start = p;
+        while (p != end && *p >= '0' && *p <= '9') {
+            ++p;
+        }
+        return p != start;
+    };
+
+    if (p != end && *p == '-') {
+        ++p;
+    }
+    if (p != end && *p == '0') {
+        ++p;
+    } else if (!digits()) {
+        return false;
+    }
+    if (p != end && *p == '.') {
+        ++p;
+        if (!digits()) {
+            return false;
+        }
+    }
+    if (p != end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        if (p != end && (*p == '+' || *p == '-')) {
+            ++p;
+        }
+        if (!digits()) {
+            return false;
+        }
+    }
+    if (p != end) {
+        return false;
+    }
+
+    auto result = std::from_chars(begin, end, value);
+    return result.ec == std::errc() && result.ptr == end && std::isfinite(value);
+}
+
+bool Aggregator::values_equal(const std::string& a, const std::string& b) {
+    double x, y;
+    return a == b || (parse_number(a, x) && parse_number(b, y) && x == y);
+}
+
+// Four accumulators break the dependency chain between iterations, so the
+// adds, mins and maxes of consecutive elements can run side by side. The
+// selects are branch-free, and comparisons with NaN are false, so missing
+// values drop out of min and max on their own.
+Aggregator::FieldSummary Aggregator::summarize(const double* values, size_t count) {
+    FieldSummary summary;
+    double sums[4] = {0, 0, 0, 0};
+    double mins[4] = {summary.min, summary.min, summary.min, summary.min};
+    double maxes[4] = {summary.max, summary.max, summary.max, summary.max};
+    size_t counts[4] = {0, 0, 0, 0};
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        for (int lane = 0; lane < 4; ++lane) {
+            double value = values[i + lane];
+            bool present = value == value;
+            sums[lane] += present ? value : 0.0;
+            counts[lane] += present;
+            mins[lane] = value < mins[lane] ? value : mins[lane];
+            maxes[lane] = value > maxes[lane] ? value : maxes[lane];
+        }
+    }
+    for (; i < count; ++i) {
+        double value = values[i];
+        bool present = value == value;
+        sums[0] += present ? value : 0.0;
+        counts[0] += present;
+        mins[0] = value < mins[0] ? value : mins[0];
+        maxes[0] = value > maxes[0] ? value : maxes[0];
+    }
+
+    summary.count = counts[0] + counts[1] + counts[2] + counts[3];
+    summary.sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    summary.min = std::min(std::min(mins[0], mins[1]), std::min(mins[2], mins[3]));
+    summary.max = std::max(std::max(maxes[0], maxes[1]), std::max(maxes[2], maxes[3]));
+    return summary;
+}
+
+uint32_t Aggregator::code_for(const Item& item) {
+    if (group_by.empty()) {
+        return 0;
+    }
+
+    auto field = item.find(group_by);
+    if (field == item.end()) {
+        if (missing_code == NO_CODE) {
+            missing_code = static_cast<uint32_t>(groups.size());
+            groups.push_back(Group{"", false, 0, std::vector<FieldSummary>(fields.size())});
+        }
+        return missing_code;
+    }
+
+    auto inserted = group_codes.emplace(field->second, static_cast<uint32_t>(groups.size()));
+    if (inserted.second) {
+        groups.push_back(Group{field->second, true, 0, std::vector<FieldSummary>(fields.size())});
+    }
+    return inserted.first->second;
+}
+
+void Aggregator::add(const std::vector<std::shared_ptr<const Item>>& records) {
+    selected.clear();
+    for (const auto& record : records) {
+        bool matches = true;
+        for (const auto& filter : filters) {
+            auto field = record->find(filter.field);
+            if (field == record->end() || !values_equal(field->second, filter.value)) {
+                matches = false;
+                break;
+            }
+        }
+        if (matches) {
+            selected.push_back(record.get());
+        }
+    }
+
+    record_codes.clear();
+    for (const Item* record : selected) {
+        uint32_t code = code_for(*record);
+        record_codes.push_back(code);
+        groups[code].count++;
+    }
+
+    for (size_t f = 0; f < fields.size(); ++f) {
+        // Gather the field into a dense column, skipping records where it is not a number
+        values.clear();
+        value_codes.clear();
+        for (size_t r = 0; r < selected.size(); ++r) {
+            auto field = selected[r]->find(fields[f]);
+            double value;
+            if (field != selected[r]->end() && parse_number(field->second, value)) {
+                values.push_back(value);
+                value_codes.push_back(record_codes[r]);
+            }
+        }
+
+        if (group_by.empty()) {
+            groups[0].fields[f].merge(summarize(values.data(), values.size()));
+            continue;
+        }
+        for (size_t i = 0; i < values.size(); ++i) {
+            FieldSummary& summary = groups[value_codes[i]].fields[f];
+            summary.count++;
+            summary.sum += values[i];
+            summary.min = std::min(summary.min, values[i]);
+            summary.max = std::max(summary.max, values[i]);
+        }
+    }
+}
+
+std::vector<Aggregator::Group> Aggregator::result() const {
+    std::vector<Group> sorted = groups;
+    std::sort(sorted.begin(), sorted.end(), [](const Group& a, const Group& b) {
+        return a.has_key != b.has_key ? !a.has_key : a.key < b.key;
+    });
+    return sorted;
+}
@@ -0,0 +1,89 @@
+#include "../include/async_io.h"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Largest piece of a write handed to a blocking thread at a time
+static const size_t WRITE_CHUNK_SIZE = 1 << 20;
+
+AsyncFile::~AsyncFile() {
+    // Closing a file is quick next to its reads and writes, so it is not worth a thread hop
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+Task<bool> AsyncFile::open(std::string path, int flags, mode_t mode) {
+    if (fd != -1) {
+        co_await close();
+    }
+    int* error = &last_error;
+    fd = co_await offload(runtime, [&path, flags, mode, error]() {
+        int opened = ::open(path.c_str(), flags | O_CLOEXEC, mode);
+        if (opened == -1) {
+            *error = errno;
+        }
+        return opened;
+    });
+    co_return fd != -1;
+}
+
+Task<ssize_t> AsyncFile::read(char* buffer, size_t length, off_t offset) {
+    int file = fd;
+    int* error = &last_error;
+    co_return co_await offload(runtime, [file, buffer, length, offset, error]() {
+        ssize_t count;
+        do {
+            count = pread(file, buffer, length, offset);
+        } while (count < 0 && errno == EINTR);
+        if (count < 0) {
+            *error = errno;
+        }
+        return count;
+    });
+}
+
+Task<bool> AsyncFile::write(std::string_view data, off_t offset) {
+    int file = fd;
+    int* error = &last_error;
+    while (!data.empty()) {
+        std::string_view chunk = data.substr(0, WRITE_CHUNK_SIZE);
+        bool written = co_await offload(runtime, [file, chunk, offset, error]() {
+            size_t done = 0;
+            while (done < chunk.size()) {
+                ssize_t count = pwrite(file, chunk.data() + done, chunk.size() - done, offset + done);
+                if (count < 0 && errno == EINTR) continue;
+                if (count <= 0) {
+                    // A write taking nothing without an error means the device is full
+                    *error = count < 0 ? errno : ENOSPC;
+                    return false;
+                }
+                done += count;
+            }
+            return true;
+        });
+        if (!written) {
+            co_return false;
+        }
+        data.remove_prefix(chunk.size());
+        offset += chunk.size();
+    }
+    co_return true;
+}
+
+Task<bool> AsyncFile::close() {
+    int file = std::exchange(fd, -1);
+    if (file == -1) {
+        co_return true;
+    }
+    // close() reports write errors some file systems only detect then
+    int* error = &last_error;
+    co_return co_await offload(runtime, [file, error]() {
+        if (::close(file) != 0) {
+            *error = errno;
+            return false;
+        }
+        return true;
+    });
+}
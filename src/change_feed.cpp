@@ -0,0 +1,60 @@
+#include "../include/change_feed.h"
+#include <algorithm>
+
+ChangeFeed::ChangeFeed(size_t capacity) : capacity(std::max<size_t>(capacity, 1)), oldest(0), overwritten_sequence(0) {}
+
+size_t ChangeFeed::publish(Event event, size_t bytes) {
+    std::lock_guard<std::mutex> lock(feed_mutex);
+    if (ring.size() < capacity) {
+        ring.push_back(std::move(event));
+        ring_bytes.push_back(bytes);
+        return 0;
+    }
+    overwritten_sequence = ring[oldest].sequence;
+    ring[oldest] = std::move(event);
+    size_t released = ring_bytes[oldest];
+    ring_bytes[oldest] = bytes;
+    oldest = (oldest + 1) % capacity;
+    return released;
+}
+
+bool ChangeFeed::read(uint64_t after_sequence, size_t limit, std::vector<Event>& events) {
+    std::lock_guard<std::mutex> lock(feed_mutex);
+    size_t count = ring.size();
+
+    // Sequences increase around the ring, so the first event to send is found by binary search
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (ring[(oldest + middle) % count].sequence <= after_sequence) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (size_t i = low; i < count && limit > 0; ++i, --limit) {
+        events.push_back(ring[(oldest + i) % count]);
+    }
+    return after_sequence >= overwritten_sequence;
+}
+
+uint64_t ChangeFeed::last_sequence() {
+    std::lock_guard<std::mutex> lock(feed_mutex);
+    if (ring.empty()) {
+        return 0;
+    }
+    return ring[(oldest + ring.size() - 1) % ring.size()].sequence;
+}
+
+const char* ChangeFeed::type_name(Type type) {
+    switch (type) {
+        case Type::Create:
+            return "create";
+        case Type::Update:
+            return "update";
+        default:
+            return "delete";
+    }
+}
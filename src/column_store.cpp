@@ -0,0 +1,365 @@
+#include "../include/column_store.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <mutex>
+
+static const uint32_t NO_GROUP = std::numeric_limits<uint32_t>::max();
+static const double MISSING = std::numeric_limits<double>::quiet_NaN();
+
+// Rows an aggregate reads per acquisition of the lock, bounding how long writers wait
+static const size_t ROWS_PER_SLICE = 16384;
+
+// Shortest text that reads back as the same double for typical values
+static std::string format_number(double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.15g", value);
+    return buffer;
+}
+
+ColumnStore::ColumnStore(const std::vector<std::string>& fields) : live_rows(0) {
+    for (const auto& field : fields) {
+        if (field_positions.emplace(field, field_names.size()).second) {
+            field_names.push_back(field);
+        }
+    }
+    columns.resize(field_names.size());
+}
+
+bool ColumnStore::has_field(const std::string& field) const {
+    return field_positions.count(field) != 0;
+}
+
+const ColumnStore::Column* ColumnStore::find_column(const std::string& field) const {
+    auto it = field_positions.find(field);
+    return it == field_positions.end() ? nullptr : &columns[it->second];
+}
+
+// A dictionary entry: its string, and the lookup node with the key's own copy
+static size_t entry_bytes(const std::string& text) {
+    static const size_t inline_capacity = std::string().capacity();
+    size_t heap = text.size() > inline_capacity ? text.size() + 1 : 0;
+    return sizeof(std::pair<const std::string, uint32_t>) + 2 * sizeof(void*) + 2 * heap;
+}
+
+// Code for `text`, counting one more row that holds it
+uint32_t ColumnStore::acquire_code(Column& column, const std::string& text) {
+    auto found = column.lookup.find(text);
+    if (found != column.lookup.end()) {
+        column.references[found->second]++;
+        return found->second;
+    }
+
+    double value;
+    double number = Aggregator::parse_number(text, value) ? value : MISSING;
+    uint32_t code;
+    if (!column.free_codes.empty()) {
+        code = column.free_codes.back();
+        column.free_codes.pop_back();
+        column.dictionary[code - 1] = text;
+        column.dictionary_numbers[code] = number;
+    } else {
+        code = static_cast<uint32_t>(column.dictionary.size() + 1);
+        column.dictionary.push_back(text);
+        column.dictionary_numbers.push_back(number);
+        column.references.push_back(0);
+    }
+    column.references[code] = 1;
+    column.lookup.emplace(text, code);
+    column.dictionary_bytes += entry_bytes(text);
+    return code;
+}
+
+// Drops the entry once no row holds it, so values that come and go do not pile up
+void ColumnStore::release_code(Column& column, uint32_t code) {
+    if (code == 0 || --column.references[code] > 0) {
+        return;
+    }
+    std::string& text = column.dictionary[code - 1];
+    column.dictionary_bytes -= entry_bytes(text);
+    column.lookup.erase(text);
+    std::string().swap(text);
+    column.dictionary_numbers[code] = MISSING;
+    column.free_codes.push_back(code);
+}
+
+// Numbers print back exactly as they were stored, so the conversion keeps every value
+void ColumnStore::convert_to_dictionary(Column& column) {
+    column.codes.assign(column.numbers.size(), 0);
+    for (size_t row = 0; row < column.numbers.size(); ++row) {
+        if (!std::isnan(column.numbers[row])) {
+            column.codes[row] = acquire_code(column, format_number(column.numbers[row]));
+        }
+    }
+    std::vector<double>().swap(column.numbers);
+    column.numeric = false;
+}
+
+void ColumnStore::set_value(Column& column, uint32_t row, const std::string* text) {
+    if (column.numeric) {
+        double value;
+        if (!text) {
+            column.numbers[row] = MISSING;
+            return;
+        }
+        if (Aggregator::parse_number(*text, value) && format_number(value) == *text) {
+            column.numbers[row] = value;
+            return;
+        }
+        convert_to_dictionary(column);
+    }
+    // Acquired first, so rewriting a row with the value it holds keeps the entry
+    uint32_t code = text ? acquire_code(column, *text) : 0;
+    release_code(column, column.codes[row]);
+    column.codes[row] = code;
+}
+
+double ColumnStore::value_at(const Column& column, uint32_t row) {
+    return column.numeric ? column.numbers[row] : column.dictionary_numbers[column.codes[row]];
+}
+
+size_t ColumnStore::put(const std::string& id, const Item& item) {
+    std::unique_lock<std::shared_mutex> lock(column_mutex);
+
+    uint32_t row;
+    auto existing = rows.find(id);
+    if (existing != rows.end()) {
+        row = existing->second;
+    } else if (!free_rows.empty()) {
+        row = free_rows.back();
+        free_rows.pop_back();
+        rows.emplace(id, row);
+    } else {
+        row = static_cast<uint32_t>(live.size());
+        live.push_back(0);
+        deadlines.push_back(std::chrono::steady_clock::time_point());
+        for (auto& column : columns) {
+            if (column.numeric) {
+                column.numbers.push_back(MISSING);
+            } else {
+                column.codes.push_back(0);
+            }
+        }
+        rows.emplace(id, row);
+    }
+
+    if (!live[row]) {
+        live[row] = 1;
+        live_rows++;
+    }
+    for (size_t i = 0; i < columns.size(); ++i) {
+        auto field = item.find(field_names[i]);
+        set_value(columns[i], row, field == item.end() ? nullptr : &field->second);
+    }
+    return memory();
+}
+
+size_t ColumnStore::remove(const std::string& id) {
+    std::unique_lock<std::shared_mutex> lock(column_mutex);
+    auto it = rows.find(id);
+    if (it == rows.end()) {
+        return memory();
+    }
+
+    uint32_t row = it->second;
+    for (auto& column : columns) {
+        set_value(column, row, nullptr);
+    }
+    live[row] = 0;
+    deadlines[row] = std::chrono::steady_clock::time_point();
+    live_rows--;
+    free_rows.push_back(row);
+    rows.erase(it);
+    return memory();
+}
+
+void ColumnStore::set_deadline(const std::string& id, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::shared_mutex> lock(column_mutex);
+    auto it = rows.find(id);
+    if (it != rows.end()) {
+        deadlines[it->second] = deadline;
+    }
+}
+
+bool ColumnStore::aggregate(const std::vector<std::string>& fields, const std::string& group_by,
+                            const std::vector<Aggregator::Filter>& filters, std::vector<Aggregator::Group>& groups) {
+    // Which fields have columns is fixed at construction, so this needs no lock
+    std::vector<const Column*> value_columns;
+    for (const auto& field : fields) {
+        value_columns.push_back(find_column(field));
+        if (!value_columns.back()) return false;
+    }
+    const Column* group_column = group_by.empty() ? nullptr : find_column(group_by);
+    if (!group_by.empty() && !group_column) {
+        return false;
+    }
+    std::vector<const Column*> filter_columns;
+    for (const auto& filter : filters) {
+        filter_columns.push_back(find_column(filter.field));
+        if (!filter_columns.back()) return false;
+    }
+
+    // Groups are matched by key across slices, since codes may be reused in between
+    std::vector<Aggregator::Group> result;
+    std::unordered_map<std::string, uint32_t> keyed_groups;
+    uint32_t missing_group = NO_GROUP;
+    auto group_for = [&](const std::string* key) {
+        uint32_t& group = key ? keyed_groups.emplace(*key, NO_GROUP).first->second : missing_group;
+        if (group == NO_GROUP) {
+            result.push_back(Aggregator::Group{key ? *key : "", key != nullptr, 0,
+                                               std::vector<Aggregator::FieldSummary>(fields.size())});
+            group = static_cast<uint32_t>(result.size() - 1);
+        }
+        return group;
+    };
+    if (!group_column) {
+        group_for(nullptr);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto never = std::chrono::steady_clock::time_point();
+    std::vector<uint8_t> keep;
+    std::vector<uint32_t> selected;
+    std::vector<uint32_t> row_groups;
+    std::vector<double> values;
+    for (size_t start = 0;; start += ROWS_PER_SLICE) {
+        std::shared_lock<std::shared_mutex> lock(column_mutex);
+        if (start >= live.size()) {
+            break;
+        }
+        size_t end = std::min(live.size(), start + ROWS_PER_SLICE);
+
+        // Expired rows and filters narrow a row mask one column at a time; dictionary
+        // columns compare each distinct value once and then only look at codes
+        keep.assign(live.begin() + start, live.begin() + end);
+        bool every_live_row = filters.empty();
+        for (size_t row = start; row < end; ++row) {
+            if (keep[row - start] && deadlines[row] != never && deadlines[row] <= now) {
+                keep[row - start] = 0;
+                every_live_row = false;
+            }
+        }
+        for (size_t i = 0; i < filters.size(); ++i) {
+            const Column& column = *filter_columns[i];
+            if (column.numeric) {
+                double wanted;
+                bool numeric = Aggregator::parse_number(filters[i].value, wanted);
+                for (size_t row = start; row < end; ++row) {
+                    keep[row - start] &= numeric && column.numbers[row] == wanted;
+                }
+            } else {
+                std::vector<uint8_t> matches(column.dictionary.size() + 1, 0);
+                for (size_t code = 1; code <= column.dictionary.size(); ++code) {
+                    matches[code] = column.references[code] > 0 &&
+                                    Aggregator::values_equal(column.dictionary[code - 1], filters[i].value);
+                }
+                for (size_t row = start; row < end; ++row) {
+                    keep[row - start] &= matches[column.codes[row]];
+                }
+            }
+        }
+        selected.clear();
+        for (size_t row = start; row < end; ++row) {
+            if (keep[row - start]) selected.push_back(static_cast<uint32_t>(row));
+        }
+
+        // Resolve the group of every selected row
+        if (!group_column) {
+            result[0].count += selected.size();
+        } else {
+            row_groups.resize(selected.size());
+            if (group_column->numeric) {
+                std::unordered_map<double, uint32_t> by_value;
+                for (size_t i = 0; i < selected.size(); ++i) {
+                    double value = group_column->numbers[selected[i]];
+                    uint32_t group;
+                    if (std::isnan(value)) {
+                        group = group_for(nullptr);
+                    } else {
+                        auto found = by_value.find(value);
+                        if (found != by_value.end()) {
+                            group = found->second;
+                        } else {
+                            std::string key = format_number(value);
+                            group = by_value[value] = group_for(&key);
+                        }
+                    }
+                    row_groups[i] = group;
+                    result[group].count++;
+                }
+            } else {
+                std::vector<uint32_t> by_code(group_column->dictionary.size() + 1, NO_GROUP);
+                for (size_t i = 0; i < selected.size(); ++i) {
+                    uint32_t code = group_column->codes[selected[i]];
+                    if (by_code[code] == NO_GROUP) {
+                        by_code[code] = group_for(code == 0 ? nullptr : &group_column->dictionary[code - 1]);
+                    }
+                    row_groups[i] = by_code[code];
+                    result[row_groups[i]].count++;
+                }
+            }
+        }
+
+        for (size_t f = 0; f < fields.size(); ++f) {
+            const Column& column = *value_columns[f];
+
+            // A slice of a numeric column reduces in place; free rows hold NaN and drop out
+            if (!group_column && every_live_row && column.numeric) {
+                result[0].fields[f].merge(Aggregator::summarize(column.numbers.data() + start, end - start));
+                continue;
+            }
+
+            values.resize(selected.size());
+            for (size_t i = 0; i < selected.size(); ++i) {
+                values[i] = value_at(column, selected[i]);
+            }
+            if (!group_column) {
+                result[0].fields[f].merge(Aggregator::summarize(values.data(), values.size()));
+                continue;
+            }
+            for (size_t i = 0; i < values.size(); ++i) {
+                if (std::isnan(values[i])) continue;
+                Aggregator::FieldSummary& summary = result[row_groups[i]].fields[f];
+                summary.count++;
+                summary.sum += values[i];
+                summary.min = std::min(summary.min, values[i]);
+                summary.max = std::max(summary.max, values[i]);
+            }
+        }
+    }
+
+    std::sort(result.begin(), result.end(), [](const Aggregator::Group& a, const Aggregator::Group& b) {
+        return a.has_key != b.has_key ? !a.has_key : a.key < b.key;
+    });
+    groups.swap(result);
+    return true;
+}
+
+// Approximate, like the store's own accounting: array capacity, hash table nodes and buckets
+size_t ColumnStore::memory() const {
+    size_t bytes = live.capacity() + deadlines.capacity() * sizeof(deadlines[0]) +
+                   free_rows.capacity() * sizeof(uint32_t) + rows.bucket_count() * sizeof(void*) +
+                   rows.size() * (sizeof(std::pair<const std::string, uint32_t>) + 2 * sizeof(void*));
+    for (const auto& column : columns) {
+        bytes += column.numbers.capacity() * sizeof(double) + column.codes.capacity() * sizeof(uint32_t) +
+                 column.dictionary_numbers.capacity() * sizeof(double) +
+                 column.references.capacity() * sizeof(uint32_t) + column.free_codes.capacity() * sizeof(uint32_t) +
+                 column.dictionary.capacity() * sizeof(std::string) + column.lookup.bucket_count() * sizeof(void*) +
+                 column.dictionary_bytes;
+    }
+    return bytes;
+}
+
+ColumnStore::Stats ColumnStore::stats() {
+    std::shared_lock<std::shared_mutex> lock(column_mutex);
+    Stats stats;
+    stats.rows = live_rows;
+    stats.bytes = memory();
+    stats.dictionary_columns = 0;
+    for (const auto& column : columns) {
+        if (!column.numeric) {
+            stats.dictionary_columns++;
+        }
+    }
+    return stats;
+}
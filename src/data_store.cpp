@@ -0,0 +1,1376 @@
+#include "../include/data_store.h"
+#include <algorithm>
+#include <limits>
+
+// Items per lock acquisition when read_all or aggregate walk a collection
+static const size_t READ_ALL_PAGE = 512;
+
+// Width of an expiry bucket; records expire at most this late
+static const int64_t EXPIRY_BUCKET_MS = 100;
+
+// Victims tried per write before giving up, e.g. while snapshots pin everything
+static const size_t MAX_EVICTIONS_PER_WRITE = 64;
+
+// Redis-style LFU: new records start warm, and higher counts get harder to bump
+static const uint8_t LFU_INITIAL_COUNT = 5;
+static const unsigned LFU_LOG_FACTOR = 10;
+
+static const size_t SKETCH_WIDTH = 1 << 16;
+
+// The spill memtable is sized from the budget but kept between these bounds
+static const size_t MIN_SPILL_MEMTABLE = 1 << 20;
+static const size_t MAX_SPILL_MEMTABLE = 16 << 20;
+
+// Disk tier keys sort by collection, then id
+static std::string disk_key(const std::string& collection, const std::string& id) {
+    std::string key = collection;
+    key += '\0';
+    key += id;
+    return key;
+}
+
+static int64_t expiry_bucket(std::chrono::steady_clock::time_point deadline) {
+    int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline.time_since_epoch()).count();
+    return (ms + EXPIRY_BUCKET_MS - 1) / EXPIRY_BUCKET_MS;
+}
+
+// Last bucket whose deadlines have all passed at `now`. The bucket `now` falls in may
+// still hold live records, and a sweep drops every entry it visits.
+static int64_t passed_bucket(std::chrono::steady_clock::time_point now) {
+    int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+    return ms / EXPIRY_BUCKET_MS;
+}
+
+// Heap bytes behind a string beyond its inline buffer
+static size_t string_heap_bytes(const std::string& value) {
+    static const size_t inline_capacity = std::string().capacity();
+    return value.capacity() > inline_capacity ? value.capacity() + 1 : 0;
+}
+
+// Red-black tree node header that std::map adds to every element
+static const size_t MAP_NODE_OVERHEAD = 4 * sizeof(void*);
+
+static size_t item_bytes(const DataStore::Item& item) {
+    // Object plus the control block make_shared puts in front of it
+    size_t bytes = sizeof(DataStore::Item) + 2 * sizeof(void*) + sizeof(long);
+    for (const auto& field : item) {
+        bytes += MAP_NODE_OVERHEAD + sizeof(field) + string_heap_bytes(field.first) + string_heap_bytes(field.second);
+    }
+    return bytes;
+}
+
+// Requested fields in map order with `id` added, so each copied field is appended at the end
+static std::vector<std::string> projection_fields(const std::vector<std::string>& fields) {
+    if (fields.empty()) {
+        return fields;
+    }
+    std::vector<std::string> sorted = fields;
+    sorted.push_back("id");
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    return sorted;
+}
+
+// Copies the fields listed by projection_fields(), or all of them when the list is empty
+static DataStore::Item project(const DataStore::Item& item, const std::vector<std::string>& fields) {
+    if (fields.empty()) {
+        return item;
+    }
+
+    DataStore::Item projected;
+    for (const auto& name : fields) {
+        auto field = item.find(name);
+        if (field != item.end()) {
+            projected.emplace_hint(projected.end(), *field);
+        }
+    }
+    return projected;
+}
+
+static uint64_t record_hash(const std::string& collection, const std::string& id) {
+    return std::hash<std::string>()(collection) * 0x9E3779B97F4A7C15ULL ^ std::hash<std::string>()(id);
+}
+
+static uint16_t current_minute() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint16_t>(std::chrono::duration_cast<std::chrono::minutes>(now).count());
+}
+
+DataStore::DataStore()
+    : next_id(1), commit_sequence(0), first_expiry_bucket(INT64_MAX), used_bytes(0), total_evictions(0),
+      total_expirations(0), access_clock(0), random_state(0x2545F4914F6CDD1DULL), spilling_bytes(0), total_spills(0),
+      total_promotions(0), search_everything(false), indexing(false), change_feed_capacity(0) {}
+
+DataStore::Snapshot::~Snapshot() {
+    store.release_snapshot(snapshot_sequence);
+}
+
+void DataStore::set_mutation_listener(MutationListener listener) {
+    std::lock_guard<std::mutex> lock(data_mutex);
+    mutation_listener = listener;
+}
+
+void DataStore::notify_mutation(const std::string& collection) {
+    MutationListener listener;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        listener = mutation_listener;
+        evicted_collections.erase(collection);
+    }
+    if (listener) {
+        listener(collection);
+    }
+    notify_evictions();
+}
+
+// Also applies whatever the call before it queued for the disk and the search indexes, now
+// that the locks are released
+void DataStore::notify_evictions() {
+    write_disk();
+    write_index();
+
+    MutationListener listener;
+    std::set<std::string> collections;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        listener = mutation_listener;
+        collections.swap(evicted_collections);
+    }
+    if (listener) {
+        for (const auto& collection : collections) {
+            listener(collection);
+        }
+    }
+}
+
+// Newest version committed at or before `sequence`, or null if the record did not exist yet
+const DataStore::Version* DataStore::visible_version(const Record& record, uint64_t sequence) {
+    for (auto it = record.versions.rbegin(); it != record.versions.rend(); ++it) {
+        if (it->sequence <= sequence) {
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+bool DataStore::is_expired(const Record& record, std::chrono::steady_clock::time_point now) {
+    return record.expires_at != std::chrono::steady_clock::time_point() && record.expires_at <= now;
+}
+
+// Sets `collection_it` to data.end() when the record does not exist
+DataStore::RecordMap::iterator DataStore::find_record(const std::string& collection, const std::string& id,
+                                                      CollectionMap::iterator& collection_it) {
+    collection_it = data.find(collection);
+    if (collection_it == data.end()) {
+        return RecordMap::iterator();
+    }
+    auto record_it = collection_it->second.records.find(id);
+    if (record_it == collection_it->second.records.end()) {
+        collection_it = data.end();
+    }
+    return record_it;
+}
+
+// Record whose current version is live, or null when missing, deleted or expired.
+// Callers lock_records() first, so a record still only on disk does not exist.
+DataStore::Record* DataStore::find_current(const std::string& collection, const std::string& id) {
+    if (needs_disk(collection, id)) {
+        return nullptr;
+    }
+
+    CollectionMap::iterator collection_it;
+    auto record_it = find_record(collection, id, collection_it);
+    if (collection_it == data.end() || !record_it->second.versions.back().item ||
+        is_expired(record_it->second, std::chrono::steady_clock::now())) {
+        return nullptr;
+    }
+    return &record_it->second;
+}
+
+// Sets the deadline of a live record; a zero ttl clears it. Columns get it too, so
+// aggregates leave the record out once it expires, even before it is swept.
+void DataStore::set_expiry(const std::string& collection, const std::string& id, std::chrono::milliseconds ttl) {
+    Collection& owner = data[collection];
+    Record& record = owner.records[id];
+    auto previous = record.expires_at;
+    if (ttl.count() <= 0) {
+        record.expires_at = std::chrono::steady_clock::time_point();
+    } else {
+        record.expires_at = std::chrono::steady_clock::now() + ttl;
+        expiry_buckets[expiry_bucket(record.expires_at)].emplace_back(collection, id);
+        first_expiry_bucket = expiry_buckets.begin()->first;
+    }
+    if (owner.columns && record.expires_at != previous) {
+        owner.columns->set_deadline(id, record.expires_at);
+    }
+    if (owner.search && record.expires_at != previous) {
+        search_updates.push_back(SearchUpdate{owner.search.get(), SearchUpdate::Type::Deadline, id, nullptr,
+                                              record.expires_at});
+    }
+}
+
+// Drops versions hidden from every open snapshot. Returns true when nothing
+// visible is left and the record itself can be erased.
+bool DataStore::prune(Record& record) {
+    uint64_t oldest = open_snapshots.empty() ? std::numeric_limits<uint64_t>::max() : *open_snapshots.begin();
+
+    // Everything before the version the oldest snapshot sees is unreachable
+    size_t keep_from = 0;
+    for (size_t i = record.versions.size(); i-- > 0;) {
+        if (record.versions[i].sequence <= oldest) {
+            keep_from = i;
+            break;
+        }
+    }
+    record.versions.erase(record.versions.begin(), record.versions.begin() + keep_from);
+
+    // A lone deletion looks the same to every reader as no record at all, and a lone
+    // spilled version is found on disk by every reader that should see it. Records
+    // with disk writes queued stay until they are done.
+    return record.disk_writes == 0 && record.versions.size() == 1 && !record.versions.front().item;
+}
+
+// True when no open snapshot and no in-flight copy can observe the current version.
+// Readers take their references under data_mutex, so the count cannot grow meanwhile.
+bool DataStore::is_private(const Record& record) const {
+    const Version& current = record.versions.back();
+    bool snapshot_sees = !open_snapshots.empty() && *open_snapshots.rbegin() >= current.sequence;
+    return !snapshot_sees && current.item.use_count() == 1;
+}
+
+// Recomputes what a record costs after its versions changed
+void DataStore::recharge(CollectionMap::iterator collection_it, RecordMap::iterator record_it) {
+    Record& record = record_it->second;
+    size_t bytes = MAP_NODE_OVERHEAD + sizeof(RecordMap::value_type) + string_heap_bytes(record_it->first) +
+                   record.versions.capacity() * sizeof(Version) + sizeof(ResidentRef);
+    for (const auto& version : record.versions) {
+        if (version.item) {
+            bytes += item_bytes(*version.item);
+        }
+    }
+
+    CollectionUsage& usage = collection_it->second.usage;
+    usage.bytes = usage.bytes - record.bytes + bytes;
+    used_bytes = used_bytes - record.bytes + bytes;
+    record.bytes = bytes;
+}
+
+std::pair<DataStore::CollectionMap::iterator, DataStore::RecordMap::iterator>
+DataStore::emplace_record(const std::string& collection, const std::string& id) {
+    auto created = data.emplace(collection, Collection());
+    auto collection_it = created.first;
+    if (created.second && (search_everything || search_collections.count(collection))) {
+        collection_it->second.search.reset(new SearchIndex());
+    }
+    auto columnar = column_fields.find(collection);
+    if (created.second && columnar != column_fields.end()) {
+        collection_it->second.columns.reset(new ColumnStore(columnar->second));
+    }
+    if (created.second && change_feed_capacity > 0) {
+        collection_it->second.changes.reset(new ChangeFeed(change_feed_capacity));
+    }
+    auto inserted = collection_it->second.records.emplace(id, Record());
+    if (inserted.second) {
+        inserted.first->second.resident_slot = residents.size();
+        residents.push_back(ResidentRef{collection_it, inserted.first});
+        collection_it->second.usage.records++;
+    }
+    return std::make_pair(collection_it, inserted.first);
+}
+
+void DataStore::erase_record(CollectionMap::iterator collection_it, RecordMap::iterator record_it) {
+    Record& record = record_it->second;
+    CollectionUsage& usage = collection_it->second.usage;
+    usage.bytes -= record.bytes;
+    usage.records--;
+    used_bytes -= record.bytes;
+
+    ResidentRef last = residents.back();
+    residents[record.resident_slot] = last;
+    last.record->second.resident_slot = record.resident_slot;
+    residents.pop_back();
+
+    collection_it->second.records.erase(record_it);
+}
+
+void DataStore::write_version(const std::string& collection, const std::string& id, std::shared_ptr<Item> item) {
+    auto position = emplace_record(collection, id);
+    auto collection_it = position.first;
+    auto record_it = position.second;
+    Record& record = record_it->second;
+
+    bool live = item != nullptr;
+    bool existed = !record.versions.empty() &&
+                   (record.versions.back().item || is_spilled(record, record.versions.back()));
+    record.versions.push_back(Version{++commit_sequence, std::move(item)});
+    index_record(collection_it->second, id, record.versions.back().item);
+    publish_change(collection_it->second,
+                   !live ? ChangeFeed::Type::Delete : existed ? ChangeFeed::Type::Update : ChangeFeed::Type::Create,
+                   id, record.versions.back());
+
+    // The disk copy would outlive the deletion once the record leaves memory
+    if (!live && record.spilled_sequence != 0) {
+        disk_writes.push_back(DiskWrite{RecordKey(collection, id), 0, nullptr, 0});
+        record.spilled_sequence = 0;
+        record.disk_writes++;
+    }
+
+    if (prune(record)) {
+        erase_record(collection_it, record_it);
+        return;
+    }
+    recharge(collection_it, record_it);
+    if (live) {
+        touch(collection, id, record);
+    }
+
+    // Older versions are still pinned by a snapshot; revisit when it closes
+    if (record.versions.size() > 1 && !record.gc_queued) {
+        record.gc_queued = true;
+        gc_queue.emplace_back(collection, id);
+    }
+}
+
+std::string DataStore::create_locked(const std::string& collection, const Item& item, const WriteOptions& options) {
+    std::string id = std::to_string(next_id++);
+
+    auto new_item = std::make_shared<Item>(item);
+    (*new_item)["id"] = id;
+    write_version(collection, id, std::move(new_item));
+    set_expiry(collection, id, options.ttl);
+    enforce_budget(&data[collection].records[id]);
+
+    return id;
+}
+
+DataStore::WriteStatus DataStore::update_locked(const std::string& collection, const std::string& id,
+                                                const Item& item, const WriteOptions& options) {
+    Record* record = find_current(collection, id);
+    if (!record) {
+        return WriteStatus::NotFound;
+    }
+    if (!options.accepts(record->versions.back().sequence)) {
+        return WriteStatus::VersionMismatch;
+    }
+
+    auto updated_item = std::make_shared<Item>(item);
+    (*updated_item)["id"] = id;
+    write_version(collection, id, std::move(updated_item));
+    set_expiry(collection, id, options.ttl);
+    enforce_budget(record);
+    return WriteStatus::Ok;
+}
+
+DataStore::WriteStatus DataStore::remove_locked(const std::string& collection, const std::string& id,
+                                                const WriteOptions& options) {
+    Record* record = find_current(collection, id);
+    if (!record) {
+        return WriteStatus::NotFound;
+    }
+    if (!options.accepts(record->versions.back().sequence)) {
+        return WriteStatus::VersionMismatch;
+    }
+
+    record->expires_at = std::chrono::steady_clock::time_point();
+    write_version(collection, id, nullptr);
+    return WriteStatus::Ok;
+}
+
+DataStore::WriteStatus DataStore::patch_locked(const std::string& collection, const std::string& id,
+                                               const Item& changes, const std::vector<std::string>& removed,
+                                               const WriteOptions& options) {
+    Record* record = find_current(collection, id);
+    if (!record) {
+        return WriteStatus::NotFound;
+    }
+    Version& current = record->versions.back();
+    if (!options.accepts(current.sequence)) {
+        return WriteStatus::VersionMismatch;
+    }
+
+    bool in_place = is_private(*record);
+    std::shared_ptr<Item> item = in_place ? current.item : std::make_shared<Item>(*current.item);
+    for (const auto& field : changes) {
+        if (field.first != "id") {
+            (*item)[field.first] = field.second;
+        }
+    }
+    for (const auto& field : removed) {
+        if (field != "id") {
+            item->erase(field);
+        }
+    }
+
+    if (in_place) {
+        current.sequence = ++commit_sequence;
+        CollectionMap::iterator collection_it;
+        auto record_it = find_record(collection, id, collection_it);
+        recharge(collection_it, record_it);
+        touch(collection, id, *record);
+        index_record(collection_it->second, id, item);
+        publish_change(collection_it->second, ChangeFeed::Type::Update, id, current);
+    } else {
+        write_version(collection, id, std::move(item));
+    }
+    if (options.ttl.count() > 0) {
+        set_expiry(collection, id, options.ttl);
+    }
+    enforce_budget(record);
+    return WriteStatus::Ok;
+}
+
+std::string DataStore::create(const std::string& collection, const Item& item, const WriteOptions& options,
+                              uint64_t* version) {
+    std::string id;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        id = create_locked(collection, item, options);
+        if (version) {
+            *version = commit_sequence;
+        }
+    }
+
+    notify_mutation(collection);
+    return id;
+}
+
+DataStore::Item DataStore::read(const std::string& collection, const std::string& id, uint64_t* version,
+                                const std::vector<std::string>& fields) {
+    std::shared_ptr<const Item> item;
+    bool promoted;
+    {
+        std::shared_lock<std::shared_mutex> disk_lock;
+        std::unique_lock<std::mutex> lock = lock_records(collection, {id}, disk_lock, promoted);
+        Record* record = find_current(collection, id);
+        if (record) {
+            item = record->versions.back().item;
+            if (version) {
+                *version = record->versions.back().sequence;
+            }
+            touch(collection, id, *record);
+        }
+    }
+
+    if (promoted) {
+        notify_evictions();
+    }
+    return item ? project(*item, projection_fields(fields)) : Item();
+}
+
+bool DataStore::try_read(const std::string& collection, const std::string& id, Item& item, uint64_t* version,
+                         const std::vector<std::string>& fields) {
+    std::shared_ptr<const Item> current;
+    {
+        std::unique_lock<std::mutex> lock(data_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || needs_disk(collection, id)) {
+            return false;
+        }
+        Record* record = find_current(collection, id);
+        if (record) {
+            current = record->versions.back().item;
+            if (version) {
+                *version = record->versions.back().sequence;
+            }
+            touch(collection, id, *record);
+        }
+    }
+
+    item = current ? project(*current, projection_fields(fields)) : Item();
+    return true;
+}
+
+DataStore::WriteStatus DataStore::patch(const std::string& collection, const std::string& id, const Item& changes,
+                                        const std::vector<std::string>& removed, const WriteOptions& options,
+                                        uint64_t* version) {
+    WriteStatus status;
+    bool promoted;
+    {
+        std::shared_lock<std::shared_mutex> disk_lock;
+        std::unique_lock<std::mutex> lock = lock_records(collection, {id}, disk_lock, promoted);
+        status = patch_locked(collection, id, changes, removed, options);
+        if (status == WriteStatus::Ok && version) {
+            *version = commit_sequence;
+        }
+    }
+
+    if (status == WriteStatus::Ok) {
+        notify_mutation(collection);
+    } else if (promoted) {
+        notify_evictions();
+    }
+    return status;
+}
+
+std::vector<DataStore::Item> DataStore::read_all(const std::string& collection, const std::vector<std::string>& fields) {
+    auto view = snapshot();
+    std::vector<Item> result;
+
+    std::string after_id;
+    while (true) {
+        std::vector<Item> page = scan(collection, after_id, READ_ALL_PAGE, view.get(), fields);
+        if (page.empty()) {
+            break;
+        }
+        after_id = page.back()["id"];
+        for (auto& item : page) {
+            result.push_back(std::move(item));
+        }
+    }
+
+    return result;
+}
+
+std::vector<DataStore::Item> DataStore::scan(const std::string& collection, const std::string& after_id, size_t limit,
+                                             const Snapshot* snapshot, const std::vector<std::string>& fields) {
+    std::vector<std::shared_ptr<const Item>> visible = scan_shared(collection, after_id, limit, snapshot);
+    std::vector<std::string> projection = projection_fields(fields);
+
+    // Versions are immutable, so the copies can be made without the lock
+    std::vector<Item> result;
+    result.reserve(visible.size());
+    for (const auto& item : visible) {
+        result.push_back(project(*item, projection));
+    }
+    return result;
+}
+
+std::vector<std::shared_ptr<const DataStore::Item>> DataStore::scan_shared(const std::string& collection,
+                                                                           const std::string& after_id, size_t limit,
+                                                                           const Snapshot* snapshot) {
+    std::vector<std::shared_ptr<const Item>> visible;
+    LsmStore* spilled;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        spilled = disk.get();
+    }
+
+    std::string prefix = disk_key(collection, "");
+    std::string cursor = after_id;
+    bool done = false;
+    while (!done && visible.size() < limit) {
+        // Read the next disk page before taking the lock, so writers never wait on the disk.
+        // disk_mutex keeps queued spills and deletions off the disk until the page is merged.
+        std::shared_lock<std::shared_mutex> disk_lock;
+        std::vector<std::pair<std::string, LsmStore::Entry>> page;
+        if (spilled) {
+            disk_lock = std::shared_lock<std::shared_mutex>(disk_mutex);
+            page = spilled->scan(prefix, cursor.empty() ? "" : prefix + cursor, limit - visible.size());
+        }
+
+        std::lock_guard<std::mutex> lock(data_mutex);
+        bool page_full = spilled && page.size() == limit - visible.size();
+        uint64_t sequence = snapshot ? snapshot->sequence() : commit_sequence;
+        auto now = std::chrono::steady_clock::now();
+
+        RecordMap empty;
+        auto collection_it = data.find(collection);
+        const RecordMap& records = collection_it != data.end() ? collection_it->second.records : empty;
+        auto it = cursor.empty() ? records.begin() : records.upper_bound(cursor);
+        size_t next_disk = 0;
+
+        // Merge memory and disk in id order; memory decides for every id it holds
+        while (visible.size() < limit) {
+            bool disk_left = next_disk < page.size();
+            if (!disk_left && page_full) {
+                break;      // Ids past this page may still be on disk
+            }
+            if (it == records.end() && !disk_left) {
+                done = true;
+                break;
+            }
+
+            std::string disk_id = disk_left ? page[next_disk].first.substr(prefix.size()) : std::string();
+            if (it == records.end() || (disk_left && disk_id < it->first)) {
+                // Spilled records leave memory once no snapshot predating them remains
+                LsmStore::Entry& entry = page[next_disk].second;
+                if (entry.sequence <= sequence) {
+                    visible.push_back(std::make_shared<const Item>(std::move(entry.item)));
+                }
+                cursor = disk_id;
+                ++next_disk;
+                continue;
+            }
+
+            const Record& record = it->second;
+            const Version* version = visible_version(record, sequence);
+            bool on_disk_too = disk_left && disk_id == it->first;
+            // An expired current version is hidden before the sweeper gets to it
+            if (version && !(version == &record.versions.back() && is_expired(record, now))) {
+                if (version->item) {
+                    visible.push_back(version->item);
+                } else if (is_spilled(record, *version) && on_disk_too &&
+                           page[next_disk].second.sequence == version->sequence) {
+                    // The page holds every spilled id up to its last one
+                    visible.push_back(std::make_shared<const Item>(std::move(page[next_disk].second.item)));
+                }
+            }
+            cursor = it->first;
+            ++it;
+            if (on_disk_too) {
+                ++next_disk;
+            }
+        }
+    }
+
+    return visible;
+}
+
+std::vector<Aggregator::Group> DataStore::aggregate(const std::string& collection,
+                                                    const std::vector<std::string>& fields,
+                                                    const std::string& group_by,
+                                                    const std::vector<Aggregator::Filter>& filters) {
+    ColumnStore* columns = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        auto collection_it = data.find(collection);
+        if (collection_it != data.end()) {
+            columns = collection_it->second.columns.get();
+        }
+    }
+
+    // Collections are never dropped, so the columns outlive the lock; they have their own
+    std::vector<Aggregator::Group> groups;
+    if (columns && columns->aggregate(fields, group_by, filters, groups)) {
+        return groups;
+    }
+
+    auto view = snapshot();
+    Aggregator aggregator(fields, group_by, filters);
+
+    std::string after_id;
+    while (true) {
+        auto page = scan_shared(collection, after_id, READ_ALL_PAGE, view.get());
+        if (page.empty()) {
+            break;
+        }
+        after_id = page.back()->at("id");
+        aggregator.add(page);
+    }
+
+    return aggregator.result();
+}
+
+DataStore::WriteStatus DataStore::update(const std::string& collection, const std::string& id, const Item& item,
+                                         const WriteOptions& options, uint64_t* version) {
+    WriteStatus status;
+    bool promoted;
+    {
+        std::shared_lock<std::shared_mutex> disk_lock;
+        std::unique_lock<std::mutex> lock = lock_records(collection, {id}, disk_lock, promoted);
+        status = update_locked(collection, id, item, options);
+        if (status == WriteStatus::Ok && version) {
+            *version = commit_sequence;
+        }
+    }
+
+    if (status == WriteStatus::Ok) {
+        notify_mutation(collection);
+    } else if (promoted) {
+        notify_evictions();
+    }
+    return status;
+}
+
+DataStore::WriteStatus DataStore::remove(const std::string& collection, const std::string& id,
+                                         const WriteOptions& options) {
+    WriteStatus status;
+    bool promoted;
+    {
+        std::shared_lock<std::shared_mutex> disk_lock;
+        std::unique_lock<std::mutex> lock = lock_records(collection, {id}, disk_lock, promoted);
+        status = remove_locked(collection, id, options);
+    }
+
+    if (status == WriteStatus::Ok) {
+        notify_mutation(collection);
+    } else if (promoted) {
+        notify_evictions();
+    }
+    return status;
+}
+
+static int batch_status(DataStore::WriteStatus status) {
+    switch (status) {
+        case DataStore::WriteStatus::Ok: return 200;
+        case DataStore::WriteStatus::NotFound: return 404;
+        case DataStore::WriteStatus::VersionMismatch: return 412;
+    }
+    return 500;
+}
+
+std::vector<DataStore::BatchResult> DataStore::apply_batch(const std::string& collection,
+                                                           const std::vector<BatchOperation>& operations) {
+    std::vector<BatchResult> results;
+    results.reserve(operations.size());
+    bool changed = false;
+    bool promoted;
+
+    std::vector<std::string> existing;
+    for (const auto& operation : operations) {
+        if (operation.type != BatchOperation::Type::Create) {
+            existing.push_back(operation.id);
+        }
+    }
+
+    {
+        std::shared_lock<std::shared_mutex> disk_lock;
+        std::unique_lock<std::mutex> lock = lock_records(collection, existing, disk_lock, promoted);
+        for (const auto& operation : operations) {
+            BatchResult result{200, operation.id};
+
+            switch (operation.type) {
+                case BatchOperation::Type::Create:
+                    result.id = create_locked(collection, operation.item, operation.options);
+                    result.status = 201;
+                    break;
+                case BatchOperation::Type::Update:
+                    result.status = batch_status(update_locked(collection, operation.id, operation.item,
+                                                               operation.options));
+                    break;
+                case BatchOperation::Type::Delete:
+                    result.status = batch_status(remove_locked(collection, operation.id, operation.options));
+                    break;
+            }
+
+            changed = changed || result.status < 300;
+            results.push_back(result);
+        }
+    }
+
+    if (changed) {
+        notify_mutation(collection);
+    } else if (promoted) {
+        notify_evictions();
+    }
+    return results;
+}
+
+std::shared_ptr<DataStore::Snapshot> DataStore::snapshot() {
+    std::lock_guard<std::mutex> lock(data_mutex);
+    open_snapshots.insert(commit_sequence);
+    return std::shared_ptr<Snapshot>(new Snapshot(*this, commit_sequence));
+}
+
+void DataStore::release_snapshot(uint64_t sequence) {
+    std::lock_guard<std::mutex> lock(data_mutex);
+    auto it = open_snapshots.find(sequence);
+    if (it == open_snapshots.end()) {
+        return;
+    }
+    bool was_oldest = it == open_snapshots.begin();
+    open_snapshots.erase(it);
+
+    // Only closing the oldest snapshot can make more versions unreachable
+    if (!was_oldest) {
+        return;
+    }
+
+    std::vector<RecordKey> still_pinned;
+    for (const auto& key : gc_queue) {
+        CollectionMap::iterator collection_it;
+        auto record_it = find_record(key.first, key.second, collection_it);
+        if (collection_it == data.end()) {
+            continue;
+        }
+
+        Record& record = record_it->second;
+        if (prune(record)) {
+            erase_record(collection_it, record_it);
+            continue;
+        }
+        recharge(collection_it, record_it);
+        if (record.versions.size() > 1) {
+            still_pinned.push_back(key);
+        } else {
+            record.gc_queued = false;
+        }
+    }
+    gc_queue.swap(still_pinned);
+}
+
+size_t DataStore::expire_due(std::chrono::steady_clock::time_point now, size_t budget) {
+    std::set<std::string> touched;
+    size_t expired = 0;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        int64_t due = passed_bucket(now);
+
+        while (budget > 0 && !expiry_buckets.empty() && expiry_buckets.begin()->first <= due) {
+            auto& keys = expiry_buckets.begin()->second;
+            while (budget > 0 && !keys.empty()) {
+                RecordKey key = std::move(keys.back());
+                keys.pop_back();
+                --budget;
+
+                // Skip entries left behind by deletes and by deadlines that moved
+                CollectionMap::iterator collection_it;
+                auto record_it = find_record(key.first, key.second, collection_it);
+                if (collection_it == data.end()) continue;
+                Record& record = record_it->second;
+                if (!record.versions.back().item || !is_expired(record, now)) continue;
+
+                record.expires_at = std::chrono::steady_clock::time_point();
+                collection_it->second.usage.expirations++;
+                total_expirations++;
+                write_version(key.first, key.second, nullptr);
+                touched.insert(key.first);
+                ++expired;
+            }
+            if (keys.empty()) {
+                expiry_buckets.erase(expiry_buckets.begin());
+            }
+        }
+        first_expiry_bucket = expiry_buckets.empty() ? INT64_MAX : expiry_buckets.begin()->first;
+    }
+
+    for (const auto& collection : touched) {
+        notify_mutation(collection);
+    }
+    return expired;
+}
+
+bool DataStore::expiry_due(std::chrono::steady_clock::time_point now) const {
+    return first_expiry_bucket.load() <= passed_bucket(now);
+}
+
+// xorshift64*, good enough to spread eviction samples
+uint64_t DataStore::next_random() {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Records an access for whichever policy is active
+void DataStore::touch(const std::string& collection, const std::string& id, Record& record) {
+    bool first_access = record.last_access == 0;
+    record.last_access = ++access_clock;
+
+    switch (memory_budget.policy) {
+        case EvictionPolicy::Lru:
+            break;
+        case EvictionPolicy::Lfu: {
+            // Decay by one per idle minute, then bump with probability 1 / (excess * factor + 1)
+            uint16_t minute = current_minute();
+            if (first_access) {
+                record.frequency = LFU_INITIAL_COUNT;
+            } else {
+                uint16_t idle = static_cast<uint16_t>(minute - record.frequency_minute);
+                record.frequency = idle >= record.frequency ? 0 : record.frequency - idle;
+            }
+            record.frequency_minute = minute;
+
+            if (record.frequency < 255) {
+                unsigned excess = record.frequency > LFU_INITIAL_COUNT ? record.frequency - LFU_INITIAL_COUNT : 0;
+                if (next_random() % (excess * LFU_LOG_FACTOR + 1) == 0) {
+                    record.frequency++;
+                }
+            }
+            break;
+        }
+        case EvictionPolicy::TinyLfu:
+            sketch->increment(record_hash(collection, id));
+            break;
+    }
+}
+
+// Lower ranks are evicted first; recency breaks frequency ties
+uint64_t DataStore::eviction_rank(const ResidentRef& resident) {
+    const Record& record = resident.record->second;
+    uint64_t frequency = 0;
+
+    switch (memory_budget.policy) {
+        case EvictionPolicy::Lru:
+            return record.last_access;
+        case EvictionPolicy::Lfu: {
+            uint16_t idle = static_cast<uint16_t>(current_minute() - record.frequency_minute);
+            frequency = idle >= record.frequency ? 0 : record.frequency - idle;
+            break;
+        }
+        case EvictionPolicy::TinyLfu:
+            frequency = sketch->estimate(record_hash(resident.collection->first, resident.record->first));
+            break;
+    }
+    return (frequency << 48) | (record.last_access & ((1ULL << 48) - 1));
+}
+
+// Evicts sampled cold records until the store fits its budget again. `keep` is
+// the record just written, which is never its own victim.
+//
+// Only records whose eviction releases memory are chosen. Without a disk tier, a
+// record an open snapshot still sees keeps its data after the deletion is written,
+// so once the samples turn up nothing else, or an eviction releases nothing, what
+// is left over the budget is pinned and eviction stops until the next write.
+void DataStore::enforce_budget(const Record* keep) {
+    if (memory_budget.max_bytes == 0) {
+        return;
+    }
+
+    uint64_t newest_snapshot = open_snapshots.empty() ? 0 : *open_snapshots.rbegin();
+    // Spills still queued free their memory once written, so they count as gone already
+    for (size_t attempt = 0; attempt < MAX_EVICTIONS_PER_WRITE && used_bytes > memory_budget.max_bytes + spilling_bytes;
+         ++attempt) {
+        const ResidentRef* victim = nullptr;
+        uint64_t victim_rank = 0;
+
+        for (size_t i = 0; i < memory_budget.sample_size && !residents.empty(); ++i) {
+            const ResidentRef& candidate = residents[next_random() % residents.size()];
+            const Record& record = candidate.record->second;
+            // Deleted and spilled records only linger for snapshots; evicting them frees nothing,
+            // and records with disk writes queued are on their way out already
+            if (&record == keep || !record.versions.back().item || record.disk_writes > 0) {
+                continue;
+            }
+            // Expiring records are not worth the disk write, so they are deleted like the rest
+            bool spills = disk && record.expires_at == std::chrono::steady_clock::time_point();
+            if (!spills && !open_snapshots.empty() && newest_snapshot >= record.versions.back().sequence) {
+                continue;
+            }
+            uint64_t rank = eviction_rank(candidate);
+            if (!victim || rank < victim_rank) {
+                victim = &candidate;
+                victim_rank = rank;
+            }
+        }
+        if (!victim) {
+            break;
+        }
+
+        int64_t before = static_cast<int64_t>(used_bytes) - static_cast<int64_t>(spilling_bytes);
+        victim->collection->second.usage.evictions++;
+        total_evictions++;
+        if (disk && victim->record->second.expires_at == std::chrono::steady_clock::time_point()) {
+            spill(*victim);
+        } else {
+            // Evicting writes a deletion, so open snapshots still see the record
+            std::string collection = victim->collection->first;
+            std::string id = victim->record->first;
+            victim->record->second.expires_at = std::chrono::steady_clock::time_point();
+            write_version(collection, id, nullptr);
+            evicted_collections.insert(collection);
+        }
+        if (static_cast<int64_t>(used_bytes) - static_cast<int64_t>(spilling_bytes) >= before) {
+            break;
+        }
+    }
+}
+
+void DataStore::set_memory_budget(const MemoryBudget& budget) {
+    // Opening the spill directory reads it, so it happens before taking the lock
+    std::unique_ptr<LsmStore> store;
+    if (!budget.spill_directory.empty()) {
+        bool opened;
+        {
+            std::lock_guard<std::mutex> lock(data_mutex);
+            opened = disk != nullptr;
+        }
+        if (!opened) {
+            size_t memtable = std::min(std::max(budget.max_bytes / 16, MIN_SPILL_MEMTABLE), MAX_SPILL_MEMTABLE);
+            store.reset(new LsmStore(budget.spill_directory, memtable));
+            if (!store->open()) {
+                store.reset();
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        memory_budget = budget;
+        if (memory_budget.sample_size == 0) {
+            memory_budget.sample_size = 1;
+        }
+        if (!disk && store) {
+            disk = std::move(store);
+        }
+        if (memory_budget.policy == EvictionPolicy::TinyLfu) {
+            if (!sketch) {
+                sketch.reset(new FrequencySketch(SKETCH_WIDTH));
+            }
+        } else {
+            sketch.reset();
+        }
+        enforce_budget(nullptr);
+    }
+    notify_evictions();
+}
+
+DataStore::MemoryStats DataStore::memory_stats() {
+    std::lock_guard<std::mutex> lock(data_mutex);
+    MemoryStats stats;
+    stats.budget = memory_budget;
+    stats.used_bytes = used_bytes;
+    stats.evictions = total_evictions;
+    stats.expirations = total_expirations;
+    stats.spilling = disk != nullptr;
+    stats.spills = total_spills;
+    stats.promotions = total_promotions;
+    stats.disk = disk ? disk->stats() : LsmStore::Stats();
+    for (const auto& collection : data) {
+        stats.collections[collection.first] = collection.second.usage;
+        if (collection.second.search) {
+            stats.search[collection.first] = collection.second.search->stats();
+        }
+        if (collection.second.columns) {
+            stats.columns[collection.first] = collection.second.columns->stats();
+        }
+    }
+    return stats;
+}
+
+void DataStore::enable_search(const std::string& collection) {
+    std::lock_guard<std::mutex> lock(data_mutex);
+    if (collection == "*") {
+        search_everything = true;
+        for (auto& entry : data) {
+            build_search_index(entry.second);
+        }
+        return;
+    }
+
+    search_collections.insert(collection);
+    auto collection_it = data.find(collection);
+    if (collection_it != data.end()) {
+        build_search_index(collection_it->second);
+    }
+}
+
+// Keeps the search index and columns of a collection in step with a record; null removes it
+void DataStore::index_record(Collection& collection, const std::string& id, const std::shared_ptr<Item>& item) {
+    if (collection.search) {
+        search_updates.push_back(SearchUpdate{collection.search.get(),
+                                              item ? SearchUpdate::Type::Add : SearchUpdate::Type::Remove, id, item,
+                                              std::chrono::steady_clock::time_point()});
+    }
+    if (collection.columns) {
+        charge_columns(collection, item ? collection.columns->put(id, *item) : collection.columns->remove(id));
+    }
+}
+
+void DataStore::charge_columns(Collection& collection, size_t bytes) {
+    collection.usage.bytes = collection.usage.bytes - collection.column_bytes + bytes;
+    used_bytes = used_bytes - collection.column_bytes + bytes;
+    collection.column_bytes = bytes;
+}
+
+void DataStore::enable_columns(const std::string& collection, const std::vector<std::string>& fields) {
+    std::lock_guard<std::mutex> lock(data_mutex);
+    if (!column_fields.emplace(collection, fields).second) {
+        return;
+    }
+    auto collection_it = data.find(collection);
+    if (collection_it != data.end()) {
+        build_columns(collection_it->second, fields);
+    }
+}
+
+void DataStore::build_columns(Collection& collection, const std::vector<std::string>& fields) {
+    collection.columns.reset(new ColumnStore(fields));
+    auto now = std::chrono::steady_clock::now();
+    for (const auto& entry : collection.records) {
+        const Record& record = entry.second;
+        if (record.versions.back().item && !is_expired(record, now)) {
+            charge_columns(collection, collection.columns->put(entry.first, *record.versions.back().item));
+            if (record.expires_at != std::chrono::steady_clock::time_point()) {
+                collection.columns->set_deadline(entry.first, record.expires_at);
+            }
+        }
+    }
+}
+
+// Indexes the live records of a collection that has no index yet
+void DataStore::build_search_index(Collection& collection) {
+    if (collection.search) {
+        return;
+    }
+    collection.search.reset(new SearchIndex());
+    auto now = std::chrono::steady_clock::now();
+    for (const auto& entry : collection.records) {
+        const Record& record = entry.second;
+        if (record.versions.back().item && !is_expired(record, now)) {
+            collection.search->add(entry.first, *record.versions.back().item);
+            if (record.expires_at != std::chrono::steady_clock::time_point()) {
+                collection.search->set_deadline(entry.first, record.expires_at);
+            }
+        }
+    }
+}
+
+bool DataStore::search(const std::string& collection, const std::string& query, size_t limit,
+                       std::vector<SearchIndex::Hit>& hits, size_t* total) {
+    SearchIndex* index = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        if (!search_everything && !search_collections.count(collection)) {
+            return false;
+        }
+        auto collection_it = data.find(collection);
+        if (collection_it != data.end()) {
+            index = collection_it->second.search.get();
+        }
+    }
+
+    // Collections are never dropped, so the index outlives the lock; it has its own
+    if (index) {
+        hits = index->search(query, limit, total);
+    } else {
+        hits.clear();
+        if (total) {
+            *total = 0;
+        }
+    }
+    return true;
+}
+
+void DataStore::set_change_feed_capacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(data_mutex);
+    change_feed_capacity = capacity;
+}
+
+bool DataStore::change_feed_enabled() {
+    std::lock_guard<std::mutex> lock(data_mutex);
+    return change_feed_capacity > 0;
+}
+
+uint64_t DataStore::last_commit() {
+    std::lock_guard<std::mutex> lock(data_mutex);
+    return commit_sequence;
+}
+
+// The feed gets its own copy, so it never pins the version or stops a patch editing it in
+// place, and what the ring holds is charged to the collection like its records
+void DataStore::publish_change(Collection& collection, ChangeFeed::Type type, const std::string& id,
+                               const Version& version) {
+    if (!collection.changes) {
+        return;
+    }
+    std::shared_ptr<const Item> item;
+    size_t bytes = sizeof(ChangeFeed::Event) + string_heap_bytes(id);
+    if (version.item) {
+        item = std::make_shared<const Item>(*version.item);
+        bytes += item_bytes(*item);
+    }
+    size_t released = collection.changes->publish(ChangeFeed::Event{version.sequence, type, id, item}, bytes);
+    collection.usage.bytes = collection.usage.bytes + bytes - released;
+    used_bytes = used_bytes + bytes - released;
+}
+
+bool DataStore::read_changes(const std::string& collection, uint64_t after_sequence, size_t limit,
+                             std::vector<ChangeFeed::Event>& events) {
+    ChangeFeed* feed = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        auto collection_it = data.find(collection);
+        if (collection_it != data.end()) {
+            feed = collection_it->second.changes.get();
+        }
+    }
+
+    // Like the search index, the feed outlives the lock and has its own
+    return !feed || feed->read(after_sequence, limit, events);
+}
+
+// A version whose data was moved to the disk tier
+bool DataStore::is_spilled(const Record& record, const Version& version) {
+    return !version.item && record.spilled_sequence == version.sequence;
+}
+
+// True when the record's current data can only be found on disk
+bool DataStore::needs_disk(const std::string& collection, const std::string& id) {
+    if (!disk) {
+        return false;
+    }
+    CollectionMap::iterator collection_it;
+    auto record_it = find_record(collection, id, collection_it);
+    return collection_it == data.end() || is_spilled(record_it->second, record_it->second.versions.back());
+}
+
+// Brings a spilled record back into memory ahead of a read or write, reading the
+// disk without the lock. The caller holds disk_mutex shared, so the disk cannot
+// change under the read. True when the record was installed, which may have
+// evicted others.
+bool DataStore::promote(const std::string& collection, const std::string& id) {
+    LsmStore* spilled;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        if (!needs_disk(collection, id)) {
+            return false;
+        }
+        spilled = disk.get();
+    }
+
+    LsmStore::Entry entry;
+    if (!spilled->get(disk_key(collection, id), entry)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(data_mutex);
+    if (!needs_disk(collection, id)) {
+        return false;   // Another caller promoted it meanwhile
+    }
+    install(collection, id, entry);
+    return true;
+}
+
+// Locks data_mutex with every record of `ids` in memory, or known not to exist.
+// Spilled ones are promoted first, and `disk_lock` keeps them in memory until the
+// caller releases it after the returned lock. Records already in memory cost no
+// more than the lock itself.
+std::unique_lock<std::mutex> DataStore::lock_records(const std::string& collection,
+                                                     const std::vector<std::string>& ids,
+                                                     std::shared_lock<std::shared_mutex>& disk_lock,
+                                                     bool& promoted) {
+    promoted = false;
+    std::unique_lock<std::mutex> lock(data_mutex);
+    bool resident = std::none_of(ids.begin(), ids.end(),
+                                 [&](const std::string& id) { return needs_disk(collection, id); });
+    if (resident) {
+        return lock;
+    }
+
+    lock.unlock();
+    disk_lock = std::shared_lock<std::shared_mutex>(disk_mutex);
+    for (const auto& id : ids) {
+        promoted = promote(collection, id) || promoted;
+    }
+    lock.lock();
+    return lock;
+}
+
+// Puts a record read from disk back in memory, replacing its marker if it has one
+DataStore::Record* DataStore::install(const std::string& collection, const std::string& id,
+                                      const LsmStore::Entry& entry) {
+    auto position = emplace_record(collection, id);
+    Record& record = position.second->second;
+    auto item = std::make_shared<Item>(entry.item);
+    if (record.versions.empty()) {
+        record.versions.push_back(Version{entry.sequence, std::move(item)});
+    } else {
+        record.versions.back().item = std::move(item);
+    }
+    record.spilled_sequence = entry.sequence;
+    total_promotions++;
+
+    recharge(position.first, position.second);
+    touch(collection, id, record);
+    enforce_budget(&record);
+    return &record;
+}
+
+// Moves the current version of a record to disk, leaving a marker in its place.
+// The disk write is queued and the data kept until write_disk() is done with it;
+// a copy already on disk from an earlier spill is reused at once.
+void DataStore::spill(const ResidentRef& victim) {
+    auto collection_it = victim.collection;
+    auto record_it = victim.record;
+    Record& record = record_it->second;
+    Version& current = record.versions.back();
+    total_spills++;
+
+    if (record.spilled_sequence != current.sequence) {
+        size_t bytes = item_bytes(*current.item);
+        disk_writes.push_back(DiskWrite{RecordKey(collection_it->first, record_it->first), current.sequence,
+                                        current.item, bytes});
+        record.spilled_sequence = current.sequence;
+        record.disk_writes++;
+        spilling_bytes += bytes;
+        return;
+    }
+    current.item.reset();
+    release_spilled(collection_it, record_it);
+}
+
+void DataStore::release_spilled(CollectionMap::iterator collection_it, RecordMap::iterator record_it) {
+    Record& record = record_it->second;
+    if (prune(record)) {
+        erase_record(collection_it, record_it);
+        return;
+    }
+    recharge(collection_it, record_it);
+    if (record.versions.size() > 1 && !record.gc_queued) {
+        record.gc_queued = true;
+        gc_queue.emplace_back(collection_it->first, record_it->first);
+    }
+}
+
+// Applies the queued search index changes in commit order. A caller finding the queue
+// empty while another applies it waits for that to finish, so a write is searchable
+// once it returns.
+void DataStore::write_index() {
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        if (search_updates.empty() && !indexing) {
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> order(indexing_mutex);
+    std::vector<SearchUpdate> updates;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        updates.swap(search_updates);
+        indexing = !updates.empty();
+    }
+    if (updates.empty()) {
+        return;
+    }
+    for (const auto& update : updates) {
+        switch (update.type) {
+            case SearchUpdate::Type::Add:
+                update.index->add(update.id, *update.item);
+                break;
+            case SearchUpdate::Type::Remove:
+                update.index->remove(update.id);
+                break;
+            case SearchUpdate::Type::Deadline:
+                update.index->set_deadline(update.id, update.deadline);
+                break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(data_mutex);
+    indexing = false;
+}
+
+// Writes the queued spills and deletions in commit order, then drops the data of
+// spilled versions that are still current. Runs without data_mutex; holding
+// disk_mutex exclusively keeps readers from seeing the disk half way through.
+void DataStore::write_disk() {
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        if (disk_writes.empty()) {
+            return;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> disk_lock(disk_mutex);
+    std::vector<DiskWrite> writes;
+    {
+        std::lock_guard<std::mutex> lock(data_mutex);
+        writes.swap(disk_writes);
+    }
+    for (const auto& write : writes) {
+        std::string key = disk_key(write.key.first, write.key.second);
+        if (write.item) {
+            disk->put(key, write.sequence, *write.item);
+        } else {
+            disk->remove(key);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(data_mutex);
+    for (const auto& write : writes) {
+        spilling_bytes -= write.bytes;
+        CollectionMap::iterator collection_it;
+        auto record_it = find_record(write.key.first, write.key.second, collection_it);
+        if (collection_it == data.end()) {
+            continue;
+        }
+        Record& record = record_it->second;
+        record.disk_writes--;
+        // Versions written since the spill keep their data
+        if (write.item && record.versions.back().item == write.item) {
+            record.versions.back().item.reset();
+        }
+        release_spilled(collection_it, record_it);
+    }
+}
@@ -0,0 +1,53 @@
+#include "../include/frequency_sketch.h"
+
+// Per-row multipliers so the rows hash independently
+static const uint64_t ROW_SEEDS[] = {
+    0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
+
+FrequencySketch::FrequencySketch(size_t requested_width) : width(64), additions(0) {
+    while (width < requested_width) {
+        width <<= 1;
+    }
+    counters.assign(width * DEPTH, 0);
+    sample_period = width * 10;
+}
+
+size_t FrequencySketch::index(uint64_t hash, int row) const {
+    uint64_t mixed = (hash + ROW_SEEDS[row]) * ROW_SEEDS[row];
+    mixed ^= mixed >> 32;
+    return row * width + (mixed & (width - 1));
+}
+
+void FrequencySketch::increment(uint64_t hash) {
+    bool added = false;
+    for (int row = 0; row < DEPTH; ++row) {
+        uint8_t& counter = counters[index(hash, row)];
+        if (counter < MAX_COUNT) {
+            ++counter;
+            added = true;
+        }
+    }
+
+    if (added && ++additions >= sample_period) {
+        age();
+    }
+}
+
+unsigned FrequencySketch::estimate(uint64_t hash) const {
+    unsigned smallest = MAX_COUNT;
+    for (int row = 0; row < DEPTH; ++row) {
+        unsigned counter = counters[index(hash, row)];
+        if (counter < smallest) {
+            smallest = counter;
+        }
+    }
+    return smallest;
+}
+
+void FrequencySketch::age() {
+    for (auto& counter : counters) {
+        counter >>= 1;
+    }
+    additions /= 2;
+}
@@ -0,0 +1,451 @@
+#include "../include/hpack.h"
+#include <algorithm>
+#include <unordered_map>
+
+// Largest table this side allows the peer's encoder, the protocol default
+static const size_t DEFAULT_TABLE_SIZE = 4096;
+
+// Integers past this are not something a real peer sends, and would overflow
+static const uint64_t MAX_INTEGER = 1u << 30;
+
+// Fields that change with nearly every response, so indexing them only churns the table
+static const char* const UNINDEXED_NAMES[] = {"content-length", "date", "etag", "last-modified", "set-cookie"};
+
+// RFC 7541 appendix A; index 1 is the first entry
+static const char* const STATIC_TABLE[61][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// RFC 7541 appendix B, by symbol; 256 is end-of-string
+static const uint32_t HUFFMAN_CODES[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea,
+    0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee, 0xfffffef,
+    0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3, 0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7,
+    0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa,
+    0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18, 0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x5c,
+    0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65,
+    0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73, 0xfd, 0x1ffb,
+    0x7fff0, 0x1ffc, 0x3ffc, 0x22, 0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26, 0x27, 0x6, 0x74, 0x75, 0x28,
+    0x29, 0x2a, 0x7, 0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6,
+    0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf, 0xffffec, 0xffffed, 0x3fffd7,
+    0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9,
+    0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9,
+    0x1fffde, 0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec, 0x1fffe0,
+    0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2, 0x3fffe3,
+    0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1, 0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7,
+    0x7ffff2, 0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1,
+    0x1ffffed, 0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2, 0x1fffe4,
+    0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed,
+    0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4,
+    0xfffff5, 0x3ffffea, 0x7ffff4, 0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0,
+    0x3ffffee, 0x3fffffff
+};
+
+static const uint8_t HUFFMAN_LENGTHS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6, 6, 6, 6, 6,
+    6, 7, 8, 15, 6, 12, 10, 13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8,
+    13, 19, 13, 14, 6, 15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15,
+    11, 14, 13, 28, 20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23,
+    23, 23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23, 26, 26, 20, 19, 22, 23, 22, 25, 26, 26,
+    26, 27, 27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20, 21,
+    22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27,
+    27, 26, 30
+};
+
+static const size_t STATIC_COUNT = 61;
+
+// Decoding walks a binary tree of the codes one bit at a time
+struct HuffmanNode {
+    int16_t next[2];
+    int16_t symbol;             // -1 for inner nodes
+};
+
+static const std::vector<HuffmanNode>& huffman_tree() {
+    static const std::vector<HuffmanNode> tree = []() {
+        std::vector<HuffmanNode> nodes(1, HuffmanNode{{-1, -1}, -1});
+        for (int symbol = 0; symbol < 257; ++symbol) {
+            size_t node = 0;
+            for (int bit = HUFFMAN_LENGTHS[symbol] - 1; bit >= 0; --bit) {
+                int branch = (HUFFMAN_CODES[symbol] >> bit) & 1;
+                if (nodes[node].next[branch] == -1) {
+                    nodes[node].next[branch] = static_cast<int16_t>(nodes.size());
+                    nodes.push_back(HuffmanNode{{-1, -1}, -1});
+                }
+                node = nodes[node].next[branch];
+            }
+            nodes[node].symbol = static_cast<int16_t>(symbol);
+        }
+        return nodes;
+    }();
+    return tree;
+}
+
+// Rejects the end-of-string symbol and padding that is not a short run of 1 bits
+static bool huffman_decode(const uint8_t* data, size_t length, std::string& out) {
+    const std::vector<HuffmanNode>& tree = huffman_tree();
+    size_t node = 0;
+    int pending_bits = 0;       // Bits read since the last symbol
+    bool all_ones = true;
+    for (size_t i = 0; i < length; ++i) {
+        for (int bit = 7; bit >= 0; --bit) {
+            int branch = (data[i] >> bit) & 1;
+            if (tree[node].next[branch] < 0) {
+                return false;
+            }
+            node = tree[node].next[branch];
+            pending_bits++;
+            all_ones = all_ones && branch;
+            if (tree[node].symbol >= 0) {
+                if (tree[node].symbol == 256) {
+                    return false;
+                }
+                out += static_cast<char>(tree[node].symbol);
+                node = 0;
+                pending_bits = 0;
+                all_ones = true;
+            }
+        }
+    }
+    return pending_bits < 8 && all_ones;
+}
+
+static size_t huffman_length(const std::string& value) {
+    size_t bits = 0;
+    for (unsigned char c : value) {
+        bits += HUFFMAN_LENGTHS[c];
+    }
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(const std::string& value, std::string& out) {
+    uint64_t buffer = 0;
+    int buffered = 0;
+    for (unsigned char c : value) {
+        buffer = (buffer << HUFFMAN_LENGTHS[c]) | HUFFMAN_CODES[c];
+        buffered += HUFFMAN_LENGTHS[c];
+        while (buffered >= 8) {
+            buffered -= 8;
+            out += static_cast<char>((buffer >> buffered) & 0xFF);
+        }
+    }
+    // Pad with the most significant bits of end-of-string, which are all ones
+    if (buffered > 0) {
+        out += static_cast<char>(((buffer << (8 - buffered)) | (0xFF >> buffered)) & 0xFF);
+    }
+}
+
+static void encode_integer(std::string& out, uint8_t first_byte, int prefix_bits, uint64_t value) {
+    uint64_t limit = (1u << prefix_bits) - 1;
+    if (value < limit) {
+        out += static_cast<char>(first_byte | value);
+        return;
+    }
+    out += static_cast<char>(first_byte | limit);
+    value -= limit;
+    while (value >= 128) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+// Huffman coding is used whenever it makes the string shorter
+static void encode_string(std::string& out, const std::string& value) {
+    size_t coded = huffman_length(value);
+    if (coded < value.size()) {
+        encode_integer(out, 0x80, 7, coded);
+        huffman_encode(value, out);
+    } else {
+        encode_integer(out, 0x00, 7, value.size());
+        out += value;
+    }
+}
+
+static bool decode_integer(const uint8_t* data, size_t length, size_t& pos, int prefix_bits, uint64_t& value) {
+    if (pos >= length) {
+        return false;
+    }
+    uint64_t limit = (1u << prefix_bits) - 1;
+    value = data[pos++] & limit;
+    if (value < limit) {
+        return true;
+    }
+    for (int shift = 0; pos < length; shift += 7) {
+        // Continuation bytes of 0x80 add nothing, so the value alone never ends a long run
+        // of them, and shifting by 64 or more is undefined
+        if (shift > 56) {
+            return false;
+        }
+        uint8_t byte = data[pos++];
+        value += static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (value > MAX_INTEGER) {
+            return false;
+        }
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool decode_string(const uint8_t* data, size_t length, size_t& pos, std::string& out) {
+    if (pos >= length) {
+        return false;
+    }
+    bool huffman = data[pos] & 0x80;
+    uint64_t string_length;
+    if (!decode_integer(data, length, pos, 7, string_length) || string_length > length - pos) {
+        return false;
+    }
+    const uint8_t* start = data + pos;
+    pos += string_length;
+    if (huffman) {
+        return huffman_decode(start, string_length, out);
+    }
+    out.assign(reinterpret_cast<const char*>(start), string_length);
+    return true;
+}
+
+// First static index carrying each name; entries with the same name are adjacent
+static const std::unordered_map<std::string, size_t>& static_names() {
+    static const std::unordered_map<std::string, size_t> names = []() {
+        std::unordered_map<std::string, size_t> map;
+        for (size_t i = 0; i < STATIC_COUNT; ++i) {
+            map.emplace(STATIC_TABLE[i][0], i + 1);
+        }
+        return map;
+    }();
+    return names;
+}
+
+HpackTable::HpackTable(size_t max_size) : size(0), limit(max_size) {}
+
+void HpackTable::add(std::string name, std::string value) {
+    size_t added = entry_size(name, value);
+    // An entry larger than the whole table empties it and is not stored
+    if (added > limit) {
+        evict(0);
+        return;
+    }
+    evict(limit - added);
+    size += added;
+    entries.emplace_front(std::move(name), std::move(value));
+}
+
+void HpackTable::set_max_size(size_t new_size) {
+    limit = new_size;
+    evict(limit);
+}
+
+void HpackTable::evict(size_t target) {
+    while (size > target) {
+        size -= entry_size(entries.back().first, entries.back().second);
+        entries.pop_back();
+    }
+}
+
+HpackDecoder::HpackDecoder() : table(DEFAULT_TABLE_SIZE), protocol_max_size(DEFAULT_TABLE_SIZE) {}
+
+HpackDecoder::Status HpackDecoder::decode(const uint8_t* data, size_t length, HeaderList& headers,
+                                          size_t max_list_size) {
+    size_t pos = 0;
+    size_t list_size = 0;
+    bool fields_seen = false;
+
+    auto lookup = [this](uint64_t index, std::pair<std::string, std::string>& field) {
+        if (index == 0 || index > STATIC_COUNT + table.count()) {
+            return false;
+        }
+        if (index <= STATIC_COUNT) {
+            field.first = STATIC_TABLE[index - 1][0];
+            field.second = STATIC_TABLE[index - 1][1];
+        } else {
+            field = table.at(index - STATIC_COUNT - 1);
+        }
+        return true;
+    };
+
+    while (pos < length) {
+        uint8_t first = data[pos];
+        std::pair<std::string, std::string> field;
+
+        if (first & 0x80) {
+            // Indexed field
+            uint64_t index;
+            if (!decode_integer(data, length, pos, 7, index) || !lookup(index, field)) {
+                return Status::Invalid;
+            }
+        } else if ((first & 0xE0) == 0x20) {
+            // Table size updates may only open a block
+            uint64_t new_size;
+            if (fields_seen || !decode_integer(data, length, pos, 5, new_size) || new_size > protocol_max_size) {
+                return Status::Invalid;
+            }
+            table.set_max_size(new_size);
+            continue;
+        } else {
+            // Literal: with incremental indexing (01), without (0000) or never indexed (0001)
+            bool indexing = (first & 0xC0) == 0x40;
+            uint64_t name_index;
+            if (!decode_integer(data, length, pos, indexing ? 6 : 4, name_index)) {
+                return Status::Invalid;
+            }
+            if (name_index > 0) {
+                if (!lookup(name_index, field)) {
+                    return Status::Invalid;
+                }
+            } else if (!decode_string(data, length, pos, field.first)) {
+                return Status::Invalid;
+            }
+            field.second.clear();
+            if (!decode_string(data, length, pos, field.second)) {
+                return Status::Invalid;
+            }
+            if (indexing) {
+                table.add(field.first, field.second);
+            }
+        }
+
+        fields_seen = true;
+        list_size += HpackTable::entry_size(field.first, field.second);
+        if (list_size <= max_list_size) {
+            headers.push_back(std::move(field));
+        }
+    }
+    return list_size > max_list_size ? Status::TooLarge : Status::Ok;
+}
+
+HpackEncoder::HpackEncoder() : table(DEFAULT_TABLE_SIZE), smallest_pending(DEFAULT_TABLE_SIZE), size_changed(false) {}
+
+void HpackEncoder::set_max_table_size(size_t size) {
+    // The peer's limit is a ceiling; the table never grows past the default
+    size = std::min(size, DEFAULT_TABLE_SIZE);
+    smallest_pending = size_changed ? std::min(smallest_pending, size) : size;
+    size_changed = true;
+    table.set_max_size(size);
+}
+
+void HpackEncoder::encode(const HeaderList& headers, std::string& out) {
+    if (size_changed) {
+        // A shrink followed by a growth has to announce both
+        if (smallest_pending < table.max_size()) {
+            encode_integer(out, 0x20, 5, smallest_pending);
+        }
+        encode_integer(out, 0x20, 5, table.max_size());
+        size_changed = false;
+    }
+
+    const auto& names = static_names();
+    for (const auto& header : headers) {
+        const std::string& name = header.first;
+        const std::string& value = header.second;
+
+        size_t name_index = 0;
+        size_t full_index = 0;
+        auto named = names.find(name);
+        if (named != names.end()) {
+            name_index = named->second;
+            for (size_t i = name_index; i <= STATIC_COUNT && name == STATIC_TABLE[i - 1][0]; ++i) {
+                if (value == STATIC_TABLE[i - 1][1]) {
+                    full_index = i;
+                    break;
+                }
+            }
+        }
+        for (size_t i = 0; i < table.count() && !full_index; ++i) {
+            if (table.at(i).first == name) {
+                if (table.at(i).second == value) {
+                    full_index = STATIC_COUNT + 1 + i;
+                } else if (!name_index) {
+                    name_index = STATIC_COUNT + 1 + i;
+                }
+            }
+        }
+
+        if (full_index) {
+            encode_integer(out, 0x80, 7, full_index);
+            continue;
+        }
+
+        bool indexing = HpackTable::entry_size(name, value) <= table.max_size() / 2;
+        for (const char* unindexed : UNINDEXED_NAMES) {
+            indexing = indexing && name != unindexed;
+        }
+        if (indexing) {
+            encode_integer(out, 0x40, 6, name_index);
+        } else {
+            encode_integer(out, 0x00, 4, name_index);
+        }
+        if (!name_index) {
+            encode_string(out, name);
+        }
+        encode_string(out, value);
+        if (indexing) {
+            table.add(name, value);
+        }
+    }
+}
@@ -0,0 +1,1200 @@
+#include "../include/http2.h"
+#include <algorithm>
+#include <cstring>
+
+const std::string Http2Connection::PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// Frame flags
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+// SETTINGS parameters
+static const uint16_t SETTINGS_HEADER_TABLE_SIZE = 0x1;
+static const uint16_t SETTINGS_ENABLE_PUSH = 0x2;
+static const uint16_t SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+static const uint16_t SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+static const uint16_t SETTINGS_MAX_FRAME_SIZE = 0x5;
+static const uint16_t SETTINGS_MAX_HEADER_LIST_SIZE = 0x6;
+
+static const size_t FRAME_HEADER_SIZE = 9;
+
+// Frames this side accepts; never raised, so it is not advertised
+static const uint32_t MAX_RECEIVED_FRAME = 16384;
+
+static const int64_t DEFAULT_WINDOW = 65535;
+static const int64_t MAX_WINDOW = 0x7FFFFFFF;
+static const uint16_t DEFAULT_WEIGHT = 16;
+
+// Closed streams whose priority nodes are kept, and room for nodes of streams not yet opened
+static const size_t RETIRED_NODES = 32;
+static const size_t IDLE_NODES = 64;
+
+// Streams this side reset whose frames may still be in flight, and are then not the peer's error
+static const size_t RECENT_RESETS = 64;
+
+// Header blocks may arrive in pieces; more than this compressed is not a real request
+static const size_t MAX_HEADER_BLOCK = 64 * 1024;
+
+static uint32_t read_uint32(const uint8_t* data) {
+    return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+}
+
+static void append_uint32(std::string& out, uint32_t value) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>((value >> 16) & 0xFF);
+    out += static_cast<char>((value >> 8) & 0xFF);
+    out += static_cast<char>(value & 0xFF);
+}
+
+static void append_setting(std::string& out, uint16_t id, uint32_t value) {
+    out += static_cast<char>(id >> 8);
+    out += static_cast<char>(id & 0xFF);
+    append_uint32(out, value);
+}
+
+// HTTP2-Settings is base64url without padding
+static bool base64url_decode(const std::string& input, std::string& out) {
+    uint32_t buffer = 0;
+    int bits = 0;
+    for (char c : input) {
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '-') value = 62;
+        else if (c == '_') value = 63;
+        else if (c == '=') break;
+        else return false;
+        buffer = (buffer << 6) | value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += static_cast<char>((buffer >> bits) & 0xFF);
+        }
+    }
+    return true;
+}
+
+// Checks a request's fields as RFC 9113 section 8.2 and 8.3 require: lowercase names,
+// pseudo-fields first and only the request ones, no connection-specific fields, and
+// a single Content-Length. Returns false for a malformed request.
+static bool validate_request_fields(const HeaderList& fields, int64_t& content_length) {
+    bool regular_seen = false;
+    bool method = false, scheme = false, path = false, authority = false;
+    bool connect = false;
+    content_length = -1;
+
+    for (const auto& field : fields) {
+        const std::string& name = field.first;
+        const std::string& value = field.second;
+        if (name.empty()) {
+            return false;
+        }
+        for (size_t i = name[0] == ':' ? 1 : 0; i < name.size(); ++i) {
+            unsigned char c = name[i];
+            if (c <= 0x20 || c >= 0x7F || c == ':' || (c >= 'A' && c <= 'Z')) {
+                return false;
+            }
+        }
+        if (value.find_first_of(std::string("\0\r\n", 3)) != std::string::npos) {
+            return false;
+        }
+
+        if (name[0] == ':') {
+            bool* seen = name == ":method" ? &method : name == ":scheme" ? &scheme
+                       : name == ":path" ? &path : name == ":authority" ? &authority : nullptr;
+            if (regular_seen || !seen || *seen) {
+                return false;
+            }
+            *seen = true;
+            connect = connect || (name == ":method" && value == "CONNECT");
+            if (name == ":path" && value.empty()) {
+                return false;
+            }
+            continue;
+        }
+
+        regular_seen = true;
+        if (name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+            name == "transfer-encoding" || name == "upgrade" || (name == "te" && value != "trailers")) {
+            return false;
+        }
+        if (name == "content-length") {
+            if (value.empty() || value.size() > 18 || value.find_first_not_of("0123456789") != std::string::npos) {
+                return false;
+            }
+            int64_t length = std::stoll(value);
+            if (content_length >= 0 && content_length != length) {
+                return false;
+            }
+            content_length = length;
+        }
+    }
+    return method && (connect ? authority && !scheme && !path : scheme && path);
+}
+
+Http2Body::Http2Body(std::string data)
+    : buffer(std::move(data)), read_offset(0), max_buffered(0), complete(true), cancelled(false),
+      reader_waiting(false) {}
+
+Http2Body::Http2Body(std::function<void()> wake, size_t max_buffered)
+    : read_offset(0), max_buffered(max_buffered), complete(false), cancelled(false), reader_waiting(false),
+      wake(std::move(wake)) {}
+
+Http2Body::WriteStatus Http2Body::write(std::string_view chunk, std::chrono::milliseconds timeout) {
+    bool needs_wake;
+    {
+        std::unique_lock<std::mutex> lock(body_mutex);
+        bool room = drained.wait_for(lock, timeout, [this]() {
+            return cancelled || buffer.size() - read_offset < max_buffered;
+        });
+        if (cancelled) {
+            return WriteStatus::Cancelled;
+        }
+        if (!room) {
+            return WriteStatus::Full;
+        }
+        // Read bytes are dropped here, on the producer's thread, rather than on every read
+        if (read_offset > 0) {
+            buffer.erase(0, read_offset);
+            read_offset = 0;
+        }
+        buffer.append(chunk.data(), chunk.size());
+        needs_wake = reader_waiting;
+        reader_waiting = false;
+    }
+    if (needs_wake && wake) {
+        wake();
+    }
+    return WriteStatus::Written;
+}
+
+void Http2Body::finish() {
+    bool needs_wake;
+    {
+        std::lock_guard<std::mutex> lock(body_mutex);
+        complete = true;
+        needs_wake = reader_waiting;
+        reader_waiting = false;
+    }
+    if (needs_wake && wake) {
+        wake();
+    }
+}
+
+void Http2Body::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(body_mutex);
+        cancelled = true;
+        std::string().swap(buffer);
+        read_offset = 0;
+    }
+    drained.notify_all();
+}
+
+size_t Http2Body::read(std::string& out, size_t max_length, bool& finished) {
+    size_t length;
+    bool producing;
+    {
+        std::lock_guard<std::mutex> lock(body_mutex);
+        length = std::min(max_length, buffer.size() - read_offset);
+        out.append(buffer, read_offset, length);
+        read_offset += length;
+        finished = complete && read_offset == buffer.size();
+        reader_waiting = !complete && read_offset == buffer.size();
+        producing = !complete;
+    }
+    if (length > 0 && producing) {
+        drained.notify_all();
+    }
+    return length;
+}
+
+size_t Http2Body::available(bool& finished) {
+    std::lock_guard<std::mutex> lock(body_mutex);
+    size_t length = buffer.size() - read_offset;
+    finished = complete;
+    reader_waiting = !complete && length == 0;
+    return length;
+}
+
+bool Http2Body::was_cancelled() {
+    std::lock_guard<std::mutex> lock(body_mutex);
+    return cancelled;
+}
+
+Http2RequestBody::Http2RequestBody(std::function<void()> wake)
+    : read_offset(0), consumed(0), complete(false), cancelled(false), wake(std::move(wake)) {}
+
+ssize_t Http2RequestBody::read(char* out, size_t length, std::chrono::milliseconds timeout) {
+    size_t count;
+    bool needs_wake;
+    {
+        std::unique_lock<std::mutex> lock(body_mutex);
+        bool ready = arrived.wait_for(lock, timeout, [this]() {
+            return cancelled || complete || read_offset < buffer.size();
+        });
+        if (cancelled || !ready) {
+            return -1;
+        }
+        count = std::min(length, buffer.size() - read_offset);
+        std::memcpy(out, buffer.data() + read_offset, count);
+        read_offset += count;
+        if (read_offset == buffer.size()) {
+            buffer.clear();
+            read_offset = 0;
+        }
+        // One wakeup until the connection collects the count
+        needs_wake = count > 0 && consumed == 0;
+        consumed += count;
+    }
+    if (needs_wake && wake) {
+        wake();
+    }
+    return static_cast<ssize_t>(count);
+}
+
+void Http2RequestBody::append(const char* data, size_t length) {
+    {
+        std::lock_guard<std::mutex> lock(body_mutex);
+        if (cancelled) {
+            return;
+        }
+        if (read_offset > 0) {
+            buffer.erase(0, read_offset);
+            read_offset = 0;
+        }
+        buffer.append(data, length);
+    }
+    arrived.notify_all();
+}
+
+void Http2RequestBody::finish() {
+    {
+        std::lock_guard<std::mutex> lock(body_mutex);
+        complete = true;
+    }
+    arrived.notify_all();
+}
+
+// What was held is released by the connection as a whole, so nothing read is reported after this
+void Http2RequestBody::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(body_mutex);
+        cancelled = true;
+        std::string().swap(buffer);
+        read_offset = 0;
+        consumed = 0;
+    }
+    arrived.notify_all();
+}
+
+size_t Http2RequestBody::take_consumed() {
+    std::lock_guard<std::mutex> lock(body_mutex);
+    size_t count = consumed;
+    consumed = 0;
+    return count;
+}
+
+Http2Connection::Http2Connection(const Settings& settings)
+    : settings(settings), preface_received(false), settings_received(false), last_stream_id(0),
+      continuation_stream(0), continuation_flags(0), block_priority{false, 0, DEFAULT_WEIGHT, false},
+      goaway_sent(false), goaway_received(false), failed(false), connection_send_window(DEFAULT_WINDOW),
+      connection_receive_window(settings.connection_window_size), connection_unacknowledged(0), buffered(0),
+      peer_initial_window(DEFAULT_WINDOW), peer_max_frame_size(16384), virtual_time(0) {
+    priorities[0] = PriorityNode{0, DEFAULT_WEIGHT, {}, 0};
+    this->settings.max_buffered = std::max<size_t>(settings.max_buffered, settings.connection_window_size);
+
+    // The server preface, with the window for request bodies opened past the default
+    std::string payload;
+    append_setting(payload, SETTINGS_ENABLE_PUSH, 0);
+    append_setting(payload, SETTINGS_MAX_CONCURRENT_STREAMS, settings.max_concurrent_streams);
+    append_setting(payload, SETTINGS_INITIAL_WINDOW_SIZE, settings.initial_window_size);
+    append_setting(payload, SETTINGS_MAX_HEADER_LIST_SIZE, settings.max_header_list_size);
+    append_frame(control, SettingsFrame, 0, 0, payload);
+    if (settings.connection_window_size > DEFAULT_WINDOW) {
+        std::string increment;
+        append_uint32(increment, static_cast<uint32_t>(settings.connection_window_size - DEFAULT_WINDOW));
+        append_frame(control, WindowUpdate, 0, 0, increment);
+    }
+}
+
+Http2Connection::~Http2Connection() {
+    abandon();
+}
+
+bool Http2Connection::upgrade(const std::string& http2_settings) {
+    std::string payload;
+    if (!base64url_decode(http2_settings, payload) || payload.size() % 6 != 0 ||
+        !apply_settings(reinterpret_cast<const uint8_t*>(payload.data()), payload.size())) {
+        return false;
+    }
+
+    // The request already arrived over HTTP/1.1, so stream 1 only waits for its response
+    Stream stream{};
+    stream.request_done = true;
+    stream.expected_length = -1;
+    stream.receive_window = settings.initial_window_size;
+    stream.send_window = peer_initial_window;
+    streams.emplace(1, std::move(stream));
+    priority_node(1);
+    last_stream_id = 1;
+    return true;
+}
+
+void Http2Connection::append_frame(std::string& out, uint8_t type, uint8_t flags, uint32_t stream_id,
+                                   std::string_view payload) {
+    size_t length = payload.size();
+    out += static_cast<char>((length >> 16) & 0xFF);
+    out += static_cast<char>((length >> 8) & 0xFF);
+    out += static_cast<char>(length & 0xFF);
+    out += static_cast<char>(type);
+    out += static_cast<char>(flags);
+    append_uint32(out, stream_id & 0x7FFFFFFF);
+    out.append(payload.data(), payload.size());
+}
+
+bool Http2Connection::connection_error(ErrorCode code) {
+    if (!goaway_sent) {
+        std::string payload;
+        append_uint32(payload, last_stream_id);
+        append_uint32(payload, code);
+        append_frame(control, GoAway, 0, 0, payload);
+        goaway_sent = true;
+    }
+    failed = true;
+    return false;
+}
+
+void Http2Connection::reset_stream(uint32_t stream_id, ErrorCode code) {
+    std::string payload;
+    append_uint32(payload, code);
+    append_frame(control, RstStream, 0, stream_id, payload);
+    auto it = streams.find(stream_id);
+    if (it != streams.end()) {
+        close_stream(it);
+    }
+    forget_stream(stream_id);
+}
+
+// The peer may not know yet that the stream is gone, so its frames there are dropped quietly for a while
+void Http2Connection::forget_stream(uint32_t stream_id) {
+    reset_streams.push_back(stream_id);
+    if (reset_streams.size() > RECENT_RESETS) {
+        reset_streams.erase(reset_streams.begin());
+    }
+}
+
+void Http2Connection::close_stream(std::map<uint32_t, Stream>::iterator it) {
+    if (it->second.response_body) {
+        it->second.response_body->cancel();
+    }
+    if (it->second.request_stream) {
+        it->second.request_stream->cancel();
+    }
+    release_body(it->second);
+    retire_node(it->first);
+    streams.erase(it);
+}
+
+// A response may end before its request did, as when the body was refused; the
+// rest of the request is then declined with NO_ERROR
+void Http2Connection::end_stream_sent(std::map<uint32_t, Stream>::iterator it) {
+    if (it->second.request_done) {
+        close_stream(it);
+    } else {
+        reset_stream(it->first, NoError);
+    }
+}
+
+bool Http2Connection::apply_settings(const uint8_t* payload, size_t length) {
+    for (size_t offset = 0; offset + 6 <= length; offset += 6) {
+        uint16_t id = static_cast<uint16_t>((payload[offset] << 8) | payload[offset + 1]);
+        uint32_t value = read_uint32(payload + offset + 2);
+        switch (id) {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                encoder.set_max_table_size(value);
+                break;
+            case SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return connection_error(ProtocolError);
+                }
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > MAX_WINDOW) {
+                    return connection_error(FlowControlError);
+                }
+                // The change applies to every open stream's window, which may go negative
+                int64_t delta = static_cast<int64_t>(value) - peer_initial_window;
+                for (auto& entry : streams) {
+                    entry.second.send_window += delta;
+                    if (entry.second.send_window > MAX_WINDOW) {
+                        return connection_error(FlowControlError);
+                    }
+                }
+                peer_initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < 16384 || value > 16777215) {
+                    return connection_error(ProtocolError);
+                }
+                peer_max_frame_size = value;
+                break;
+            default:
+                // Includes MAX_CONCURRENT_STREAMS and MAX_HEADER_LIST_SIZE, which only bound
+                // what this side would initiate or send in one block
+                break;
+        }
+    }
+    return true;
+}
+
+bool Http2Connection::receive(std::string& input, std::vector<Request>& requests,
+                              std::chrono::steady_clock::time_point now) {
+    if (failed) {
+        input.clear();
+        return false;
+    }
+    received_at = now;
+
+    size_t offset = 0;
+    if (!preface_received) {
+        size_t compared = std::min(input.size(), PREFACE.size());
+        if (input.compare(0, compared, PREFACE, 0, compared) != 0) {
+            return connection_error(ProtocolError);
+        }
+        if (compared < PREFACE.size()) {
+            return true;
+        }
+        offset = PREFACE.size();
+        preface_received = true;
+    }
+
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(input.data());
+    while (!failed && input.size() - offset >= FRAME_HEADER_SIZE) {
+        const uint8_t* header = data + offset;
+        uint32_t length = (uint32_t(header[0]) << 16) | (uint32_t(header[1]) << 8) | header[2];
+        uint8_t type = header[3];
+        uint8_t flags = header[4];
+        uint32_t stream_id = read_uint32(header + 5) & 0x7FFFFFFF;
+        if (length > MAX_RECEIVED_FRAME) {
+            connection_error(FrameSizeError);
+            break;
+        }
+        if (input.size() - offset - FRAME_HEADER_SIZE < length) {
+            break;
+        }
+        offset += FRAME_HEADER_SIZE + length;
+
+        // The client's preface ends with its SETTINGS, and a header block allows nothing in between
+        if (!settings_received && (type != SettingsFrame || (flags & FLAG_ACK))) {
+            connection_error(ProtocolError);
+            break;
+        }
+        if (continuation_stream && (type != Continuation || stream_id != continuation_stream)) {
+            connection_error(ProtocolError);
+            break;
+        }
+        handle_frame(type, flags, stream_id, header + FRAME_HEADER_SIZE, length, requests);
+    }
+
+    acknowledge_connection();
+    input.erase(0, failed ? input.size() : offset);
+    return !failed;
+}
+
+bool Http2Connection::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload,
+                                   size_t length, std::vector<Request>& requests) {
+    switch (type) {
+        case Data:
+            return handle_data(flags, stream_id, payload, length, requests);
+
+        case Headers:
+            return handle_headers(flags, stream_id, payload, length, requests);
+
+        case Priority: {
+            if (stream_id == 0) {
+                return connection_error(ProtocolError);
+            }
+            if (length != 5) {
+                reset_stream(stream_id, FrameSizeError);
+                return true;
+            }
+            uint32_t parent = read_uint32(payload);
+            if ((parent & 0x7FFFFFFF) == stream_id) {
+                return connection_error(ProtocolError);
+            }
+            // Streams not opened yet get a node only while there is room for them
+            if (priorities.count(stream_id) || priorities.size() < settings.max_concurrent_streams + RETIRED_NODES + IDLE_NODES) {
+                set_priority(stream_id, parent & 0x7FFFFFFF, static_cast<uint16_t>(payload[4] + 1), parent >> 31);
+            }
+            return true;
+        }
+
+        case RstStream: {
+            if (stream_id == 0 || stream_id > last_stream_id) {
+                return connection_error(ProtocolError);
+            }
+            if (length != 4) {
+                return connection_error(FrameSizeError);
+            }
+            auto it = streams.find(stream_id);
+            if (it != streams.end()) {
+                close_stream(it);
+            }
+            return true;
+        }
+
+        case SettingsFrame:
+            if (stream_id != 0) {
+                return connection_error(ProtocolError);
+            }
+            if (flags & FLAG_ACK) {
+                return length == 0 || connection_error(FrameSizeError);
+            }
+            if (length % 6 != 0) {
+                return connection_error(FrameSizeError);
+            }
+            if (!apply_settings(payload, length)) {
+                return false;
+            }
+            settings_received = true;
+            append_frame(control, SettingsFrame, FLAG_ACK, 0, "");
+            return true;
+
+        case PushPromise:
+            // Only servers push
+            return connection_error(ProtocolError);
+
+        case Ping:
+            if (stream_id != 0) {
+                return connection_error(ProtocolError);
+            }
+            if (length != 8) {
+                return connection_error(FrameSizeError);
+            }
+            if (!(flags & FLAG_ACK)) {
+                append_frame(control, Ping, FLAG_ACK, 0, std::string_view(reinterpret_cast<const char*>(payload), 8));
+            }
+            return true;
+
+        case GoAway:
+            if (stream_id != 0) {
+                return connection_error(ProtocolError);
+            }
+            if (length < 8) {
+                return connection_error(FrameSizeError);
+            }
+            goaway_received = true;
+            return true;
+
+        case WindowUpdate:
+            return handle_window_update(stream_id, payload, length);
+
+        case Continuation:
+            if (!continuation_stream) {
+                return connection_error(ProtocolError);
+            }
+            if (header_block.size() + length > MAX_HEADER_BLOCK) {
+                return connection_error(EnhanceYourCalm);
+            }
+            header_block.append(reinterpret_cast<const char*>(payload), length);
+            if (flags & FLAG_END_HEADERS) {
+                return finish_header_block(stream_id, continuation_flags, requests);
+            }
+            return true;
+
+        default:
+            // Unknown frame types are ignored
+            return true;
+    }
+}
+
+bool Http2Connection::handle_data(uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t length,
+                                  std::vector<Request>& requests) {
+    if (stream_id == 0 || stream_id > last_stream_id) {
+        return connection_error(ProtocolError);
+    }
+
+    // The connection window counts every DATA frame, padding included, whatever its stream.
+    // It grows back as the bytes leave, in acknowledge_connection().
+    if (static_cast<int64_t>(length) > connection_receive_window) {
+        return connection_error(FlowControlError);
+    }
+    connection_receive_window -= length;
+    connection_unacknowledged += length;
+
+    // Frames still in flight when this side reset the stream are dropped
+    auto it = streams.find(stream_id);
+    if (it == streams.end()) {
+        return true;
+    }
+    Stream& stream = it->second;
+    if (stream.request_done) {
+        reset_stream(stream_id, StreamClosed);
+        return true;
+    }
+
+    size_t data_offset = 0;
+    size_t data_length = length;
+    if (flags & FLAG_PADDED) {
+        if (length == 0 || payload[0] >= length) {
+            return connection_error(ProtocolError);
+        }
+        data_offset = 1;
+        data_length = length - 1 - payload[0];
+    }
+    if (static_cast<int64_t>(length) > stream.receive_window) {
+        reset_stream(stream_id, FlowControlError);
+        return true;
+    }
+    stream.receive_window -= length;
+    stream.deadline = received_at + settings.body_timeout;
+
+    // A body over the limit is answered right away; whatever follows it is discarded
+    size_t kept = 0;
+    if (!stream.responded) {
+        const char* data = reinterpret_cast<const char*>(payload) + data_offset;
+        if (stream.body_length + data_length > settings.max_body_size) {
+            if (stream.request_stream) {
+                stream.request_stream->cancel();
+            }
+            release_body(stream);
+            respond(stream_id, HeaderList{{":status", "413"}, {"content-length", "0"}}, std::make_shared<Http2Body>(""));
+        } else if (stream.request_stream) {
+            stream.request_stream->append(data, data_length);
+            kept = data_length;
+        } else {
+            stream.request_body.append(data, data_length);
+        }
+        stream.body_length += data_length;
+        stream.held += stream.responded ? 0 : data_length;
+        buffered += stream.responded ? 0 : data_length;
+    }
+
+    if (flags & FLAG_END_STREAM) {
+        stream.request_done = true;
+        return stream.responded || complete_request(stream_id, stream, requests);
+    }
+    // A buffered body needs the whole of it before its request starts, so only the connection
+    // window bounds it. A streamed one gets its window back as the handler reads.
+    acknowledge_data(stream, stream_id, length - kept);
+    return true;
+}
+
+// Gives the connection window back for what was received, as far as the bytes held for
+// requests stay within max_buffered. Sent once half the window is used, so a client
+// waiting on it always hears as soon as there is room.
+void Http2Connection::acknowledge_connection() {
+    if (failed || connection_receive_window > static_cast<int64_t>(settings.connection_window_size / 2)) {
+        return;
+    }
+    int64_t room = static_cast<int64_t>(settings.max_buffered) - static_cast<int64_t>(buffered) -
+                   connection_receive_window;
+    uint32_t increment = static_cast<uint32_t>(std::min<int64_t>(connection_unacknowledged, std::max<int64_t>(room, 0)));
+    if (increment == 0) {
+        return;
+    }
+    std::string payload;
+    append_uint32(payload, increment);
+    append_frame(control, WindowUpdate, 0, 0, payload);
+    connection_receive_window += increment;
+    connection_unacknowledged -= increment;
+}
+
+// Drops what a stream holds of its request body from the connection's count
+void Http2Connection::release_body(Stream& stream) {
+    std::string().swap(stream.request_body);
+    buffered -= stream.held;
+    stream.held = 0;
+}
+
+void Http2Connection::acknowledge_data(Stream& stream, uint32_t stream_id, size_t length) {
+    stream.unacknowledged += length;
+    if (stream.unacknowledged >= settings.initial_window_size / 2) {
+        std::string increment;
+        append_uint32(increment, stream.unacknowledged);
+        append_frame(control, WindowUpdate, 0, stream_id, increment);
+        stream.receive_window += stream.unacknowledged;
+        stream.unacknowledged = 0;
+    }
+}
+
+bool Http2Connection::handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t length,
+                                     std::vector<Request>& requests) {
+    // Clients open odd-numbered streams
+    if (stream_id == 0 || stream_id % 2 == 0) {
+        return connection_error(ProtocolError);
+    }
+
+    size_t start = 0;
+    size_t end = length;
+    if (flags & FLAG_PADDED) {
+        if (length == 0 || payload[0] >= length) {
+            return connection_error(ProtocolError);
+        }
+        start = 1;
+        end = length - payload[0];
+    }
+    block_priority = PrioritySpec{false, 0, DEFAULT_WEIGHT, false};
+    if (flags & FLAG_PRIORITY) {
+        if (end - start < 5) {
+            return connection_error(FrameSizeError);
+        }
+        uint32_t parent = read_uint32(payload + start);
+        block_priority = PrioritySpec{true, parent & 0x7FFFFFFF, static_cast<uint16_t>(payload[start + 4] + 1),
+                                      (parent >> 31) != 0};
+        if (block_priority.parent == stream_id) {
+            return connection_error(ProtocolError);
+        }
+        start += 5;
+    }
+
+    header_block.assign(reinterpret_cast<const char*>(payload) + start, end - start);
+    continuation_flags = flags;
+    if (flags & FLAG_END_HEADERS) {
+        return finish_header_block(stream_id, flags, requests);
+    }
+    continuation_stream = stream_id;
+    continuation_deadline = received_at + settings.header_timeout;
+    return true;
+}
+
+bool Http2Connection::finish_header_block(uint32_t stream_id, uint8_t flags, std::vector<Request>& requests) {
+    HeaderList fields;
+    auto status = decoder.decode(reinterpret_cast<const uint8_t*>(header_block.data()), header_block.size(), fields,
+                                 settings.max_header_list_size);
+    std::string().swap(header_block);
+    continuation_stream = 0;
+    if (status == HpackDecoder::Status::Invalid) {
+        return connection_error(CompressionError);
+    }
+
+    // Trailers end a request whose body is still arriving; their fields are not used
+    auto existing = streams.find(stream_id);
+    if (existing != streams.end()) {
+        Stream& stream = existing->second;
+        if (stream.request_done) {
+            reset_stream(stream_id, StreamClosed);
+        } else if (!(flags & FLAG_END_STREAM)) {
+            reset_stream(stream_id, ProtocolError);
+        } else {
+            stream.request_done = true;
+            return stream.responded || complete_request(stream_id, stream, requests);
+        }
+        return true;
+    }
+
+    // Blocks for streams this side just reset only had to be decoded, to keep the table in step;
+    // on any other closed stream they are the peer's error
+    if (stream_id <= last_stream_id) {
+        if (std::find(reset_streams.begin(), reset_streams.end(), stream_id) != reset_streams.end()) {
+            return true;
+        }
+        return connection_error(ProtocolError);
+    }
+    last_stream_id = stream_id;
+    if (goaway_sent) {
+        forget_stream(stream_id);
+        return true;
+    }
+    if (streams.size() >= settings.max_concurrent_streams) {
+        reset_stream(stream_id, RefusedStream);
+        return true;
+    }
+
+    Stream stream{};
+    stream.expected_length = -1;
+    stream.receive_window = settings.initial_window_size;
+    stream.send_window = peer_initial_window;
+    stream.deadline = received_at + settings.body_timeout;
+    Stream& opened = streams.emplace(stream_id, std::move(stream)).first->second;
+    if (block_priority.present) {
+        set_priority(stream_id, block_priority.parent, block_priority.weight, block_priority.exclusive);
+    } else {
+        priority_node(stream_id);
+    }
+
+    if (status == HpackDecoder::Status::TooLarge) {
+        respond(stream_id, HeaderList{{":status", "431"}, {"content-length", "0"}}, std::make_shared<Http2Body>(""));
+        return true;
+    }
+    if (!validate_request_fields(fields, opened.expected_length)) {
+        reset_stream(stream_id, ProtocolError);
+        return true;
+    }
+    opened.request_headers = std::move(fields);
+    if (flags & FLAG_END_STREAM) {
+        opened.request_done = true;
+        return complete_request(stream_id, opened, requests);
+    }
+
+    // A handler that reads the body itself starts now and takes the body as it arrives
+    if (settings.stream_body) {
+        const std::string* method = nullptr;
+        const std::string* path = nullptr;
+        for (const auto& field : opened.request_headers) {
+            if (field.first == ":method") {
+                method = &field.second;
+            } else if (field.first == ":path") {
+                path = &field.second;
+            }
+        }
+        if (method && path && settings.stream_body(*method, *path)) {
+            opened.request_stream = std::make_shared<Http2RequestBody>(settings.wake);
+            hand_out(stream_id, opened, requests);
+        }
+    }
+    return true;
+}
+
+bool Http2Connection::complete_request(uint32_t stream_id, Stream& stream, std::vector<Request>& requests) {
+    if (stream.expected_length >= 0 && stream.expected_length != static_cast<int64_t>(stream.body_length)) {
+        reset_stream(stream_id, ProtocolError);
+        return true;
+    }
+    // A request handed out at its HEADERS only has to learn that the body ended
+    if (stream.request_stream) {
+        stream.request_stream->finish();
+        return true;
+    }
+    hand_out(stream_id, stream, requests);
+    return true;
+}
+
+void Http2Connection::hand_out(uint32_t stream_id, Stream& stream, std::vector<Request>& requests) {
+    Request request;
+    request.stream_id = stream_id;
+    for (auto& field : stream.request_headers) {
+        if (field.first == ":method") {
+            request.method = std::move(field.second);
+        } else if (field.first == ":path") {
+            request.path = std::move(field.second);
+        } else if (field.first == ":authority") {
+            request.authority = std::move(field.second);
+        } else if (field.first[0] != ':') {
+            request.headers.push_back(std::move(field));
+        }
+    }
+    HeaderList().swap(stream.request_headers);
+    if (stream.request_stream) {
+        request.body_stream = stream.request_stream;
+    } else {
+        request.body = std::move(stream.request_body);
+        release_body(stream);
+    }
+    requests.push_back(std::move(request));
+}
+
+bool Http2Connection::handle_window_update(uint32_t stream_id, const uint8_t* payload, size_t length) {
+    if (length != 4) {
+        return connection_error(FrameSizeError);
+    }
+    uint32_t increment = read_uint32(payload) & 0x7FFFFFFF;
+    if (stream_id == 0) {
+        if (increment == 0) {
+            return connection_error(ProtocolError);
+        }
+        connection_send_window += increment;
+        return connection_send_window <= MAX_WINDOW || connection_error(FlowControlError);
+    }
+
+    if (stream_id > last_stream_id) {
+        return connection_error(ProtocolError);
+    }
+    auto it = streams.find(stream_id);
+    if (it == streams.end()) {
+        return true;
+    }
+    if (increment == 0) {
+        reset_stream(stream_id, ProtocolError);
+        return true;
+    }
+    it->second.send_window += increment;
+    if (it->second.send_window > MAX_WINDOW) {
+        reset_stream(stream_id, FlowControlError);
+    }
+    return true;
+}
+
+Http2Connection::PriorityNode& Http2Connection::priority_node(uint32_t stream_id) {
+    auto it = priorities.find(stream_id);
+    if (it != priorities.end()) {
+        return it->second;
+    }
+    priorities[0].children.insert(stream_id);
+    return priorities.emplace(stream_id, PriorityNode{0, DEFAULT_WEIGHT, {}, virtual_time}).first->second;
+}
+
+// Follows RFC 7540 section 5.3.3: a stream made to depend on its own descendant first
+// swaps places with it, and an exclusive dependency adopts the new parent's children
+void Http2Connection::set_priority(uint32_t stream_id, uint32_t parent, uint16_t weight, bool exclusive) {
+    PriorityNode& node = priority_node(stream_id);
+
+    // A parent outside the tree means default priority
+    if (parent != 0 && !priorities.count(parent)) {
+        parent = 0;
+        weight = DEFAULT_WEIGHT;
+        exclusive = false;
+    }
+
+    for (uint32_t ancestor = parent; ancestor != 0; ancestor = priorities[ancestor].parent) {
+        if (ancestor == stream_id) {
+            PriorityNode& moved = priorities[parent];
+            priorities[moved.parent].children.erase(parent);
+            moved.parent = node.parent;
+            priorities[node.parent].children.insert(parent);
+            break;
+        }
+    }
+
+    priorities[node.parent].children.erase(stream_id);
+    PriorityNode& parent_node = priorities[parent];
+    if (exclusive) {
+        for (uint32_t child : parent_node.children) {
+            priorities[child].parent = stream_id;
+            node.children.insert(child);
+        }
+        parent_node.children.clear();
+    }
+    parent_node.children.insert(stream_id);
+    node.parent = parent;
+    node.weight = weight;
+}
+
+void Http2Connection::retire_node(uint32_t stream_id) {
+    retired_nodes.push_back(stream_id);
+    if (retired_nodes.size() > RETIRED_NODES) {
+        remove_node(retired_nodes.front());
+        retired_nodes.erase(retired_nodes.begin());
+    }
+}
+
+// Dependants move up to the removed node's parent
+void Http2Connection::remove_node(uint32_t stream_id) {
+    auto it = priorities.find(stream_id);
+    if (it == priorities.end()) {
+        return;
+    }
+    uint32_t parent = it->second.parent;
+    for (uint32_t child : it->second.children) {
+        priorities[child].parent = parent;
+        priorities[parent].children.insert(child);
+    }
+    priorities[parent].children.erase(stream_id);
+    priorities.erase(it);
+}
+
+void Http2Connection::respond(uint32_t stream_id, HeaderList headers, std::shared_ptr<Http2Body> body) {
+    auto it = streams.find(stream_id);
+    if (it == streams.end() || it->second.responded) {
+        body->cancel();
+        return;
+    }
+    Stream& stream = it->second;
+    stream.responded = true;
+    stream.response_headers = std::move(headers);
+    stream.response_body = std::move(body);
+}
+
+// Encodes the response head, split into CONTINUATION frames past the peer's frame size.
+// True when it also ended the stream, for an empty body.
+bool Http2Connection::write_headers(std::string& out, uint32_t stream_id, Stream& stream) {
+    std::string block;
+    encoder.encode(stream.response_headers, block);
+    HeaderList().swap(stream.response_headers);
+    stream.headers_sent = true;
+    priority_node(stream_id).pass = std::max(priority_node(stream_id).pass, virtual_time);
+
+    bool finished;
+    bool empty = stream.response_body->available(finished) == 0 && finished;
+    size_t offset = 0;
+    do {
+        size_t length = std::min<size_t>(block.size() - offset, peer_max_frame_size);
+        uint8_t flags = offset + length == block.size() ? FLAG_END_HEADERS : 0;
+        if (offset == 0) {
+            append_frame(out, Headers, flags | (empty ? FLAG_END_STREAM : 0), stream_id,
+                         std::string_view(block).substr(offset, length));
+        } else {
+            append_frame(out, Continuation, flags, stream_id, std::string_view(block).substr(offset, length));
+        }
+        offset += length;
+    } while (offset < block.size());
+    return empty;
+}
+
+// The ready stream with the earliest pass among those none of whose ancestors is ready
+uint32_t Http2Connection::next_data_stream(const std::set<uint32_t>& ready) {
+    uint32_t chosen = 0;
+    uint64_t chosen_pass = 0;
+    for (uint32_t stream_id : ready) {
+        const PriorityNode& node = priorities[stream_id];
+        bool blocked = false;
+        for (uint32_t ancestor = node.parent; ancestor != 0 && !blocked; ancestor = priorities[ancestor].parent) {
+            blocked = ready.count(ancestor) != 0;
+        }
+        uint64_t pass = std::max(node.pass, virtual_time);
+        if (!blocked && (chosen == 0 || pass < chosen_pass)) {
+            chosen = stream_id;
+            chosen_pass = pass;
+        }
+    }
+    return chosen;
+}
+
+bool Http2Connection::write(std::string& out, size_t budget) {
+    // What handlers read of streamed bodies frees its room, and the window for it
+    for (auto& entry : streams) {
+        Stream& stream = entry.second;
+        size_t consumed = stream.request_stream ? stream.request_stream->take_consumed() : 0;
+        if (consumed > 0) {
+            consumed = std::min(consumed, stream.held);
+            stream.held -= consumed;
+            buffered -= consumed;
+            if (!stream.request_done) {
+                acknowledge_data(stream, entry.first, consumed);
+            }
+        }
+    }
+    acknowledge_connection();
+
+    size_t start = out.size();
+    out += control;
+    control.clear();
+
+    // Heads are not flow controlled and go out as soon as the responses arrive. A body its
+    // writer gave up on ends the stream, as it would never finish.
+    for (auto it = streams.begin(); it != streams.end();) {
+        auto current = it++;
+        Stream& stream = current->second;
+        if (stream.responded && stream.response_body->was_cancelled()) {
+            reset_stream(current->first, Cancel);
+        } else if (stream.responded && !stream.headers_sent && write_headers(out, current->first, stream)) {
+            end_stream_sent(current);
+        }
+    }
+
+    size_t data_written = 0;
+    while (data_written < budget) {
+        std::set<uint32_t> ready;
+        for (auto& entry : streams) {
+            Stream& stream = entry.second;
+            if (!stream.headers_sent) {
+                continue;
+            }
+            bool finished;
+            size_t available = stream.response_body->available(finished);
+            if ((available > 0 && stream.send_window > 0 && connection_send_window > 0) || (available == 0 && finished)) {
+                ready.insert(entry.first);
+            }
+        }
+        if (ready.empty()) {
+            break;
+        }
+
+        uint32_t stream_id = next_data_stream(ready);
+        auto it = streams.find(stream_id);
+        Stream& stream = it->second;
+        int64_t allowed = std::min<int64_t>({static_cast<int64_t>(peer_max_frame_size), stream.send_window,
+                                             connection_send_window});
+        std::string payload;
+        bool finished;
+        size_t length = stream.response_body->read(payload, static_cast<size_t>(std::max<int64_t>(allowed, 0)), finished);
+        append_frame(out, Data, finished ? FLAG_END_STREAM : 0, stream_id, payload);
+
+        stream.send_window -= length;
+        connection_send_window -= length;
+        data_written += length + FRAME_HEADER_SIZE;
+        stream.stalled_since = std::chrono::steady_clock::time_point();
+
+        // Stride scheduling: each byte costs a stream time in inverse proportion to its weight
+        PriorityNode& node = priorities[stream_id];
+        node.pass = std::max(node.pass, virtual_time);
+        virtual_time = node.pass;
+        node.pass += (length + FRAME_HEADER_SIZE) * 256 / node.weight;
+
+        if (finished) {
+            end_stream_sent(it);
+        }
+    }
+
+    // Resets from streams that ended early above
+    out += control;
+    control.clear();
+    return out.size() > start;
+}
+
+void Http2Connection::expire(std::chrono::steady_clock::time_point now) {
+    if (failed) {
+        return;
+    }
+    if (continuation_stream && now >= continuation_deadline) {
+        connection_error(ProtocolError);
+        return;
+    }
+
+    for (auto it = streams.begin(); it != streams.end();) {
+        auto current = it++;
+        uint32_t stream_id = current->first;
+        Stream& stream = current->second;
+        // A client has no way to send while the handler leaves its window shut
+        if (!stream.request_done && stream.receive_window <= 0) {
+            stream.deadline = std::max(stream.deadline, now + settings.body_timeout);
+        }
+        if (!stream.request_done && now >= stream.deadline) {
+            // Once answered, as when its body was refused, a request that stalls is only reset
+            if (stream.responded) {
+                reset_stream(stream_id, Cancel);
+            } else {
+                if (stream.request_stream) {
+                    stream.request_stream->cancel();
+                }
+                release_body(stream);
+                stream.deadline = std::chrono::steady_clock::time_point::max();
+                respond(stream_id, HeaderList{{":status", "408"}, {"content-length", "0"}},
+                        std::make_shared<Http2Body>(""));
+            }
+            continue;
+        }
+
+        bool finished;
+        bool blocked = stream.headers_sent && stream.response_body->available(finished) > 0 &&
+                       (stream.send_window <= 0 || connection_send_window <= 0);
+        if (!blocked) {
+            stream.stalled_since = std::chrono::steady_clock::time_point();
+        } else if (stream.stalled_since == std::chrono::steady_clock::time_point()) {
+            stream.stalled_since = now;
+        } else if (now - stream.stalled_since >= settings.send_timeout) {
+            reset_stream(stream_id, Cancel);
+        }
+    }
+}
+
+void Http2Connection::go_away() {
+    if (!goaway_sent) {
+        std::string payload;
+        append_uint32(payload, last_stream_id);
+        append_uint32(payload, NoError);
+        append_frame(control, GoAway, 0, 0, payload);
+        goaway_sent = true;
+    }
+}
+
+void Http2Connection::abandon() {
+    for (auto& entry : streams) {
+        if (entry.second.response_body) {
+            entry.second.response_body->cancel();
+        }
+        if (entry.second.request_stream) {
+            entry.second.request_stream->cancel();
+        }
+    }
+}
+
+bool Http2Connection::finished() const {
+    return failed || ((goaway_sent || goaway_received) && streams.empty());
+}
@@ -1,124 +1,497 @@
 #include "../include/http_server.h"
+#include "../include/json_util.h"
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <signal.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
 #include <algorithm>
 #include <filesystem>
 #include <regex>
 
-// DataStore implementation
-std::string DataStore::create(const std::string& collection, const std::map<std::string, std::string>& item) {
-    std::lock_guard<std::mutex> lock(data_mutex);
-    std::string id = std::to_string(next_id++);
-    
-    std::map<std::string, std::string> new_item = item;
-    new_item["id"] = id;
-    data[collection][id] = new_item;
-    
-    return id;
+// Bytes a request read asks for at a time: a whole TLS record, so OpenSSL never keeps
+// decrypted input back where epoll cannot see it
+static const size_t REQUEST_READ_SIZE = 16 * 1024;
+
+// Most request bytes a shed connection discards before it is closed
+static const size_t SHED_DRAIN_LIMIT = 64 * 1024;
+
+// Most expired records one sweep deletes, so it never holds the store lock for long
+static const size_t EXPIRY_SWEEP_BUDGET = 1024;
+
+// Times stop() resumes the handlers still suspended before destroying the rest
+static const size_t SHUTDOWN_RESUME_ROUNDS = 8;
+
+// An event stream with nothing to send gets a comment this often, so dead peers are noticed
+static const auto EVENT_STREAM_HEARTBEAT = std::chrono::seconds(15);
+
+// Output the event loop buffers for a client that reads too slowly before dropping it
+static const size_t MAX_STREAM_BACKLOG = 1 << 20;
+
+// Largest WebSocket message accepted, across all of its fragments
+static const size_t MAX_WEBSOCKET_MESSAGE = 16 << 20;
+
+// Bytes a WebSocket read asks for at a time
+static const size_t WEBSOCKET_READ_SIZE = 16 * 1024;
+
+// A WebSocket that sends nothing this long is pinged, and dropped if the ping goes unanswered as long
+static const auto WEBSOCKET_PING_INTERVAL = std::chrono::seconds(30);
+
+// Time the client gets to answer a close frame
+static const auto WEBSOCKET_CLOSE_TIMEOUT = std::chrono::seconds(5);
+
+// Changes a watcher is sent per poll of the feed
+static const size_t CHANGE_EVENTS_PER_POLL = 256;
+
+// Streams an HTTP/2 connection may have open at once unless configured otherwise
+static const uint32_t DEFAULT_HTTP2_STREAMS = 256;
+
+// Response data framed per write on an HTTP/2 connection; kept small so priorities decide what goes next
+static const size_t HTTP2_WRITE_BUDGET = 256 * 1024;
+
+// Bytes a streamed HTTP/2 response buffers before its handler waits for the client
+static const size_t HTTP2_STREAM_BUFFER = 256 * 1024;
+
+// Piece of a file read at a time for an HTTP/2 response
+static const size_t HTTP2_FILE_CHUNK = 64 * 1024;
+
+// A handler waiting on a slow HTTP/2 client wakes this often to check for shutdown
+static const auto HTTP2_WRITE_SLICE = std::chrono::milliseconds(100);
+
+static const std::string& find_header(const HttpRequest& request, HttpHeader name) {
+    return request.known_headers[static_cast<size_t>(name)];
 }
 
-std::map<std::string, std::string> DataStore::read(const std::string& collection, const std::string& id) {
-    std::lock_guard<std::mutex> lock(data_mutex);
-    
-    if (data.find(collection) != data.end() && data[collection].find(id) != data[collection].end()) {
-        return data[collection][id];
+// Header names are case-insensitive
+static std::string find_header(const HttpRequest& request, const std::string& name) {
+    HttpHeader known = parse_header_name(name);
+    if (known != HttpHeader::Unknown) {
+        return find_header(request, known);
     }
-    
-    return std::map<std::string, std::string>();
+    for (const auto& header : request.headers) {
+        if (strcasecmp(header.first.c_str(), name.c_str()) == 0) {
+            return header.second;
+        }
+    }
+    return "";
 }
 
-std::vector<std::map<std::string, std::string>> DataStore::read_all(const std::string& collection) {
-    std::lock_guard<std::mutex> lock(data_mutex);
-    std::vector<std::map<std::string, std::string>> result;
-    
-    if (data.find(collection) != data.end()) {
-        for (const auto& pair : data[collection]) {
-            result.push_back(pair.second);
+// A streamed body goes to an HTTP/1.0 client without chunked encoding
+static void fit_response_to_version(const HttpRequest& request, HttpResponse& response) {
+    response.close_delimited = response.stream_body && request.version == "HTTP/1.0";
+}
+
+// Fills in `known_headers` once `headers` is complete. A name sent in several spellings
+// gets one list of all their values, as the lines of a single spelling do.
+static void index_headers(HttpRequest& request) {
+    for (const auto& header : request.headers) {
+        HttpHeader known = parse_header_name(header.first);
+        if (known != HttpHeader::Unknown) {
+            std::string& value = request.known_headers[static_cast<size_t>(known)];
+            value = value.empty() ? header.second : value + ", " + header.second;
         }
     }
-    
-    return result;
 }
 
-bool DataStore::update(const std::string& collection, const std::string& id, const std::map<std::string, std::string>& item) {
-    std::lock_guard<std::mutex> lock(data_mutex);
-    
-    if (data.find(collection) != data.end() && data[collection].find(id) != data[collection].end()) {
-        std::map<std::string, std::string> updated_item = item;
-        updated_item["id"] = id;
-        data[collection][id] = updated_item;
+// Only plain digits that fit a size_t; a sign, a list of lengths or trailing text
+// makes the request invalid rather than being read as some length
+static bool parse_content_length(const std::string& text, size_t& length) {
+    if (text.empty()) {
+        return false;
+    }
+    length = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        size_t digit = static_cast<size_t>(c - '0');
+        if (length > (SIZE_MAX - digit) / 10) {
+            return false;
+        }
+        length = length * 10 + digit;
+    }
+    return true;
+}
+
+// The body ends where the chunks do only when chunked is the last coding applied
+static bool chunked_is_last(std::string codings) {
+    std::transform(codings.begin(), codings.end(), codings.begin(), ::tolower);
+    size_t comma = codings.rfind(',');
+    std::string last = comma == std::string::npos ? codings : codings.substr(comma + 1);
+    last.erase(0, last.find_first_not_of(" \t"));
+    last.erase(last.find_last_not_of(" \t") + 1);
+    return last == "chunked";
+}
+
+// Record versions travel as strong entity tags: the version number in quotes
+static std::string format_etag(uint64_t version) {
+    return "\"" + std::to_string(version) + "\"";
+}
+
+// Accepts a bare version number or an entity tag; weak tags never match for writes
+static bool parse_version(std::string text, uint64_t& version) {
+    if (text.size() >= 2 && text.front() == '"' && text.back() == '"') {
+        text = text.substr(1, text.size() - 2);
+    }
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    version = std::strtoull(text.c_str(), nullptr, 10);
+    return version != 0;
+}
+
+// Returns false when the request has no If-Match. Otherwise `expected_versions` lists the
+// versions the write may find: none for "*", which only requires the record to exist, and
+// a value no record can have when none of the tags is one of ours.
+static bool parse_if_match(const HttpRequest& request, std::vector<uint64_t>& expected_versions) {
+    const std::string& value = find_header(request, HttpHeader::IfMatch);
+    if (value.find_first_not_of(" \t") == std::string::npos) {
+        return false;
+    }
+
+    // A comma-separated list of tags; commas inside a quoted tag do not split it
+    expected_versions.clear();
+    bool quoted = false;
+    size_t start = 0;
+    for (size_t i = 0; i <= value.size(); ++i) {
+        if (i < value.size() && value[i] == '"') {
+            quoted = !quoted;
+        }
+        if (i < value.size() && (value[i] != ',' || quoted)) {
+            continue;
+        }
+        std::string tag = value.substr(start, i - start);
+        start = i + 1;
+        size_t first = tag.find_first_not_of(" \t");
+        if (first == std::string::npos) {
+            continue;
+        }
+        tag = tag.substr(first, tag.find_last_not_of(" \t") - first + 1);
+        uint64_t version;
+        if (tag == "*") {
+            expected_versions.clear();
+            return true;
+        } else if (parse_version(tag, version)) {
+            expected_versions.push_back(version);
+        }
+    }
+    if (expected_versions.empty()) {
+        expected_versions.push_back(UINT64_MAX);
+    }
+    return true;
+}
+
+// Time-to-live in whole seconds, as given by ?ttl= or a batch operation's "ttl"
+static bool parse_ttl(const std::string& text, std::chrono::milliseconds& ttl) {
+    if (text.empty() || text.size() > 9 || text.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    ttl = std::chrono::seconds(std::strtoul(text.c_str(), nullptr, 10));
+    return true;
+}
+
+static bool parse_ttl_param(const HttpRequest& request, std::chrono::milliseconds& ttl) {
+    auto it = request.query_params.find("ttl");
+    return it == request.query_params.end() || parse_ttl(it->second, ttl);
+}
+
+// Field names given by ?fields=a,b; an empty list means every field
+static bool parse_fields_param(const HttpRequest& request, std::vector<std::string>& fields) {
+    auto it = request.query_params.find("fields");
+    if (it == request.query_params.end()) {
         return true;
     }
-    
-    return false;
+    std::stringstream list(it->second);
+    std::string field;
+    while (std::getline(list, field, ',')) {
+        if (!field.empty()) {
+            fields.push_back(field);
+        }
+    }
+    return !fields.empty();
 }
 
-bool DataStore::remove(const std::string& collection, const std::string& id) {
-    std::lock_guard<std::mutex> lock(data_mutex);
-    
-    if (data.find(collection) != data.end() && data[collection].find(id) != data[collection].end()) {
-        data[collection].erase(id);
+// Result count for ?limit=, between 1 and `max_limit`
+static bool parse_limit_param(const HttpRequest& request, size_t default_limit, size_t max_limit, size_t& limit) {
+    auto it = request.query_params.find("limit");
+    if (it == request.query_params.end()) {
+        limit = default_limit;
         return true;
     }
-    
-    return false;
+    const std::string& text = it->second;
+    if (text.empty() || text.size() > 9 || text.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    limit = std::strtoul(text.c_str(), nullptr, 10);
+    return limit >= 1 && limit <= max_limit;
+}
+
+// Reductions asked for by ?metrics=, e.g. "count,sum:price,max:price"
+struct AggregateMetric {
+    std::string op;         // count, sum, avg, min or max
+    std::string field;      // Empty for count
+};
+
+static bool parse_metrics(const std::string& text, std::vector<AggregateMetric>& metrics) {
+    std::stringstream list(text);
+    std::string entry;
+    while (std::getline(list, entry, ',')) {
+        AggregateMetric metric;
+        size_t colon = entry.find(':');
+        metric.op = entry.substr(0, colon);
+        if (colon != std::string::npos) {
+            metric.field = entry.substr(colon + 1);
+        }
+        bool numeric = metric.op == "sum" || metric.op == "avg" || metric.op == "min" || metric.op == "max";
+        if (metric.op == "count" ? colon != std::string::npos : !numeric || metric.field.empty()) {
+            return false;
+        }
+        metrics.push_back(metric);
+    }
+    return !metrics.empty();
+}
+
+// Equality filters given by ?where=, e.g. "category:books,year:2020"
+static bool parse_filters(const std::string& text, std::vector<Aggregator::Filter>& filters) {
+    std::stringstream list(text);
+    std::string entry;
+    while (std::getline(list, entry, ',')) {
+        size_t colon = entry.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            return false;
+        }
+        filters.push_back(Aggregator::Filter{entry.substr(0, colon), entry.substr(colon + 1)});
+    }
+    return !filters.empty();
+}
+
+static std::string format_number(double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.15g", value);
+    return buffer;
+}
+
+// {"count":N,"price":{"sum":...}} with the requested metrics of one group
+static std::string aggregate_group_json(const Aggregator::Group& group, const std::vector<AggregateMetric>& metrics,
+                                        const std::vector<std::string>& fields) {
+    std::string json = "\"count\":" + std::to_string(group.count);
+    for (size_t f = 0; f < fields.size(); ++f) {
+        const Aggregator::FieldSummary& summary = group.fields[f];
+        json += ",\"" + json_escape(fields[f]) + "\":{";
+        bool first = true;
+        for (const auto& metric : metrics) {
+            if (metric.field != fields[f]) continue;
+            if (!first) json += ",";
+            first = false;
+            json += "\"" + metric.op + "\":";
+            if (metric.op == "sum") {
+                json += format_number(summary.sum);
+            } else if (summary.count == 0) {
+                json += "null";
+            } else if (metric.op == "avg") {
+                json += format_number(summary.sum / summary.count);
+            } else {
+                json += format_number(metric.op == "min" ? summary.min : summary.max);
+            }
+        }
+        json += "}";
+    }
+    return json;
 }
 
 // HttpServer implementation
-HttpServer::HttpServer(int port) : port(port), server_socket(-1), running(false) {}
+HttpServer::HttpServer(int port)
+    : port(port), server_socket(-1), running(false), stop_requested(false), inline_routes(0), inline_served(0), expiring(false),
+      epoll_fd(-1), wake_fd(-1), accept_paused(false), next_home_worker(0),
+      http2_max_streams(DEFAULT_HTTP2_STREAMS) {
+    // Any change to a collection drops the cached listings and items under it and wakes its watchers
+    data_store.set_mutation_listener([this](const std::string& collection) {
+        if (response_cache) {
+            response_cache->invalidate("/api/data/" + collection);
+        }
+        signal_event_channel("/api/data/" + collection);
+    });
+}
 
 HttpServer::~HttpServer() {
     stop();
+    
+    if (epoll_fd != -1) close(epoll_fd);
+    if (wake_fd != -1) close(wake_fd);
 }
 
-void HttpServer::add_route(const std::string& method, const std::string& path, RouteHandler handler) {
-    routes[method][path] = handler;
+void HttpServer::add_route(const std::string& method, const std::string& path, RouteHandler handler,
+                           const RouteOptions& options) {
+    routes[method][path] = RouteEntry{HandlerRef<const HttpRequest&, HttpResponse&>::owning(std::move(handler)),
+                                      nullptr, options};
+    index_dynamic_routes();
 }
 
-void HttpServer::setup_default_routes() {
-    // CRUD routes
-    add_route("POST", "/api/data/{collection}", [this](const HttpRequest& req, HttpResponse& res) {
-        handle_crud_create(req, res);
-    });
-    
-    add_route("GET", "/api/data/{collection}/{id}", [this](const HttpRequest& req, HttpResponse& res) {
-        handle_crud_read(req, res);
-    });
-    
-    add_route("GET", "/api/data/{collection}", [this](const HttpRequest& req, HttpResponse& res) {
-        handle_crud_read_all(req, res);
-    });
-    
-    add_route("PUT", "/api/data/{collection}/{id}", [this](const HttpRequest& req, HttpResponse& res) {
-        handle_crud_update(req, res);
-    });
-    
-    add_route("DELETE", "/api/data/{collection}/{id}", [this](const HttpRequest& req, HttpResponse& res) {
-        handle_crud_delete(req, res);
-    });
-    
-    // File upload/download routes
-    add_route("POST", "/api/files/upload", [this](const HttpRequest& req, HttpResponse& res) {
-        handle_file_upload(req, res);
-    });
-    
-    add_route("GET", "/api/files/download/{filename}", [this](const HttpRequest& req, HttpResponse& res) {
-        handle_file_download(req, res);
-    });
+void HttpServer::add_async_route(const std::string& method, const std::string& path, AsyncRouteHandler handler,
+                                 const RouteOptions& options) {
+    routes[method][path] = RouteEntry{{}, handler, options};
+    index_dynamic_routes();
+}
+
+void HttpServer::set_connection_limits(const ConnectionLimits& new_limits) {
+    limits = new_limits;
+}
+
+void HttpServer::set_admission_config(const AdmissionConfig& config) {
+    admission = config;
+}
+
+void HttpServer::enable_response_cache(size_t max_bytes) {
+    response_cache.reset(new ResponseCache(max_bytes));
+}
+
+void HttpServer::set_memory_budget(const DataStore::MemoryBudget& budget) {
+    data_store.set_memory_budget(budget);
+}
+
+void HttpServer::enable_search(const std::string& collection) {
+    data_store.enable_search(collection);
+}
+
+void HttpServer::enable_columns(const std::string& collection, const std::vector<std::string>& fields) {
+    data_store.enable_columns(collection, fields);
+}
+
+void HttpServer::set_change_feed_capacity(size_t capacity) {
+    data_store.set_change_feed_capacity(capacity);
+}
+
+void HttpServer::set_http2_max_streams(uint32_t streams) {
+    http2_max_streams = streams;
+}
+
+bool HttpServer::enable_tls(const TlsConfig& config, std::string& error) {
+    TlsConfig applied = config;
+    applied.http2 = config.http2 && http2_max_streams > 0;
+    tls = TlsContext::create(applied, error);
+    return tls != nullptr;
+}
+
+// RouteOptions of a built-in route, in a form usable as a template argument
+struct BuiltinRouteFlags {
+    bool cacheable = false;
+    bool stream_body = false;
+    RouteOptions::Execution execution = RouteOptions::Execution::Worker;
+};
+
+// The built-in routes. Their patterns are parsed and their matching unrolled at compile
+// time, and each handler is called straight through a thunk for its member function.
+// More specific patterns come first, as the first match wins.
+struct HttpServer::BuiltinRoutes {
+    using Execution = RouteOptions::Execution;
+    using Flags = BuiltinRouteFlags;
+    
+    static constexpr Flags cacheable{true};
+    // Single reads are a lookup and a short serialisation, cheaper than a hand-off to a worker
+    static constexpr Flags cacheable_inline{true, false, Execution::Inline};
+    // Bodies streamed in and files streamed out take as long as the client does
+    static constexpr Flags blocking{false, false, Execution::Blocking};
+    static constexpr Flags streaming{false, true, Execution::Blocking};
+    
+    template <FixedString Method, FixedString Pattern, auto Handler, Flags Options = Flags()>
+    struct Route : StaticRoutePattern<Method, Pattern> {
+        static void invoke(void* server, const HttpRequest& request, HttpResponse& response) {
+            (static_cast<HttpServer*>(server)->*Handler)(request, response);
+        }
+        
+        static RouteEntry entry(HttpServer& server) {
+            RouteOptions options;
+            options.cacheable = Options.cacheable;
+            options.stream_body = Options.stream_body;
+            options.execution = Options.execution;
+            if constexpr (std::is_same_v<decltype((server.*Handler)(std::declval<const HttpRequest&>(),
+                                                                    std::declval<HttpResponse&>())),
+                                         Task<void>>) {
+                return RouteEntry{{}, [&server](const HttpRequest& request, HttpResponse& response) {
+                    return (server.*Handler)(request, response);
+                }, options};
+            } else {
+                return RouteEntry{{&invoke, &server}, nullptr, options};
+            }
+        }
+    };
+    
+    using Table = RouteTable<
+        // CRUD routes
+        Route<"POST", "/api/data/{collection}/_batch", &HttpServer::handle_crud_batch>,
+        Route<"POST", "/api/data/{collection}/_import", &HttpServer::handle_crud_import, streaming>,
+        Route<"POST", "/api/data/{collection}", &HttpServer::handle_crud_create>,
+        Route<"GET", "/api/data/{collection}/_search", &HttpServer::handle_crud_search, cacheable>,
+        Route<"GET", "/api/data/{collection}/_aggregate", &HttpServer::handle_crud_aggregate, cacheable>,
+        Route<"GET", "/api/data/{collection}/_changes", &HttpServer::handle_crud_changes>,
+        Route<"GET", "/api/data/{collection}/{id}", &HttpServer::handle_crud_read, cacheable_inline>,
+        Route<"GET", "/api/data/{collection}", &HttpServer::handle_crud_read_all, cacheable>,
+        Route<"PUT", "/api/data/{collection}/{id}", &HttpServer::handle_crud_update>,
+        Route<"PATCH", "/api/data/{collection}/{id}", &HttpServer::handle_crud_patch>,
+        Route<"DELETE", "/api/data/{collection}/{id}", &HttpServer::handle_crud_delete>,
+        
+        // File upload/download routes
+        Route<"POST", "/api/files/upload", &HttpServer::handle_file_upload>,
+        Route<"GET", "/api/files/download/{filename}", &HttpServer::handle_file_download, blocking>,
+        Route<"GET", "/api/files", &HttpServer::handle_file_list, cacheable>,
+        Route<"GET", "/api/stats", &HttpServer::handle_stats>,
+        
+        // Static file route for client
+        Route<"GET", "/", &HttpServer::handle_client_page>>;
     
-    add_route("GET", "/api/files", [this](const HttpRequest& req, HttpResponse& res) {
-        handle_file_list(req, res);
-    });
+    template <typename... Routes>
+    static std::vector<RouteEntry> entries(HttpServer& server, RouteTable<Routes...>*) {
+        return {Routes::entry(server)...};
+    }
+};
+
+// Also counts the inline routes, so replacing a route never counts it twice
+void HttpServer::index_dynamic_routes() {
+    dynamic_routes.clear();
+    builtin_overrides.assign(builtin_routes.size(), nullptr);
+    for (const auto& method_routes : routes) {
+        for (const auto& route : method_routes.second) {
+            int builtin = BuiltinRoutes::Table::find_declared(method_routes.first, route.first);
+            if (builtin >= 0 && static_cast<size_t>(builtin) < builtin_overrides.size()) {
+                builtin_overrides[builtin] = &route.second;
+                continue;
+            }
+            RoutePattern pattern = parse_route_pattern(route.first);
+            if (!pattern.valid) {
+                std::cerr << "Ignoring malformed route pattern: " << route.first << std::endl;
+                continue;
+            }
+            dynamic_routes.push_back(DynamicRoute{method_routes.first, parse_method(method_routes.first), pattern,
+                                                 &route.second});
+        }
+    }
     
-    // Static file route for client
-    add_route("GET", "/", [this](const HttpRequest& req, HttpResponse& res) {
-        handle_client_page(req, res);
-    });
+    inline_routes = 0;
+    for (size_t i = 0; i < builtin_routes.size(); ++i) {
+        const RouteEntry& entry = builtin_overrides[i] ? *builtin_overrides[i] : builtin_routes[i];
+        inline_routes += entry.options.execution == RouteOptions::Execution::Inline;
+    }
+    for (const DynamicRoute& route : dynamic_routes) {
+        inline_routes += route.entry->options.execution == RouteOptions::Execution::Inline;
+    }
+}
+
+void HttpServer::setup_default_routes() {
+    builtin_routes = BuiltinRoutes::entries(*this, static_cast<BuiltinRoutes::Table*>(nullptr));
+    index_dynamic_routes();
 }
 
 void HttpServer::start() {
@@ -142,145 +515,2324 @@ void HttpServer::start() {
         return;
     }
     
-    if (listen(server_socket, 10) == -1) {
+    if (listen(server_socket, SOMAXCONN) == -1) {
         std::cerr << "Failed to listen on socket" << std::endl;
         close(server_socket);
         return;
     }
     
+    // sendfile() and OpenSSL write to sockets without MSG_NOSIGNAL; a client that left
+    // has to fail the write with EPIPE rather than end the process
+    signal(SIGPIPE, SIG_IGN);
+    
     running = true;
-    std::cout << "HTTP Server started on port " << port << std::endl;
+    std::cout << "HTTP Server started on port " << port << (tls ? " (TLS)" : "") << std::endl;
     
     setup_default_routes();
     start_listening();
 }
 
 void HttpServer::stop() {
-    running = false;
+    if (!running.exchange(false)) {
+        return;
+    }
+    
+    if (wake_fd != -1) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
     
     if (server_socket != -1) {
         close(server_socket);
         server_socket = -1;
     }
     
+    // Unblock workers still reading or writing, then wait for them to finish
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        for (const auto& entry : connections) {
+            shutdown(entry.first, SHUT_RDWR);
+        }
+    }
+    if (scheduler) {
+        scheduler->stop();
+    }
     for (auto& thread : worker_threads) {
         if (thread.joinable()) {
             thread.join();
         }
     }
     worker_threads.clear();
+    
+    // Jobs already queued still run, since coroutines may be waiting on them
+    blocking_ready.notify_all();
+    for (auto& thread : blocking_threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    blocking_threads.clear();
+    if (scheduler) {
+        finish_coroutines();
+    }
+    
+    // Whatever is left is parked in the event loop
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    for (const auto& entry : connections) {
+        timers.cancel(entry.second->timer);
+        close(entry.first);
+    }
+    connections.clear();
+}
+
+void HttpServer::request_stop() {
+    stop_requested = true;
+    // A signal can arrive before the event loop exists, which then stops at its first turn
+    if (wake_fd != -1) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
 }
 
 void HttpServer::start_listening() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || wake_fd == -1) {
+        std::cerr << "Failed to create event loop" << std::endl;
+        return;
+    }
+    
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL, 0) | O_NONBLOCK);
+    
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = server_socket;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event);
+    event.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+    
+    codel.reset(new CoDelController(std::chrono::milliseconds(admission.target_delay_ms),
+                                    std::chrono::milliseconds(admission.interval_ms)));
+    size_t worker_count = admission.worker_count;
+    // Disk and other blocking work goes to the blocking pool and slow clients suspend their
+    // handler, so one worker per core keeps every core busy without the threads competing
+    if (worker_count == 0) {
+        worker_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    scheduler.reset(new WorkScheduler<QueuedConnection>(worker_count));
+    for (size_t i = 0; i < worker_count; ++i) {
+        worker_threads.emplace_back([this, i]() {
+            worker_loop(i);
+        });
+    }
+    for (size_t i = 0; i < std::max<size_t>(admission.blocking_count, 1); ++i) {
+        blocking_threads.emplace_back([this]() {
+            blocking_loop();
+        });
+    }
+    
+    const int tick_ms = static_cast<int>(timers.tick_duration().count());
+    epoll_event events[256];
+    
+    while (running && !stop_requested) {
+        int ready = epoll_wait(epoll_fd, events, 256, tick_ms);
+        if (ready == -1 && errno != EINTR) {
+            std::cerr << "Event loop failed: " << strerror(errno) << std::endl;
+            break;
+        }
+        
+        for (int i = 0; i < ready && running; ++i) {
+            int fd = events[i].data.fd;
+            
+            if (fd == server_socket) {
+                accept_connections();
+            } else if (fd == wake_fd) {
+                uint64_t value;
+                ssize_t ignored = read(wake_fd, &value, sizeof(value));
+                (void)ignored;
+            } else if (event_streams.count(fd)) {
+                handle_event_stream_io(fd, events[i].events);
+            } else if (websockets.count(fd)) {
+                handle_websocket_io(fd, events[i].events);
+            } else if (http2_sessions.count(fd)) {
+                handle_http2_io(fd, events[i].events);
+            } else {
+                std::shared_ptr<Connection> conn;
+                std::coroutine_handle<> waiting;
+                {
+                    std::lock_guard<std::mutex> lock(connections_mutex);
+                    auto it = connections.find(fd);
+                    if (it != connections.end()) {
+                        conn = it->second;
+                        waiting = std::exchange(conn->awaiting, nullptr);
+                    }
+                }
+                // A coroutine handler waiting on the socket goes on where it stopped
+                if (waiting) {
+                    resume_on_worker(waiting, conn->home_worker);
+                } else if (conn && !(inline_routes && serve_inline(conn))) {
+                    dispatch_connection(conn);
+                }
+            }
+        }
+        
+        // Expired timers shut their socket down, which wakes whoever owns it
+        auto now = std::chrono::steady_clock::now();
+        timers.advance(now);
+        // Deleting can write to the spill store and indexes, which the event loop must not
+        // wait for, so sweeps go to the blocking pool, one at a time
+        if (!expiring && data_store.expiry_due(now)) {
+            expiring = true;
+            queue_blocking([this]() {
+                data_store.expire_due(std::chrono::steady_clock::now(), EXPIRY_SWEEP_BUDGET);
+                expiring = false;
+            });
+        }
+        run_streams(now);
+        update_accept_state();
+    }
+}
+
+void HttpServer::accept_connections() {
     while (running) {
         sockaddr_in client_addr{};
         socklen_t client_len = sizeof(client_addr);
         
-        int client_socket = accept(server_socket, (sockaddr*)&client_addr, &client_len);
+        int client_socket = accept4(server_socket, (sockaddr*)&client_addr, &client_len, SOCK_CLOEXEC);
         if (client_socket == -1) {
-            if (running) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && running) {
                 std::cerr << "Failed to accept client connection" << std::endl;
             }
-            continue;
+            return;
         }
         
-        worker_threads.emplace_back([this, client_socket]() {
-            handle_client(client_socket);
-        });
+        auto conn = std::make_shared<Connection>(client_socket);
+        conn->home_worker = next_home_worker++ % scheduler->worker_count();
+        if (tls) {
+            // OpenSSL must never block the event loop; workers wait for the socket themselves
+            fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL, 0) | O_NONBLOCK);
+            conn->tls = tls->accept(client_socket);
+            if (!conn->tls) {
+                close(client_socket);
+                continue;
+            }
+        }
+        Connection* raw_conn = conn.get();
+        conn->timer.callback = [raw_conn]() {
+            raw_conn->timed_out = true;
+            // Keep the write side open so a 408 can still be sent, unless the write itself stalled
+            shutdown(raw_conn->socket, raw_conn->phase == Connection::Phase::Write ? SHUT_RDWR : SHUT_RD);
+        };
+        
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            connections[client_socket] = conn;
+        }
+        
+        // The header deadline starts at accept, so connecting and sending nothing still times out
+        arm_timer(*conn, Connection::Phase::Header, limits.header_timeout_ms);
+        
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.fd = client_socket;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+            close_connection(conn);
+        }
     }
 }
 
-void HttpServer::handle_client(int client_socket) {
-    std::string request_str;
-    char buffer[8192];
-    ssize_t bytes_received;
+void HttpServer::dispatch_connection(const std::shared_ptr<Connection>& conn) {
+    scheduler->push(conn->home_worker, QueuedConnection{conn, std::chrono::steady_clock::now(), nullptr});
+}
+
+void HttpServer::update_accept_state() {
+    size_t queue_length = scheduler->size();
     
-    // Read the initial request
-    bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received <= 0) {
-        close(client_socket);
+    // Past the hard limit new connections wait in the kernel backlog instead of our queue
+    bool should_pause = accept_paused ? queue_length > admission.max_queue_length / 2
+                                      : queue_length >= admission.max_queue_length;
+    if (should_pause == accept_paused || server_socket == -1) {
         return;
     }
     
-    buffer[bytes_received] = '\0';
-    request_str = std::string(buffer);
-    
-    // Check if there's a Content-Length header to read more data
-    size_t content_length_pos = request_str.find("Content-Length:");
-    if (content_length_pos != std::string::npos) {
-        size_t line_end = request_str.find("\r\n", content_length_pos);
-        if (line_end != std::string::npos) {
-            std::string length_str = request_str.substr(content_length_pos + 15, line_end - content_length_pos - 15);
-            // Trim whitespace
-            length_str.erase(0, length_str.find_first_not_of(" \t"));
-            length_str.erase(length_str.find_last_not_of(" \t\r\n") + 1);
-            
-            size_t content_length;
-            try {
-                content_length = std::stoul(length_str);
-            } catch (const std::exception&) {
-                content_length = 0;
+    epoll_event event{};
+    event.events = should_pause ? 0u : static_cast<uint32_t>(EPOLLIN);
+    event.data.fd = server_socket;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, server_socket, &event) == 0) {
+        accept_paused = should_pause;
+    }
+}
+
+// Leaves signal handling to the main thread
+static void block_shutdown_signals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+}
+
+// The worker a thread runs as, so work it queues for itself stays on it; none off the pool
+static thread_local size_t current_worker = SIZE_MAX;
+
+// Set while an inline route runs on the event loop. A handler that would have to wait there,
+// on a lock or the disk, sets inline_declined instead of answering, and a worker takes the request.
+static thread_local bool serving_inline = false;
+static thread_local bool inline_declined = false;
+
+void HttpServer::worker_loop(size_t worker) {
+    block_shutdown_signals();
+    current_worker = worker;
+    
+    QueuedConnection item;
+    while (scheduler->pop(worker, item)) {
+        // Only new work is measured and may be shed. A handler resuming, or the rest of a
+        // response, may have waited on a client for long, which says nothing about the queue.
+        if (item.resumed) {
+            item.resumed.resume();
+            item = QueuedConnection();
+            continue;
+        }
+        bool shed = false;
+        if (!item.admitted) {
+            std::lock_guard<std::mutex> lock(codel_mutex);
+            // A queue that drained completely is not a standing queue, whatever this item waited
+            auto now = std::chrono::steady_clock::now();
+            auto sojourn = scheduler->size() == 0 ? std::chrono::steady_clock::duration::zero()
+                                                  : now - item.enqueued;
+            shed = codel->should_drop(sojourn, now);
+        }
+        
+        if (item.task) {
+            item.task(shed);
+        } else if (shed) {
+            shed_connection(item.conn);
+        } else {
+            handle_client(item.conn);
+        }
+        item = QueuedConnection();
+    }
+}
+
+void HttpServer::blocking_loop() {
+    block_shutdown_signals();
+    
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(blocking_mutex);
+            blocking_ready.wait(lock, [this]() { return !running || !blocking_jobs.empty(); });
+            // Stopping drains the queue first, so nobody waits on a job that never ran
+            if (blocking_jobs.empty()) {
+                return;
             }
-            
-            // Find where headers end
-            size_t header_end = request_str.find("\r\n\r\n");
-            if (header_end != std::string::npos) {
-                size_t headers_size = header_end + 4;
-                size_t body_received = request_str.length() - headers_size;
-                
-                // Read remaining body data if needed
-                while (body_received < content_length) {
-                    bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-                    if (bytes_received <= 0) break;
-                    
-                    buffer[bytes_received] = '\0';
-                    request_str += std::string(buffer);
-                    body_received += bytes_received;
+            job = std::move(blocking_jobs.front());
+            blocking_jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void HttpServer::queue_blocking(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(blocking_mutex);
+        blocking_jobs.push_back(std::move(job));
+    }
+    blocking_ready.notify_one();
+}
+
+void HttpServer::run_blocking(std::function<void()> work, std::coroutine_handle<> waiting) {
+    // The coroutine goes back to the worker it left
+    size_t worker = current_worker != SIZE_MAX ? current_worker : 0;
+    queue_blocking([this, work = std::move(work), waiting, worker]() {
+        work();
+        resume_on_worker(waiting, worker);
+    });
+}
+
+void HttpServer::resume_on_worker(std::coroutine_handle<> waiting, size_t worker) {
+    // The request was admitted when it started, so a resumption is never shed
+    scheduler->push(worker, QueuedConnection{nullptr, std::chrono::steady_clock::now(), nullptr, waiting});
+}
+
+// Handlers still suspended once both pools are gone are resumed on the stopping thread,
+// so they unwind and free what they hold. Their sockets are shut down, so whatever they
+// wait on next completes at once; the few still going after that are destroyed.
+void HttpServer::finish_coroutines() {
+    auto collect = [this]() {
+        std::vector<std::coroutine_handle<>> waiting;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            for (auto& entry : connections) {
+                if (entry.second->awaiting) {
+                    waiting.push_back(std::exchange(entry.second->awaiting, nullptr));
                 }
             }
         }
+        for (auto& item : scheduler->drain()) {
+            if (item.resumed) {
+                waiting.push_back(item.resumed);
+            }
+        }
+        return waiting;
+    };
+    
+    for (size_t round = 0; round < SHUTDOWN_RESUME_ROUNDS; ++round) {
+        std::deque<std::function<void()>> jobs;
+        {
+            std::lock_guard<std::mutex> lock(blocking_mutex);
+            jobs.swap(blocking_jobs);
+        }
+        for (auto& job : jobs) {
+            job();
+        }
+        
+        auto waiting = collect();
+        if (waiting.empty() && jobs.empty()) {
+            return;
+        }
+        for (auto handle : waiting) {
+            handle.resume();
+        }
+    }
+    
+    // Nothing may resume what is destroyed, so every reference to it goes first
+    collect();
+    {
+        std::lock_guard<std::mutex> lock(blocking_mutex);
+        blocking_jobs.clear();
+    }
+    handlers.destroy_suspended();
+}
+
+void HttpServer::await_socket(Connection& conn, uint32_t events, std::coroutine_handle<> waiting) {
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        conn.awaiting = waiting;
+    }
+    epoll_event event{};
+    event.events = events | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.fd = conn.socket;
+    if (!running || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.socket, &event) == -1) {
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            conn.awaiting = nullptr;
+        }
+        resume_on_worker(waiting, conn.home_worker);
+    }
+}
+
+void HttpServer::shed_connection(const std::shared_ptr<Connection>& conn) {
+    // Answer without reading or parsing the request so shedding stays cheap
+    HttpResponse response;
+    send_error_response(response, 503, "Service Unavailable");
+    response.headers["Retry-After"] = "1";
+    response.headers["Connection"] = "close";
+    
+    // A TLS client still in its handshake is dropped instead, which costs less than finishing it
+    if (!conn->tls || conn->tls->established()) {
+        std::string response_str = build_response(response);
+        conn->transmit(response_str.c_str(), response_str.length(), false);
+    }
+    
+    // Closing with the request still unread makes the kernel answer with a reset, which
+    // can destroy the 503 before the client reads it. The FIN goes out first, and what
+    // has already arrived is drained without waiting for more.
+    shutdown(conn->socket, SHUT_WR);
+    char discard[4096];
+    for (size_t drained = 0; drained < SHED_DRAIN_LIMIT;) {
+        ssize_t received = recv(conn->socket, discard, sizeof(discard), MSG_DONTWAIT);
+        if (received <= 0) {
+            break;
+        }
+        drained += received;
+    }
+    close_connection(conn);
+}
+
+void HttpServer::arm_timer(Connection& conn, Connection::Phase phase, int timeout_ms) {
+    conn.phase = phase;
+    timers.arm(conn.timer, std::chrono::milliseconds(timeout_ms));
+}
+
+void HttpServer::park_connection(const std::shared_ptr<Connection>& conn) {
+    arm_timer(*conn, Connection::Phase::Idle, limits.idle_timeout_ms);
+    
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.fd = conn->socket;
+    if (!running || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->socket, &event) == -1) {
+        close_connection(conn);
+    }
+}
+
+void HttpServer::close_connection(const std::shared_ptr<Connection>& conn) {
+    timers.cancel(conn->timer);
+    
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    auto it = connections.find(conn->socket);
+    if (it != connections.end() && it->second == conn) {
+        connections.erase(it);
+        if (conn->tls) {
+            conn->tls->close();
+        }
+        close(conn->socket);
+    }
+}
+
+void HttpServer::handle_client(std::shared_ptr<Connection> conn) {
+    // A connection stolen by another worker stays with it, where its state is now cached
+    conn->home_worker = current_worker;
+    
+    // A connection coming back from idle gets a fresh header deadline;
+    // a new one keeps the deadline armed at accept
+    if (conn->requests_served > 0) {
+        arm_timer(*conn, Connection::Phase::Header, limits.header_timeout_ms);
+    }
+    
+    while (true) {
+        size_t header_end = 0;
+        
+        // Read the request line and headers under the header deadline
+        ReadStatus status = read_request_head(*conn, header_end);
+        if (status != ReadStatus::Ok) {
+            send_read_error(conn, status, true);
+            return;
+        }
+        timers.cancel(conn->timer);
+        
+        // The head is parsed on its own so the route can decide how the body is read
+        HttpRequest request = parse_request(conn->buffer.substr(0, header_end + 4));
+        conn->buffer.erase(0, header_end + 4);
+        
+        // With prior knowledge the client opens with the HTTP/2 preface, whose first
+        // half reads as a request head; the connection is HTTP/2 from its first byte
+        if (http2_max_streams && request.method == "PRI" && request.path == "*" && request.version == "HTTP/2.0") {
+            conn->buffer.insert(0, Http2Connection::PREFACE.substr(0, header_end + 4));
+            if (!open_http2(*conn, new_http2_connection(conn->socket))) {
+                close_connection(conn);
+            }
+            return;
+        }
+        
+        BodyState body;
+        status = begin_body(request, body);
+        if (status != ReadStatus::Ok) {
+            send_read_error(conn, status, false);
+            return;
+        }
+        
+        // An upgrade is only taken without a body, which would otherwise have to be read first;
+        // the request becomes stream 1 and is answered over HTTP/2. Over TLS, HTTP/2 is
+        // agreed through ALPN instead and the client starts with the preface.
+        if (http2_max_streams && !conn->tls && body.finished && is_http2_upgrade(request)) {
+            std::unique_ptr<Http2Connection> protocol = new_http2_connection(conn->socket);
+            if (protocol->upgrade(find_header(request, HttpHeader::Http2Settings))) {
+                static const std::string switching = "HTTP/1.1 101 Switching Protocols\r\n"
+                                                     "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+                arm_timer(*conn, Connection::Phase::Write, limits.write_timeout_ms);
+                bool sent = send_all(*conn, switching.data(), switching.size());
+                timers.cancel(conn->timer);
+                if (!sent || conn->timed_out || !open_http2(*conn, std::move(protocol))) {
+                    close_connection(conn);
+                    return;
+                }
+                parse_request_body(request);
+                serve_http2_stream(conn, 1, request, nullptr, false);
+                return;
+            }
+        }
+        
+        const RouteEntry* route = find_route(request);
+        if (route && route->async_handler) {
+            // The coroutine reads the body, answers and passes the connection on by itself;
+            // this thread is free again as soon as it first waits
+            bool keep_alive = running && wants_keep_alive(request);
+            spawn(serve_async_request(conn, std::move(request), route, body, keep_alive), handlers);
+            return;
+        }
+        if (route && route->options.execution == RouteOptions::Execution::Blocking) {
+            // The body is read there too, so a slow client holds a blocking thread and not this one
+            queue_blocking([this, conn, request = std::move(request), route, body]() mutable {
+                if (serve_routed_request(conn, request, route, body)) {
+                    dispatch_connection(conn);
+                }
+            });
+            return;
+        }
+        if (!serve_routed_request(conn, request, route, body)) {
+            return;
+        }
+    }
+}
+
+// Reads the body of a parsed request, runs its handler and answers. True when the next
+// pipelined request is there to be read.
+bool HttpServer::serve_routed_request(const std::shared_ptr<Connection>& conn, HttpRequest& request,
+                                      const RouteEntry* route, BodyState& body) {
+    if (route && route->options.stream_body) {
+        Connection& stream_conn = *conn;
+        request.read_body = [this, &stream_conn, &body](char* buffer, size_t length) {
+            return read_body_some(stream_conn, body, buffer, length);
+        };
+    } else {
+        // Read the whole body, enforcing progress and a minimum transfer rate
+        ReadStatus status = read_full_body(*conn, body, request.body);
+        if (status != ReadStatus::Ok) {
+            send_read_error(conn, status, false);
+            return false;
+        }
+        parse_request_body(request);
+    }
+    
+    bool keep_alive = running && wants_keep_alive(request);
+    bool served = serve_request(*conn, request, route, body, keep_alive);
+    return finish_request(conn, served, keep_alive, body.finished);
+}
+
+// Answers a request on the event loop when its route runs inline and the request arrived
+// whole without a body. False when a worker has to take the connection instead; whatever
+// was read stays in its buffer.
+bool HttpServer::serve_inline(const std::shared_ptr<Connection>& conn) {
+    // A TLS handshake is too slow for the event loop
+    if (conn->timed_out || (conn->tls && !conn->tls->established())) {
+        return false;
+    }
+    
+    char buffer[REQUEST_READ_SIZE];
+    ssize_t received = conn->receive(buffer, sizeof(buffer), false);
+    if (received > 0) {
+        conn->buffer.append(buffer, received);
+    } else if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        // The worker finds the socket closed too, and cleans up
+        return false;
+    }
+    
+    size_t header_end = conn->buffer.find("\r\n\r\n");
+    if (header_end == std::string::npos || header_end + 4 > limits.max_header_size) {
+        return false;
+    }
+    
+    // The request line is enough to route; the rest is only parsed for an inline route
+    HttpRequest request = parse_request(conn->buffer.substr(0, conn->buffer.find("\r\n") + 2));
+    const RouteEntry* route = find_route(request);
+    if (!route || route->async_handler || route->options.execution != RouteOptions::Execution::Inline ||
+        route->options.stream_body) {
+        return false;
+    }
+    request = parse_request(conn->buffer.substr(0, header_end + 4));
+    BodyState body;
+    if (begin_body(request, body) != ReadStatus::Ok || !body.finished ||
+        (http2_max_streams && is_http2_upgrade(request))) {
+        return false;
+    }
+    
+    bool keep_alive = running && wants_keep_alive(request);
+    CacheLookup lookup;
+    ResponseCache::CachedResponse cached;
+    bool hit = lookup_cached_response(request, route, lookup, cached);
+    HttpResponse response;
+    if (!hit) {
+        serving_inline = true;
+        inline_declined = false;
+        route->handler(request, response);
+        serving_inline = false;
+        if (inline_declined) {
+            return false;
+        }
+    }
+    timers.cancel(conn->timer);
+    conn->buffer.erase(0, header_end + 4);
+    inline_served++;
+    if (hit) {
+        finish_inline(conn, build_cached_response(cached, keep_alive), keep_alive);
+        return true;
+    }
+    fit_response_to_version(request, response);
+    if (response.event_source || response.websocket || response.stream_body || response.file) {
+        // These take the connection over or are sent the blocking way, so a worker does it
+        auto shared = std::make_shared<HttpResponse>(std::move(response));
+        scheduler->push(conn->home_worker, QueuedConnection{conn, std::chrono::steady_clock::now(),
+                                                            [this, conn, shared, lookup, keep_alive](bool) {
+            bool served = send_handler_response(*conn, *shared, lookup, keep_alive);
+            if (finish_request(conn, served, keep_alive, true)) {
+                handle_client(conn);
+            }
+        }, nullptr, true});
+        return true;
+    }
+    finish_inline(conn, build_handler_response(response, lookup, keep_alive), keep_alive);
+    return true;
+}
+
+// Sends an inline response with whatever the socket takes right away. A worker sends the
+// rest, should the client be slow to read.
+void HttpServer::finish_inline(const std::shared_ptr<Connection>& conn, std::string response_str, bool keep_alive) {
+    ssize_t sent;
+    do {
+        sent = conn->transmit(response_str.data(), response_str.size(), false);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        close_connection(conn);
+        return;
+    }
+    
+    size_t done = std::max<ssize_t>(sent, 0);
+    if (done < response_str.size()) {
+        auto rest = std::make_shared<std::string>(response_str.substr(done));
+        scheduler->push(conn->home_worker, QueuedConnection{conn, std::chrono::steady_clock::now(),
+                                                            [this, conn, rest, keep_alive](bool) {
+            arm_timer(*conn, Connection::Phase::Write, limits.write_timeout_ms);
+            bool sent = send_all(*conn, rest->data(), rest->size());
+            timers.cancel(conn->timer);
+            if (finish_request(conn, sent && !conn->timed_out, keep_alive, true)) {
+                handle_client(conn);
+            }
+        }, nullptr, true});
+        return;
+    }
+    if (finish_request(conn, true, keep_alive, true)) {
+        dispatch_connection(conn);
+    }
+}
+
+// Closes, parks or hands off the connection once a response went out. True when the next
+// pipelined request is already there to be read.
+bool HttpServer::finish_request(const std::shared_ptr<Connection>& conn, bool served, bool keep_alive,
+                                bool body_finished) {
+    if (served && conn->phase == Connection::Phase::Stream) {
+        // The event loop owns the connection from here on
+        return false;
+    }
+    if (!served || !keep_alive || !body_finished) {
+        close_connection(conn);
+        return false;
+    }
+    conn->requests_served++;
+    
+    // Anything left in the buffer belongs to the next pipelined request
+    if (conn->buffer.empty() && !conn->has_buffered_input()) {
+        park_connection(conn);
+        return false;
+    }
+    arm_timer(*conn, Connection::Phase::Header, limits.header_timeout_ms);
+    return true;
+}
+
+void HttpServer::send_read_error(const std::shared_ptr<Connection>& conn, ReadStatus status, bool in_head) {
+    HttpResponse error_response;
+    switch (status) {
+        case ReadStatus::Timeout:
+            send_error_response(error_response, 408, "Request Timeout");
+            break;
+        case ReadStatus::TooLarge:
+            if (in_head) {
+                send_error_response(error_response, 431, "Request Header Fields Too Large");
+            } else {
+                send_error_response(error_response, 413, "Payload Too Large");
+            }
+            break;
+        case ReadStatus::Invalid:
+            send_error_response(error_response, 400, "Bad Request");
+            break;
+        default:
+            close_connection(conn);
+            return;
+    }
+    send_and_close(conn, error_response);
+}
+
+const HttpServer::RouteEntry* HttpServer::find_route(const HttpRequest& request) {
+    int index = BuiltinRoutes::Table::find(request.method_id, request.method, request.path);
+    if (index >= 0 && static_cast<size_t>(index) < builtin_routes.size()) {
+        return builtin_overrides[index] ? builtin_overrides[index] : &builtin_routes[index];
+    }
+    
+    for (const DynamicRoute& route : dynamic_routes) {
+        if (method_matches(route.method_id, route.method, request.method_id, request.method) &&
+            route.pattern.matches(request.path)) {
+            return route.entry;
+        }
+    }
+    return nullptr;
+}
+
+bool HttpServer::serve_request(Connection& conn, const HttpRequest& request, const RouteEntry* route,
+                               const BodyState& body, bool keep_alive) {
+    // Cache hits are answered without running the handler
+    CacheLookup lookup;
+    ResponseCache::CachedResponse cached;
+    if (lookup_cached_response(request, route, lookup, cached)) {
+        return send_cached_response(conn, cached, keep_alive);
+    }
+    
+    HttpResponse response;
+    if (route) {
+        route->handler(request, response);
+    } else {
+        send_error_response(response, 404, "Not Found");
+    }
+    fit_response_to_version(request, response);
+    
+    // A streaming handler that stopped reading early leaves the connection out of sync
+    return send_handler_response(conn, response, lookup, keep_alive && body.finished);
+}
+
+// Runs an async route on behalf of handle_client, from reading the body to handing the
+// connection on. The task owns the request and response, so they outlive every suspension.
+Task<void> HttpServer::serve_async_request(std::shared_ptr<Connection> conn, HttpRequest request,
+                                           const RouteEntry* route, BodyState body, bool keep_alive) {
+    CacheLookup lookup;
+    ResponseCache::CachedResponse cached;
+    bool served;
+    if (lookup_cached_response(request, route, lookup, cached)) {
+        served = send_cached_response(*conn, cached, keep_alive);
+    } else {
+        if (route->options.stream_body) {
+            Connection& stream_conn = *conn;
+            request.read_body_async = [this, &stream_conn, &body](char* buffer, size_t length) {
+                return read_body_async(stream_conn, body, buffer, length);
+            };
+        } else {
+            ReadStatus status = co_await read_full_body_async(*conn, body, request.body);
+            if (status != ReadStatus::Ok) {
+                send_read_error(conn, status, false);
+                co_return;
+            }
+            parse_request_body(request);
+        }
+        
+        HttpResponse response;
+        try {
+            co_await route->async_handler(request, response);
+        } catch (const std::exception& e) {
+            response = HttpResponse();
+            send_error_response(response, 500, "Internal Server Error");
+            keep_alive = false;
+        }
+        fit_response_to_version(request, response);
+        served = co_await send_handler_response_async(*conn, response, lookup, keep_alive && body.finished);
+    }
+    
+    if (finish_request(conn, served, keep_alive, body.finished)) {
+        dispatch_connection(conn);
+    }
+}
+
+bool HttpServer::lookup_cached_response(const HttpRequest& request, const RouteEntry* route, CacheLookup& lookup,
+                                        ResponseCache::CachedResponse& cached) {
+    lookup.use = route && route->options.cacheable && response_cache && request.method_id == HttpMethod::Get;
+    lookup.generation = 0;
+    if (!lookup.use) {
+        return false;
+    }
+    lookup.key = cache_key(request, route->options);
+    if (response_cache->lookup(lookup.key, cached)) {
+        return true;
+    }
+    lookup.generation = response_cache->generation();
+    return false;
+}
+
+bool HttpServer::send_handler_response(Connection& conn, HttpResponse& response, const CacheLookup& lookup,
+                                       bool keep_alive) {
+    if (response.event_source && response.status_code == 200) {
+        return open_event_stream(conn, response);
+    }
+    if (response.websocket && response.status_code == 101) {
+        return open_websocket(conn, response);
+    }
+    
+    if (lookup.use && response.status_code == 200 && !response.is_binary && !response.stream_body) {
+        ResponseCache::CachedResponse built = split_response(build_response(response));
+        response_cache->store(lookup.key, built, lookup.generation);
+        return send_cached_response(conn, built, keep_alive);
+    }
+    
+    response.headers["Connection"] = keep_alive && !response.close_delimited ? "keep-alive" : "close";
+    return send_response(conn, response);
+}
+
+// As send_handler_response, but an ordinary response waits for a slow client without
+// holding the thread. Streamed and file bodies, whose producers block anyway, and
+// responses that take the connection over, are still sent the synchronous way.
+Task<bool> HttpServer::send_handler_response_async(Connection& conn, HttpResponse& response,
+                                                   const CacheLookup& lookup, bool keep_alive) {
+    if (response.event_source || response.websocket || response.stream_body || response.file) {
+        co_return send_handler_response(conn, response, lookup, keep_alive);
+    }
+    
+    arm_timer(conn, Connection::Phase::Write, limits.write_timeout_ms);
+    bool sent = co_await send_all_async(conn, build_handler_response(response, lookup, keep_alive));
+    timers.cancel(conn.timer);
+    co_return sent && !conn.timed_out;
+}
+
+std::string HttpServer::cache_key(const HttpRequest& request, const RouteOptions& options) {
+    // The path must come first so invalidation can match entries by prefix. Decoded query
+    // parameters may contain '&', '=' or anything else, so every part after it carries its
+    // length and no two requests can produce the same key.
+    std::string key = request.path + "?";
+    auto append = [&key](const std::string& part) {
+        key += std::to_string(part.size());
+        key += ':';
+        key += part;
+    };
+    for (const auto& param : request.query_params) {
+        append(param.first);
+        append(param.second);
+    }
+    for (const auto& name : options.vary) {
+        key += "\n";
+        append(name);
+        append(find_header(request, name));
+    }
+    return key;
+}
+
+ResponseCache::CachedResponse HttpServer::split_response(const std::string& response_str) {
+    // build_response() always writes Content-Length as the last header
+    size_t header_end = response_str.find("\r\n\r\n");
+    size_t length_pos = response_str.rfind("Content-Length: ", header_end);
+    
+    ResponseCache::CachedResponse cached;
+    cached.head = response_str.substr(0, length_pos);
+    cached.tail = response_str.substr(length_pos);
+    return cached;
+}
+
+std::string HttpServer::build_cached_response(const ResponseCache::CachedResponse& cached, bool keep_alive) {
+    std::string response_str;
+    response_str.reserve(cached.head.size() + cached.tail.size() + 24);
+    response_str += cached.head;
+    response_str += keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    response_str += cached.tail;
+    return response_str;
+}
+
+// The whole of an ordinary handler response, stored in the cache on the way when it may be
+std::string HttpServer::build_handler_response(HttpResponse& response, const CacheLookup& lookup, bool keep_alive) {
+    if (lookup.use && response.status_code == 200 && !response.is_binary) {
+        ResponseCache::CachedResponse built = split_response(build_response(response));
+        response_cache->store(lookup.key, built, lookup.generation);
+        return build_cached_response(built, keep_alive);
+    }
+    response.headers["Connection"] = keep_alive ? "keep-alive" : "close";
+    std::string response_str = build_response(response);
+    if (response.is_binary) {
+        response_str.append(response.binary_data.data(), response.binary_data.size());
+    }
+    return response_str;
+}
+
+bool HttpServer::send_cached_response(Connection& conn, const ResponseCache::CachedResponse& cached, bool keep_alive) {
+    std::string response_str = build_cached_response(cached, keep_alive);
+    
+    arm_timer(conn, Connection::Phase::Write, limits.write_timeout_ms);
+    bool sent = send_all(conn, response_str.c_str(), response_str.length());
+    timers.cancel(conn.timer);
+    return sent && !conn.timed_out;
+}
+
+HttpServer::ReadStatus HttpServer::read_request_head(Connection& conn, size_t& header_end) {
+    char buffer[REQUEST_READ_SIZE];
+    size_t search_from = 0;
+    
+    while (true) {
+        header_end = conn.buffer.find("\r\n\r\n", search_from);
+        if (header_end != std::string::npos) {
+            return header_end + 4 > limits.max_header_size ? ReadStatus::TooLarge : ReadStatus::Ok;
+        }
+        if (conn.buffer.length() > limits.max_header_size) {
+            return ReadStatus::TooLarge;
+        }
+        // The terminator may straddle two reads
+        search_from = conn.buffer.length() < 3 ? 0 : conn.buffer.length() - 3;
+        
+        ssize_t bytes_received = conn.receive(buffer, sizeof(buffer), true);
+        if (bytes_received < 0 && errno == EINTR) continue;
+        if (bytes_received <= 0) {
+            // Only answer clients that actually started a request
+            return conn.timed_out && !conn.buffer.empty() ? ReadStatus::Timeout : ReadStatus::Closed;
+        }
+        conn.buffer.append(buffer, bytes_received);
+    }
+}
+
+HttpServer::ReadStatus HttpServer::begin_body(const HttpRequest& request, BodyState& body) {
+    body.chunked = false;
+    body.finished = false;
+    body.chunk_crlf_pending = false;
+    body.trailers = false;
+    body.remaining = 0;
+    body.total = 0;
+    body.received = 0;
+    body.error = ReadStatus::Ok;
+    body.started = std::chrono::steady_clock::now();
+    
+    // A body framed two ways, or with lengths that disagree, can end in a different place for a
+    // proxy in front of the server than for the server, which lets a second request be smuggled
+    // inside the first. Such requests are refused and their connection closed (RFC 9112 section 6.3).
+    const std::string& transfer_encoding = find_header(request, HttpHeader::TransferEncoding);
+    const std::string& length_str = find_header(request, HttpHeader::ContentLength);
+    if (!transfer_encoding.empty()) {
+        if (!length_str.empty() || !chunked_is_last(transfer_encoding)) {
+            return ReadStatus::Invalid;
+        }
+        body.chunked = true;
+        return ReadStatus::Ok;
+    }
+    
+    if (!length_str.empty() && !parse_content_length(length_str, body.remaining)) {
+        return ReadStatus::Invalid;
+    }
+    if (body.remaining > limits.max_body_size) {
+        return ReadStatus::TooLarge;
+    }
+    
+    body.finished = body.remaining == 0;
+    return ReadStatus::Ok;
+}
+
+// Clients trickling the body below the minimum rate are cut off after the grace period
+bool HttpServer::body_too_slow(const BodyState& body) {
+    auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - body.started).count();
+    return elapsed_ms > limits.body_rate_grace_ms &&
+           body.received * 1000 / static_cast<size_t>(elapsed_ms) < limits.min_body_rate;
+}
+
+HttpServer::ReadStatus HttpServer::fill_body_buffer(Connection& conn, BodyState& body) {
+    char buffer[REQUEST_READ_SIZE];
+    
+    if (body_too_slow(body)) {
+        return ReadStatus::Timeout;
+    }
+    
+    // Every chunk of progress pushes the idle deadline out again
+    arm_timer(conn, Connection::Phase::Body, limits.body_idle_timeout_ms);
+    ssize_t bytes_received;
+    do {
+        bytes_received = conn.receive(buffer, sizeof(buffer), true);
+    } while (bytes_received < 0 && errno == EINTR);
+    timers.cancel(conn.timer);
+    
+    if (bytes_received <= 0) {
+        return conn.timed_out ? ReadStatus::Timeout : ReadStatus::Closed;
+    }
+    
+    conn.buffer.append(buffer, bytes_received);
+    body.received += bytes_received;
+    return ReadStatus::Ok;
+}
+
+// As fill_body_buffer, but while the client has nothing new to send the coroutine waits
+// in the event loop and the thread goes back to the pool
+Task<HttpServer::ReadStatus> HttpServer::fill_body_buffer_async(Connection& conn, BodyState& body) {
+    char buffer[REQUEST_READ_SIZE];
+    
+    if (body_too_slow(body)) {
+        co_return ReadStatus::Timeout;
+    }
+    
+    arm_timer(conn, Connection::Phase::Body, limits.body_idle_timeout_ms);
+    ssize_t bytes_received;
+    while (true) {
+        bytes_received = conn.receive(buffer, sizeof(buffer), false);
+        if (bytes_received < 0 && errno == EINTR) continue;
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !conn.timed_out) {
+            co_await SocketWait{*this, conn, conn.retry_events(false)};
+            continue;
+        }
+        break;
+    }
+    timers.cancel(conn.timer);
+    
+    if (bytes_received <= 0) {
+        co_return conn.timed_out ? ReadStatus::Timeout : ReadStatus::Closed;
+    }
+    
+    conn.buffer.append(buffer, bytes_received);
+    body.received += bytes_received;
+    co_return ReadStatus::Ok;
+}
+
+// Decodes up to `length` body bytes out of the connection buffer. When the buffer runs
+// out before any byte is ready it sets `need_input` and returns 0, and the caller reads
+// more from the socket its own way; otherwise it returns the bytes taken, 0 at the end
+// of the body, or -1 with body.error set.
+ssize_t HttpServer::take_body_some(Connection& conn, BodyState& body, char* buffer, size_t length,
+                                   bool& need_input) {
+    need_input = false;
+    while (!body.finished) {
+        if (body.error != ReadStatus::Ok) {
+            return -1;
+        }
+        
+        if (body.trailers) {
+            // Skip trailer fields up to the terminating empty line
+            size_t trailer_end = conn.buffer.find("\r\n");
+            if (trailer_end == std::string::npos) {
+                if (conn.buffer.size() > limits.max_header_size) {
+                    body.error = ReadStatus::Invalid;
+                    continue;
+                }
+                need_input = true;
+                return 0;
+            }
+            conn.buffer.erase(0, trailer_end + 2);
+            if (trailer_end == 0) {
+                body.trailers = false;
+                body.finished = true;
+            }
+            continue;
+        }
+        
+        if (body.chunked && body.remaining == 0) {
+            if (body.chunk_crlf_pending) {
+                if (conn.buffer.size() < 2) {
+                    need_input = true;
+                    return 0;
+                }
+                if (conn.buffer.compare(0, 2, "\r\n") != 0) {
+                    body.error = ReadStatus::Invalid;
+                    continue;
+                }
+                conn.buffer.erase(0, 2);
+                body.chunk_crlf_pending = false;
+            }
+            
+            size_t line_end = conn.buffer.find("\r\n");
+            if (line_end == std::string::npos) {
+                if (conn.buffer.size() > 1024) {
+                    body.error = ReadStatus::Invalid;
+                    continue;
+                }
+                need_input = true;
+                return 0;
+            }
+            
+            // Chunk size line, ignoring any chunk extensions
+            std::string size_str = conn.buffer.substr(0, line_end);
+            conn.buffer.erase(0, line_end + 2);
+            char* end = nullptr;
+            unsigned long chunk_size = std::strtoul(size_str.c_str(), &end, 16);
+            if (end == size_str.c_str()) {
+                body.error = ReadStatus::Invalid;
+                continue;
+            }
+            
+            if (chunk_size == 0) {
+                body.trailers = true;
+                continue;
+            }
+            
+            body.remaining = chunk_size;
+            body.chunk_crlf_pending = true;
+        }
+        
+        if (conn.buffer.empty()) {
+            need_input = true;
+            return 0;
+        }
+        
+        size_t count = std::min(std::min(length, body.remaining), conn.buffer.size());
+        memcpy(buffer, conn.buffer.data(), count);
+        conn.buffer.erase(0, count);
+        body.remaining -= count;
+        body.total += count;
+        
+        if (body.total > limits.max_body_size) {
+            body.error = ReadStatus::TooLarge;
+            return -1;
+        }
+        if (!body.chunked && body.remaining == 0) {
+            body.finished = true;
+        }
+        return count;
+    }
+    
+    return 0;
+}
+
+ssize_t HttpServer::read_body_some(Connection& conn, BodyState& body, char* buffer, size_t length) {
+    bool need_input;
+    ssize_t count;
+    while ((count = take_body_some(conn, body, buffer, length, need_input)) == 0 && need_input) {
+        body.error = fill_body_buffer(conn, body);
+    }
+    return count;
+}
+
+Task<ssize_t> HttpServer::read_body_async(Connection& conn, BodyState& body, char* buffer, size_t length) {
+    bool need_input;
+    ssize_t count;
+    while ((count = take_body_some(conn, body, buffer, length, need_input)) == 0 && need_input) {
+        body.error = co_await fill_body_buffer_async(conn, body);
+    }
+    co_return count;
+}
+
+HttpServer::ReadStatus HttpServer::read_full_body(Connection& conn, BodyState& body, std::string& out) {
+    char buffer[8192];
+    if (!body.chunked) {
+        out.reserve(body.remaining);
+    }
+    
+    ssize_t bytes_read;
+    while ((bytes_read = read_body_some(conn, body, buffer, sizeof(buffer))) > 0) {
+        out.append(buffer, bytes_read);
+    }
+    
+    return bytes_read < 0 ? body.error : ReadStatus::Ok;
+}
+
+Task<HttpServer::ReadStatus> HttpServer::read_full_body_async(Connection& conn, BodyState& body, std::string& out) {
+    char buffer[8192];
+    if (!body.chunked) {
+        out.reserve(body.remaining);
+    }
+    
+    bool need_input;
+    ssize_t bytes_read;
+    while ((bytes_read = take_body_some(conn, body, buffer, sizeof(buffer), need_input)) > 0 || need_input) {
+        if (need_input) {
+            body.error = co_await fill_body_buffer_async(conn, body);
+        } else {
+            out.append(buffer, bytes_read);
+        }
+    }
+    
+    co_return bytes_read < 0 ? body.error : ReadStatus::Ok;
+}
+
+bool HttpServer::wants_keep_alive(const HttpRequest& request) {
+    std::string connection_header = find_header(request, HttpHeader::Connection);
+    std::transform(connection_header.begin(), connection_header.end(), connection_header.begin(), ::tolower);
+    
+    // HTTP/1.1 connections persist by default, HTTP/1.0 ones only when asked to
+    if (request.version == "HTTP/1.1") {
+        return connection_header.find("close") == std::string::npos;
+    }
+    return connection_header.find("keep-alive") != std::string::npos;
+}
+
+ssize_t HttpServer::Connection::receive(char* data, size_t length, bool wait) {
+    if (tls) {
+        return tls->read(data, length, wait);
+    }
+    return recv(socket, data, length, wait ? 0 : MSG_DONTWAIT);
+}
+
+ssize_t HttpServer::Connection::transmit(const char* data, size_t length, bool wait) {
+    if (tls) {
+        return tls->write(data, length, wait);
+    }
+    return send(socket, data, length, wait ? MSG_NOSIGNAL : MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+uint32_t HttpServer::Connection::retry_events(bool transmitting) const {
+    if (tls) {
+        transmitting = tls->wants_write();
+    }
+    return transmitting ? EPOLLOUT : EPOLLIN;
+}
+
+ResponseFile::~ResponseFile() {
+    close(fd);
+}
+
+bool HttpServer::send_all(Connection& conn, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_sent = conn.transmit(data, length, true);
+        if (bytes_sent < 0 && errno == EINTR) continue;
+        if (bytes_sent <= 0) {
+            return false;
+        }
+        data += bytes_sent;
+        length -= bytes_sent;
+    }
+    return true;
+}
+
+// Sends `data` without blocking the thread: while the socket is full the coroutine waits
+// in the event loop. The caller arms the write deadline, which wakes the wait when it passes.
+Task<bool> HttpServer::send_all_async(Connection& conn, std::string data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t bytes_sent = conn.transmit(data.data() + sent, data.size() - sent, false);
+        if (bytes_sent < 0 && errno == EINTR) continue;
+        if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !conn.timed_out) {
+            co_await SocketWait{*this, conn, conn.retry_events(true)};
+            continue;
+        }
+        if (bytes_sent <= 0) {
+            co_return false;
+        }
+        sent += bytes_sent;
+    }
+    co_return true;
+}
+
+// The file goes from the page cache to the socket without passing through user space,
+// unless TLS has to encrypt it here
+bool HttpServer::send_file_body(Connection& conn, const ResponseFile& file) {
+    off_t offset = 0;
+    while (static_cast<size_t>(offset) < file.size) {
+        size_t remaining = file.size - static_cast<size_t>(offset);
+        ssize_t sent;
+        if (conn.tls) {
+            sent = conn.tls->send_file(file.fd, offset, remaining);
+            offset += std::max<ssize_t>(sent, 0);
+        } else {
+            sent = sendfile(conn.socket, file.fd, &offset, remaining);
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        // Nothing sent means the file shrank since its size was taken
+        if (sent <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HttpServer::send_response(Connection& conn, HttpResponse& response) {
+    arm_timer(conn, Connection::Phase::Write, limits.write_timeout_ms);
+    
+    std::string response_str = build_response(response);
+    bool sent = send_all(conn, response_str.c_str(), response_str.length());
+    
+    if (sent && response.file) {
+        sent = send_file_body(conn, *response.file);
+    } else if (sent && response.is_binary && !response.binary_data.empty()) {
+        sent = send_all(conn, response.binary_data.data(), response.binary_data.size());
+    }
+    
+    timers.cancel(conn.timer);
+    
+    if (sent && response.stream_body) {
+        sent = send_chunked_body(conn, response);
+    }
+    // A close-delimited body only ends once the connection closes, so it is never kept
+    return sent && !conn.timed_out && !response.close_delimited;
+}
+
+bool HttpServer::send_chunked_body(Connection& conn, HttpResponse& response) {
+    bool client_alive = true;
+    
+    // The write deadline covers each chunk, not the gaps while the producer works
+    response.stream_body([this, &conn, &response, &client_alive](const std::string& chunk) {
+        if (!client_alive || chunk.empty()) {
+            return client_alive;
+        }
+        
+        arm_timer(conn, Connection::Phase::Write, limits.write_timeout_ms);
+        if (response.close_delimited) {
+            client_alive = send_all(conn, chunk.data(), chunk.size()) && !conn.timed_out;
+        } else {
+            char size_line[24];
+            int size_length = snprintf(size_line, sizeof(size_line), "%zx\r\n", chunk.size());
+            client_alive = send_all(conn, size_line, size_length) &&
+                           send_all(conn, chunk.data(), chunk.size()) &&
+                           send_all(conn, "\r\n", 2) && !conn.timed_out;
+        }
+        timers.cancel(conn.timer);
+        return client_alive;
+    });
+    
+    if (!client_alive || response.close_delimited) {
+        return client_alive;
+    }
+    
+    arm_timer(conn, Connection::Phase::Write, limits.write_timeout_ms);
+    bool sent = send_all(conn, "0\r\n\r\n", 5);
+    timers.cancel(conn.timer);
+    return sent;
+}
+
+void HttpServer::send_and_close(const std::shared_ptr<Connection>& conn, HttpResponse& response) {
+    response.headers["Connection"] = "close";
+    send_response(*conn, response);
+    close_connection(conn);
+}
+
+void HttpServer::wake_event_loop() {
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void HttpServer::signal_event_channel(const std::string& channel) {
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        // Nobody watching costs a lookup; repeated signals before the loop wakes coalesce
+        if (!watched_channels.count(channel) || !signalled_channels.insert(channel).second) {
+            return;
+        }
+    }
+    wake_event_loop();
+}
+
+void HttpServer::unwatch_channel(const std::string& channel) {
+    std::lock_guard<std::mutex> lock(streams_mutex);
+    auto watched = watched_channels.find(channel);
+    if (watched != watched_channels.end() && --watched->second == 0) {
+        watched_channels.erase(watched);
+    }
+}
+
+// Adopts connections handed over by workers, serves the signalled ones, and once a
+// second drops stalled clients and keeps idle ones alive
+void HttpServer::run_streams(std::chrono::steady_clock::time_point now) {
+    std::vector<EventStream> adopted;
+    std::vector<EventOutput> outputs;
+    std::set<std::string> channels;
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        adopted.swap(new_event_streams);
+        outputs.swap(event_output);
+        channels.swap(signalled_channels);
+    }
+    
+    for (auto& stream : adopted) {
+        int fd = stream.conn->socket;
+        auto it = event_streams.emplace(fd, std::move(stream)).first;
+        
+        // Level-triggered, so a client that hangs up is noticed whenever it happens
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1 || !pump_event_stream(it->second)) {
+            close_event_stream(it);
+        }
+    }
+    
+    for (auto& output : outputs) {
+        auto it = event_streams.find(output.conn->socket);
+        if (it == event_streams.end() || it->second.conn != output.conn) {
+            continue;   // Closed while the source ran
+        }
+        EventStream& stream = it->second;
+        bool again = stream.repoll || output.finished || !output.events.empty();
+        stream.polling = false;
+        stream.repoll = false;
+        stream.finished = output.finished;
+        stream.out.pending += output.events;
+        if (again && !pump_event_stream(stream)) {
+            close_event_stream(it);
+        }
+    }
+    
+    if (!channels.empty()) {
+        for (auto it = event_streams.begin(); it != event_streams.end();) {
+            if (channels.count(it->second.channel) && !pump_event_stream(it->second)) {
+                it = close_event_stream(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    
+    bool check_idle = now >= next_stream_check;
+    run_websockets(now, channels, check_idle);
+    run_http2(now, check_idle);
+    if (!check_idle) {
+        return;
+    }
+    next_stream_check = now + std::chrono::seconds(1);
+    for (auto it = event_streams.begin(); it != event_streams.end();) {
+        EventStream& stream = it->second;
+        bool alive = true;
+        if (!stream.out.pending.empty()) {
+            alive = now - stream.out.last_write < std::chrono::milliseconds(limits.write_timeout_ms);
+        } else if (now - stream.out.last_write >= EVENT_STREAM_HEARTBEAT) {
+            stream.out.pending = ": keep-alive\n\n";
+            alive = pump_event_stream(stream);
+        }
+        it = alive ? std::next(it) : close_event_stream(it);
+    }
+}
+
+// Writes as much as the socket takes without blocking. False when the client is gone
+// or has let too much output pile up.
+bool HttpServer::flush_outbound(Connection& conn, Outbound& out) {
+    while (!out.pending.empty()) {
+        ssize_t sent = conn.transmit(out.pending.data(), out.pending.size(), false);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return out.pending.size() <= MAX_STREAM_BACKLOG && wait_writable(conn.socket, out, true);
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        out.pending.erase(0, sent);
+        out.last_write = std::chrono::steady_clock::now();
+    }
+    return wait_writable(conn.socket, out, false);
+}
+
+bool HttpServer::wait_writable(int socket, Outbound& out, bool wait) {
+    if (out.waiting_writable == wait) {
+        return true;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLRDHUP | (wait ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    event.data.fd = socket;
+    out.waiting_writable = wait;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket, &event) == 0;
+}
+
+// Sends the head of an event stream and hands the connection to the event loop
+bool HttpServer::open_event_stream(Connection& conn, HttpResponse& response) {
+    response.headers["Connection"] = "close";
+    response.headers["X-Accel-Buffering"] = "no";
+    std::string head = build_response(response);
+    
+    arm_timer(conn, Connection::Phase::Write, limits.write_timeout_ms);
+    bool sent = send_all(conn, head.c_str(), head.length());
+    timers.cancel(conn.timer);
+    if (!sent || conn.timed_out) {
+        return false;
+    }
+    
+    conn.phase = Connection::Phase::Stream;
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        Outbound out{"", false, std::chrono::steady_clock::now()};
+        auto source = std::make_shared<std::function<bool(std::string&)>>(std::move(response.event_source));
+        new_event_streams.push_back(EventStream{conn.shared_from_this(), source, response.event_channel, out,
+                                                false, false, false});
+        watched_channels[response.event_channel]++;
+    }
+    wake_event_loop();
+    return true;
+}
+
+void HttpServer::handle_event_stream_io(int fd, uint32_t events) {
+    auto it = event_streams.find(fd);
+    
+    // Clients have nothing to say on an event stream; the read only tells whether they left
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // OpenSSL may keep decrypted bytes back that epoll never reports, so those are
+        // read too; what is still in the socket makes epoll report it again
+        char discard[512];
+        ssize_t received;
+        do {
+            received = it->second.conn->receive(discard, sizeof(discard), false);
+        } while (received > 0 && it->second.conn->has_buffered_input());
+        bool gone = received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+        if (gone || (events & (EPOLLHUP | EPOLLERR))) {
+            close_event_stream(it);
+            return;
+        }
+    }
+    if ((events & EPOLLOUT) && !pump_event_stream(it->second)) {
+        close_event_stream(it);
+    }
+}
+
+// Polls the source each time the socket has taken everything. False once the stream is over.
+bool HttpServer::pump_event_stream(EventStream& stream) {
+    if (!flush_outbound(*stream.conn, stream.out)) {
+        return false;
+    }
+    if (!stream.out.pending.empty()) {
+        return true;
+    }
+    if (stream.finished) {
+        return false;
+    }
+    poll_event_source(stream);
+    return true;
+}
+
+// Sources may wait on locks, such as the store's for the change feed, so they run on the
+// blocking pool and never on the event loop
+void HttpServer::poll_event_source(EventStream& stream) {
+    if (stream.polling) {
+        stream.repoll = true;
+        return;
+    }
+    stream.polling = true;
+    queue_blocking([this, conn = stream.conn, source = stream.source]() {
+        EventOutput output{conn, "", false};
+        output.finished = !(*source)(output.events);
+        {
+            std::lock_guard<std::mutex> lock(streams_mutex);
+            event_output.push_back(std::move(output));
+        }
+        wake_event_loop();
+    });
+}
+
+std::map<int, HttpServer::EventStream>::iterator HttpServer::close_event_stream(
+    std::map<int, EventStream>::iterator it) {
+    unwatch_channel(it->second.channel);
+    close_connection(it->second.conn);
+    return event_streams.erase(it);
+}
+
+bool HttpServer::is_websocket_upgrade(const HttpRequest& request) {
+    std::string upgrade = find_header(request, HttpHeader::Upgrade);
+    std::transform(upgrade.begin(), upgrade.end(), upgrade.begin(), ::tolower);
+    return upgrade.find("websocket") != std::string::npos;
+}
+
+bool HttpServer::accept_websocket(const HttpRequest& request, HttpResponse& response,
+                                  const WebSocketHandlers& handlers) {
+    std::string connection = find_header(request, HttpHeader::Connection);
+    std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+    std::string key = find_header(request, HttpHeader::SecWebSocketKey);
+    if (request.method_id != HttpMethod::Get || request.version != "HTTP/1.1" || !is_websocket_upgrade(request) ||
+        connection.find("upgrade") == std::string::npos || key.size() != 24) {
+        send_error_response(response, 400, "Invalid WebSocket upgrade");
+        return false;
+    }
+    if (find_header(request, HttpHeader::SecWebSocketVersion) != "13") {
+        send_error_response(response, 426, "Upgrade Required");
+        response.headers["Sec-WebSocket-Version"] = "13";
+        return false;
+    }
+    
+    response.status_code = 101;
+    response.status_text = "Switching Protocols";
+    response.headers["Upgrade"] = "websocket";
+    response.headers["Connection"] = "Upgrade";
+    response.headers["Sec-WebSocket-Accept"] = WebSocketFrame::accept_key(key);
+    response.websocket = std::make_shared<WebSocketHandlers>(handlers);
+    return true;
+}
+
+// Sends the 101 head and hands the connection to the event loop
+bool HttpServer::open_websocket(Connection& conn, HttpResponse& response) {
+    std::string head = build_response(response);
+    arm_timer(conn, Connection::Phase::Write, limits.write_timeout_ms);
+    bool sent = send_all(conn, head.c_str(), head.length());
+    timers.cancel(conn.timer);
+    if (!sent || conn.timed_out) {
+        return false;
+    }
+    
+    conn.phase = Connection::Phase::Stream;
+    int fd = conn.socket;
+    auto socket = std::make_shared<WebSocket>([this, fd]() {
+        {
+            std::lock_guard<std::mutex> lock(streams_mutex);
+            websocket_output.insert(fd);
+        }
+        wake_event_loop();
+    });
+    
+    auto now = std::chrono::steady_clock::now();
+    WebSocketSession session{conn.shared_from_this(), socket, response.websocket, Outbound{"", false, now},
+                             "", 0, false, false, 1006, now, std::chrono::steady_clock::time_point(),
+                             std::chrono::steady_clock::time_point()};
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        if (session.handlers->on_signal) {
+            watched_channels[session.handlers->channel]++;
+        }
+        new_websockets.push_back(std::move(session));
+    }
+    wake_event_loop();
+    return true;
+}
+
+void HttpServer::run_websockets(std::chrono::steady_clock::time_point now, const std::set<std::string>& channels,
+                                bool check_idle) {
+    std::vector<WebSocketSession> adopted;
+    std::set<int> output;
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        adopted.swap(new_websockets);
+        output.swap(websocket_output);
+    }
+    
+    for (auto& session : adopted) {
+        int fd = session.conn->socket;
+        auto it = websockets.emplace(fd, std::move(session)).first;
+        WebSocketSession& opened = it->second;
+        
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+            close_websocket(it);
+            continue;
+        }
+        if (opened.handlers->on_open) {
+            opened.handlers->on_open(*opened.socket);
+        }
+        // Frames the client sent right behind the handshake are already buffered
+        process_websocket_frames(opened);
+        if (!flush_websocket(opened)) {
+            close_websocket(it);
+        }
+    }
+    
+    for (int fd : output) {
+        auto it = websockets.find(fd);
+        if (it != websockets.end() && !flush_websocket(it->second)) {
+            close_websocket(it);
+        }
+    }
+    
+    if (!channels.empty()) {
+        for (auto it = websockets.begin(); it != websockets.end();) {
+            WebSocketSession& session = it->second;
+            if (session.handlers->on_signal && !session.close_sent && channels.count(session.handlers->channel)) {
+                session.handlers->on_signal(*session.socket);
+                if (!flush_websocket(session)) {
+                    it = close_websocket(it);
+                    continue;
+                }
+            }
+            ++it;
+        }
+    }
+    
+    if (!check_idle) {
+        return;
+    }
+    auto no_ping = std::chrono::steady_clock::time_point();
+    for (auto it = websockets.begin(); it != websockets.end();) {
+        WebSocketSession& session = it->second;
+        bool alive = true;
+        if (session.close_sent) {
+            alive = now - session.close_started < WEBSOCKET_CLOSE_TIMEOUT;
+        } else if (!session.out.pending.empty()) {
+            alive = now - session.out.last_write < std::chrono::milliseconds(limits.write_timeout_ms);
+        } else if (session.ping_sent != no_ping) {
+            alive = now - session.ping_sent < WEBSOCKET_PING_INTERVAL;
+        } else if (now - session.last_received >= WEBSOCKET_PING_INTERVAL) {
+            // A quiet client has to answer a ping, or it is taken for gone
+            WebSocketFrame::append(session.out.pending, WebSocketFrame::Ping, "");
+            session.ping_sent = now;
+            alive = flush_websocket(session);
+        }
+        it = alive ? std::next(it) : close_websocket(it);
+    }
+}
+
+void HttpServer::handle_websocket_io(int fd, uint32_t events) {
+    auto it = websockets.find(fd);
+    bool alive = true;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        alive = read_websocket(it->second);
+    }
+    if (!alive || !flush_websocket(it->second)) {
+        close_websocket(it);
+    }
+}
+
+// Receives straight into the connection buffer, where frames are then parsed in place.
+// False once the client is gone.
+bool HttpServer::read_websocket(WebSocketSession& session) {
+    std::string& buffer = session.conn->buffer;
+    
+    // A few reads per wakeup keep one busy client from starving the others
+    for (int reads = 0; reads < 4 && !session.finishing; ++reads) {
+        size_t used = buffer.size();
+        buffer.resize(used + WEBSOCKET_READ_SIZE);
+        ssize_t received = session.conn->receive(&buffer[used], WEBSOCKET_READ_SIZE, false);
+        buffer.resize(used + std::max<ssize_t>(received, 0));
+        if (received < 0 && errno == EINTR) continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        
+        session.last_received = std::chrono::steady_clock::now();
+        session.ping_sent = std::chrono::steady_clock::time_point();
+        process_websocket_frames(session);
+        if (static_cast<size_t>(received) < WEBSOCKET_READ_SIZE) {
+            break;
+        }
+    }
+    return true;
+}
+
+// Handles every complete frame in the buffer. Payloads are unmasked where they lie, and
+// a message in a single frame is handed to on_message as a view of the buffer.
+void HttpServer::process_websocket_frames(WebSocketSession& session) {
+    std::string& buffer = session.conn->buffer;
+    size_t offset = 0;
+    
+    while (!session.finishing) {
+        WebSocketFrame frame;
+        auto status = WebSocketFrame::parse_header(buffer.data() + offset, buffer.size() - offset, frame);
+        if (status == WebSocketFrame::ParseStatus::Incomplete) {
+            break;
+        }
+        if (status == WebSocketFrame::ParseStatus::Invalid || !frame.masked) {
+            fail_websocket(session, 1002);
+            break;
+        }
+        if (frame.payload_length > MAX_WEBSOCKET_MESSAGE - session.message.size()) {
+            fail_websocket(session, 1009);
+            break;
+        }
+        size_t payload_length = static_cast<size_t>(frame.payload_length);
+        if (buffer.size() - offset - frame.header_length < payload_length) {
+            break;
+        }
+        
+        char* payload = &buffer[offset + frame.header_length];
+        WebSocketFrame::apply_mask(payload, payload_length, frame.mask);
+        offset += frame.header_length + payload_length;
+        
+        switch (frame.opcode) {
+            case WebSocketFrame::Text:
+            case WebSocketFrame::Binary:
+            case WebSocketFrame::Continuation: {
+                bool continuation = frame.opcode == WebSocketFrame::Continuation;
+                if (continuation != (session.message_opcode != 0)) {
+                    fail_websocket(session, 1002);
+                    break;
+                }
+                if (!frame.fin || continuation) {
+                    session.message.append(payload, payload_length);
+                    if (!continuation) {
+                        session.message_opcode = frame.opcode;
+                    }
+                    if (!frame.fin) {
+                        break;
+                    }
+                }
+                
+                bool binary = (continuation ? session.message_opcode : frame.opcode) == WebSocketFrame::Binary;
+                std::string_view message = continuation ? std::string_view(session.message)
+                                                        : std::string_view(payload, payload_length);
+                if (!binary && !WebSocketFrame::valid_utf8(message.data(), message.size())) {
+                    fail_websocket(session, 1007);
+                    break;
+                }
+                if (session.handlers->on_message && !session.close_sent) {
+                    session.handlers->on_message(*session.socket, message, binary);
+                }
+                if (continuation) {
+                    std::string().swap(session.message);
+                    session.message_opcode = 0;
+                }
+                break;
+            }
+            case WebSocketFrame::Ping: {
+                WebSocketFrame::append(session.out.pending, WebSocketFrame::Pong,
+                                       std::string_view(payload, payload_length));
+                break;
+            }
+            case WebSocketFrame::Pong:
+                break;
+            case WebSocketFrame::Close: {
+                uint16_t code = 1005;
+                if (payload_length >= 2) {
+                    code = static_cast<uint16_t>((static_cast<uint8_t>(payload[0]) << 8) | static_cast<uint8_t>(payload[1]));
+                }
+                bool valid_code = payload_length == 0 ||
+                                  (payload_length >= 2 && ((code >= 1000 && code <= 1003) ||
+                                                           (code >= 1007 && code <= 1011) ||
+                                                           (code >= 3000 && code <= 4999)));
+                if (!valid_code || !WebSocketFrame::valid_utf8(payload + std::min<size_t>(payload_length, 2),
+                                                               payload_length - std::min<size_t>(payload_length, 2))) {
+                    fail_websocket(session, valid_code ? 1007 : 1002);
+                    break;
+                }
+                
+                // Answer with the same code unless this side already started closing
+                session.close_code = code;
+                if (!session.close_sent) {
+                    session.socket->take_output(session.out.pending);
+                    WebSocketFrame::append(session.out.pending, WebSocketFrame::Close,
+                                           std::string_view(payload, std::min<size_t>(payload_length, 2)));
+                    session.close_sent = true;
+                    session.close_started = std::chrono::steady_clock::now();
+                }
+                session.socket->mark_closed();
+                session.finishing = true;
+                break;
+            }
+        }
+    }
+    
+    buffer.erase(0, offset);
+    if (buffer.empty() && buffer.capacity() > WEBSOCKET_READ_SIZE) {
+        std::string().swap(buffer);
+    }
+}
+
+// Sends a close frame for a protocol violation and drops the connection once it is out
+void HttpServer::fail_websocket(WebSocketSession& session, uint16_t code) {
+    session.socket->mark_closed();
+    if (!session.close_sent) {
+        char payload[2] = {static_cast<char>(code >> 8), static_cast<char>(code & 0xFF)};
+        WebSocketFrame::append(session.out.pending, WebSocketFrame::Close, std::string_view(payload, 2));
+        session.close_sent = true;
+        session.close_started = std::chrono::steady_clock::now();
+    }
+    session.close_code = code;
+    session.finishing = true;
+}
+
+// Moves frames queued by handlers out and writes them. False once the connection is done.
+bool HttpServer::flush_websocket(WebSocketSession& session) {
+    if (!session.close_sent && session.socket->take_output(session.out.pending)) {
+        session.close_sent = true;
+        session.close_started = std::chrono::steady_clock::now();
+    }
+    if (!flush_outbound(*session.conn, session.out)) {
+        return false;
+    }
+    return !(session.finishing && session.out.pending.empty());
+}
+
+std::map<int, HttpServer::WebSocketSession>::iterator HttpServer::close_websocket(
+    std::map<int, WebSocketSession>::iterator it) {
+    WebSocketSession& session = it->second;
+    session.socket->mark_closed();
+    if (session.handlers->on_close) {
+        session.handlers->on_close(*session.socket, session.close_code);
+    }
+    if (session.handlers->on_signal) {
+        unwatch_channel(session.handlers->channel);
+    }
+    close_connection(session.conn);
+    return websockets.erase(it);
+}
+
+bool HttpServer::is_http2_upgrade(const HttpRequest& request) {
+    std::string upgrade = find_header(request, HttpHeader::Upgrade);
+    std::string connection = find_header(request, HttpHeader::Connection);
+    std::transform(upgrade.begin(), upgrade.end(), upgrade.begin(), ::tolower);
+    std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+    return request.version == "HTTP/1.1" && upgrade.find("h2c") != std::string::npos &&
+           connection.find("upgrade") != std::string::npos && connection.find("http2-settings") != std::string::npos;
+}
+
+std::unique_ptr<Http2Connection> HttpServer::new_http2_connection(int fd) {
+    Http2Connection::Settings settings;
+    settings.max_concurrent_streams = http2_max_streams;
+    settings.max_header_list_size = static_cast<uint32_t>(limits.max_header_size);
+    settings.max_body_size = limits.max_body_size;
+    // As much as one HTTP/1.1 connection may hold, whatever the number of streams
+    settings.max_buffered = limits.max_body_size;
+    // Handlers that read the body themselves get it through a pipe as it arrives
+    settings.stream_body = [this](const std::string& method, const std::string& path) {
+        HttpRequest request = parse_request(method + " " + path + " HTTP/2.0\r\n");
+        const RouteEntry* route = find_route(request);
+        return route && route->options.stream_body;
+    };
+    settings.wake = [this, fd]() { wake_http2_output(fd); };
+    settings.header_timeout = std::chrono::milliseconds(limits.header_timeout_ms);
+    settings.body_timeout = std::chrono::milliseconds(limits.body_idle_timeout_ms);
+    settings.send_timeout = std::chrono::milliseconds(limits.write_timeout_ms);
+    return std::unique_ptr<Http2Connection>(new Http2Connection(settings));
+}
+
+// Hands the connection to the event loop, which reads frames from then on
+bool HttpServer::open_http2(Connection& conn, std::unique_ptr<Http2Connection> protocol) {
+    conn.phase = Connection::Phase::Stream;
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        if (!running) {
+            return false;
+        }
+        new_http2_sessions.push_back(Http2Session{conn.shared_from_this(), std::move(protocol), Outbound{"", false, now}, now});
+    }
+    wake_event_loop();
+    return true;
+}
+
+void HttpServer::run_http2(std::chrono::steady_clock::time_point now, bool check_idle) {
+    std::vector<Http2Session> adopted;
+    std::vector<Http2Response> responses;
+    std::set<int> output;
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        adopted.swap(new_http2_sessions);
+        responses.swap(http2_responses);
+        output.swap(http2_output);
+    }
+    
+    for (auto& session : adopted) {
+        int fd = session.conn->socket;
+        auto it = http2_sessions.emplace(fd, std::move(session)).first;
+        
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+            close_http2(it);
+            continue;
+        }
+        // The preface, and whatever followed it, may already be buffered
+        std::vector<Http2Connection::Request> requests;
+        it->second.protocol->receive(it->second.conn->buffer, requests, now);
+        dispatch_http2_requests(it->second, requests);
+        output.insert(fd);
+    }
+    
+    // A response for a connection that closed meanwhile, or whose socket number was reused, is dropped
+    for (auto& response : responses) {
+        auto it = http2_sessions.find(response.conn->socket);
+        if (it == http2_sessions.end() || it->second.conn != response.conn) {
+            response.body->cancel();
+            continue;
+        }
+        it->second.protocol->respond(response.stream_id, std::move(response.fields), std::move(response.body));
+        output.insert(it->first);
+    }
+    
+    for (int fd : output) {
+        auto it = http2_sessions.find(fd);
+        if (it != http2_sessions.end() && !flush_http2(it->second)) {
+            close_http2(it);
+        }
+    }
+    
+    if (!check_idle) {
+        return;
+    }
+    for (auto it = http2_sessions.begin(); it != http2_sessions.end();) {
+        Http2Session& session = it->second;
+        bool alive = true;
+        // Streams have deadlines of their own, for requests that stall or responses the client does not take
+        session.protocol->expire(now);
+        if (!session.out.pending.empty()) {
+            alive = now - session.out.last_write < std::chrono::milliseconds(limits.write_timeout_ms);
+        } else {
+            // Idle connections are told to go away, which closes them once the GOAWAY is out
+            if (session.protocol->open_streams() == 0 &&
+                now - std::max(session.last_received, session.out.last_write) >=
+                    std::chrono::milliseconds(limits.idle_timeout_ms)) {
+                session.protocol->go_away();
+            }
+            alive = flush_http2(session);
+        }
+        it = alive ? std::next(it) : close_http2(it);
+    }
+}
+
+void HttpServer::handle_http2_io(int fd, uint32_t events) {
+    auto it = http2_sessions.find(fd);
+    bool alive = true;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        alive = read_http2(it->second);
+    }
+    if (!alive || !flush_http2(it->second)) {
+        close_http2(it);
+    }
+}
+
+// Reads frames and starts the requests they complete. False once the client is gone.
+bool HttpServer::read_http2(Http2Session& session) {
+    std::string& buffer = session.conn->buffer;
+    
+    // A few reads per wakeup keep one busy client from starving the others
+    for (int reads = 0; reads < 4; ++reads) {
+        size_t used = buffer.size();
+        buffer.resize(used + WEBSOCKET_READ_SIZE);
+        ssize_t received = session.conn->receive(&buffer[used], WEBSOCKET_READ_SIZE, false);
+        buffer.resize(used + std::max<ssize_t>(received, 0));
+        if (received < 0 && errno == EINTR) continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        
+        session.last_received = std::chrono::steady_clock::now();
+        std::vector<Http2Connection::Request> requests;
+        bool valid = session.protocol->receive(buffer, requests, session.last_received);
+        dispatch_http2_requests(session, requests);
+        if (!valid || static_cast<size_t>(received) < WEBSOCKET_READ_SIZE) {
+            break;
+        }
+    }
+    if (buffer.empty() && buffer.capacity() > WEBSOCKET_READ_SIZE) {
+        std::string().swap(buffer);
+    }
+    return true;
+}
+
+// Every stream is queued on its own, on the connection's home worker; idle workers steal
+// from there, so one connection can still keep them all busy
+void HttpServer::dispatch_http2_requests(Http2Session& session, std::vector<Http2Connection::Request>& requests) {
+    if (requests.empty()) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (auto& received : requests) {
+        auto shared = std::make_shared<Http2Connection::Request>(std::move(received));
+        std::shared_ptr<Connection> conn = session.conn;
+        scheduler->push(conn->home_worker, QueuedConnection{conn, now, [this, conn, shared](bool shed) {
+            Http2Connection::Request& stream = *shared;
+            HttpRequest request = parse_request(stream.method + " " + stream.path + " HTTP/2.0\r\n");
+            if (!stream.authority.empty()) {
+                request.headers["host"] = stream.authority;
+            }
+            // Repeated fields are joined the way HTTP/1.1 would have folded them
+            for (auto& field : stream.headers) {
+                auto inserted = request.headers.emplace(field.first, field.second);
+                if (!inserted.second) {
+                    inserted.first->second += (field.first == "cookie" ? "; " : ", ") + field.second;
+                }
+            }
+            index_headers(request);
+            request.body = std::move(stream.body);
+            serve_http2_stream(conn, stream.stream_id, request, std::move(stream.body_stream), shed);
+        }});
+    }
+}
+
+// Runs on a worker: produces the response to one stream and passes it to the event loop
+void HttpServer::serve_http2_stream(const std::shared_ptr<Connection>& conn, uint32_t stream_id, HttpRequest& request,
+                                    std::shared_ptr<Http2RequestBody> body_stream, bool shed) {
+    HttpResponse response;
+    const RouteEntry* route = shed ? nullptr : find_route(request);
+    CacheLookup lookup{};
+    ResponseCache::CachedResponse cached;
+    
+    if (shed) {
+        send_error_response(response, 503, "Service Unavailable");
+        response.headers["Retry-After"] = "1";
+    } else if (lookup_cached_response(request, route, lookup, cached)) {
+        respond_http2_stream(conn, stream_id, response, lookup, &cached);
+        return;
+    } else if (route && route->async_handler) {
+        spawn(serve_async_http2_stream(conn, stream_id, std::move(request), std::move(body_stream), route, lookup), handlers);
+        return;
+    } else if (route && route->options.execution == RouteOptions::Execution::Blocking && current_worker != SIZE_MAX) {
+        // Inline routes run here, on the worker: the event loop cannot wait on a stream's buffer
+        queue_blocking([this, conn, stream_id, request = std::move(request), body_stream]() mutable {
+            serve_http2_stream(conn, stream_id, request, body_stream, false);
+        });
+        return;
+    } else {
+        // Streaming handlers read the body from the stream's pipe as it arrives, or, when it came
+        // whole, from the buffer through the same interface
+        size_t body_offset = 0;
+        auto body_timeout = std::chrono::milliseconds(limits.body_idle_timeout_ms);
+        if (route && route->options.stream_body && body_stream) {
+            request.read_body = [&body_stream, body_timeout](char* buffer, size_t length) {
+                return body_stream->read(buffer, length, body_timeout);
+            };
+        } else if (route && route->options.stream_body) {
+            request.read_body = [&request, &body_offset](char* buffer, size_t length) -> ssize_t {
+                return copy_buffered_body(request, body_offset, buffer, length);
+            };
+        } else {
+            parse_request_body(request);
+        }
+        if (route) {
+            route->handler(request, response);
+        } else {
+            send_error_response(response, 404, "Not Found");
+        }
+    }
+    
+    respond_http2_stream(conn, stream_id, response, lookup, nullptr);
+}
+
+// A streamed request body is read on the blocking pool, so the handler never holds a worker while it waits
+Task<void> HttpServer::serve_async_http2_stream(std::shared_ptr<Connection> conn, uint32_t stream_id,
+                                                HttpRequest request, std::shared_ptr<Http2RequestBody> body_stream,
+                                                const RouteEntry* route, CacheLookup lookup) {
+    size_t body_offset = 0;
+    if (route->options.stream_body && body_stream) {
+        request.read_body_async = [this, &body_stream](char* buffer, size_t length) {
+            return read_streamed_body_async(*body_stream, buffer, length);
+        };
+    } else if (route->options.stream_body) {
+        request.read_body_async = [&request, &body_offset](char* buffer, size_t length) {
+            return read_buffered_body_async(request, body_offset, buffer, length);
+        };
+    } else {
+        parse_request_body(request);
+    }
+    
+    HttpResponse response;
+    try {
+        co_await route->async_handler(request, response);
+    } catch (const std::exception& e) {
+        response = HttpResponse();
+        send_error_response(response, 500, "Internal Server Error");
+    }
+    respond_http2_stream(conn, stream_id, response, lookup, nullptr);
+}
+
+ssize_t HttpServer::copy_buffered_body(const HttpRequest& request, size_t& offset, char* buffer, size_t length) {
+    size_t count = std::min(length, request.body.size() - offset);
+    std::memcpy(buffer, request.body.data() + offset, count);
+    offset += count;
+    return static_cast<ssize_t>(count);
+}
+
+// Waiting on the client is left to the blocking pool, so the handler does not hold a worker
+Task<ssize_t> HttpServer::read_streamed_body_async(Http2RequestBody& body_stream, char* buffer, size_t length) {
+    auto timeout = std::chrono::milliseconds(limits.body_idle_timeout_ms);
+    co_return co_await offload(*this, [&body_stream, buffer, length, timeout]() {
+        return body_stream.read(buffer, length, timeout);
+    });
+}
+
+Task<ssize_t> HttpServer::read_buffered_body_async(const HttpRequest& request, size_t& offset, char* buffer,
+                                                   size_t length) {
+    co_return copy_buffered_body(request, offset, buffer, length);
+}
+
+// Sends what a handler produced, or the cached response when `cached` is set, on one stream
+void HttpServer::respond_http2_stream(const std::shared_ptr<Connection>& conn, uint32_t stream_id,
+                                      HttpResponse& response, const CacheLookup& lookup,
+                                      const ResponseCache::CachedResponse* cached) {
+    bool cache_hit = cached != nullptr;
+    
+    // Event streams and WebSockets take over a whole connection, which a stream cannot
+    if ((response.event_source && response.status_code == 200) || (response.websocket && response.status_code == 101)) {
+        response = HttpResponse();
+        send_error_response(response, 501, "Not supported over HTTP/2; use HTTP/1.1");
     }
     
-    HttpRequest request = parse_request(request_str);
-    HttpResponse response;
+    if (lookup.use && !cache_hit && response.status_code == 200 && !response.is_binary && !response.stream_body) {
+        response_cache->store(lookup.key, split_response(build_response(response)), lookup.generation);
+    }
     
-    // Find matching route
-    bool route_found = false;
-    for (const auto& method_routes : routes) {
-        if (method_routes.first == request.method) {
-            for (const auto& route : method_routes.second) {
-                std::string pattern = route.first;
-                
-                // Simple pattern matching for {param} style routes
-                std::regex param_regex(R"(\{[^}]+\})");
-                std::string regex_pattern = std::regex_replace(pattern, param_regex, "([^/]+)");
-                regex_pattern = "^" + regex_pattern + "$";
-                
-                std::regex route_regex(regex_pattern);
-                std::smatch matches;
-                
-                if (std::regex_match(request.path, matches, route_regex)) {
-                    route.second(request, response);
-                    route_found = true;
-                    break;
+    // A file goes out through the stream's buffer a piece at a time, like any streamed body
+    std::shared_ptr<ResponseFile> file = std::move(response.file);
+    if (file) {
+        response.stream_body = [file](const HttpResponse::ChunkWriter& write) {
+            std::string chunk;
+            size_t offset = 0;
+            while (offset < file->size) {
+                chunk.resize(std::min(HTTP2_FILE_CHUNK, file->size - offset));
+                ssize_t count = pread(file->fd, &chunk[0], chunk.size(), static_cast<off_t>(offset));
+                if (count <= 0) {
+                    return;
+                }
+                chunk.resize(count);
+                offset += count;
+                if (!write(chunk)) {
+                    return;
                 }
             }
-            if (route_found) break;
-        }
+        };
     }
     
-    if (!route_found) {
-        send_error_response(response, 404, "Not Found");
+    // Header names are lowercase in HTTP/2, and the connection-level ones do not exist
+    HeaderList fields;
+    auto add_field = [&fields](std::string name, const std::string& value) {
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name != "connection" && name != "keep-alive" && name != "transfer-encoding" && name != "upgrade") {
+            fields.emplace_back(std::move(name), value);
+        }
+    };
+    std::string body;
+    if (cache_hit) {
+        // The cached head is an HTTP/1.1 status line and header lines, read back into fields
+        std::istringstream head(cached->head);
+        std::string line;
+        std::getline(head, line);
+        fields.emplace_back(":status", line.substr(9, 3));
+        while (std::getline(head, line) && line.size() > 1) {
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                add_field(line.substr(0, colon), line.substr(colon + 2, line.size() - colon - 3));
+            }
+        }
+        size_t body_start = cached->tail.find("\r\n\r\n") + 4;
+        body = cached->tail.substr(body_start);
+        fields.emplace_back("content-length", std::to_string(body.size()));
+    } else {
+        fields.emplace_back(":status", std::to_string(response.status_code));
+        for (const auto& header : response.headers) {
+            add_field(header.first, header.second);
+        }
+        if (file) {
+            fields.emplace_back("content-length", std::to_string(file->size));
+        } else if (!response.stream_body) {
+            body = response.is_binary ? std::string(response.binary_data.begin(), response.binary_data.end())
+                                      : std::move(response.body);
+            fields.emplace_back("content-length", std::to_string(body.size()));
+        }
     }
     
-    std::string response_str = build_response(response);
-    send(client_socket, response_str.c_str(), response_str.length(), 0);
-    
-    if (response.is_binary && !response.binary_data.empty()) {
-        send(client_socket, response.binary_data.data(), response.binary_data.size(), 0);
+    if (!response.stream_body || cache_hit) {
+        post_http2_response(conn, stream_id, std::move(fields), std::make_shared<Http2Body>(std::move(body)));
+        return;
     }
     
-    close(client_socket);
+    // A streamed body goes through a bounded buffer; the handler waits while the client is slow
+    int fd = conn->socket;
+    auto stream_body = std::make_shared<Http2Body>([this, fd]() { wake_http2_output(fd); }, HTTP2_STREAM_BUFFER);
+    post_http2_response(conn, stream_id, std::move(fields), stream_body);
+    
+    bool client_alive = true;
+    response.stream_body([this, &stream_body, &client_alive](const std::string& chunk) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(limits.write_timeout_ms);
+        while (client_alive && !chunk.empty()) {
+            Http2Body::WriteStatus status = stream_body->write(chunk, HTTP2_WRITE_SLICE);
+            if (status == Http2Body::WriteStatus::Written) {
+                break;
+            }
+            client_alive = status == Http2Body::WriteStatus::Full && running &&
+                           std::chrono::steady_clock::now() < deadline;
+        }
+        return client_alive;
+    });
+    if (client_alive) {
+        stream_body->finish();
+    } else {
+        stream_body->cancel();
+    }
+}
+
+void HttpServer::post_http2_response(const std::shared_ptr<Connection>& conn, uint32_t stream_id, HeaderList fields,
+                                     std::shared_ptr<Http2Body> body) {
+    bool needs_wake;
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        // Responses finishing together share one wakeup
+        needs_wake = http2_responses.empty();
+        http2_responses.push_back(Http2Response{conn, stream_id, std::move(fields), std::move(body)});
+    }
+    if (needs_wake) {
+        wake_event_loop();
+    }
+}
+
+// Called from any thread when a stream has output, or window to give back, for the event loop to send
+void HttpServer::wake_http2_output(int fd) {
+    {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        http2_output.insert(fd);
+    }
+    wake_event_loop();
+}
+
+// Frames what is ready, a budget at a time, for as long as the socket takes it.
+// False once the connection is done.
+bool HttpServer::flush_http2(Http2Session& session) {
+    while (true) {
+        if (!flush_outbound(*session.conn, session.out)) {
+            return false;
+        }
+        if (!session.out.pending.empty() || !session.protocol->write(session.out.pending, HTTP2_WRITE_BUDGET)) {
+            break;
+        }
+    }
+    return !(session.protocol->finished() && session.out.pending.empty());
+}
+
+std::map<int, HttpServer::Http2Session>::iterator HttpServer::close_http2(std::map<int, Http2Session>::iterator it) {
+    it->second.protocol->abandon();
+    close_connection(it->second.conn);
+    return http2_sessions.erase(it);
 }
 
 HttpRequest HttpServer::parse_request(const std::string& request_str) {
@@ -292,6 +2844,7 @@ HttpRequest HttpServer::parse_request(const std::string& request_str) {
     if (std::getline(iss, line)) {
         std::istringstream request_line(line);
         request_line >> request.method >> request.path >> request.version;
+        request.method_id = parse_method(request.method);
         
         // Parse query parameters
         size_t query_pos = request.path.find('?');
@@ -325,26 +2878,23 @@ HttpRequest HttpServer::parse_request(const std::string& request_str) {
             value.erase(0, value.find_first_not_of(" \t"));
             value.erase(value.find_last_not_of(" \t\r\n") + 1);
             
-            request.headers[key] = value;
+            // A field sent on several lines is one list, as if sent on one line with commas
+            auto inserted = request.headers.emplace(key, value);
+            if (!inserted.second) {
+                inserted.first->second += ", " + value;
+            }
         }
     }
+    index_headers(request);
     
-    // Parse body
-    std::string body;
-    std::string body_line;
-    while (std::getline(iss, body_line)) {
-        body += body_line + "\n";
-    }
-    if (!body.empty()) {
-        body.pop_back(); // Remove last newline
-    }
-    request.body = body;
-    
+    return request;
+}
+
+void HttpServer::parse_request_body(HttpRequest& request) {
     // Parse form data based on content type
-    auto content_type_it = request.headers.find("Content-Type");
-    if (content_type_it != request.headers.end()) {
-        std::string content_type = content_type_it->second;
-        
+    std::string content_type = find_header(request, HttpHeader::ContentType);
+    if (!content_type.empty()) {
+
         if (content_type.find("multipart/form-data") != std::string::npos) {
             size_t boundary_pos = content_type.find("boundary=");
             if (boundary_pos != std::string::npos) {
@@ -367,8 +2917,6 @@ HttpRequest HttpServer::parse_request(const std::string& request_str) {
             parse_url_encoded_form_data(request);
         }
     }
-    
-    return request;
 }
 
 std::string HttpServer::build_response(const HttpResponse& response) {
@@ -380,15 +2928,22 @@ std::string HttpServer::build_response(const HttpResponse& response) {
         oss << header.first << ": " << header.second << "\r\n";
     }
     
-    if (response.is_binary) {
+    if (response.stream_body) {
+        if (!response.close_delimited) {
+            oss << "Transfer-Encoding: chunked\r\n";
+        }
+    } else if (response.file) {
+        oss << "Content-Length: " << response.file->size << "\r\n";
+    } else if (response.is_binary) {
         oss << "Content-Length: " << response.binary_data.size() << "\r\n";
-    } else {
+    } else if (!response.event_source && !response.websocket) {
+        // Event streams end when the connection closes instead, and 101 responses have no body
         oss << "Content-Length: " << response.body.length() << "\r\n";
     }
     
     oss << "\r\n";
     
-    if (!response.is_binary) {
+    if (!response.is_binary && !response.stream_body) {
         oss << response.body;
     }
     
@@ -532,6 +3087,21 @@ std::string HttpServer::extract_filename_from_path(const std::string& path) {
 }
 
 // CRUD handlers
+bool HttpServer::parse_item_body(const HttpRequest& request, std::map<std::string, std::string>& item) {
+    if (!request.form_data.empty()) {
+        item = request.form_data;
+        return true;
+    }
+    
+    // An empty body creates an empty item
+    size_t pos = 0;
+    json_skip_whitespace(request.body, pos);
+    if (pos == request.body.size()) {
+        return true;
+    }
+    return json_parse_object(request.body, pos, item);
+}
+
 void HttpServer::handle_crud_create(const HttpRequest& request, HttpResponse& response) {
     std::regex collection_regex(R"(/api/data/([^/]+))");
     std::smatch matches;
@@ -539,50 +3109,184 @@ void HttpServer::handle_crud_create(const HttpRequest& request, HttpResponse& re
     if (std::regex_match(request.path, matches, collection_regex)) {
         std::string collection = matches[1].str();
         
-        // Parse JSON body (simple implementation)
         std::map<std::string, std::string> item;
+        if (!parse_item_body(request, item)) {
+            send_error_response(response, 400, "Invalid JSON body");
+            return;
+        }
         
-        // For simplicity, we'll use form data or a simple key=value format
-        if (!request.form_data.empty()) {
-            item = request.form_data;
-        } else {
-            // Simple JSON-like parsing (very basic)
-            std::string body = request.body;
-            if (body.find('{') != std::string::npos && body.find('}') != std::string::npos) {
-                // Remove braces and split by commas
-                body = body.substr(1, body.length() - 2);
-                std::istringstream iss(body);
-                std::string pair;
-                
-                while (std::getline(iss, pair, ',')) {
-                    size_t colon_pos = pair.find(':');
-                    if (colon_pos != std::string::npos) {
-                        std::string key = pair.substr(0, colon_pos);
-                        std::string value = pair.substr(colon_pos + 1);
-                        
-                        // Remove quotes and whitespace
-                        key.erase(std::remove_if(key.begin(), key.end(), [](char c) {
-                            return c == '"' || c == ' ' || c == '\t';
-                        }), key.end());
-                        
-                        value.erase(std::remove_if(value.begin(), value.end(), [](char c) {
-                            return c == '"' || c == ' ' || c == '\t';
-                        }), value.end());
-                        
-                        item[key] = value;
-                    }
-                }
-            }
+        DataStore::WriteOptions options;
+        if (!parse_ttl_param(request, options.ttl)) {
+            send_error_response(response, 400, "Invalid ttl");
+            return;
         }
         
-        std::string id = data_store.create(collection, item);
+        uint64_t version = 0;
+        std::string id = data_store.create(collection, item, options, &version);
         std::string json_response = "{\"id\":\"" + id + "\",\"status\":\"created\"}";
         send_json_response(response, json_response, 201);
+        response.headers["ETag"] = format_etag(version);
     } else {
         send_error_response(response, 400, "Invalid collection path");
     }
 }
 
+void HttpServer::handle_crud_batch(const HttpRequest& request, HttpResponse& response) {
+    std::regex batch_regex(R"(/api/data/([^/]+)/_batch)");
+    std::smatch matches;
+    
+    if (!std::regex_match(request.path, matches, batch_regex)) {
+        send_error_response(response, 400, "Invalid collection path");
+        return;
+    }
+    std::string collection = matches[1].str();
+    
+    // The body is a JSON array or NDJSON stream of {"op": ..., "id": ..., "item": {...}}
+    std::vector<std::map<std::string, std::string>> entries;
+    if (!json_parse_object_list(request.body, entries)) {
+        send_error_response(response, 400, "Invalid JSON body");
+        return;
+    }
+    
+    std::vector<DataStore::BatchOperation> operations;
+    operations.reserve(entries.size());
+    std::vector<bool> valid(entries.size(), true);
+    
+    for (size_t i = 0; i < entries.size(); ++i) {
+        auto& entry = entries[i];
+        DataStore::BatchOperation operation;
+        operation.id = entry["id"];
+        if (entry.count("version")) {
+            uint64_t version;
+            operation.options.expected_versions.push_back(parse_version(entry["version"], version) ? version
+                                                                                                  : UINT64_MAX);
+        }
+        bool valid_ttl = !entry.count("ttl") || parse_ttl(entry["ttl"], operation.options.ttl);
+        
+        const std::string& op = entry["op"];
+        size_t pos = 0;
+        bool has_item = entry.count("item") && json_parse_object(entry["item"], pos, operation.item);
+        
+        if (!valid_ttl) {
+            valid[i] = false;
+            continue;
+        } else if (op == "create" && has_item) {
+            operation.type = DataStore::BatchOperation::Type::Create;
+        } else if (op == "update" && has_item && !operation.id.empty()) {
+            operation.type = DataStore::BatchOperation::Type::Update;
+        } else if (op == "delete" && !operation.id.empty()) {
+            operation.type = DataStore::BatchOperation::Type::Delete;
+        } else {
+            valid[i] = false;
+            continue;
+        }
+        operations.push_back(std::move(operation));
+    }
+    
+    std::vector<DataStore::BatchResult> results = data_store.apply_batch(collection, operations);
+    
+    // Report one result per submitted entry, in order
+    std::string json_response = "{\"results\":[";
+    size_t applied = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (i > 0) json_response += ",";
+        if (!valid[i]) {
+            json_response += "{\"status\":400,\"error\":\"Invalid operation\"}";
+            continue;
+        }
+        
+        const auto& result = results[applied++];
+        json_response += "{\"id\":\"" + json_escape(result.id) + "\",\"status\":" + std::to_string(result.status);
+        if (result.status == 404) {
+            json_response += ",\"error\":\"Item not found\"";
+        } else if (result.status == 412) {
+            json_response += ",\"error\":\"Version mismatch\"";
+        }
+        json_response += "}";
+    }
+    json_response += "]}";
+    
+    send_json_response(response, json_response);
+}
+
+void HttpServer::handle_crud_import(const HttpRequest& request, HttpResponse& response) {
+    std::regex import_regex(R"(/api/data/([^/]+)/_import)");
+    std::smatch matches;
+    
+    if (!std::regex_match(request.path, matches, import_regex)) {
+        send_error_response(response, 400, "Invalid collection path");
+        return;
+    }
+    std::string collection = matches[1].str();
+    
+    // Records are parsed line by line as they arrive and stored in small batches,
+    // so memory use does not depend on the size of the upload
+    const size_t batch_size = 1024;
+    const size_t max_line_length = 1024 * 1024;
+    std::vector<DataStore::BatchOperation> batch;
+    DataStore::WriteOptions options;
+    if (!parse_ttl_param(request, options.ttl)) {
+        send_error_response(response, 400, "Invalid ttl");
+        return;
+    }
+    size_t imported = 0;
+    size_t failed = 0;
+    
+    auto flush = [&]() {
+        if (!batch.empty()) {
+            imported += data_store.apply_batch(collection, batch).size();
+            batch.clear();
+        }
+    };
+    auto add_line = [&](const std::string& line, size_t begin, size_t end) {
+        size_t pos = begin;
+        while (pos < end && (line[pos] == ' ' || line[pos] == '\t' || line[pos] == '\r')) ++pos;
+        if (pos == end) return;
+        
+        DataStore::BatchOperation operation;
+        operation.type = DataStore::BatchOperation::Type::Create;
+        operation.options = options;
+        std::string record = line.substr(pos, end - pos);
+        size_t record_pos = 0;
+        if (json_parse_object(record, record_pos, operation.item)) {
+            batch.push_back(std::move(operation));
+            if (batch.size() >= batch_size) flush();
+        } else {
+            failed++;
+        }
+    };
+    
+    std::string pending;
+    char buffer[16384];
+    ssize_t bytes_read;
+    while ((bytes_read = request.read_body(buffer, sizeof(buffer))) > 0) {
+        pending.append(buffer, bytes_read);
+        
+        size_t line_start = 0;
+        size_t newline;
+        while ((newline = pending.find('\n', line_start)) != std::string::npos) {
+            add_line(pending, line_start, newline);
+            line_start = newline + 1;
+        }
+        pending.erase(0, line_start);
+        
+        if (pending.size() > max_line_length) {
+            flush();
+            send_error_response(response, 413, "Record too large");
+            return;
+        }
+    }
+    add_line(pending, 0, pending.size());
+    flush();
+    
+    std::string json_response = "{\"imported\":" + std::to_string(imported) + ",\"failed\":" + std::to_string(failed);
+    if (bytes_read < 0) {
+        json_response += ",\"error\":\"Incomplete body\"";
+    }
+    json_response += "}";
+    send_json_response(response, json_response, bytes_read < 0 ? 400 : 200);
+}
+
 void HttpServer::handle_crud_read(const HttpRequest& request, HttpResponse& response) {
     std::regex item_regex(R"(/api/data/([^/]+)/([^/]+))");
     std::smatch matches;
@@ -591,17 +3295,25 @@ void HttpServer::handle_crud_read(const HttpRequest& request, HttpResponse& resp
         std::string collection = matches[1].str();
         std::string id = matches[2].str();
         
-        auto item = data_store.read(collection, id);
+        std::vector<std::string> fields;
+        if (!parse_fields_param(request, fields)) {
+            send_error_response(response, 400, "Invalid fields");
+            return;
+        }
+        
+        uint64_t version = 0;
+        DataStore::Item item;
+        if (!serving_inline) {
+            item = data_store.read(collection, id, &version, fields);
+        } else if (!data_store.try_read(collection, id, item, &version, fields)) {
+            inline_declined = true;
+            return;
+        }
         if (!item.empty()) {
-            std::string json_response = "{";
-            bool first = true;
-            for (const auto& pair : item) {
-                if (!first) json_response += ",";
-                json_response += "\"" + pair.first + "\":\"" + pair.second + "\"";
-                first = false;
-            }
-            json_response += "}";
-            send_json_response(response, json_response);
+            send_json_response(response, json_serialize_object(item));
+            // A projection is not the representation a write's If-Match would compare
+            // against, so it gets a weak tag, which writes never accept
+            response.headers["ETag"] = fields.empty() ? format_etag(version) : "W/" + format_etag(version);
         } else {
             send_error_response(response, 404, "Item not found");
         }
@@ -610,6 +3322,204 @@ void HttpServer::handle_crud_read(const HttpRequest& request, HttpResponse& resp
     }
 }
 
+void HttpServer::handle_crud_search(const HttpRequest& request, HttpResponse& response) {
+    std::regex search_regex(R"(/api/data/([^/]+)/_search)");
+    std::smatch matches;
+    
+    if (!std::regex_match(request.path, matches, search_regex)) {
+        send_error_response(response, 400, "Invalid collection path");
+        return;
+    }
+    std::string collection = matches[1].str();
+    
+    auto query_it = request.query_params.find("q");
+    if (query_it == request.query_params.end() || SearchIndex::tokenize(query_it->second).empty()) {
+        send_error_response(response, 400, "Missing search query");
+        return;
+    }
+    size_t limit;
+    if (!parse_limit_param(request, 20, 1000, limit)) {
+        send_error_response(response, 400, "Invalid limit");
+        return;
+    }
+    
+    std::vector<SearchIndex::Hit> hits;
+    size_t total = 0;
+    if (!data_store.search(collection, query_it->second, limit, hits, &total)) {
+        send_error_response(response, 404, "Search not enabled for collection");
+        return;
+    }
+    
+    std::string json_response = "{\"total\":" + std::to_string(total) + ",\"results\":[";
+    char score[32];
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (i > 0) json_response += ",";
+        snprintf(score, sizeof(score), "%.4f", hits[i].score);
+        json_response += "{\"id\":\"" + json_escape(hits[i].id) + "\",\"score\":" + score + "}";
+    }
+    json_response += "]}";
+    
+    send_json_response(response, json_response);
+}
+
+void HttpServer::handle_crud_aggregate(const HttpRequest& request, HttpResponse& response) {
+    std::regex aggregate_regex(R"(/api/data/([^/]+)/_aggregate)");
+    std::smatch matches;
+    
+    if (!std::regex_match(request.path, matches, aggregate_regex)) {
+        send_error_response(response, 400, "Invalid collection path");
+        return;
+    }
+    std::string collection = matches[1].str();
+    
+    auto metrics_it = request.query_params.find("metrics");
+    std::vector<AggregateMetric> metrics;
+    if (!parse_metrics(metrics_it == request.query_params.end() ? "count" : metrics_it->second, metrics)) {
+        send_error_response(response, 400, "Invalid metrics");
+        return;
+    }
+    auto group_it = request.query_params.find("group_by");
+    std::string group_by = group_it == request.query_params.end() ? "" : group_it->second;
+    auto where_it = request.query_params.find("where");
+    std::vector<Aggregator::Filter> filters;
+    if (where_it != request.query_params.end() && !parse_filters(where_it->second, filters)) {
+        send_error_response(response, 400, "Invalid filter");
+        return;
+    }
+    
+    // Each field is reduced once, however many metrics ask for it
+    std::vector<std::string> fields;
+    for (const auto& metric : metrics) {
+        if (!metric.field.empty() && std::find(fields.begin(), fields.end(), metric.field) == fields.end()) {
+            fields.push_back(metric.field);
+        }
+    }
+    
+    auto groups = data_store.aggregate(collection, fields, group_by, filters);
+    
+    std::string json_response;
+    if (group_by.empty()) {
+        json_response = "{" + aggregate_group_json(groups.front(), metrics, fields) + "}";
+    } else {
+        json_response = "{\"group_by\":\"" + json_escape(group_by) + "\",\"groups\":[";
+        for (size_t i = 0; i < groups.size(); ++i) {
+            if (i > 0) json_response += ",";
+            json_response += "{\"key\":";
+            json_response += groups[i].has_key ? "\"" + json_escape(groups[i].key) + "\"" : "null";
+            json_response += "," + aggregate_group_json(groups[i], metrics, fields) + "}";
+        }
+        json_response += "]}";
+    }
+    
+    send_json_response(response, json_response);
+}
+
+void HttpServer::handle_crud_changes(const HttpRequest& request, HttpResponse& response) {
+    std::regex changes_regex(R"(/api/data/([^/]+)/_changes)");
+    std::smatch matches;
+    
+    if (!std::regex_match(request.path, matches, changes_regex)) {
+        send_error_response(response, 400, "Invalid collection path");
+        return;
+    }
+    std::string collection = matches[1].str();
+    if (!data_store.change_feed_enabled()) {
+        send_error_response(response, 404, "Change feed is disabled");
+        return;
+    }
+    
+    // EventSource reconnects with Last-Event-ID; other watchers pass the sequence they
+    // last saw. Without either the stream starts with the next change.
+    auto since_it = request.query_params.find("since");
+    std::string resume = since_it != request.query_params.end() ? since_it->second
+                                                               : find_header(request, HttpHeader::LastEventId);
+    uint64_t since = 0;
+    if (resume.empty()) {
+        since = data_store.last_commit();
+    } else if (resume != "0" && !parse_version(resume, since)) {
+        send_error_response(response, 400, "Invalid since");
+        return;
+    }
+    
+    if (is_websocket_upgrade(request)) {
+        // Over a WebSocket each change is one text message, sent as the feed is signalled.
+        // Handlers run on the event loop, so the feed is read on the blocking pool, by one
+        // job at a time that goes round again when signalled meanwhile.
+        struct ChangeWatch {
+            std::mutex mutex;
+            uint64_t cursor;
+            bool running;
+            bool again;
+        };
+        auto watch = std::make_shared<ChangeWatch>();
+        watch->cursor = since;
+        watch->running = false;
+        watch->again = false;
+        WebSocketHandlers handlers;
+        handlers.channel = "/api/data/" + collection;
+        handlers.on_signal = [this, collection, watch](WebSocket& socket) {
+            {
+                std::lock_guard<std::mutex> lock(watch->mutex);
+                if (watch->running) {
+                    watch->again = true;
+                    return;
+                }
+                watch->running = true;
+            }
+            queue_blocking([this, collection, watch, socket = socket.shared_from_this()]() {
+                while (true) {
+                    std::vector<ChangeFeed::Event> events;
+                    do {
+                        events.clear();
+                        if (!data_store.read_changes(collection, watch->cursor, CHANGE_EVENTS_PER_POLL, events)) {
+                            socket->send_text("{\"type\":\"reset\",\"since\":" + std::to_string(watch->cursor) + "}");
+                        }
+                        for (const auto& event : events) {
+                            std::string message = "{\"sequence\":" + std::to_string(event.sequence) + ",\"type\":\"" +
+                                                  ChangeFeed::type_name(event.type) + "\",\"id\":\"" +
+                                                  json_escape(event.id) + "\"";
+                            if (event.item) {
+                                message += ",\"item\":" + json_serialize_object(*event.item);
+                            }
+                            socket->send_text(message + "}");
+                            watch->cursor = event.sequence;
+                        }
+                    } while (events.size() == CHANGE_EVENTS_PER_POLL && socket->is_open());
+                    
+                    std::lock_guard<std::mutex> lock(watch->mutex);
+                    if (!watch->again) {
+                        watch->running = false;
+                        return;
+                    }
+                    watch->again = false;
+                }
+            });
+        };
+        handlers.on_open = handlers.on_signal;
+        accept_websocket(request, response, handlers);
+        return;
+    }
+    
+    response.headers["Content-Type"] = "text/event-stream";
+    response.headers["Cache-Control"] = "no-cache";
+    response.event_channel = "/api/data/" + collection;
+    response.event_source = [this, collection, since](std::string& out) mutable {
+        std::vector<ChangeFeed::Event> events;
+        if (!data_store.read_changes(collection, since, CHANGE_EVENTS_PER_POLL, events)) {
+            // Changes were lost; the watcher reloads the collection and carries on from here
+            out += "event: reset\ndata: {\"since\":" + std::to_string(since) + "}\n\n";
+        }
+        for (const auto& event : events) {
+            out += "id: " + std::to_string(event.sequence) + "\nevent: " + ChangeFeed::type_name(event.type) +
+                   "\ndata: ";
+            out += event.item ? json_serialize_object(*event.item) : "{\"id\":\"" + json_escape(event.id) + "\"}";
+            out += "\n\n";
+            since = event.sequence;
+        }
+        return true;
+    };
+}
+
 void HttpServer::handle_crud_read_all(const HttpRequest& request, HttpResponse& response) {
     std::regex collection_regex(R"(/api/data/([^/]+))");
     std::smatch matches;
@@ -617,20 +3527,46 @@ void HttpServer::handle_crud_read_all(const HttpRequest& request, HttpResponse&
     if (std::regex_match(request.path, matches, collection_regex)) {
         std::string collection = matches[1].str();
         
-        auto items = data_store.read_all(collection);
+        // Only the requested fields are copied out of the store and serialised
+        std::vector<std::string> fields;
+        if (!parse_fields_param(request, fields)) {
+            send_error_response(response, 400, "Invalid fields");
+            return;
+        }
+        
+        // NDJSON exports stream the collection page by page instead of building one array,
+        // all pages read from one snapshot so the export is consistent while writes continue
+        auto format_it = request.query_params.find("format");
+        if (format_it != request.query_params.end() && format_it->second == "ndjson") {
+            response.status_code = 200;
+            response.status_text = "OK";
+            response.headers["Content-Type"] = "application/x-ndjson";
+            response.headers["Access-Control-Allow-Origin"] = "*";
+            response.stream_body = [this, collection, fields](const HttpResponse::ChunkWriter& write) {
+                auto snapshot = data_store.snapshot();
+                std::string last_id;
+                while (true) {
+                    auto page = data_store.scan(collection, last_id, 256, snapshot.get(), fields);
+                    if (page.empty()) break;
+                    
+                    std::string chunk;
+                    for (const auto& item : page) {
+                        chunk += json_serialize_object(item);
+                        chunk += "\n";
+                    }
+                    last_id = page.back()["id"];
+                    if (!write(chunk)) break;
+                }
+            };
+            return;
+        }
+        
+        auto items = data_store.read_all(collection, fields);
         std::string json_response = "[";
         
         for (size_t i = 0; i < items.size(); ++i) {
             if (i > 0) json_response += ",";
-            json_response += "{";
-            
-            bool first = true;
-            for (const auto& pair : items[i]) {
-                if (!first) json_response += ",";
-                json_response += "\"" + pair.first + "\":\"" + pair.second + "\"";
-                first = false;
-            }
-            json_response += "}";
+            json_response += json_serialize_object(items[i]);
         }
         
         json_response += "]";
@@ -649,42 +3585,66 @@ void HttpServer::handle_crud_update(const HttpRequest& request, HttpResponse& re
         std::string id = matches[2].str();
         
         std::map<std::string, std::string> item;
+        if (!parse_item_body(request, item)) {
+            send_error_response(response, 400, "Invalid JSON body");
+            return;
+        }
+        
+        DataStore::WriteOptions options;
+        if (!parse_ttl_param(request, options.ttl)) {
+            send_error_response(response, 400, "Invalid ttl");
+            return;
+        }
+        bool conditional = parse_if_match(request, options.expected_versions);
         
-        if (!request.form_data.empty()) {
-            item = request.form_data;
+        uint64_t version = 0;
+        auto status = data_store.update(collection, id, item, options, &version);
+        if (status == DataStore::WriteStatus::Ok) {
+            std::string json_response = "{\"id\":\"" + id + "\",\"status\":\"updated\"}";
+            send_json_response(response, json_response);
+            response.headers["ETag"] = format_etag(version);
         } else {
-            // Simple JSON-like parsing (basic implementation)
-            std::string body = request.body;
-            if (body.find('{') != std::string::npos && body.find('}') != std::string::npos) {
-                body = body.substr(1, body.length() - 2);
-                std::istringstream iss(body);
-                std::string pair;
-                
-                while (std::getline(iss, pair, ',')) {
-                    size_t colon_pos = pair.find(':');
-                    if (colon_pos != std::string::npos) {
-                        std::string key = pair.substr(0, colon_pos);
-                        std::string value = pair.substr(colon_pos + 1);
-                        
-                        key.erase(std::remove_if(key.begin(), key.end(), [](char c) {
-                            return c == '"' || c == ' ' || c == '\t';
-                        }), key.end());
-                        
-                        value.erase(std::remove_if(value.begin(), value.end(), [](char c) {
-                            return c == '"' || c == ' ' || c == '\t';
-                        }), value.end());
-                        
-                        item[key] = value;
-                    }
-                }
+            send_write_error(response, status, conditional);
+        }
+    } else {
+        send_error_response(response, 400, "Invalid item path");
+    }
+}
+
+void HttpServer::handle_crud_patch(const HttpRequest& request, HttpResponse& response) {
+    std::regex item_regex(R"(/api/data/([^/]+)/([^/]+))");
+    std::smatch matches;
+    
+    if (std::regex_match(request.path, matches, item_regex)) {
+        std::string collection = matches[1].str();
+        std::string id = matches[2].str();
+        
+        // Merge patch (RFC 7396): listed fields are set, fields given as null are removed
+        std::map<std::string, std::string> changes = request.form_data;
+        std::vector<std::string> removed;
+        if (changes.empty()) {
+            size_t pos = 0;
+            if (!json_parse_object(request.body, pos, changes, &removed)) {
+                send_error_response(response, 400, "Invalid JSON body");
+                return;
             }
         }
         
-        if (data_store.update(collection, id, item)) {
+        DataStore::WriteOptions options;
+        if (!parse_ttl_param(request, options.ttl)) {
+            send_error_response(response, 400, "Invalid ttl");
+            return;
+        }
+        bool conditional = parse_if_match(request, options.expected_versions);
+        
+        uint64_t version = 0;
+        auto status = data_store.patch(collection, id, changes, removed, options, &version);
+        if (status == DataStore::WriteStatus::Ok) {
             std::string json_response = "{\"id\":\"" + id + "\",\"status\":\"updated\"}";
             send_json_response(response, json_response);
+            response.headers["ETag"] = format_etag(version);
         } else {
-            send_error_response(response, 404, "Item not found");
+            send_write_error(response, status, conditional);
         }
     } else {
         send_error_response(response, 400, "Invalid item path");
@@ -699,11 +3659,15 @@ void HttpServer::handle_crud_delete(const HttpRequest& request, HttpResponse& re
         std::string collection = matches[1].str();
         std::string id = matches[2].str();
         
-        if (data_store.remove(collection, id)) {
+        DataStore::WriteOptions options;
+        bool conditional = parse_if_match(request, options.expected_versions);
+        
+        auto status = data_store.remove(collection, id, options);
+        if (status == DataStore::WriteStatus::Ok) {
             std::string json_response = "{\"id\":\"" + id + "\",\"status\":\"deleted\"}";
             send_json_response(response, json_response);
         } else {
-            send_error_response(response, 404, "Item not found");
+            send_write_error(response, status, conditional);
         }
     } else {
         send_error_response(response, 400, "Invalid item path");
@@ -711,7 +3675,8 @@ void HttpServer::handle_crud_delete(const HttpRequest& request, HttpResponse& re
 }
 
 // File handlers
-void HttpServer::handle_file_upload(const HttpRequest& request, HttpResponse& response) {
+// A coroutine, so a large upload waits for the disk without holding a worker
+Task<void> HttpServer::handle_file_upload(const HttpRequest& request, HttpResponse& response) {
     // Debug: Check if we have any form data or files
     if (request.files.empty() && request.form_data.empty()) {
         std::string debug_info = "No files or form data found. ";
@@ -724,12 +3689,12 @@ void HttpServer::handle_file_upload(const HttpRequest& request, HttpResponse& re
         }
         debug_info += ", Body size: " + std::to_string(request.body.size());
         send_error_response(response, 400, debug_info);
-        return;
+        co_return;
     }
     
     if (request.files.empty()) {
         send_error_response(response, 400, "No files uploaded");
-        return;
+        co_return;
     }
     
     std::string json_response = "{\"uploaded_files\":[";
@@ -739,11 +3704,27 @@ void HttpServer::handle_file_upload(const HttpRequest& request, HttpResponse& re
         const auto& file_data = file_pair.second;
         
         std::string filepath = "uploads/" + file_data.filename;
-        std::ofstream file(filepath, std::ios::binary);
+        AsyncFile file(*this);
         
-        if (file.is_open()) {
-            file.write(file_data.data.data(), file_data.data.size());
-            file.close();
+        if (co_await file.open(filepath, O_WRONLY | O_CREAT | O_TRUNC)) {
+            bool written = co_await file.write(std::string_view(file_data.data.data(), file_data.data.size()), 0);
+            // Closing can report what the write left unflushed, so both are checked
+            bool closed = co_await file.close();
+            if (!written || !closed) {
+                // A truncated file must not be served as if the upload had worked
+                int error = file.error();
+                const char* path = filepath.c_str();
+                co_await offload(*this, [path]() { ::unlink(path); });
+                if (!first && response_cache) {
+                    response_cache->invalidate("/api/files");
+                }
+                if (error == ENOSPC || error == EDQUOT) {
+                    send_error_response(response, 507, "Insufficient Storage");
+                } else {
+                    send_error_response(response, 500, "Failed to write " + file_data.filename);
+                }
+                co_return;
+            }
             
             if (!first) json_response += ",";
             json_response += "{\"filename\":\"" + file_data.filename + "\",\"status\":\"uploaded\"}";
@@ -753,6 +3734,10 @@ void HttpServer::handle_file_upload(const HttpRequest& request, HttpResponse& re
     
     json_response += "]}";
     send_json_response(response, json_response, 201);
+    
+    if (response_cache) {
+        response_cache->invalidate("/api/files");
+    }
 }
 
 void HttpServer::handle_file_download(const HttpRequest& request, HttpResponse& response) {
@@ -787,6 +3772,76 @@ void HttpServer::handle_file_list(const HttpRequest&, HttpResponse& response) {
     send_json_response(response, json_response);
 }
 
+void HttpServer::handle_stats(const HttpRequest&, HttpResponse& response) {
+    DataStore::MemoryStats stats = data_store.memory_stats();
+    const char* policies[] = {"lru", "lfu", "tinylfu"};
+    
+    std::string json_response = "{\"memory\":{";
+    json_response += "\"budget_bytes\":" + std::to_string(stats.budget.max_bytes);
+    json_response += ",\"used_bytes\":" + std::to_string(stats.used_bytes);
+    json_response += ",\"eviction_policy\":\"" + std::string(policies[static_cast<int>(stats.budget.policy)]) + "\"";
+    json_response += ",\"evictions\":" + std::to_string(stats.evictions);
+    json_response += ",\"expirations\":" + std::to_string(stats.expirations);
+    json_response += "}";
+    if (stats.spilling) {
+        json_response += ",\"disk\":{";
+        json_response += "\"spills\":" + std::to_string(stats.spills);
+        json_response += ",\"promotions\":" + std::to_string(stats.promotions);
+        json_response += ",\"runs\":" + std::to_string(stats.disk.runs);
+        json_response += ",\"disk_bytes\":" + std::to_string(stats.disk.disk_bytes);
+        json_response += ",\"memtable_bytes\":" + std::to_string(stats.disk.memtable_bytes);
+        json_response += ",\"flushes\":" + std::to_string(stats.disk.flushes);
+        json_response += ",\"compactions\":" + std::to_string(stats.disk.compactions);
+        json_response += ",\"bloom_skips\":" + std::to_string(stats.disk.bloom_skips);
+        json_response += "}";
+    }
+    if (tls) {
+        TlsStats tls_stats = tls->stats();
+        json_response += ",\"tls\":{";
+        json_response += "\"handshakes\":" + std::to_string(tls_stats.handshakes);
+        json_response += ",\"resumed\":" + std::to_string(tls_stats.resumed);
+        json_response += ",\"failed\":" + std::to_string(tls_stats.failed);
+        json_response += ",\"kernel_send\":" + std::to_string(tls_stats.kernel_send);
+        json_response += ",\"kernel_receive\":" + std::to_string(tls_stats.kernel_receive);
+        json_response += "}";
+    }
+    json_response += ",\"workers\":{";
+    json_response += "\"threads\":" + std::to_string(scheduler->worker_count());
+    json_response += ",\"queued\":" + std::to_string(scheduler->size());
+    json_response += ",\"stolen\":" + std::to_string(scheduler->stolen());
+    json_response += ",\"inline\":" + std::to_string(inline_served.load());
+    json_response += "}";
+    json_response += ",\"collections\":{";
+    
+    bool first = true;
+    for (const auto& collection : stats.collections) {
+        if (!first) json_response += ",";
+        first = false;
+        const auto& usage = collection.second;
+        json_response += "\"" + json_escape(collection.first) + "\":{";
+        json_response += "\"records\":" + std::to_string(usage.records);
+        json_response += ",\"bytes\":" + std::to_string(usage.bytes);
+        json_response += ",\"evictions\":" + std::to_string(usage.evictions);
+        json_response += ",\"expirations\":" + std::to_string(usage.expirations);
+        auto search = stats.search.find(collection.first);
+        if (search != stats.search.end()) {
+            json_response += ",\"search\":{\"documents\":" + std::to_string(search->second.documents);
+            json_response += ",\"terms\":" + std::to_string(search->second.terms);
+            json_response += ",\"posting_bytes\":" + std::to_string(search->second.posting_bytes) + "}";
+        }
+        auto columns = stats.columns.find(collection.first);
+        if (columns != stats.columns.end()) {
+            json_response += ",\"columns\":{\"rows\":" + std::to_string(columns->second.rows);
+            json_response += ",\"bytes\":" + std::to_string(columns->second.bytes);
+            json_response += ",\"dictionary_columns\":" + std::to_string(columns->second.dictionary_columns) + "}";
+        }
+        json_response += "}";
+    }
+    json_response += "}}";
+    
+    send_json_response(response, json_response);
+}
+
 void HttpServer::handle_client_page(const HttpRequest&, HttpResponse& response) {
     send_file_response(response, "client.html");
 }
@@ -800,6 +3855,16 @@ void HttpServer::send_json_response(HttpResponse& response, const std::string& j
     response.body = json;
 }
 
+// A conditional write on a missing record fails its precondition as well (RFC 9110 13.1.1)
+void HttpServer::send_write_error(HttpResponse& response, DataStore::WriteStatus status, bool conditional) {
+    if (status == DataStore::WriteStatus::VersionMismatch ||
+        (status == DataStore::WriteStatus::NotFound && conditional)) {
+        send_error_response(response, 412, "Precondition Failed");
+    } else {
+        send_error_response(response, 404, "Item not found");
+    }
+}
+
 void HttpServer::send_error_response(HttpResponse& response, int status, const std::string& message) {
     response.status_code = status;
     response.status_text = message;
@@ -815,10 +3880,6 @@ void HttpServer::send_file_response(HttpResponse& response, const std::string& f
         return;
     }
     
-    file.seekg(0, std::ios::end);
-    size_t file_size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    
     std::string content_type = get_content_type(filepath);
     
     // For HTML files, serve as text content instead of binary download
@@ -834,10 +3895,18 @@ void HttpServer::send_file_response(HttpResponse& response, const std::string& f
         response.headers["Access-Control-Allow-Origin"] = "*";
         response.body = html_content;
     } else {
-        // Binary file download
-        response.binary_data.resize(file_size);
-        file.read(response.binary_data.data(), file_size);
+        // Binary file download, sent from the open file rather than copied into the response
         file.close();
+        int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (fd == -1 || fstat(fd, &info) == -1) {
+            if (fd != -1) {
+                close(fd);
+            }
+            send_error_response(response, 404, "File not found");
+            return;
+        }
+        response.file = std::make_shared<ResponseFile>(fd, static_cast<size_t>(info.st_size));
         
         response.is_binary = true;
         response.status_code = 200;
@@ -0,0 +1,249 @@
+#include "../include/json_util.h"
+#include <cstdio>
+#include <cstdlib>
+
+std::string json_escape(const std::string& value) {
+    std::string escaped;
+    escaped.reserve(value.size() + 2);
+
+    for (char c : value) {
+        switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            case '\t': escaped += "\\t"; break;
+            case '\b': escaped += "\\b"; break;
+            case '\f': escaped += "\\f"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buffer[8];
+                    snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                    escaped += buffer;
+                } else {
+                    escaped += c;
+                }
+        }
+    }
+
+    return escaped;
+}
+
+std::string json_serialize_object(const std::map<std::string, std::string>& item) {
+    std::string json = "{";
+    bool first = true;
+    for (const auto& pair : item) {
+        if (!first) json += ",";
+        json += "\"" + json_escape(pair.first) + "\":\"" + json_escape(pair.second) + "\"";
+        first = false;
+    }
+    json += "}";
+    return json;
+}
+
+void json_skip_whitespace(const std::string& text, size_t& pos) {
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) {
+        ++pos;
+    }
+}
+
+static void append_utf8(std::string& out, unsigned long code_point) {
+    if (code_point < 0x80) {
+        out += static_cast<char>(code_point);
+    } else if (code_point < 0x800) {
+        out += static_cast<char>(0xC0 | (code_point >> 6));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+        out += static_cast<char>(0xE0 | (code_point >> 12));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (code_point >> 18));
+        out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code_point & 0x3F));
+    }
+}
+
+static bool parse_hex4(const std::string& text, size_t pos, unsigned long& value) {
+    if (pos + 4 > text.size()) return false;
+    char* end = nullptr;
+    std::string digits = text.substr(pos, 4);
+    value = std::strtoul(digits.c_str(), &end, 16);
+    return end == digits.c_str() + 4;
+}
+
+static bool parse_string(const std::string& text, size_t& pos, std::string& out) {
+    if (pos >= text.size() || text[pos] != '"') return false;
+    ++pos;
+
+    while (pos < text.size()) {
+        char c = text[pos++];
+        if (c == '"') return true;
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+
+        if (pos >= text.size()) return false;
+        char escape = text[pos++];
+        switch (escape) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned long code_point;
+                if (!parse_hex4(text, pos, code_point)) return false;
+                pos += 4;
+                // Combine surrogate pairs
+                unsigned long low;
+                if (code_point >= 0xD800 && code_point <= 0xDBFF && pos + 6 <= text.size() &&
+                    text[pos] == '\\' && text[pos + 1] == 'u' && parse_hex4(text, pos + 2, low) &&
+                    low >= 0xDC00 && low <= 0xDFFF) {
+                    code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                    pos += 6;
+                }
+                append_utf8(out, code_point);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+
+    return false;
+}
+
+// Skips a nested object or array, returning its raw text
+static bool parse_nested(const std::string& text, size_t& pos, std::string& raw) {
+    size_t start = pos;
+    int depth = 0;
+
+    while (pos < text.size()) {
+        char c = text[pos];
+        if (c == '"') {
+            std::string ignored;
+            if (!parse_string(text, pos, ignored)) return false;
+            continue;
+        }
+        if (c == '{' || c == '[') {
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            if (--depth == 0) {
+                ++pos;
+                raw = text.substr(start, pos - start);
+                return true;
+            }
+        }
+        ++pos;
+    }
+
+    return false;
+}
+
+static bool parse_value(const std::string& text, size_t& pos, std::string& value, bool& is_null) {
+    is_null = false;
+    if (pos >= text.size()) return false;
+
+    char c = text[pos];
+    if (c == '"') {
+        return parse_string(text, pos, value);
+    }
+    if (c == '{' || c == '[') {
+        return parse_nested(text, pos, value);
+    }
+
+    // Numbers and literals run until the next delimiter
+    size_t start = pos;
+    while (pos < text.size() && text[pos] != ',' && text[pos] != '}' && text[pos] != ']' &&
+           text[pos] != ' ' && text[pos] != '\t' && text[pos] != '\r' && text[pos] != '\n') {
+        ++pos;
+    }
+    value = text.substr(start, pos - start);
+    if (value.empty()) return false;
+
+    is_null = value == "null";
+    if (is_null || value == "true" || value == "false") return true;
+
+    char* end = nullptr;
+    std::strtod(value.c_str(), &end);
+    return end == value.c_str() + value.size();
+}
+
+bool json_parse_object(const std::string& text, size_t& pos, std::map<std::string, std::string>& item,
+                       std::vector<std::string>* null_keys) {
+    json_skip_whitespace(text, pos);
+    if (pos >= text.size() || text[pos] != '{') return false;
+    ++pos;
+
+    json_skip_whitespace(text, pos);
+    if (pos < text.size() && text[pos] == '}') {
+        ++pos;
+        return true;
+    }
+
+    while (pos < text.size()) {
+        std::string key;
+        json_skip_whitespace(text, pos);
+        if (!parse_string(text, pos, key)) return false;
+
+        json_skip_whitespace(text, pos);
+        if (pos >= text.size() || text[pos] != ':') return false;
+        ++pos;
+        json_skip_whitespace(text, pos);
+
+        std::string value;
+        bool is_null;
+        if (!parse_value(text, pos, value, is_null)) return false;
+        if (is_null) {
+            if (null_keys) null_keys->push_back(key);
+        } else {
+            item[key] = value;
+        }
+
+        json_skip_whitespace(text, pos);
+        if (pos >= text.size()) return false;
+        if (text[pos] == '}') {
+            ++pos;
+            return true;
+        }
+        if (text[pos] != ',') return false;
+        ++pos;
+    }
+
+    return false;
+}
+
+bool json_parse_object_list(const std::string& text, std::vector<std::map<std::string, std::string>>& items) {
+    size_t pos = 0;
+    json_skip_whitespace(text, pos);
+    bool is_array = pos < text.size() && text[pos] == '[';
+    if (is_array) {
+        ++pos;
+        json_skip_whitespace(text, pos);
+        if (pos < text.size() && text[pos] == ']') {
+            return true;
+        }
+    }
+
+    while (true) {
+        std::map<std::string, std::string> item;
+        if (!json_parse_object(text, pos, item)) return false;
+        items.push_back(std::move(item));
+
+        json_skip_whitespace(text, pos);
+        if (is_array) {
+            if (pos >= text.size()) return false;
+            if (text[pos] == ']') return true;
+            if (text[pos] != ',') return false;
+            ++pos;
+        } else if (pos >= text.size()) {
+            return true;
+        }
+    }
+}
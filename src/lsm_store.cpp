@@ -0,0 +1,681 @@
+#include "../include/lsm_store.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Keys between two sparse index entries; a lookup reads one such block
+static const size_t INDEX_INTERVAL = 16;
+
+// Runs of one level that trigger a merge into the next
+static const size_t RUNS_PER_LEVEL = 4;
+
+static const size_t BLOOM_BITS_PER_KEY = 10;
+static const int BLOOM_HASHES = 7;
+
+static const size_t READ_CHUNK = 64 * 1024;
+static const size_t WRITE_CHUNK = 1024 * 1024;
+
+// Bookkeeping bytes per memtable entry on top of its key and fields
+static const size_t ENTRY_OVERHEAD = 96;
+
+static void put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+static bool get_varint(const char*& pos, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*pos++);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool get_bytes(const char*& pos, const char* end, std::string& out) {
+    uint64_t length;
+    if (!get_varint(pos, end, length) || static_cast<uint64_t>(end - pos) < length) {
+        return false;
+    }
+    out.assign(pos, length);
+    pos += length;
+    return true;
+}
+
+// key, deleted flag, sequence, field count, then length-prefixed field names and values
+static void encode_entry(std::string& out, const std::string& key, const LsmStore::Entry& entry) {
+    put_varint(out, key.size());
+    out += key;
+    out += entry.deleted ? '\1' : '\0';
+    put_varint(out, entry.sequence);
+    put_varint(out, entry.item.size());
+    for (const auto& field : entry.item) {
+        put_varint(out, field.first.size());
+        out += field.first;
+        put_varint(out, field.second.size());
+        out += field.second;
+    }
+}
+
+// Leaves `pos` untouched and returns false when the buffer ends mid-entry
+static bool decode_entry(const char*& pos, const char* end, std::string& key, LsmStore::Entry& entry) {
+    const char* cursor = pos;
+    uint64_t sequence, fields;
+    if (!get_bytes(cursor, end, key) || cursor >= end) {
+        return false;
+    }
+    entry.deleted = *cursor++ != '\0';
+    if (!get_varint(cursor, end, sequence) || !get_varint(cursor, end, fields)) {
+        return false;
+    }
+
+    entry.sequence = sequence;
+    entry.item.clear();
+    for (uint64_t i = 0; i < fields; ++i) {
+        std::string name, value;
+        if (!get_bytes(cursor, end, name) || !get_bytes(cursor, end, value)) {
+            return false;
+        }
+        entry.item.emplace_hint(entry.item.end(), std::move(name), std::move(value));
+    }
+
+    pos = cursor;
+    return true;
+}
+
+static size_t entry_bytes(const std::string& key, const LsmStore::Entry& entry) {
+    size_t bytes = ENTRY_OVERHEAD + key.size();
+    for (const auto& field : entry.item) {
+        bytes += field.first.size() + field.second.size() + ENTRY_OVERHEAD / 2;
+    }
+    return bytes;
+}
+
+static bool has_prefix(const std::string& key, const std::string& prefix) {
+    return key.compare(0, prefix.size(), prefix) == 0;
+}
+
+static bool write_fully(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+// Bloom filter
+
+void LsmStore::BloomFilter::reset(size_t keys) {
+    bit_count = std::max<size_t>(64, keys * BLOOM_BITS_PER_KEY);
+    bits.assign((bit_count + 63) / 64, 0);
+}
+
+// Double hashing: probe i is h1 + i * h2
+void LsmStore::BloomFilter::add(const std::string& key) {
+    uint64_t h1 = std::hash<std::string>()(key);
+    uint64_t h2 = (h1 >> 17) | (h1 << 47) | 1;
+    for (int i = 0; i < BLOOM_HASHES; ++i) {
+        uint64_t bit = (h1 + i * h2) % bit_count;
+        bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+bool LsmStore::BloomFilter::might_contain(const std::string& key) const {
+    uint64_t h1 = std::hash<std::string>()(key);
+    uint64_t h2 = (h1 >> 17) | (h1 << 47) | 1;
+    for (int i = 0; i < BLOOM_HASHES; ++i) {
+        uint64_t bit = (h1 + i * h2) % bit_count;
+        if (!(bits[bit / 64] & (1ULL << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs are scratch: dropping the last reference deletes the file
+LsmStore::Run::~Run() {
+    if (fd != -1) {
+        close(fd);
+        unlink(path.c_str());
+    }
+}
+
+// Reads a run's entries in order from a given offset
+class LsmStore::RunCursor {
+public:
+    RunCursor(std::shared_ptr<Run> run, uint64_t offset) : run(std::move(run)), file_offset(offset), position(0) {}
+
+    // False at the end of the run or on a read error
+    bool next(std::string& key, Entry& entry) {
+        while (true) {
+            const char* pos = buffer.data() + position;
+            if (decode_entry(pos, buffer.data() + buffer.size(), key, entry)) {
+                position = pos - buffer.data();
+                return true;
+            }
+            if (file_offset >= run->data_bytes) {
+                return false;
+            }
+
+            buffer.erase(0, position);
+            position = 0;
+            size_t want = std::min<uint64_t>(READ_CHUNK, run->data_bytes - file_offset);
+            size_t old_size = buffer.size();
+            buffer.resize(old_size + want);
+            ssize_t n = pread(run->fd, &buffer[old_size], want, file_offset);
+            if (n <= 0) {
+                buffer.resize(old_size);
+                return false;
+            }
+            buffer.resize(old_size + n);
+            file_offset += n;
+        }
+    }
+
+private:
+    std::shared_ptr<Run> run;
+    uint64_t file_offset;
+    std::string buffer;
+    size_t position;
+};
+
+// Streams sorted entries into a new run file
+class LsmStore::RunWriter {
+public:
+    RunWriter(const std::string& path, uint64_t number, int level, size_t expected_entries) : failed(false) {
+        run = std::make_shared<Run>();
+        run->number = number;
+        run->level = level;
+        run->path = path;
+        run->fd = ::open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0600);
+        run->bloom.reset(expected_entries);
+        failed = run->fd == -1;
+    }
+
+    void add(const std::string& key, const Entry& entry) {
+        if (failed) return;
+        if (run->entries % INDEX_INTERVAL == 0) {
+            run->index.emplace_back(key, run->data_bytes + pending.size());
+        }
+        run->bloom.add(key);
+        run->entries++;
+
+        encode_entry(pending, key, entry);
+        if (pending.size() >= WRITE_CHUNK) {
+            flush();
+        }
+    }
+
+    // The finished run, or null if any write failed
+    std::shared_ptr<Run> finish() {
+        flush();
+        if (failed) {
+            if (run->fd != -1) {
+                close(run->fd);
+                unlink(run->path.c_str());
+                run->fd = -1;
+            }
+            return nullptr;
+        }
+        return run;
+    }
+
+private:
+    std::shared_ptr<Run> run;
+    std::string pending;
+    bool failed;
+
+    void flush() {
+        if (failed || pending.empty()) return;
+        failed = !write_fully(run->fd, pending);
+        run->data_bytes += pending.size();
+        pending.clear();
+    }
+};
+
+LsmStore::LsmStore(const std::string& directory, size_t memtable_bytes)
+    : directory(directory), memtable_limit(memtable_bytes), memtable_bytes(0), next_run_number(1),
+      stopping(false), flush_count(0), compaction_count(0), bloom_skip_count(0) {}
+
+LsmStore::~LsmStore() {
+    {
+        std::lock_guard<std::mutex> lock(store_mutex);
+        stopping = true;
+    }
+    flush_needed.notify_all();
+    compaction_needed.notify_all();
+    flush_done.notify_all();
+
+    if (flush_thread.joinable()) flush_thread.join();
+    if (compaction_thread.joinable()) compaction_thread.join();
+}
+
+bool LsmStore::open() {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error) {
+        std::cerr << "Cannot create spill directory " << directory << ": " << error.message() << std::endl;
+        return false;
+    }
+    for (const auto& file : std::filesystem::directory_iterator(directory, error)) {
+        if (file.path().extension() == ".run") {
+            std::filesystem::remove(file.path(), error);
+        }
+    }
+
+    flush_thread = std::thread([this]() { flush_loop(); });
+    compaction_thread = std::thread([this]() { compaction_loop(); });
+    return true;
+}
+
+void LsmStore::insert(const std::string& key, Entry entry) {
+    std::unique_lock<std::mutex> lock(store_mutex);
+
+    size_t bytes = entry_bytes(key, entry);
+    auto existing = memtable.find(key);
+    if (existing != memtable.end()) {
+        memtable_bytes -= entry_bytes(key, existing->second);
+        existing->second = std::move(entry);
+    } else {
+        memtable.emplace(key, std::move(entry));
+    }
+    memtable_bytes += bytes;
+
+    if (memtable_bytes < memtable_limit) {
+        return;
+    }
+
+    // Hand the full memtable to the flush thread, waiting if it is still busy with the last one
+    flush_done.wait(lock, [this]() { return !flushing || stopping; });
+    if (stopping) {
+        return;
+    }
+    flushing = std::make_shared<const Memtable>(std::move(memtable));
+    memtable.clear();
+    memtable_bytes = 0;
+    flush_needed.notify_one();
+}
+
+void LsmStore::put(const std::string& key, uint64_t sequence, const Item& item) {
+    Entry entry;
+    entry.sequence = sequence;
+    entry.item = item;
+    insert(key, std::move(entry));
+}
+
+void LsmStore::remove(const std::string& key) {
+    Entry entry;
+    entry.deleted = true;
+    insert(key, std::move(entry));
+}
+
+bool LsmStore::search_run(const Run& run, const std::string& key, Entry& entry) {
+    // The block to read starts at the last indexed key not after `key`
+    auto block = std::upper_bound(run.index.begin(), run.index.end(), key,
+                                  [](const std::string& value, const std::pair<std::string, uint64_t>& indexed) {
+                                      return value < indexed.first;
+                                  });
+    if (block == run.index.begin()) {
+        return false;
+    }
+    uint64_t start = std::prev(block)->second;
+    uint64_t end = block == run.index.end() ? run.data_bytes : block->second;
+
+    std::string buffer(end - start, '\0');
+    size_t read_total = 0;
+    while (read_total < buffer.size()) {
+        ssize_t n = pread(run.fd, &buffer[read_total], buffer.size() - read_total, start + read_total);
+        if (n <= 0) {
+            return false;
+        }
+        read_total += n;
+    }
+
+    const char* pos = buffer.data();
+    const char* buffer_end = buffer.data() + buffer.size();
+    std::string entry_key;
+    while (decode_entry(pos, buffer_end, entry_key, entry)) {
+        if (entry_key == key) {
+            return true;
+        }
+        if (entry_key > key) {
+            break;
+        }
+    }
+    return false;
+}
+
+bool LsmStore::get(const std::string& key, Entry& entry) {
+    std::shared_ptr<const Memtable> flushing_table;
+    std::vector<std::shared_ptr<Run>> current_runs;
+    {
+        std::lock_guard<std::mutex> lock(store_mutex);
+        auto it = memtable.find(key);
+        if (it != memtable.end()) {
+            entry = it->second;
+            return !entry.deleted;
+        }
+        flushing_table = flushing;
+        current_runs = runs;
+    }
+
+    if (flushing_table) {
+        auto it = flushing_table->find(key);
+        if (it != flushing_table->end()) {
+            entry = it->second;
+            return !entry.deleted;
+        }
+    }
+
+    // Newest run first; the first run holding the key decides
+    size_t skipped = 0;
+    bool found = false;
+    for (const auto& run : current_runs) {
+        if (!run->bloom.might_contain(key)) {
+            skipped++;
+            continue;
+        }
+        if (search_run(*run, key, entry)) {
+            found = true;
+            break;
+        }
+    }
+
+    if (skipped > 0) {
+        std::lock_guard<std::mutex> lock(store_mutex);
+        bloom_skip_count += skipped;
+    }
+    return found && !entry.deleted;
+}
+
+std::vector<std::pair<std::string, LsmStore::Entry>> LsmStore::scan(const std::string& prefix, const std::string& after,
+                                                                    size_t limit) {
+    std::vector<std::pair<std::string, Entry>> result;
+    std::string cursor = after.empty() || after < prefix ? "" : after;
+
+    while (result.size() < limit) {
+        // Copy a slice of the live memtable; the flushing one and the runs are immutable
+        std::vector<std::pair<std::string, Entry>> recent;
+        std::shared_ptr<const Memtable> flushing_table;
+        std::vector<std::shared_ptr<Run>> current_runs;
+        bool recent_truncated = false;
+        {
+            std::lock_guard<std::mutex> lock(store_mutex);
+            auto it = cursor.empty() ? memtable.lower_bound(prefix) : memtable.upper_bound(cursor);
+            size_t live = 0;
+            for (; it != memtable.end() && has_prefix(it->first, prefix); ++it) {
+                if (live == limit) {
+                    recent_truncated = true;
+                    break;
+                }
+                recent.push_back(*it);
+                if (!it->second.deleted) live++;
+            }
+            flushing_table = flushing;
+            current_runs = runs;
+        }
+
+        // Sources in priority order: the newest holder of a key wins
+        struct Source {
+            std::vector<std::pair<std::string, Entry>>::const_iterator slice, slice_end;
+            Memtable::const_iterator table, table_end;
+            std::unique_ptr<RunCursor> run;
+            bool valid;
+            std::string key;
+            Entry entry;
+        };
+        std::vector<Source> sources;
+        auto step = [](Source& source) {
+            if (source.run) {
+                source.valid = source.run->next(source.key, source.entry);
+                return;
+            }
+            source.valid = true;
+            if (source.slice != source.slice_end) {
+                source.key = source.slice->first;
+                source.entry = (source.slice++)->second;
+            } else if (source.table != source.table_end) {
+                source.key = source.table->first;
+                source.entry = (source.table++)->second;
+            } else {
+                source.valid = false;
+            }
+        };
+        // Runs start at an index block, so skip keys up to the cursor; keys past the prefix end the source
+        auto advance = [&](Source& source) {
+            step(source);
+            while (source.valid && (cursor.empty() ? source.key < prefix : source.key <= cursor)) {
+                step(source);
+            }
+            if (source.valid && !has_prefix(source.key, prefix)) {
+                source.valid = false;
+            }
+        };
+
+        sources.emplace_back();
+        sources.back().slice = recent.begin();
+        sources.back().slice_end = recent.end();
+        if (flushing_table) {
+            sources.emplace_back();
+            Source& source = sources.back();
+            source.slice = source.slice_end = recent.end();
+            source.table = cursor.empty() ? flushing_table->lower_bound(prefix) : flushing_table->upper_bound(cursor);
+            source.table_end = flushing_table->end();
+        }
+        for (const auto& run : current_runs) {
+            const std::string& seek = cursor.empty() ? prefix : cursor;
+            auto block = std::upper_bound(run->index.begin(), run->index.end(), seek,
+                                          [](const std::string& value, const std::pair<std::string, uint64_t>& indexed) {
+                                              return value < indexed.first;
+                                          });
+            uint64_t offset = block == run->index.begin() ? 0 : std::prev(block)->second;
+            sources.emplace_back();
+            Source& source = sources.back();
+            source.slice = source.slice_end = recent.end();
+            source.run.reset(new RunCursor(run, offset));
+        }
+        for (auto& source : sources) {
+            advance(source);
+        }
+
+        // Past the last copied memtable key the merge would be missing entries
+        const std::string* bound = recent_truncated ? &recent.back().first : nullptr;
+        bool exhausted = true;
+        while (result.size() < limit) {
+            Source* winner = nullptr;
+            for (auto& source : sources) {
+                if (source.valid && (!winner || source.key < winner->key)) {
+                    winner = &source;
+                }
+            }
+            if (!winner || (bound && winner->key > *bound)) {
+                exhausted = !winner;
+                break;
+            }
+
+            std::string key = winner->key;
+            if (!winner->entry.deleted) {
+                result.emplace_back(key, winner->entry);
+            }
+            for (auto& source : sources) {
+                if (source.valid && source.key == key) {
+                    advance(source);
+                }
+            }
+            cursor = key;
+        }
+
+        if (exhausted || !bound) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+void LsmStore::flush_loop() {
+    std::unique_lock<std::mutex> lock(store_mutex);
+    while (true) {
+        flush_needed.wait(lock, [this]() { return flushing || stopping; });
+        if (stopping) {
+            return;
+        }
+
+        std::shared_ptr<const Memtable> table = flushing;
+        uint64_t number = next_run_number++;
+        lock.unlock();
+
+        RunWriter writer(directory + "/" + std::to_string(number) + ".run", number, 0, table->size());
+        for (const auto& entry : *table) {
+            writer.add(entry.first, entry.second);
+        }
+        std::shared_ptr<Run> run = writer.finish();
+
+        lock.lock();
+        if (!run) {
+            // Keep serving the memtable from memory and try again shortly
+            std::cerr << "Failed to write spill run: " << strerror(errno) << std::endl;
+            flush_done.wait_for(lock, std::chrono::seconds(1), [this]() { return stopping; });
+            continue;
+        }
+
+        runs.insert(runs.begin(), run);
+        flushing.reset();
+        flush_count++;
+        flush_done.notify_all();
+        compaction_needed.notify_one();
+    }
+}
+
+// Finds a level holding RUNS_PER_LEVEL runs. Levels only grow with age, so
+// the runs of a level sit next to each other in `runs`.
+bool LsmStore::find_compaction(size_t& first, size_t& count) {
+    size_t start = 0;
+    for (size_t i = 1; i <= runs.size(); ++i) {
+        if (i == runs.size() || runs[i]->level != runs[start]->level) {
+            if (i - start >= RUNS_PER_LEVEL) {
+                first = start;
+                count = i - start;
+                return true;
+            }
+            start = i;
+        }
+    }
+    return false;
+}
+
+std::shared_ptr<LsmStore::Run> LsmStore::merge_runs(const std::vector<std::shared_ptr<Run>>& inputs, bool drop_deleted) {
+    size_t expected = 0;
+    int level = 0;
+    for (const auto& run : inputs) {
+        expected += run->entries;
+        level = std::max(level, run->level + 1);
+    }
+
+    uint64_t number;
+    {
+        std::lock_guard<std::mutex> lock(store_mutex);
+        number = next_run_number++;
+    }
+    RunWriter writer(directory + "/" + std::to_string(number) + ".run", number, level, expected);
+
+    struct Head {
+        std::unique_ptr<RunCursor> cursor;
+        bool valid;
+        std::string key;
+        Entry entry;
+    };
+    std::vector<Head> heads(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        heads[i].cursor.reset(new RunCursor(inputs[i], 0));
+        heads[i].valid = heads[i].cursor->next(heads[i].key, heads[i].entry);
+    }
+
+    // Inputs are newest first, so the first head holding the smallest key has its latest entry
+    while (true) {
+        Head* winner = nullptr;
+        for (auto& head : heads) {
+            if (head.valid && (!winner || head.key < winner->key)) {
+                winner = &head;
+            }
+        }
+        if (!winner) {
+            break;
+        }
+
+        std::string key = winner->key;
+        if (!(drop_deleted && winner->entry.deleted)) {
+            writer.add(key, winner->entry);
+        }
+        for (auto& head : heads) {
+            while (head.valid && head.key == key) {
+                head.valid = head.cursor->next(head.key, head.entry);
+            }
+        }
+    }
+
+    return writer.finish();
+}
+
+void LsmStore::compaction_loop() {
+    std::unique_lock<std::mutex> lock(store_mutex);
+    while (true) {
+        size_t first = 0, count = 0;
+        compaction_needed.wait(lock, [&]() { return stopping || find_compaction(first, count); });
+        if (stopping) {
+            return;
+        }
+
+        std::vector<std::shared_ptr<Run>> inputs(runs.begin() + first, runs.begin() + first + count);
+        // Deletions only matter while something older could still hold the key
+        bool drop_deleted = first + count == runs.size();
+        lock.unlock();
+
+        std::shared_ptr<Run> merged = merge_runs(inputs, drop_deleted);
+
+        lock.lock();
+        if (!merged) {
+            std::cerr << "Failed to compact spill runs: " << strerror(errno) << std::endl;
+            compaction_needed.wait_for(lock, std::chrono::seconds(1), [this]() { return stopping; });
+            continue;
+        }
+
+        // Flushes only add runs at the front, so the inputs are still contiguous
+        auto position = std::find(runs.begin(), runs.end(), inputs.front());
+        position = runs.erase(position, position + inputs.size());
+        if (merged->entries > 0) {
+            runs.insert(position, merged);
+        }
+        compaction_count++;
+    }
+}
+
+LsmStore::Stats LsmStore::stats() {
+    std::lock_guard<std::mutex> lock(store_mutex);
+    Stats stats;
+    stats.runs = runs.size();
+    stats.disk_bytes = 0;
+    for (const auto& run : runs) {
+        stats.disk_bytes += run->data_bytes;
+    }
+    stats.memtable_bytes = memtable_bytes;
+    stats.flushes = flush_count;
+    stats.compactions = compaction_count;
+    stats.bloom_skips = bloom_skip_count;
+    return stats;
+}
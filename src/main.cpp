@@ -1,19 +1,16 @@
 #include "../include/http_server.h"
 #include <iostream>
 #include <signal.h>
-#include <thread>
-#include <chrono>
+#include <cstdlib>
+#include <sstream>
 
 HttpServer* server = nullptr;
 
+// Only ends the event loop; main() shuts the server down once start() returns
 void signal_handler(int) {
     if (server) {
-        std::cout << "\nShutting down server..." << std::endl;
-        server->stop();
-        delete server;
-        server = nullptr;
+        server->request_stop();
     }
-    exit(0);
 }
 
 int main(int argc, char* argv[]) {
@@ -40,7 +37,16 @@ int main(int argc, char* argv[]) {
     std::cout << "    GET    /api/data/{collection}     - Get all items" << std::endl;
     std::cout << "    GET    /api/data/{collection}/{id} - Get specific item" << std::endl;
     std::cout << "    PUT    /api/data/{collection}/{id} - Update item" << std::endl;
+    std::cout << "    PATCH  /api/data/{collection}/{id} - Update some fields of an item" << std::endl;
     std::cout << "    DELETE /api/data/{collection}/{id} - Delete item" << std::endl;
+    std::cout << "    POST   /api/data/{collection}/_batch - Bulk create/update/delete" << std::endl;
+    std::cout << "    POST   /api/data/{collection}/_import - Stream NDJSON records in" << std::endl;
+    std::cout << "    GET    /api/data/{collection}?format=ndjson - Stream items out as NDJSON" << std::endl;
+    std::cout << "    GET    /api/data/{collection}/_search?q= - Full-text search, ranked ids" << std::endl;
+    std::cout << "    GET    /api/data/{collection}/_aggregate - Count, sum, avg, min, max, group by" << std::endl;
+    std::cout << "    GET    /api/data/{collection}/_changes - Watch changes (Server-Sent Events)" << std::endl;
+    std::cout << "  Monitoring:" << std::endl;
+    std::cout << "    GET    /api/stats                 - Memory usage and eviction counters" << std::endl;
     std::cout << "  File Operations:" << std::endl;
     std::cout << "    POST   /api/files/upload         - Upload files" << std::endl;
     std::cout << "    GET    /api/files                - List uploaded files" << std::endl;
@@ -51,12 +57,152 @@ int main(int argc, char* argv[]) {
     std::cout << "Open http://localhost:" << port << " in your browser to use the web client\n" << std::endl;
     
     server = new HttpServer(port);
-    server->start();
     
-    // Keep the main thread alive
-    while (true) {
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+    // Optional response cache for GET listings, sized in megabytes
+    const char* cache_mb = std::getenv("HTTP_SERVER_RESPONSE_CACHE_MB");
+    if (cache_mb) {
+        try {
+            size_t megabytes = std::stoul(cache_mb);
+            if (megabytes > 0) {
+                server->enable_response_cache(megabytes * 1024 * 1024);
+                std::cout << "Response cache: " << megabytes << "MB" << std::endl;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid HTTP_SERVER_RESPONSE_CACHE_MB. Response cache disabled." << std::endl;
+        }
+    }
+    
+    // Optional memory budget for the data store, with the eviction policy to enforce it
+    const char* budget_mb = std::getenv("HTTP_SERVER_MEMORY_BUDGET_MB");
+    if (budget_mb) {
+        try {
+            DataStore::MemoryBudget budget;
+            budget.max_bytes = std::stoul(budget_mb) * 1024 * 1024;
+            
+            std::string policy = std::getenv("HTTP_SERVER_EVICTION_POLICY") ? std::getenv("HTTP_SERVER_EVICTION_POLICY") : "lru";
+            if (policy == "lfu") {
+                budget.policy = DataStore::EvictionPolicy::Lfu;
+            } else if (policy == "tinylfu") {
+                budget.policy = DataStore::EvictionPolicy::TinyLfu;
+            } else if (policy != "lru") {
+                std::cerr << "Unknown HTTP_SERVER_EVICTION_POLICY. Using lru." << std::endl;
+                policy = "lru";
+            }
+            
+            // Evicted records go to disk instead of being dropped
+            const char* spill_dir = std::getenv("HTTP_SERVER_SPILL_DIR");
+            if (spill_dir) {
+                budget.spill_directory = spill_dir;
+            }
+            
+            if (budget.max_bytes > 0) {
+                server->set_memory_budget(budget);
+                std::cout << "Memory budget: " << budget_mb << "MB (" << policy << " eviction)" << std::endl;
+                if (spill_dir) {
+                    std::cout << "Spilling evicted records to " << spill_dir << std::endl;
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid HTTP_SERVER_MEMORY_BUDGET_MB. Memory budget disabled." << std::endl;
+        }
+    }
+    
+    // Collections to index for full-text search, comma separated, or "*" for all
+    const char* search_collections = std::getenv("HTTP_SERVER_SEARCH_COLLECTIONS");
+    if (search_collections) {
+        std::stringstream list(search_collections);
+        std::string collection;
+        while (std::getline(list, collection, ',')) {
+            collection.erase(0, collection.find_first_not_of(" \t"));
+            collection.erase(collection.find_last_not_of(" \t") + 1);
+            if (!collection.empty()) {
+                server->enable_search(collection);
+                std::cout << "Search index: " << collection << std::endl;
+            }
+        }
+    }
+    
+    // Fields kept in columns for aggregation, as comma-separated collection.field pairs
+    const char* column_list = std::getenv("HTTP_SERVER_COLUMNS");
+    if (column_list) {
+        std::map<std::string, std::vector<std::string>> columns;
+        std::stringstream list(column_list);
+        std::string entry;
+        while (std::getline(list, entry, ',')) {
+            entry.erase(0, entry.find_first_not_of(" \t"));
+            entry.erase(entry.find_last_not_of(" \t") + 1);
+            size_t dot = entry.find('.');
+            if (dot == std::string::npos || dot == 0 || dot + 1 == entry.size()) {
+                std::cerr << "Ignoring invalid HTTP_SERVER_COLUMNS entry: " << entry << std::endl;
+                continue;
+            }
+            columns[entry.substr(0, dot)].push_back(entry.substr(dot + 1));
+        }
+        for (const auto& collection : columns) {
+            server->enable_columns(collection.first, collection.second);
+            std::cout << "Columns: " << collection.first << " (" << collection.second.size() << " fields)" << std::endl;
+        }
+    }
+    
+    // Changes each collection keeps for watchers to resume from; 0 turns the feed off
+    const char* feed_size = std::getenv("HTTP_SERVER_CHANGE_FEED_SIZE");
+    if (feed_size) {
+        try {
+            size_t capacity = std::stoul(feed_size);
+            server->set_change_feed_capacity(capacity);
+            if (capacity == 0) {
+                std::cout << "Change feed: disabled" << std::endl;
+            } else {
+                std::cout << "Change feed: " << capacity << " changes per collection" << std::endl;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid HTTP_SERVER_CHANGE_FEED_SIZE. Using the default." << std::endl;
+        }
+    }
+    
+    // Streams each HTTP/2 connection may have open at once; 0 turns HTTP/2 off
+    const char* http2_streams = std::getenv("HTTP_SERVER_HTTP2_MAX_STREAMS");
+    if (http2_streams) {
+        try {
+            unsigned long streams = std::stoul(http2_streams);
+            server->set_http2_max_streams(static_cast<uint32_t>(streams));
+            if (streams == 0) {
+                std::cout << "HTTP/2: disabled" << std::endl;
+            } else {
+                std::cout << "HTTP/2: " << streams << " streams per connection" << std::endl;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid HTTP_SERVER_HTTP2_MAX_STREAMS. Using the default." << std::endl;
+        }
+    }
+    
+    // TLS on every connection; refusing to start beats serving plaintext by mistake
+    const char* certificate = std::getenv("HTTP_SERVER_TLS_CERT");
+    const char* key = std::getenv("HTTP_SERVER_TLS_KEY");
+    if (certificate || key) {
+        TlsConfig tls;
+        tls.certificate_file = certificate ? certificate : "";
+        tls.key_file = key ? key : (certificate ? certificate : "");
+        const char* kernel_tls = std::getenv("HTTP_SERVER_TLS_KTLS");
+        tls.kernel_tls = !kernel_tls || std::string(kernel_tls) != "0";
+        
+        std::string error;
+        if (!server->enable_tls(tls, error)) {
+            std::cerr << "TLS: " << error << std::endl;
+            delete server;
+            return 1;
+        }
+        std::cout << "TLS: " << tls.certificate_file << (tls.kernel_tls ? " (kernel TLS when available)" : "")
+                  << std::endl;
     }
     
+    server->start();
+    
+    std::cout << "\nShutting down server..." << std::endl;
+    HttpServer* stopping = server;
+    server = nullptr;
+    stopping->stop();
+    delete stopping;
+    
     return 0;
 }
\ No newline at end of file
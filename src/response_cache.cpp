@@ -0,0 +1,75 @@
+#include "../include/response_cache.h"
+
+ResponseCache::ResponseCache(size_t max_bytes)
+    : max_bytes(max_bytes), current_bytes(0), current_generation(0) {}
+
+size_t ResponseCache::entry_size(const std::string& key, const CachedResponse& response) {
+    return key.size() * 2 + response.head.size() + response.tail.size();
+}
+
+bool ResponseCache::lookup(const std::string& key, CachedResponse& response) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        return false;
+    }
+
+    lru.splice(lru.begin(), lru, it->second.lru_position);
+    response = it->second.response;
+    return true;
+}
+
+void ResponseCache::store(const std::string& key, CachedResponse response, uint64_t generation) {
+    size_t size = entry_size(key, response);
+    // A single huge response would flush everything else
+    if (size > max_bytes / 8) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (generation != current_generation) {
+        return;
+    }
+
+    auto existing = entries.find(key);
+    if (existing != entries.end()) {
+        erase(existing);
+    }
+
+    while (current_bytes + size > max_bytes && !lru.empty()) {
+        erase(entries.find(lru.back()));
+    }
+
+    lru.push_front(key);
+    entries.emplace(key, Entry{std::move(response), lru.begin()});
+    current_bytes += size;
+}
+
+uint64_t ResponseCache::generation() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return current_generation;
+}
+
+void ResponseCache::invalidate(const std::string& path) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    ++current_generation;
+
+    invalidate_prefix(path + "?");
+    invalidate_prefix(path + "/");
+}
+
+void ResponseCache::invalidate_prefix(const std::string& prefix) {
+    auto it = entries.lower_bound(prefix);
+    while (it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        auto next = std::next(it);
+        erase(it);
+        it = next;
+    }
+}
+
+void ResponseCache::erase(EntryMap::iterator it) {
+    current_bytes -= entry_size(it->first, it->second.response);
+    lru.erase(it->second.lru_position);
+    entries.erase(it);
+}
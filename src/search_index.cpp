@@ -0,0 +1,282 @@
+#include "../include/search_index.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+// Longer tokens are cut to this many bytes
+static const size_t MAX_TOKEN_LENGTH = 64;
+
+// Index terms a single prefix query term may expand to
+static const size_t MAX_PREFIX_TERMS = 128;
+
+// Dead documents tolerated before the posting lists are rewritten
+static const size_t MIN_DEAD_FOR_COMPACTION = 1024;
+
+// BM25 term frequency saturation and length normalisation
+static const double BM25_K1 = 1.2;
+static const double BM25_B = 0.75;
+
+static void put_varint(std::string& out, uint32_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+static uint32_t get_varint(const char*& pos) {
+    uint32_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*pos++);
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+static bool is_token_byte(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+SearchIndex::SearchIndex() : live_documents(0), total_length(0) {}
+
+std::vector<std::string> SearchIndex::tokenize(const std::string& text) {
+    std::vector<std::string> tokens;
+    std::string token;
+    for (size_t i = 0; i <= text.size(); ++i) {
+        unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+        if (is_token_byte(c)) {
+            if (token.size() < MAX_TOKEN_LENGTH) {
+                token += static_cast<char>(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+            }
+        } else if (!token.empty()) {
+            tokens.push_back(std::move(token));
+            token.clear();
+        }
+    }
+    return tokens;
+}
+
+void SearchIndex::add(const std::string& id, const Item& item) {
+    std::unordered_map<std::string, uint32_t> frequencies;
+    uint32_t length = 0;
+    for (const auto& field : item) {
+        if (field.first == "id") continue;
+        for (auto& token : tokenize(field.second)) {
+            frequencies[std::move(token)]++;
+            length++;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(index_mutex);
+    auto previous = document_numbers.find(id);
+    auto deadline = previous != document_numbers.end() ? documents[previous->second - 1].deadline
+                                                       : std::chrono::steady_clock::time_point();
+    remove_locked(id);
+
+    documents.push_back(Document{id, length, true, deadline});
+    uint32_t number = static_cast<uint32_t>(documents.size());
+    document_numbers[id] = number;
+    live_documents++;
+    total_length += length;
+
+    for (const auto& term : frequencies) {
+        Postings& postings = terms[term.first];
+        put_varint(postings.data, number - postings.last_document);
+        put_varint(postings.data, term.second);
+        postings.last_document = number;
+        postings.entries++;
+    }
+}
+
+void SearchIndex::remove(const std::string& id) {
+    std::unique_lock<std::shared_mutex> lock(index_mutex);
+    remove_locked(id);
+}
+
+void SearchIndex::set_deadline(const std::string& id, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::shared_mutex> lock(index_mutex);
+    auto it = document_numbers.find(id);
+    if (it != document_numbers.end()) {
+        documents[it->second - 1].deadline = deadline;
+    }
+}
+
+void SearchIndex::remove_locked(const std::string& id) {
+    auto it = document_numbers.find(id);
+    if (it == document_numbers.end()) {
+        return;
+    }
+
+    Document& document = documents[it->second - 1];
+    document.live = false;
+    live_documents--;
+    total_length -= document.length;
+    document_numbers.erase(it);
+
+    size_t dead = documents.size() - live_documents;
+    if (dead >= MIN_DEAD_FOR_COMPACTION && dead > live_documents) {
+        compact();
+    }
+}
+
+// Renumbers the live documents densely and rewrites every posting list without the dead ones
+void SearchIndex::compact() {
+    std::vector<uint32_t> renumbered(documents.size() + 1, 0);
+    std::vector<Document> kept;
+    kept.reserve(live_documents);
+    for (size_t i = 0; i < documents.size(); ++i) {
+        if (documents[i].live) {
+            kept.push_back(std::move(documents[i]));
+            renumbered[i + 1] = static_cast<uint32_t>(kept.size());
+        }
+    }
+
+    for (auto it = terms.begin(); it != terms.end();) {
+        Postings rewritten;
+        const char* pos = it->second.data.data();
+        const char* end = pos + it->second.data.size();
+        uint32_t number = 0;
+        while (pos < end) {
+            number += get_varint(pos);
+            uint32_t frequency = get_varint(pos);
+            if (renumbered[number] != 0) {
+                put_varint(rewritten.data, renumbered[number] - rewritten.last_document);
+                put_varint(rewritten.data, frequency);
+                rewritten.last_document = renumbered[number];
+                rewritten.entries++;
+            }
+        }
+
+        if (rewritten.entries == 0) {
+            it = terms.erase(it);
+        } else {
+            rewritten.data.shrink_to_fit();
+            it->second = std::move(rewritten);
+            ++it;
+        }
+    }
+
+    documents.swap(kept);
+    document_numbers.clear();
+    for (size_t i = 0; i < documents.size(); ++i) {
+        document_numbers[documents[i].id] = static_cast<uint32_t>(i + 1);
+    }
+}
+
+std::vector<SearchIndex::Hit> SearchIndex::search(const std::string& query, size_t limit, size_t* total) {
+    // Query terms, each flagged when a `*` right after it asks for prefix matching
+    std::vector<std::pair<std::string, bool>> query_terms;
+    std::vector<std::string> tokens = tokenize(query);
+    size_t next_token = 0;
+    for (size_t i = 0; i < query.size() && next_token < tokens.size(); ++i) {
+        bool at_end = i + 1 == query.size() || !is_token_byte(static_cast<unsigned char>(query[i + 1]));
+        if (is_token_byte(static_cast<unsigned char>(query[i])) && at_end) {
+            bool prefix = i + 1 < query.size() && query[i + 1] == '*';
+            query_terms.emplace_back(tokens[next_token++], prefix);
+        }
+    }
+
+    if (total) {
+        *total = 0;
+    }
+    if (query_terms.empty()) {
+        return {};
+    }
+
+    std::shared_lock<std::shared_mutex> lock(index_mutex);
+    auto now = std::chrono::steady_clock::now();
+    auto never = std::chrono::steady_clock::time_point();
+    double document_count = static_cast<double>(live_documents);
+    double average_length = live_documents ? static_cast<double>(total_length) / live_documents : 1.0;
+
+    std::unordered_map<uint32_t, double> scores;
+    for (size_t t = 0; t < query_terms.size(); ++t) {
+        const std::string& term = query_terms[t].first;
+        auto first = query_terms[t].second ? terms.lower_bound(term) : terms.find(term);
+
+        std::unordered_map<uint32_t, double> term_scores;
+        std::vector<std::pair<uint32_t, uint32_t>> matches;
+        size_t expanded = 0;
+        for (auto it = first; it != terms.end() && expanded < MAX_PREFIX_TERMS; ++it, ++expanded) {
+            if (query_terms[t].second ? it->first.compare(0, term.size(), term) != 0 : it != first) {
+                break;
+            }
+
+            matches.clear();
+            const char* pos = it->second.data.data();
+            const char* end = pos + it->second.data.size();
+            uint32_t number = 0;
+            while (pos < end) {
+                number += get_varint(pos);
+                uint32_t frequency = get_varint(pos);
+                // Expired records stay indexed until the store sweeps them, but are not found
+                const Document& document = documents[number - 1];
+                if (document.live && (document.deadline == never || document.deadline > now)) {
+                    matches.emplace_back(number, frequency);
+                }
+            }
+
+            double frequency_in = static_cast<double>(matches.size());
+            double idf = std::log(1.0 + (document_count - frequency_in + 0.5) / (frequency_in + 0.5));
+            for (const auto& match : matches) {
+                double tf = match.second;
+                double norm = 1.0 - BM25_B + BM25_B * documents[match.first - 1].length / average_length;
+                term_scores[match.first] += idf * tf * (BM25_K1 + 1.0) / (tf + BM25_K1 * norm);
+            }
+        }
+
+        // Every term has to match
+        if (t == 0) {
+            scores.swap(term_scores);
+        } else {
+            for (auto it = scores.begin(); it != scores.end();) {
+                auto found = term_scores.find(it->first);
+                if (found == term_scores.end()) {
+                    it = scores.erase(it);
+                } else {
+                    it->second += found->second;
+                    ++it;
+                }
+            }
+        }
+        if (scores.empty()) {
+            return {};
+        }
+    }
+
+    std::vector<std::pair<double, uint32_t>> ranked;
+    ranked.reserve(scores.size());
+    for (const auto& score : scores) {
+        ranked.emplace_back(score.second, score.first);
+    }
+    // Older records win ties, so equal scores come back in a stable order
+    size_t count = std::min(limit, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(),
+                      [](const std::pair<double, uint32_t>& a, const std::pair<double, uint32_t>& b) {
+                          return a.first != b.first ? a.first > b.first : a.second < b.second;
+                      });
+
+    if (total) {
+        *total = ranked.size();
+    }
+    std::vector<Hit> hits;
+    hits.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        hits.push_back(Hit{documents[ranked[i].second - 1].id, ranked[i].first});
+    }
+    return hits;
+}
+
+SearchIndex::Stats SearchIndex::stats() {
+    std::shared_lock<std::shared_mutex> lock(index_mutex);
+    Stats stats;
+    stats.documents = live_documents;
+    stats.terms = terms.size();
+    stats.posting_bytes = 0;
+    for (const auto& term : terms) {
+        stats.posting_bytes += term.second.data.size();
+    }
+    return stats;
+}
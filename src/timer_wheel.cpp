@@ -0,0 +1,118 @@
+#include "../include/timer_wheel.h"
+#include <algorithm>
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick)
+    : tick(tick), origin(std::chrono::steady_clock::now()), current_tick(0) {
+    for (int level = 0; level < LEVELS; ++level) {
+        for (uint64_t index = 0; index < SLOTS; ++index) {
+            Timer& head = slots[level][index];
+            head.prev = &head;
+            head.next = &head;
+        }
+    }
+}
+
+uint64_t TimerWheel::tick_at(std::chrono::steady_clock::time_point time) const {
+    if (time <= origin) {
+        return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(time - origin).count() / tick.count();
+}
+
+void TimerWheel::arm(Timer& timer, std::chrono::milliseconds delay) {
+    // Round up so a timer never fires early
+    uint64_t delay_ticks = (std::max<int64_t>(delay.count(), 0) + tick.count() - 1) / tick.count();
+
+    std::lock_guard<std::mutex> lock(wheel_mutex);
+    if (timer.armed()) {
+        unlink(timer);
+    }
+    timer.expires = tick_at(std::chrono::steady_clock::now()) + delay_ticks;
+    link(timer);
+}
+
+void TimerWheel::cancel(Timer& timer) {
+    std::lock_guard<std::mutex> lock(wheel_mutex);
+    if (timer.armed()) {
+        unlink(timer);
+    }
+}
+
+void TimerWheel::advance(std::chrono::steady_clock::time_point now) {
+    std::lock_guard<std::mutex> lock(wheel_mutex);
+    uint64_t target_tick = tick_at(now);
+
+    while (current_tick <= target_tick) {
+        uint64_t index = current_tick & SLOT_MASK;
+
+        // When the lowest level wraps, pull the next slot of each higher level down
+        if (index == 0) {
+            for (int level = 1; level < LEVELS; ++level) {
+                if (cascade(level) != 0) break;
+            }
+        }
+
+        Timer& head = slots[0][index];
+        while (head.next != &head) {
+            Timer* timer = head.next;
+            unlink(*timer);
+            if (timer->callback) {
+                timer->callback();
+            }
+        }
+
+        ++current_tick;
+    }
+}
+
+void TimerWheel::link(Timer& timer) {
+    timer.expires = std::max(timer.expires, current_tick);
+    uint64_t delta = timer.expires - current_tick;
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+
+    // Clamp timers beyond the range of the outermost level
+    uint64_t max_delta = (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+    if (delta > max_delta) {
+        timer.expires = current_tick + max_delta;
+    }
+
+    Timer& head = slots[level][(timer.expires >> (SLOT_BITS * level)) & SLOT_MASK];
+    timer.prev = head.prev;
+    timer.next = &head;
+    head.prev->next = &timer;
+    head.prev = &timer;
+}
+
+void TimerWheel::unlink(Timer& timer) {
+    timer.prev->next = timer.next;
+    timer.next->prev = timer.prev;
+    timer.prev = nullptr;
+    timer.next = nullptr;
+}
+
+uint64_t TimerWheel::cascade(int level) {
+    uint64_t index = (current_tick >> (SLOT_BITS * level)) & SLOT_MASK;
+    Timer& head = slots[level][index];
+
+    // Detach the slot first; relinking may place timers back into this level
+    Timer* first = head.next;
+    Timer* last = head.prev;
+    head.next = &head;
+    head.prev = &head;
+    if (first == &head) {
+        return index;
+    }
+    last->next = nullptr;
+
+    while (first != nullptr) {
+        Timer* timer = first;
+        first = first->next;
+        link(*timer);
+    }
+
+    return index;
+}
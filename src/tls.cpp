@@ -0,0 +1,438 @@
+#include "../include/tls.h"
+
+#ifdef HTTP_SERVER_WITH_TLS
+
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <poll.h>
+#include <unistd.h>
+
+// Files go out through a buffer of this size when the kernel does not encrypt
+static const size_t FILE_CHUNK_SIZE = 32 * 1024;
+
+// Ticket keys as RFC 5077 lays them out: a name the ticket carries to find its key,
+// an AES-256 key for the ticket and an HMAC-SHA256 key to authenticate it
+struct TlsContext::TicketKeys {
+    struct Key {
+        unsigned char name[16];
+        unsigned char cipher_key[32];
+        unsigned char mac_key[32];
+        std::chrono::steady_clock::time_point created;
+    };
+
+    std::mutex keys_mutex;
+    Key current;
+    Key previous;
+    bool has_previous;
+
+    static bool generate(Key& key) {
+        key.created = std::chrono::steady_clock::now();
+        return RAND_bytes(key.name, sizeof(key.name)) == 1 &&
+               RAND_bytes(key.cipher_key, sizeof(key.cipher_key)) == 1 &&
+               RAND_bytes(key.mac_key, sizeof(key.mac_key)) == 1;
+    }
+};
+
+static std::string openssl_error(const std::string& what) {
+    unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (code == 0) {
+        return what;
+    }
+    char reason[256];
+    ERR_error_string_n(code, reason, sizeof(reason));
+    return what + ": " + reason;
+}
+
+// Takes h2 when the client offers it and HTTP/2 is on, else http/1.1
+static int select_protocol(SSL*, const unsigned char** out, unsigned char* out_length, const unsigned char* in,
+                           unsigned int in_length, void* arg) {
+    static const unsigned char both[] = "\x02h2\x08http/1.1";
+    static const unsigned char http1[] = "\x08http/1.1";
+    bool http2 = static_cast<const TlsConfig*>(arg)->http2;
+    unsigned char* selected = nullptr;
+    int result = http2 ? SSL_select_next_proto(&selected, out_length, both, sizeof(both) - 1, in, in_length)
+                       : SSL_select_next_proto(&selected, out_length, http1, sizeof(http1) - 1, in, in_length);
+    if (result != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+TlsContext::TlsContext()
+    : context(nullptr), ticket_keys(new TicketKeys()), handshakes(0), resumed(0), failed(0), kernel_send(0),
+      kernel_receive(0) {}
+
+TlsContext::~TlsContext() {
+    SSL_CTX_free(context);
+}
+
+std::shared_ptr<TlsContext> TlsContext::create(const TlsConfig& config, std::string& error) {
+    std::shared_ptr<TlsContext> tls(new TlsContext());
+    tls->config = config;
+    tls->config.ticket_key_rotation_s = std::max(tls->config.ticket_key_rotation_s, 60);
+
+    SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+    if (!context) {
+        error = openssl_error("Cannot create TLS context");
+        return nullptr;
+    }
+    tls->context = context;
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    uint64_t options = SSL_OP_NO_COMPRESSION | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE |
+                       SSL_OP_IGNORE_UNEXPECTED_EOF;
+    if (config.kernel_tls) {
+        options |= SSL_OP_ENABLE_KTLS;
+    }
+    SSL_CTX_set_options(context, options);
+    // Writes from the event loop may stop part way and resume from a grown buffer;
+    // idle connections give their record buffers back
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_chain_file(context, config.certificate_file.c_str()) != 1) {
+        error = openssl_error("Cannot load certificate " + config.certificate_file);
+        return nullptr;
+    }
+    if (SSL_CTX_use_PrivateKey_file(context, config.key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context) != 1) {
+        error = openssl_error("Cannot load private key " + config.key_file);
+        return nullptr;
+    }
+
+    if (!TicketKeys::generate(tls->ticket_keys->current)) {
+        error = openssl_error("Cannot generate session ticket key");
+        return nullptr;
+    }
+    tls->ticket_keys->has_previous = false;
+
+    static const unsigned char session_context[] = "http-cpp-server";
+    SSL_CTX_set_session_id_context(context, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(context, static_cast<long>(config.session_cache_size));
+    SSL_CTX_set_timeout(context, 2 * tls->config.ticket_key_rotation_s);
+    SSL_CTX_set_app_data(context, tls.get());
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(context, ticket_key_callback);
+    SSL_CTX_set_alpn_select_cb(context, select_protocol, &tls->config);
+    return tls;
+}
+
+// Called by OpenSSL to seal a new ticket (`encrypt` set) or open one a client
+// presented. Returns 1 to go on, 2 when the ticket is good but should be replaced
+// by one under the current key, 0 when it is unknown and -1 on failure.
+int TlsContext::ticket_key_callback(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher,
+                                    EVP_MAC_CTX* mac, int encrypt) {
+    TlsContext* tls = static_cast<TlsContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    TicketKeys& keys = *tls->ticket_keys;
+    auto period = std::chrono::seconds(tls->config.ticket_key_rotation_s);
+
+    TicketKeys::Key key;
+    int result = 1;
+    {
+        std::lock_guard<std::mutex> lock(keys.keys_mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (now - keys.current.created >= period) {
+            keys.previous = keys.current;
+            keys.has_previous = now - keys.previous.created < 2 * period;
+            if (!TicketKeys::generate(keys.current)) {
+                return -1;
+            }
+        }
+
+        if (encrypt) {
+            key = keys.current;
+        } else if (std::memcmp(name, keys.current.name, sizeof(key.name)) == 0) {
+            key = keys.current;
+        } else if (keys.has_previous && now - keys.previous.created < 2 * period &&
+                   std::memcmp(name, keys.previous.name, sizeof(key.name)) == 0) {
+            key = keys.previous;
+            result = 2;
+        } else {
+            return 0;
+        }
+    }
+
+    if (encrypt) {
+        std::memcpy(name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, 16) != 1 ||
+            EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.cipher_key, iv) != 1) {
+            return -1;
+        }
+    } else if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.cipher_key, iv) != 1) {
+        return -1;
+    }
+
+    char digest[] = "SHA256";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.mac_key, sizeof(key.mac_key)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+        OSSL_PARAM_construct_end()
+    };
+    if (EVP_MAC_CTX_set_params(mac, params) != 1) {
+        return -1;
+    }
+    return result;
+}
+
+std::unique_ptr<TlsSession> TlsContext::accept(int socket) {
+    SSL* ssl = SSL_new(context);
+    if (!ssl) {
+        ERR_clear_error();
+        return nullptr;
+    }
+    if (SSL_set_fd(ssl, socket) != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        return nullptr;
+    }
+    SSL_set_accept_state(ssl);
+    return std::unique_ptr<TlsSession>(new TlsSession(shared_from_this(), ssl, socket));
+}
+
+TlsStats TlsContext::stats() const {
+    TlsStats stats;
+    stats.handshakes = handshakes;
+    stats.resumed = resumed;
+    stats.failed = failed;
+    stats.kernel_send = kernel_send;
+    stats.kernel_receive = kernel_receive;
+    return stats;
+}
+
+TlsSession::TlsSession(std::shared_ptr<TlsContext> owner, SSL* ssl, int socket)
+    : owner(std::move(owner)), ssl(ssl), socket(socket), handshake_done(false), want_write(false) {}
+
+TlsSession::~TlsSession() {
+    SSL_free(ssl);
+}
+
+void TlsSession::finish_handshake() {
+    handshake_done = true;
+    owner->handshakes++;
+    if (SSL_session_reused(ssl)) {
+        owner->resumed++;
+    }
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        owner->kernel_send++;
+    }
+    if (BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+        owner->kernel_receive++;
+    }
+}
+
+bool TlsSession::should_retry(int result, bool wait) {
+    int error = SSL_get_error(ssl, result);
+    if (!handshake_done && SSL_is_init_finished(ssl)) {
+        finish_handshake();
+    }
+
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        ERR_clear_error();
+        want_write = error == SSL_ERROR_WANT_WRITE;
+        if (!wait) {
+            errno = EAGAIN;
+            return false;
+        }
+        // A socket shut down by a deadline reports ready, and the retry then fails
+        pollfd ready{socket, static_cast<short>(error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT), 0};
+        while (poll(&ready, 1, -1) == -1 && errno == EINTR) {
+        }
+        return true;
+    }
+
+    int saved_errno = errno;
+    ERR_clear_error();
+    if (error == SSL_ERROR_SYSCALL && saved_errno == EINTR) {
+        return true;
+    }
+    if (!handshake_done) {
+        owner->failed++;
+    }
+    errno = error == SSL_ERROR_SYSCALL && saved_errno != 0 ? saved_errno : ECONNRESET;
+    return false;
+}
+
+ssize_t TlsSession::read(char* buffer, size_t length, bool wait) {
+    while (true) {
+        size_t count = 0;
+        int result = SSL_read_ex(ssl, buffer, length, &count);
+        if (result == 1) {
+            if (!handshake_done) {
+                finish_handshake();
+            }
+            return static_cast<ssize_t>(count);
+        }
+        if (SSL_get_error(ssl, result) == SSL_ERROR_ZERO_RETURN) {
+            ERR_clear_error();
+            return 0;
+        }
+        if (!should_retry(result, wait)) {
+            return -1;
+        }
+    }
+}
+
+ssize_t TlsSession::write(const char* data, size_t length, bool wait) {
+    if (length == 0) {
+        return 0;
+    }
+    while (true) {
+        size_t count = 0;
+        int result = SSL_write_ex(ssl, data, length, &count);
+        if (result == 1) {
+            return static_cast<ssize_t>(count);
+        }
+        if (!should_retry(result, wait)) {
+            return -1;
+        }
+    }
+}
+
+ssize_t TlsSession::send_file(int fd, off_t offset, size_t length) {
+    if (kernel_send()) {
+        while (true) {
+            ossl_ssize_t sent = SSL_sendfile(ssl, fd, offset, length, 0);
+            if (sent >= 0) {
+                return sent;
+            }
+            if (!should_retry(static_cast<int>(sent), true)) {
+                return -1;
+            }
+        }
+    }
+
+    char buffer[FILE_CHUNK_SIZE];
+    ssize_t count;
+    do {
+        count = pread(fd, buffer, std::min(length, sizeof(buffer)), offset);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+        // The file shrank since its size was taken
+        if (count == 0) {
+            errno = EIO;
+        }
+        return -1;
+    }
+    return write(buffer, static_cast<size_t>(count), true);
+}
+
+bool TlsSession::has_buffered_input() const {
+    return SSL_pending(ssl) > 0;
+}
+
+bool TlsSession::wants_write() const {
+    return want_write;
+}
+
+bool TlsSession::established() const {
+    return handshake_done;
+}
+
+bool TlsSession::kernel_send() const {
+    return handshake_done && BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+std::string TlsSession::protocol() const {
+    const unsigned char* name = nullptr;
+    unsigned int length = 0;
+    SSL_get0_alpn_selected(ssl, &name, &length);
+    return name ? std::string(reinterpret_cast<const char*>(name), length) : std::string();
+}
+
+void TlsSession::close() {
+    if (handshake_done) {
+        SSL_shutdown(ssl);
+        ERR_clear_error();
+    }
+}
+
+#else
+
+// Built without OpenSSL: TLS cannot be turned on, so no session is ever made
+
+#include <cerrno>
+
+struct TlsContext::TicketKeys {};
+
+TlsContext::TlsContext()
+    : context(nullptr), handshakes(0), resumed(0), failed(0), kernel_send(0), kernel_receive(0) {}
+
+TlsContext::~TlsContext() {}
+
+std::shared_ptr<TlsContext> TlsContext::create(const TlsConfig&, std::string& error) {
+    error = "TLS support is not compiled in; rebuild with `make TLS=1`";
+    return nullptr;
+}
+
+int TlsContext::ticket_key_callback(struct ssl_st*, unsigned char*, unsigned char*, struct evp_cipher_ctx_st*,
+                                    struct evp_mac_ctx_st*, int) {
+    return -1;
+}
+
+std::unique_ptr<TlsSession> TlsContext::accept(int) {
+    return nullptr;
+}
+
+TlsStats TlsContext::stats() const {
+    return TlsStats{0, 0, 0, 0, 0};
+}
+
+TlsSession::TlsSession(std::shared_ptr<TlsContext> owner, struct ssl_st* ssl, int socket)
+    : owner(std::move(owner)), ssl(ssl), socket(socket), handshake_done(false), want_write(false) {}
+
+TlsSession::~TlsSession() {}
+
+void TlsSession::finish_handshake() {}
+
+bool TlsSession::should_retry(int, bool) {
+    return false;
+}
+
+ssize_t TlsSession::read(char*, size_t, bool) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t TlsSession::write(const char*, size_t, bool) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t TlsSession::send_file(int, off_t, size_t) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+bool TlsSession::has_buffered_input() const {
+    return false;
+}
+
+bool TlsSession::wants_write() const {
+    return false;
+}
+
+bool TlsSession::established() const {
+    return false;
+}
+
+bool TlsSession::kernel_send() const {
+    return false;
+}
+
+std::string TlsSession::protocol() const {
+    return std::string();
+}
+
+void TlsSession::close() {}
+
+#endif // HTTP_SERVER_WITH_TLS
@@ -0,0 +1,306 @@
+#include "../include/websocket.h"
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Appended to the client's key before hashing, as fixed by RFC 6455
+static const char* ACCEPT_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static uint32_t rotate_left(uint32_t value, int bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+// SHA-1 is only used for the handshake, where the protocol requires it
+static std::string sha1(const std::string& input) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    std::string data = input;
+    uint64_t bit_length = static_cast<uint64_t>(input.size()) * 8;
+    data += static_cast<char>(0x80);
+    while (data.size() % 64 != 56) {
+        data += '\0';
+    }
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        data += static_cast<char>((bit_length >> shift) & 0xFF);
+    }
+
+    for (size_t block = 0; block < data.size(); block += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data() + block + i * 4);
+            w[i] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+        }
+        for (int i = 16; i < 80; ++i) {
+            w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = rotate_left(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotate_left(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    std::string digest;
+    for (uint32_t word : h) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            digest += static_cast<char>((word >> shift) & 0xFF);
+        }
+    }
+    return digest;
+}
+
+static std::string base64_encode(const std::string& input) {
+    static const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    size_t i = 0;
+    for (; i + 3 <= input.size(); i += 3) {
+        uint32_t n = (uint32_t(uint8_t(input[i])) << 16) | (uint32_t(uint8_t(input[i + 1])) << 8) |
+                     uint32_t(uint8_t(input[i + 2]));
+        out += alphabet[(n >> 18) & 63];
+        out += alphabet[(n >> 12) & 63];
+        out += alphabet[(n >> 6) & 63];
+        out += alphabet[n & 63];
+    }
+    if (i < input.size()) {
+        uint32_t n = uint32_t(uint8_t(input[i])) << 16;
+        if (i + 1 < input.size()) {
+            n |= uint32_t(uint8_t(input[i + 1])) << 8;
+        }
+        out += alphabet[(n >> 18) & 63];
+        out += alphabet[(n >> 12) & 63];
+        out += i + 1 < input.size() ? alphabet[(n >> 6) & 63] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+WebSocketFrame::ParseStatus WebSocketFrame::parse_header(const char* data, size_t size, WebSocketFrame& frame) {
+    if (size < 2) {
+        return ParseStatus::Incomplete;
+    }
+    uint8_t first = static_cast<uint8_t>(data[0]);
+    uint8_t second = static_cast<uint8_t>(data[1]);
+
+    frame.fin = first & 0x80;
+    frame.opcode = first & 0x0F;
+    frame.masked = second & 0x80;
+    if (first & 0x70) {
+        return ParseStatus::Invalid;
+    }
+    bool control = frame.opcode & 0x08;
+    if (frame.opcode > Close ? frame.opcode > Pong : (frame.opcode > Binary && !control)) {
+        return ParseStatus::Invalid;
+    }
+
+    size_t length_bytes = 0;
+    uint64_t length = second & 0x7F;
+    if (length == 126) {
+        length_bytes = 2;
+    } else if (length == 127) {
+        length_bytes = 8;
+    }
+    if (control && (!frame.fin || length > 125)) {
+        return ParseStatus::Invalid;
+    }
+
+    frame.header_length = 2 + length_bytes + (frame.masked ? 4 : 0);
+    if (size < frame.header_length) {
+        return ParseStatus::Incomplete;
+    }
+    if (length_bytes) {
+        length = 0;
+        for (size_t i = 0; i < length_bytes; ++i) {
+            length = (length << 8) | static_cast<uint8_t>(data[2 + i]);
+        }
+        if ((length_bytes == 2 && length < 126) || (length_bytes == 8 && (length <= 0xFFFF || length >> 63))) {
+            return ParseStatus::Invalid;
+        }
+    }
+    frame.payload_length = length;
+    if (frame.masked) {
+        std::memcpy(frame.mask, data + 2 + length_bytes, 4);
+    }
+    return ParseStatus::Ok;
+}
+
+void WebSocketFrame::apply_mask(char* data, size_t length, const uint8_t mask[4]) {
+    // The mask repeated across a word lines up with the data as long as words start at
+    // multiples of four, which every step below keeps
+    uint8_t repeated[16];
+    for (int i = 0; i < 16; ++i) {
+        repeated[i] = mask[i & 3];
+    }
+
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i wide = _mm_loadu_si128(reinterpret_cast<const __m128i*>(repeated));
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(block, wide));
+    }
+#endif
+    uint64_t word_mask;
+    std::memcpy(&word_mask, repeated, sizeof(word_mask));
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        word ^= word_mask;
+        std::memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < length; ++i) {
+        data[i] ^= mask[i & 3];
+    }
+}
+
+void WebSocketFrame::append(std::string& out, uint8_t opcode, std::string_view payload) {
+    out += static_cast<char>(0x80 | opcode);
+    uint64_t length = payload.size();
+    if (length < 126) {
+        out += static_cast<char>(length);
+    } else if (length <= 0xFFFF) {
+        out += static_cast<char>(126);
+        out += static_cast<char>(length >> 8);
+        out += static_cast<char>(length & 0xFF);
+    } else {
+        out += static_cast<char>(127);
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            out += static_cast<char>((length >> shift) & 0xFF);
+        }
+    }
+    out.append(payload.data(), payload.size());
+}
+
+std::string WebSocketFrame::accept_key(const std::string& client_key) {
+    return base64_encode(sha1(client_key + ACCEPT_GUID));
+}
+
+// Rejects overlong encodings, surrogates and code points past U+10FFFF. Runs of
+// ASCII are skipped eight bytes at a time.
+bool WebSocketFrame::valid_utf8(const char* data, size_t length) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    while (i < length) {
+        if (i + 8 <= length) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, sizeof(word));
+            if (!(word & 0x8080808080808080ULL)) {
+                i += 8;
+                continue;
+            }
+        }
+
+        unsigned char c = bytes[i];
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+        size_t extra;
+        uint32_t code_point;
+        if (c >= 0xC2 && c <= 0xDF) {
+            extra = 1;
+            code_point = c & 0x1F;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            extra = 2;
+            code_point = c & 0x0F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            extra = 3;
+            code_point = c & 0x07;
+        } else {
+            return false;
+        }
+        if (i + extra >= length) {
+            return false;
+        }
+        for (size_t k = 1; k <= extra; ++k) {
+            if ((bytes[i + k] & 0xC0) != 0x80) {
+                return false;
+            }
+            code_point = (code_point << 6) | (bytes[i + k] & 0x3F);
+        }
+        if ((extra == 2 && (code_point < 0x800 || (code_point >= 0xD800 && code_point <= 0xDFFF))) ||
+            (extra == 3 && (code_point < 0x10000 || code_point > 0x10FFFF))) {
+            return false;
+        }
+        i += extra + 1;
+    }
+    return true;
+}
+
+WebSocket::WebSocket(std::function<void()> wake) : open(true), closing(false), wake_pending(false), wake(wake) {}
+
+void WebSocket::queue(uint8_t opcode, std::string_view payload) {
+    bool needs_wake;
+    {
+        std::lock_guard<std::mutex> lock(socket_mutex);
+        if (!open || closing) {
+            return;
+        }
+        WebSocketFrame::append(outbox, opcode, payload);
+        closing = opcode == WebSocketFrame::Close;
+        needs_wake = !wake_pending;
+        wake_pending = true;
+    }
+    if (needs_wake) {
+        wake();
+    }
+}
+
+void WebSocket::send_text(std::string_view message) {
+    queue(WebSocketFrame::Text, message);
+}
+
+void WebSocket::send_binary(std::string_view message) {
+    queue(WebSocketFrame::Binary, message);
+}
+
+void WebSocket::close(uint16_t code, std::string_view reason) {
+    std::string payload;
+    payload += static_cast<char>(code >> 8);
+    payload += static_cast<char>(code & 0xFF);
+    payload.append(reason.substr(0, 123));
+    queue(WebSocketFrame::Close, payload);
+}
+
+bool WebSocket::is_open() {
+    std::lock_guard<std::mutex> lock(socket_mutex);
+    return open && !closing;
+}
+
+bool WebSocket::take_output(std::string& out) {
+    std::lock_guard<std::mutex> lock(socket_mutex);
+    out += outbox;
+    outbox.clear();
+    wake_pending = false;
+    return closing;
+}
+
+void WebSocket::mark_closed() {
+    std::lock_guard<std::mutex> lock(socket_mutex);
+    open = false;
+    outbox.clear();
+}
@@ -2,9 +2,17 @@
 
 # HTTP C++ Server API Test Script
 # This script tests all the API endpoints of the HTTP server
+#
+# Search, aggregation columns and the change feed are off by default; start the server with
+#   HTTP_SERVER_SEARCH_COLLECTIONS=notes HTTP_SERVER_COLUMNS=notes.words,notes.tag \
+#   HTTP_SERVER_CHANGE_FEED_SIZE=1024 ./bin/http_server
+# to exercise them, otherwise their tests show the error the server answers with.
+# Set TLS_SERVER_URL (e.g. https://localhost:8443) to also test a server built with TLS=1.
 
 SERVER_URL="http://localhost:8080"
+TLS_SERVER_URL="${TLS_SERVER_URL:-}"
 COLLECTION="users"
+NOTES_COLLECTION="notes"
 
 echo "=================================="
 echo "HTTP C++ Server API Test Script"
@@ -209,6 +217,182 @@ FORM_RESPONSE=$(curl -s -X POST "$SERVER_URL/api/data/$COLLECTION" \
 echo "Response: $FORM_RESPONSE"
 echo ""
 
+# Test 11: Batch operations
+print_test "BATCH Operations"
+
+echo "Applying a batch of create/update/delete operations..."
+BATCH_RESPONSE=$(curl -s -X POST "$SERVER_URL/api/data/$COLLECTION/_batch" \
+  -H "Content-Type: application/json" \
+  -d '[{"op":"create","item":{"name":"Batch User"}},{"op":"update","id":"1","item":{"name":"John Batch"}},{"op":"delete","id":"999"}]')
+echo "Response: $BATCH_RESPONSE"
+echo ""
+
+# Test 12: NDJSON import and export
+print_test "NDJSON Import/Export"
+
+echo "Importing records as NDJSON..."
+IMPORT_RESPONSE=$(printf '{"name":"Stream One"}\n{"name":"Stream Two"}\n' | \
+  curl -s -X POST "$SERVER_URL/api/data/streamed/_import" \
+  -H "Content-Type: application/x-ndjson" --data-binary @-)
+echo "Response: $IMPORT_RESPONSE"
+
+echo ""
+echo "Exporting collection as NDJSON..."
+curl -s "$SERVER_URL/api/data/streamed?format=ndjson"
+echo ""
+
+# Test 13: Conditional updates (ETag / If-Match)
+print_test "Conditional Updates (ETag)"
+
+echo "Creating a note and reading its ETag..."
+NOTE_RESPONSE=$(curl -s -X POST "$SERVER_URL/api/data/$NOTES_COLLECTION" \
+  -H "Content-Type: application/json" \
+  -d '{"title":"First note","tag":"work","words":"3"}')
+echo "Response: $NOTE_RESPONSE"
+NOTE_ID=$(echo "$NOTE_RESPONSE" | sed -n 's/.*"id":"\([^"]*\)".*/\1/p')
+NOTE_ETAG=$(curl -s -i "$SERVER_URL/api/data/$NOTES_COLLECTION/$NOTE_ID" | grep -i "^etag" | cut -d' ' -f2 | tr -d '\r')
+echo "ETag of note $NOTE_ID: $NOTE_ETAG"
+
+echo ""
+echo "Updating note $NOTE_ID with a stale ETag (expect 412)..."
+STALE_RESPONSE=$(curl -s -w " (%{http_code})" -X PUT "$SERVER_URL/api/data/$NOTES_COLLECTION/$NOTE_ID" \
+  -H "If-Match: \"999\"" -H "Content-Type: application/json" \
+  -d '{"title":"Lost update"}')
+echo "Response: $STALE_RESPONSE"
+
+echo ""
+echo "Updating note $NOTE_ID with its current ETag (expect 200)..."
+MATCH_RESPONSE=$(curl -s -w " (%{http_code})" -X PUT "$SERVER_URL/api/data/$NOTES_COLLECTION/$NOTE_ID" \
+  -H "If-Match: $NOTE_ETAG" -H "Content-Type: application/json" \
+  -d '{"title":"First note","tag":"work","words":"3","draft":"yes"}')
+echo "Response: $MATCH_RESPONSE"
+echo ""
+
+# Test 14: JSON merge patch (PATCH)
+print_test "PATCH Operation (merge patch)"
+
+echo "Patching note $NOTE_ID: set title, remove draft..."
+PATCH_RESPONSE=$(curl -s -w " (%{http_code})" -X PATCH "$SERVER_URL/api/data/$NOTES_COLLECTION/$NOTE_ID" \
+  -H "Content-Type: application/merge-patch+json" \
+  -d '{"title":"Patched note","draft":null}')
+echo "Response: $PATCH_RESPONSE"
+
+echo ""
+echo "Getting patched note $NOTE_ID..."
+echo "Response: $(curl -s "$SERVER_URL/api/data/$NOTES_COLLECTION/$NOTE_ID")"
+echo ""
+
+# Test 15: Expiring items (TTL)
+print_test "Expiring Items (TTL)"
+
+echo "Creating a note that expires after 1 second..."
+TTL_RESPONSE=$(curl -s -X POST "$SERVER_URL/api/data/$NOTES_COLLECTION?ttl=1" \
+  -H "Content-Type: application/json" \
+  -d '{"title":"Quick fox note","tag":"tmp","words":"3"}')
+echo "Response: $TTL_RESPONSE"
+TTL_ID=$(echo "$TTL_RESPONSE" | sed -n 's/.*"id":"\([^"]*\)".*/\1/p')
+echo "Reading it right away: $(curl -s -o /dev/null -w "%{http_code}" "$SERVER_URL/api/data/$NOTES_COLLECTION/$TTL_ID")"
+sleep 2
+echo "Reading it 2 seconds later (expect 404): $(curl -s -o /dev/null -w "%{http_code}" "$SERVER_URL/api/data/$NOTES_COLLECTION/$TTL_ID")"
+echo ""
+
+# Test 16: Full-text search
+print_test "Full-Text Search"
+
+curl -s -X POST "$SERVER_URL/api/data/$NOTES_COLLECTION" \
+  -H "Content-Type: application/json" \
+  -d '{"title":"The quick brown fox","tag":"home","words":"4"}' > /dev/null
+echo "Searching notes for 'quick' (the expired note is not found)..."
+echo "Response: $(curl -s "$SERVER_URL/api/data/$NOTES_COLLECTION/_search?q=quick")"
+
+echo ""
+echo "Searching notes for the prefix 'pat*'..."
+echo "Response: $(curl -s "$SERVER_URL/api/data/$NOTES_COLLECTION/_search?q=pat*")"
+echo ""
+
+# Test 17: Aggregation
+print_test "Aggregation"
+
+echo "Counting notes and summing their words..."
+echo "Response: $(curl -s "$SERVER_URL/api/data/$NOTES_COLLECTION/_aggregate?metrics=sum:words,max:words")"
+
+echo ""
+echo "Grouping notes by tag..."
+echo "Response: $(curl -s "$SERVER_URL/api/data/$NOTES_COLLECTION/_aggregate?metrics=sum:words&group_by=tag")"
+echo ""
+
+# Test 18: Change feed (Server-Sent Events)
+print_test "Change Feed (Server-Sent Events)"
+
+echo "Replaying every retained change of notes..."
+curl -s -N --max-time 2 "$SERVER_URL/api/data/$NOTES_COLLECTION/_changes?since=0"
+echo ""
+
+# Test 19: Change feed (WebSocket)
+print_test "Change Feed (WebSocket)"
+
+echo "Upgrading a _changes request to a WebSocket..."
+WS_STATUS=$(curl -s -i --max-time 1 "$SERVER_URL/api/data/$NOTES_COLLECTION/_changes" \
+  -H "Connection: Upgrade" -H "Upgrade: websocket" \
+  -H "Sec-WebSocket-Version: 13" -H "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==" | head -1 | tr -d '\r')
+echo "Response: $WS_STATUS"
+echo ""
+
+# Test 20: HTTP/2
+print_test "HTTP/2 (h2c)"
+
+echo "Reading note $NOTE_ID over HTTP/2 with prior knowledge..."
+echo "Response: $(curl -s --http2-prior-knowledge -w " (HTTP/%{http_version} %{http_code})" "$SERVER_URL/api/data/$NOTES_COLLECTION/$NOTE_ID")"
+
+echo ""
+echo "Reading note $NOTE_ID after an Upgrade: h2c request..."
+echo "Response: $(curl -s --http2 -w " (HTTP/%{http_version} %{http_code})" "$SERVER_URL/api/data/$NOTES_COLLECTION/$NOTE_ID")"
+echo ""
+
+# Test 21: TLS
+print_test "TLS"
+
+if [ -n "$TLS_SERVER_URL" ]; then
+    echo "Reading stats over TLS with HTTP/1.1 and HTTP/2..."
+    echo "HTTP/1.1: $(curl -sk --http1.1 -o /dev/null -w "HTTP/%{http_version} %{http_code}" "$TLS_SERVER_URL/api/stats")"
+    echo "HTTP/2: $(curl -sk --http2 -o /dev/null -w "HTTP/%{http_version} %{http_code}" "$TLS_SERVER_URL/api/stats")"
+else
+    echo "Skipped: set TLS_SERVER_URL to a server started with HTTP_SERVER_TLS_CERT"
+fi
+echo ""
+
+# Test 22: Coroutine handlers
+print_test "Coroutine Handlers (async upload)"
+
+BIG_FILE="async_test.bin"
+head -c 2097152 /dev/urandom > "$BIG_FILE"
+echo "Uploading a 2MB file, read by a coroutine handler..."
+ASYNC_RESPONSE=$(curl -s -X POST "$SERVER_URL/api/files/upload" -F "file=@$BIG_FILE")
+echo "Response: $ASYNC_RESPONSE"
+curl -s "$SERVER_URL/api/files/download/$BIG_FILE" -o "downloaded_$BIG_FILE"
+if cmp -s "$BIG_FILE" "downloaded_$BIG_FILE"; then
+    echo "✓ Downloaded file matches original"
+else
+    echo "✗ Downloaded file differs from original"
+fi
+rm -f "$BIG_FILE" "downloaded_$BIG_FILE"
+echo ""
+
+# Test 23: Inline routes
+print_test "Inline Routes"
+
+INLINE_BEFORE=$(curl -s "$SERVER_URL/api/stats" | grep -o '"inline":[0-9]*' | cut -d: -f2)
+for i in 1 2 3; do
+    curl -s "$SERVER_URL/api/data/$NOTES_COLLECTION/$NOTE_ID" > /dev/null
+done
+INLINE_AFTER=$(curl -s "$SERVER_URL/api/stats" | grep -o '"inline":[0-9]*' | cut -d: -f2)
+if [ "$((INLINE_AFTER - INLINE_BEFORE))" -ge 3 ]; then
+    echo "✓ Single-item reads were served by the event loop"
+else
+    echo "✗ Single-item reads were not served inline ($INLINE_BEFORE -> $INLINE_AFTER)"
+fi
+echo ""
+
 # Summary
 echo "=================================="
 echo "Test Summary"
@@ -218,6 +402,12 @@ echo "✓ File Upload/Download tested"
 echo "✓ Error handling tested"
 echo "✓ Form data handling tested"
 echo "✓ Multiple collections tested"
+echo "✓ Batch operations tested"
+echo "✓ NDJSON import/export tested"
+echo "✓ Conditional updates and merge patch tested"
+echo "✓ Expiry, search and aggregation tested"
+echo "✓ Change feed (SSE and WebSocket) tested"
+echo "✓ HTTP/2, TLS, coroutine and inline routes tested"
 echo ""
 echo "All tests completed!"
 echo "Check the responses above to verify functionality."
@@ -0,0 +1,153 @@
+// Checks of DataStore: snapshot reads while a writer overwrites, expiry sweeps
+// that wait for a whole bucket's deadlines, and the memory budget held by eviction,
+// with and without spilling to disk.
+//
+// Build and run with `make test`.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "../include/data_store.h"
+
+static int failures = 0;
+
+static void expect(const char* name, bool ok) {
+    std::printf("%-44s %s\n", name, ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+static DataStore::Item item(const std::string& value) {
+    return DataStore::Item{{"value", value}};
+}
+
+static DataStore::WriteOptions expiring_in(std::chrono::milliseconds ttl) {
+    DataStore::WriteOptions options;
+    options.ttl = ttl;
+    return options;
+}
+
+static bool all_hold(const std::vector<DataStore::Item>& items, size_t count, const std::string& value) {
+    if (items.size() != count) {
+        return false;
+    }
+    for (const auto& found : items) {
+        if (found.at("value") != value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    using std::chrono::milliseconds;
+
+    // Snapshots (MVCC)
+    {
+        DataStore store;
+        std::vector<std::string> ids;
+        for (int i = 0; i < 100; ++i) {
+            ids.push_back(store.create("items", item("old")));
+        }
+        auto snapshot = store.snapshot();
+
+        // Every item is overwritten over and over while the snapshot is read
+        std::atomic<bool> writing(true);
+        std::thread writer([&]() {
+            for (int round = 0; round < 50; ++round) {
+                for (const auto& id : ids) {
+                    store.update("items", id, item("new " + std::to_string(round)));
+                }
+            }
+            writing = false;
+        });
+        bool consistent = true;
+        size_t reads = 0;
+        while (writing || reads == 0) {
+            consistent = consistent && all_hold(store.scan("items", "", 1000, snapshot.get()), ids.size(), "old");
+            ++reads;
+        }
+        writer.join();
+
+        expect("snapshot keeps reading the old versions", consistent);
+        expect("latest reads see the last write", all_hold(store.scan("items", "", 1000), ids.size(), "new 49"));
+        size_t pinned = store.memory_stats().used_bytes;
+        snapshot.reset();
+        expect("released snapshot frees old versions", store.memory_stats().used_bytes < pinned);
+    }
+
+    // Expiry buckets: a sweep waits until every deadline in a bucket has passed. Both records
+    // land in the bucket ending at `end`, the first due well before the second.
+    {
+        DataStore store;
+        auto now = std::chrono::steady_clock::now();
+        int64_t now_ms = std::chrono::duration_cast<milliseconds>(now.time_since_epoch()).count();
+        int64_t end_ms = (now_ms / 100 + 2) * 100;
+        store.create("sessions", item("early"), expiring_in(milliseconds(end_ms - now_ms - 70)));
+        store.create("sessions", item("late"), expiring_in(milliseconds(end_ms - now_ms - 20)));
+        std::chrono::steady_clock::time_point end{milliseconds(end_ms)};
+
+        expect("bucket not due while a deadline is ahead", !store.expiry_due(end - milliseconds(10)));
+        expect("partly expired bucket is not swept", store.expire_due(end - milliseconds(10), 100) == 0);
+        expect("bucket due once all its deadlines passed", store.expiry_due(end));
+        expect("whole bucket is swept at its end", store.expire_due(end, 100) == 2);
+        expect("swept records are counted", store.memory_stats().expirations == 2);
+    }
+
+    // Memory budget, records deleted on eviction
+    {
+        DataStore store;
+        DataStore::MemoryBudget budget;
+        budget.max_bytes = 64 * 1024;
+        store.set_memory_budget(budget);
+
+        std::string last;
+        for (int i = 0; i < 2000; ++i) {
+            last = store.create("events", item(std::string(200, 'e')));
+        }
+        DataStore::MemoryStats stats = store.memory_stats();
+        expect("evicting keeps memory under the budget", stats.used_bytes <= budget.max_bytes);
+        expect("records were evicted", stats.evictions > 0 && store.read_all("events").size() < 2000);
+        expect("the record just written is kept", store.read("events", last).count("value") == 1);
+    }
+
+    // Memory budget, records spilled to disk
+    {
+        std::string directory = (std::filesystem::temp_directory_path() /
+                                 ("data_store_test." + std::to_string(::getpid()))).string();
+        {
+            DataStore store;
+            DataStore::MemoryBudget budget;
+            budget.max_bytes = 64 * 1024;
+            budget.spill_directory = directory;
+            store.set_memory_budget(budget);
+
+            std::vector<std::string> ids;
+            for (int i = 0; i < 2000; ++i) {
+                ids.push_back(store.create("events", item("event " + std::to_string(i) + std::string(200, 'e'))));
+            }
+            DataStore::MemoryStats stats = store.memory_stats();
+            expect("spilling keeps memory under the budget", stats.used_bytes <= budget.max_bytes);
+            expect("evicted records went to disk", stats.spills > 0 && stats.spills == stats.evictions);
+
+            bool readable = true;
+            for (int i = 0; i < 2000; i += 97) {
+                DataStore::Item found = store.read("events", ids[i]);
+                readable = readable && found.count("value") &&
+                           found["value"].rfind("event " + std::to_string(i), 0) == 0;
+            }
+            expect("spilled records read back", readable && store.memory_stats().promotions > 0);
+        }
+        std::filesystem::remove_all(directory);
+    }
+
+    if (failures) {
+        std::printf("\n%d failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
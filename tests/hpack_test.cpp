@@ -0,0 +1,69 @@
+// Decoder checks for HPACK integers and Huffman strings, the parts a peer can
+// most easily get wrong or abuse.
+//
+// Build and run with `make test`.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "../include/hpack.h"
+
+static int failures = 0;
+
+static HpackDecoder::Status decode(const std::vector<uint8_t>& block, HeaderList& headers) {
+    HpackDecoder decoder;
+    return decoder.decode(block.data(), block.size(), headers, 1 << 16);
+}
+
+static void expect(const char* name, const std::vector<uint8_t>& block, HpackDecoder::Status status,
+                   const HeaderList& expected = HeaderList()) {
+    HeaderList headers;
+    HpackDecoder::Status got = decode(block, headers);
+    bool ok = got == status && (status != HpackDecoder::Status::Ok || headers == expected);
+    std::printf("%-44s %s\n", name, ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+// A literal field without indexing whose name is `name_bytes`, Huffman coded, and whose value is "x"
+static std::vector<uint8_t> huffman_name(const std::vector<uint8_t>& name_bytes) {
+    std::vector<uint8_t> block = {0x00, static_cast<uint8_t>(0x80 | name_bytes.size())};
+    block.insert(block.end(), name_bytes.begin(), name_bytes.end());
+    block.push_back(0x01);
+    block.push_back('x');
+    return block;
+}
+
+int main() {
+    using Status = HpackDecoder::Status;
+
+    // Integers (RFC 7541 section 5.1)
+    expect("table size update of 1337 (C.1.2)", {0x3F, 0x9A, 0x0A}, Status::Ok);
+    expect("integer cut off mid-way", {0x3F, 0x9A}, Status::Invalid);
+    expect("integer above the decoder's limit", {0x3F, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F}, Status::Invalid);
+    // Without a cap on the continuation bytes this reads as a valid table size of 31
+    std::vector<uint8_t> zero_run = {0x3F};
+    zero_run.insert(zero_run.end(), 20, 0x80);
+    zero_run.push_back(0x00);
+    expect("run of 0x80 continuation bytes", zero_run, Status::Invalid);
+    std::vector<uint8_t> endless = {0xFF};
+    endless.insert(endless.end(), 4096, 0x80);
+    expect("continuation bytes to the end of the block", endless, Status::Invalid);
+
+    // Huffman strings (RFC 7541 section 5.2)
+    expect("first request of C.4.1",
+           {0x82, 0x86, 0x84, 0x41, 0x8C, 0xF1, 0xE3, 0xC2, 0xE5, 0xF2, 0x3A, 0x6B, 0xA0, 0xAB, 0x90, 0xF4, 0xFF},
+           Status::Ok,
+           {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}});
+    expect("\"a\" padded with ones", huffman_name({0x1F}), Status::Ok, {{"a", "x"}});
+    expect("padding of zeros", huffman_name({0x18}), Status::Invalid);
+    expect("padding longer than 7 bits", huffman_name({0x1F, 0xFF}), Status::Invalid);
+    expect("only padding", huffman_name({0xFF}), Status::Invalid);
+    expect("EOS symbol in the string", huffman_name({0xFF, 0xFF, 0xFF, 0xFF}), Status::Invalid);
+    expect("string longer than the block", {0x00, 0x85, 0x1F, 0x01, 'x'}, Status::Invalid);
+
+    if (failures) {
+        std::printf("\n%d failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
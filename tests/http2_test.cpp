@@ -0,0 +1,218 @@
+// Checks of Http2Connection against a scripted client: the cap on open streams,
+// the deadlines expire() enforces, and a peer reusing a stream it closed.
+//
+// Build and run with `make test`.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "../include/hpack.h"
+#include "../include/http2.h"
+
+static int failures = 0;
+
+static void expect(const char* name, bool ok) {
+    std::printf("%-44s %s\n", name, ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+enum FrameType : uint8_t { DATA = 0x0, HEADERS = 0x1, RST_STREAM = 0x3, SETTINGS = 0x4, GOAWAY = 0x7 };
+static const uint8_t END_STREAM = 0x1;
+static const uint8_t END_HEADERS = 0x4;
+
+// A frame the server wrote, with the fields of a HEADERS frame decoded
+struct Frame {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream_id;
+    std::string payload;
+    HeaderList fields;
+};
+
+static std::string frame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload) {
+    std::string out;
+    out += static_cast<char>((payload.size() >> 16) & 0xFF);
+    out += static_cast<char>((payload.size() >> 8) & 0xFF);
+    out += static_cast<char>(payload.size() & 0xFF);
+    out += static_cast<char>(type);
+    out += static_cast<char>(flags);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out += static_cast<char>((stream_id >> shift) & 0xFF);
+    }
+    return out + payload;
+}
+
+static uint32_t read_uint32(const std::string& bytes, size_t offset) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        value = (value << 8) | static_cast<uint8_t>(bytes[offset + i]);
+    }
+    return value;
+}
+
+// The client side of one connection, talking to the server in memory
+struct Client {
+    Http2Connection server;
+    HpackEncoder encoder;
+    HpackDecoder decoder;
+    std::chrono::steady_clock::time_point now;
+    std::vector<Http2Connection::Request> requests;
+    bool alive;
+
+    // `client_settings` is the payload of the client's SETTINGS frame
+    explicit Client(const Http2Connection::Settings& settings, const std::string& client_settings = std::string())
+        : server(settings), now(std::chrono::steady_clock::now()), alive(true) {
+        send(Http2Connection::PREFACE + frame(SETTINGS, 0, 0, client_settings));
+        written();
+    }
+
+    void send(std::string bytes) {
+        alive = server.receive(bytes, requests, now) && alive;
+    }
+
+    // A POST leaves its stream open for a body; a GET ends it
+    void open(uint32_t stream_id, const char* method, uint8_t flags = END_HEADERS) {
+        std::string block;
+        encoder.encode({{":method", method}, {":scheme", "http"}, {":path", "/"}, {":authority", "test"}}, block);
+        if (std::string(method) == "GET") {
+            flags |= END_STREAM;
+        }
+        send(frame(HEADERS, flags, stream_id, block));
+    }
+
+    std::vector<Frame> written() {
+        std::string out;
+        while (server.write(out, 1 << 20)) {
+        }
+        std::vector<Frame> frames;
+        for (size_t offset = 0; offset + 9 <= out.size();) {
+            size_t length = (static_cast<uint8_t>(out[offset]) << 16) | (static_cast<uint8_t>(out[offset + 1]) << 8) |
+                            static_cast<uint8_t>(out[offset + 2]);
+            Frame parsed{static_cast<uint8_t>(out[offset + 3]), static_cast<uint8_t>(out[offset + 4]),
+                         read_uint32(out, offset + 5) & 0x7FFFFFFF, out.substr(offset + 9, length), {}};
+            if (parsed.type == HEADERS) {
+                decoder.decode(reinterpret_cast<const uint8_t*>(parsed.payload.data()), parsed.payload.size(),
+                               parsed.fields, 1 << 16);
+            }
+            frames.push_back(std::move(parsed));
+            offset += 9 + length;
+        }
+        return frames;
+    }
+};
+
+static const Frame* find(const std::vector<Frame>& frames, uint8_t type, uint32_t stream_id) {
+    for (const Frame& candidate : frames) {
+        if (candidate.type == type && candidate.stream_id == stream_id) {
+            return &candidate;
+        }
+    }
+    return nullptr;
+}
+
+static bool reset_with(const std::vector<Frame>& frames, uint32_t stream_id, uint32_t code) {
+    const Frame* reset = find(frames, RST_STREAM, stream_id);
+    return reset && reset->payload.size() == 4 && read_uint32(reset->payload, 0) == code;
+}
+
+static bool goaway_with(const std::vector<Frame>& frames, uint32_t code) {
+    const Frame* goaway = find(frames, GOAWAY, 0);
+    return goaway && goaway->payload.size() >= 8 && read_uint32(goaway->payload, 4) == code;
+}
+
+static bool status_is(const std::vector<Frame>& frames, uint32_t stream_id, const std::string& status) {
+    const Frame* headers = find(frames, HEADERS, stream_id);
+    return headers && !headers->fields.empty() && headers->fields[0].first == ":status" &&
+           headers->fields[0].second == status;
+}
+
+int main() {
+    using ErrorCode = Http2Connection::ErrorCode;
+    using std::chrono::milliseconds;
+
+    // Stream cap (RFC 9113 section 5.1.2)
+    {
+        Http2Connection::Settings settings;
+        settings.max_concurrent_streams = 2;
+        Client client(settings);
+        client.open(1, "POST");
+        client.open(3, "POST");
+        client.open(5, "POST");
+        auto frames = client.written();
+        expect("stream past the cap is refused", reset_with(frames, 5, ErrorCode::RefusedStream));
+        expect("streams within the cap stay open",
+               !find(frames, RST_STREAM, 1) && !find(frames, RST_STREAM, 3) && client.server.open_streams() == 2);
+        expect("refusing a stream keeps the connection", client.alive && !find(frames, GOAWAY, 0));
+
+        std::string cancel;
+        cancel.append("\0\0\0\x08", 4);
+        client.send(frame(RST_STREAM, 0, 1, cancel));
+        client.open(7, "POST");
+        frames = client.written();
+        expect("a reset stream frees its slot", !find(frames, RST_STREAM, 7) && client.server.open_streams() == 2);
+    }
+
+    // Deadlines, as enforced by expire()
+    {
+        Http2Connection::Settings settings;
+        settings.body_timeout = milliseconds(1000);
+        Client client(settings);
+        client.open(1, "POST");
+        client.server.expire(client.now + milliseconds(999));
+        expect("request body not yet overdue", client.written().empty());
+        client.server.expire(client.now + milliseconds(1000));
+        expect("stalled request body is answered 408", status_is(client.written(), 1, "408"));
+    }
+    {
+        Http2Connection::Settings settings;
+        settings.header_timeout = milliseconds(500);
+        Client client(settings);
+        client.open(1, "GET", 0);
+        client.server.expire(client.now + milliseconds(500));
+        expect("unfinished header block fails connection",
+               goaway_with(client.written(), ErrorCode::ProtocolError) && client.server.finished());
+    }
+    {
+        Http2Connection::Settings settings;
+        settings.send_timeout = milliseconds(2000);
+        // SETTINGS_INITIAL_WINDOW_SIZE of 0: no response body may be sent
+        std::string no_window("\0\x04\0\0\0\0", 6);
+        Client client(settings, no_window);
+        client.open(1, "GET");
+        client.server.respond(1, {{":status", "200"}}, std::make_shared<Http2Body>("hello"));
+        auto frames = client.written();
+        expect("response headers go out without window", status_is(frames, 1, "200") && !find(frames, DATA, 1));
+        client.server.expire(client.now);
+        client.server.expire(client.now + milliseconds(1999));
+        expect("blocked response not yet overdue", !find(client.written(), RST_STREAM, 1));
+        client.server.expire(client.now + milliseconds(2000));
+        expect("response without window is reset", reset_with(client.written(), 1, ErrorCode::Cancel));
+    }
+
+    // Closed streams (RFC 9113 section 5.1)
+    {
+        Client client{Http2Connection::Settings()};
+        client.open(1, "GET");
+        client.server.respond(1, {{":status", "200"}}, std::make_shared<Http2Body>("ok"));
+        auto frames = client.written();
+        const Frame* data = find(frames, DATA, 1);
+        expect("response ends its stream", data && (data->flags & END_STREAM) && client.server.open_streams() == 0);
+        client.open(1, "GET");
+        expect("HEADERS on a closed stream fails",
+               !client.alive && goaway_with(client.written(), ErrorCode::ProtocolError));
+    }
+    {
+        Client client{Http2Connection::Settings()};
+        client.open(3, "GET");
+        client.open(1, "GET");
+        expect("HEADERS on a skipped lower stream fails",
+               !client.alive && goaway_with(client.written(), ErrorCode::ProtocolError));
+    }
+
+    if (failures) {
+        std::printf("\n%d failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+// Checks of LsmStore: entries read back from the memtable, from flushed runs and
+// after compaction, and deletions shadowing what older runs still hold.
+//
+// Build and run with `make test`.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include "../include/lsm_store.h"
+
+static int failures = 0;
+
+static void expect(const char* name, bool ok) {
+    std::printf("%-44s %s\n", name, ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+// Flushes and compactions run on the store's own threads; false if `done` stays false
+static bool wait_for(const std::function<bool()>& done) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!done()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+static LsmStore::Item item(const std::string& value) {
+    return LsmStore::Item{{"value", value}};
+}
+
+static bool holds(LsmStore& store, const std::string& key, uint64_t sequence, const std::string& value) {
+    LsmStore::Entry entry;
+    return store.get(key, entry) && !entry.deleted && entry.sequence == sequence && entry.item == item(value);
+}
+
+// Writes unrelated entries until the memtable holding everything before has been flushed.
+// One older memtable may still have been on its way out, so that takes two flushes.
+static void flush(LsmStore& store, const std::string& tag) {
+    uint64_t target = store.stats().flushes + 2;
+    for (int i = 0; store.stats().flushes < target; ++i) {
+        store.put("filler/" + tag + "/" + std::to_string(i), 1, item(std::string(64, 'x')));
+        if (i % 64 == 63) {
+            wait_for([&]() { return store.stats().flushes >= target; });
+        }
+    }
+}
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() /
+                             ("lsm_store_test." + std::to_string(::getpid()))).string();
+
+    {
+        LsmStore store(directory, 4096);
+        expect("store opens its directory", store.open());
+
+        store.put("key/a", 1, item("one"));
+        store.put("key/b", 2, item("two"));
+        expect("memtable entry reads back", holds(store, "key/a", 1, "one"));
+
+        flush(store, "1");
+        expect("flushed entry reads back from its run",
+               holds(store, "key/a", 1, "one") && holds(store, "key/b", 2, "two"));
+        expect("flush leaves a run on disk", store.stats().runs > 0 && store.stats().disk_bytes > 0);
+
+        // The newer write lives in a newer run than the one it replaces
+        store.put("key/b", 3, item("three"));
+        flush(store, "2");
+        expect("newer run shadows an older one", holds(store, "key/b", 3, "three"));
+
+        // The deletion lands in a run of its own, above the run still holding "key/a"
+        store.remove("key/a");
+        LsmStore::Entry entry;
+        expect("deletion hides the entry at once", !store.get("key/a", entry));
+        flush(store, "3");
+        expect("flushed deletion shadows the older run", !store.get("key/a", entry));
+
+        bool compacted = wait_for([&]() { return store.stats().compactions > 0; });
+        for (int round = 4; !compacted && round < 16; ++round) {
+            flush(store, std::to_string(round));
+            compacted = wait_for([&]() { return store.stats().compactions > 0; });
+        }
+        expect("full level is compacted", compacted);
+        expect("entries survive compaction", holds(store, "key/b", 3, "three"));
+        expect("deletion survives compaction", !store.get("key/a", entry));
+
+        auto found = store.scan("key/", "", 10);
+        expect("scan skips the deleted entry",
+               found.size() == 1 && found[0].first == "key/b" && found[0].second.item == item("three"));
+    }
+
+    std::filesystem::remove_all(directory);
+
+    if (failures) {
+        std::printf("\n%d failed\n", failures);
+        return 1;
+    }
+    return 0;
+}